@@ -3,18 +3,18 @@
 #include <QColor>
 #include <QSize>
 #include <QIcon>
-#include <QMutexLocker>
+#include <QSet>
+#include <QtAlgorithms>
 #include "g2node.h"
 #include "network.h"
+#include "NeighbourStats.h"
 #include "geoiplist.h"
 #include "QSkinDialog/qskinsettings.h"
 
 CNeighboursTableModel::CNeighboursTableModel(QObject *parent) :
     QAbstractTableModel(parent)
 {
-	connect(&Network, SIGNAL(NodeAdded(CG2Node*)), this, SLOT(OnNodeAdded(CG2Node*)), Qt::QueuedConnection);
-	connect(&Network, SIGNAL(NodeUpdated(CG2Node*)), this, SLOT(UpdateNeighbourData(CG2Node*)), Qt::QueuedConnection);
-	connect(&Network, SIGNAL(NodeRemoved(CG2Node*)), this, SLOT(OnRemoveNode(CG2Node*)), Qt::QueuedConnection);
+	m_tNow = time(0);
 }
 CNeighboursTableModel::~CNeighboursTableModel()
 {
@@ -32,7 +32,7 @@ int CNeighboursTableModel::columnCount(const QModelIndex& parent) const
 {
     Q_UNUSED(parent);
 
-	return 11;
+	return 12;
 }
 
 QVariant CNeighboursTableModel::data(const QModelIndex& index, int role) const
@@ -63,11 +63,14 @@ QVariant CNeighboursTableModel::data(const QModelIndex& index, int role) const
         switch( index.column() )
         {
         case 0:
-            return n.pNode->GetAddress().toString();
+            return n.oAddress.toString();
         case 1:
             return StateToString(n.nState);
         case 2:
-            return QString().sprintf("%.2u:%.2u:%.2u", n.tConnected / 3600, (n.tConnected % 3600 / 60), (n.tConnected % 3600) % 60);
+        {
+            quint32 tDuration = m_tNow - n.tConnected;
+            return QString().sprintf("%.2u:%.2u:%.2u", tDuration / 3600, (tDuration % 3600 / 60), (tDuration % 3600) % 60);
+        }
         case 3:
             return QString().sprintf("%1.3f / %1.3f", n.nBandwidthIn / 1024.0f, n.nBandwidthOut / 1024.0f);
         case 4:
@@ -89,6 +92,8 @@ QVariant CNeighboursTableModel::data(const QModelIndex& index, int role) const
             return n.sUserAgent;
 		case 10:
 			return n.sCountry;
+		case 11:
+			return QString().sprintf("%u KB", n.nCompressionMemory / 1024);
         }
     }
     else if( role == Qt::ForegroundRole )
@@ -130,6 +135,8 @@ QVariant CNeighboursTableModel::headerData(int section, Qt::Orientation orientat
                return "User Agent";
 		case 10:
 			   return "Country";
+		case 11:
+			   return "Memory";
         }
     }
 
@@ -147,144 +154,107 @@ QVariant CNeighboursTableModel::headerData(int section, Qt::Orientation orientat
     return QVariant();
 }
 
-bool CNeighboursTableModel::NodeExists(CG2Node *pNode)
+void CNeighboursTableModel::FillRow(sNeighbour& oRow, const CNeighbourStats& oStats)
 {
-	if( Network.m_lNodes.isEmpty() )
-		return false;
+	oRow.nId = oStats.nId;
+	oRow.oAddress = oStats.oAddress;
+	oRow.iNetwork = QIcon(":/Resource/Networks/Gnutella2.png");
 
-	for( int i = 0; i < Network.m_lNodes.size(); i++ )
-	{
-		if( Network.m_lNodes.at(i) == pNode )
-			return true;
-	}
+	// the address never changes, so neither does the country
+	QString sCountry = GeoIP.findCountryCode(oRow.oAddress);
+	oRow.sCountry = GeoIP.countryNameFromCode(sCountry);
+	oRow.iCountry = QIcon(":/Resource/Flags/" + sCountry.toLower() + ".png");
 
-	return false;
+	UpdateRow(oRow, oStats);
 }
 
-void CNeighboursTableModel::OnNodeAdded(CG2Node* pNode)
+// Returns true if anything shown, other than the connection time, changed
+bool CNeighboursTableModel::UpdateRow(sNeighbour& oRow, const CNeighbourStats& oStats)
 {
-	/*qDebug() << "OnNodeAdded";
+	oRow.tConnected = oStats.tConnected;
 
-	if( !Network.m_pSection.tryLock(50) ) // if can't get lock - forget it
-		return;
+	bool bChanged = oRow.nState != oStats.nState || oRow.nType != oStats.nType
+			|| oRow.nBandwidthIn != oStats.nBandwidthIn || oRow.nBandwidthOut != oStats.nBandwidthOut
+			|| oRow.nBytesReceived != oStats.nBytesReceived || oRow.nBytesSent != oStats.nBytesSent
+			|| oRow.nPacketsIn != oStats.nPacketsIn || oRow.nPacketsOut != oStats.nPacketsOut
+			|| oRow.nCompressionMemory != oStats.nCompressionMemory
+			|| oRow.nLeafCount != oStats.nLeafCount || oRow.nLeafMax != oStats.nLeafMax
+			|| oRow.nRTT != oStats.nRTT || oRow.sUserAgent != oStats.sUserAgent;
 
-	if( NodeExists(pNode) )
-		AddNode(pNode, false);
+	if( !bChanged )
+		return false;
 
-	Network.m_pSection.unlock();*/
+	oRow.nState = oStats.nState;
+	oRow.nType = oStats.nType;
+	oRow.nBandwidthIn = oStats.nBandwidthIn;
+	oRow.nBandwidthOut = oStats.nBandwidthOut;
+	oRow.nBytesReceived = oStats.nBytesReceived;
+	oRow.nBytesSent = oStats.nBytesSent;
+	oRow.nCompressionIn = oStats.nDecompressedIn;
+	oRow.nCompressionOut = oStats.nCompressedOut;
+	oRow.nCompressionMemory = oStats.nCompressionMemory;
+	oRow.nPacketsIn = oStats.nPacketsIn;
+	oRow.nPacketsOut = oStats.nPacketsOut;
+	oRow.nLeafCount = oStats.nLeafCount;
+	oRow.nLeafMax = oStats.nLeafMax;
+	oRow.nRTT = oStats.nRTT;
+	oRow.sUserAgent = oStats.sUserAgent;
+
+	return true;
 }
 
-void CNeighboursTableModel::AddNode(CG2Node *pNode, bool bSignal)
+// Drops the rows of nodes missing from the snapshot, a run of neighbouring rows at a time
+void CNeighboursTableModel::RemoveGone(CNeighbourSnapshot* pSnapshot)
 {
-	//qDebug() << "AddNode";
-
-	sNeighbour nbr;
-
-	quint32 tNow = time(0);
-
-	beginInsertRows(QModelIndex(), m_lNodes.size(), m_lNodes.size());
-	nbr.pNode = pNode;
-	nbr.iNetwork = QIcon(":/Resource/Networks/Gnutella2.png");
-	nbr.tConnected = tNow - pNode->m_tConnected;
-	nbr.nBandwidthIn = pNode->AvgIn(tNow);
-	nbr.nBandwidthOut = pNode->AvgOut(tNow);
-	nbr.nBytesReceived = pNode->GetTotalIn();
-	nbr.nBytesSent = pNode->GetTotalOut();
-	nbr.nCompressionIn = pNode->GetTotalInDecompressed();
-	nbr.nCompressionOut = pNode->GetTotalOutCompressed();
-	nbr.nLeafCount = pNode->m_nLeafCount;
-	nbr.nLeafMax = pNode->m_nLeafMax;
-	nbr.nPacketsIn = pNode->m_nPacketsIn;
-	nbr.nPacketsOut = pNode->m_nPacketsOut;
-	nbr.nRTT = pNode->m_tRTT;
-	nbr.nState = pNode->m_nState;
-	nbr.nType = pNode->m_nType;
-	nbr.sUserAgent = pNode->m_sUserAgent;
-	QString sCountry = GeoIP.findCountryCode(nbr.pNode->m_oAddress);
-	nbr.sCountry = GeoIP.countryNameFromCode(sCountry);
-	nbr.iCountry = QIcon(":/Resource/Flags/" + sCountry.toLower() + ".png");
-
-
-	m_lNodes.append(nbr);
-	endInsertRows();
-
-	if( bSignal )
-	{
-		QModelIndex idxUpdate = index(m_lNodes.size() - 1, 0, QModelIndex());
-		QModelIndex idxUpdate2 = index(m_lNodes.size() - 1, 10, QModelIndex());
-		emit dataChanged(idxUpdate, idxUpdate2);
-	}
-}
+	QSet<quint32> lLive;
+	lLive.reserve(pSnapshot->m_lNodes.size());
+	for( int i = 0; i < pSnapshot->m_lNodes.size(); i++ )
+		lLive.insert(pSnapshot->m_lNodes.at(i).nId);
 
-void CNeighboursTableModel::UpdateNeighbourData(CG2Node* pNode)
-{
-	//qDebug() << "UpdateNeighboursData";
+	bool bRemoved = false;
 
-	if( !Network.m_pSection.tryLock() )
-		return;	// forget it
+	// from the bottom, rows still to be checked keep their index
+	for( int nLast = m_lNodes.size() - 1; nLast >= 0; nLast-- )
+	{
+		if( lLive.contains(m_lNodes.at(nLast).nId) )
+			continue;
 
-	if( NodeExists(pNode) )
-		UpdateNode(pNode);
+		int nFirst = nLast;
+		while( nFirst > 0 && !lLive.contains(m_lNodes.at(nFirst - 1).nId) )
+			nFirst--;
 
-	Network.m_pSection.unlock();
-}
-void CNeighboursTableModel::UpdateNode(CG2Node *pNode, bool bSignal)
-{
-	//qDebug() << "UpdateNode";
+		beginRemoveRows(QModelIndex(), nFirst, nLast);
+		for( int i = nLast; i >= nFirst; i-- )
+			m_lNodes.removeAt(i);
+		endRemoveRows();
 
-	quint32 tNow = time(0);
+		nLast = nFirst;
+		bRemoved = true;
+	}
 
-	for( int i = 0; i < m_lNodes.size(); i++)
+	if( bRemoved )
 	{
-		if( m_lNodes[i].pNode == pNode )
-		{
-			m_lNodes[i].tConnected = tNow - pNode->m_tConnected;
-			m_lNodes[i].nBandwidthIn = pNode->AvgIn(tNow);
-			m_lNodes[i].nBandwidthOut = pNode->AvgOut(tNow);
-			m_lNodes[i].nBytesReceived = pNode->GetTotalIn();
-			m_lNodes[i].nBytesSent = pNode->GetTotalOut();
-			m_lNodes[i].nCompressionIn = pNode->GetTotalInDecompressed();
-			m_lNodes[i].nCompressionOut = pNode->GetTotalOutCompressed();
-			m_lNodes[i].nLeafCount = pNode->m_nLeafCount;
-			m_lNodes[i].nLeafMax = pNode->m_nLeafMax;
-			m_lNodes[i].nPacketsIn = pNode->m_nPacketsIn;
-			m_lNodes[i].nPacketsOut = pNode->m_nPacketsOut;
-			m_lNodes[i].nRTT = pNode->m_tRTT;
-			m_lNodes[i].nState = pNode->m_nState;
-			m_lNodes[i].nType = pNode->m_nType;
-			m_lNodes[i].sUserAgent = pNode->m_sUserAgent;
-
-			if( bSignal )
-			{
-				QModelIndex idx = index(i, 0, QModelIndex());
-				QModelIndex idx2 = index(i, 10, QModelIndex());
-				emit dataChanged(idx, idx2);
-			}
-
-			break;
-		}
+		m_lRows.clear();
+		for( int i = 0; i < m_lNodes.size(); i++ )
+			m_lRows.insert(m_lNodes.at(i).nId, i);
 	}
 }
 
-void CNeighboursTableModel::OnRemoveNode(CG2Node* pNode)
+// One dataChanged per run of consecutive rows
+void CNeighboursTableModel::EmitChanged(QList<int>& lRows)
 {
-	//qDebug() << "OnRemoveNode";
+	qSort(lRows);
 
-    for( int i = 0; i < m_lNodes.size(); i++ )
-    {
-        if( m_lNodes[i].pNode == pNode )
-        {
-            beginRemoveRows(QModelIndex(), i, i);
-            m_lNodes.removeAt(i);
-            endRemoveRows();
-			/*if( sender() )
-			{
-				QModelIndex idx1 = index(i, 0, QModelIndex());
-				QModelIndex idx2 = index(i, 10, QModelIndex());
-				emit dataChanged(idx1, idx2);
-			}*/
-        }
-    }
+	for( int i = 0; i < lRows.size(); )
+	{
+		int nFirst = lRows.at(i);
+		int nLast = nFirst;
+
+		while( ++i < lRows.size() && lRows.at(i) == nLast + 1 )
+			nLast++;
+
+		emit dataChanged(index(nFirst, 0, QModelIndex()), index(nLast, 11, QModelIndex()));
+	}
 }
 
 QString CNeighboursTableModel::StateToString(int s) const
@@ -319,58 +289,47 @@ QString CNeighboursTableModel::TypeToString(G2NodeType t) const
 
 void CNeighboursTableModel::UpdateAll()
 {
-	
-	//qDebug() << "UpdateAll";
+	// published once per network tick, nothing new means nothing changed
+	CNeighbourSnapshot* pSnapshot = Network.m_oStats.Take();
+	if( !pSnapshot )
+		return;
 
-	if( Network.m_pSection.tryLock() )
-    {
-		// first check if we need to remove some nodes
+	m_tNow = time(0);
 
-		for( int i = 0; i < m_lNodes.size(); i++ )
-		{
-			bool bFound = false;
-
-			for( int j = 0; j < Network.m_lNodes.size(); j++ )
-			{
-				if( Network.m_lNodes.at(j) == m_lNodes.at(i).pNode )
-				{
-					bFound = true;
-				}
-			}
-
-			if( !bFound )
-			{
-				// not found in network - remove it
-				OnRemoveNode(m_lNodes.at(i).pNode);
-			}
-		}
+	RemoveGone(pSnapshot);
 
-		// now add missing nodes or update existing
+	QList<int> lChanged;
+	QList<const CNeighbourStats*> lNew;
 
-		for( int i = 0; i < Network.m_lNodes.size(); i++ )
+	for( int i = 0; i < pSnapshot->m_lNodes.size(); i++ )
+	{
+		const CNeighbourStats& oStats = pSnapshot->m_lNodes.at(i);
+		QHash<quint32, int>::const_iterator itRow = m_lRows.constFind(oStats.nId);
+
+		if( itRow == m_lRows.constEnd() )
+			lNew.append(&oStats);
+		else if( UpdateRow(m_lNodes[itRow.value()], oStats) )
+			lChanged.append(itRow.value());
+	}
+
+	// connection times move every tick, one range covers the whole column
+	if( !m_lNodes.isEmpty() )
+		emit dataChanged(index(0, 2, QModelIndex()), index(m_lNodes.size() - 1, 2, QModelIndex()));
+
+	EmitChanged(lChanged);
+
+	if( !lNew.isEmpty() )
+	{
+		beginInsertRows(QModelIndex(), m_lNodes.size(), m_lNodes.size() + lNew.size() - 1);
+		foreach( const CNeighbourStats* pStats, lNew )
 		{
-			bool bFound = false;
-
-			for( int j = 0; j < m_lNodes.size(); j++ )
-			{
-				if( Network.m_lNodes.at(i) == m_lNodes.at(j).pNode )
-				{
-					UpdateNode(m_lNodes.at(j).pNode, false);
-					bFound = true;
-					break;
-				}
-			}
-
-			if( !bFound )
-			{
-				AddNode(Network.m_lNodes.at(i), false);
-			}
+			sNeighbour oRow;
+			FillRow(oRow, *pStats);
+			m_lRows.insert(oRow.nId, m_lNodes.size());
+			m_lNodes.append(oRow);
 		}
+		endInsertRows();
+	}
 
-		Network.m_pSection.unlock();
-
-		QModelIndex idx1 = index(0, 0, QModelIndex());
-		QModelIndex idx2 = index(m_lNodes.size() - 1, 10, QModelIndex());
-		emit dataChanged(idx1, idx2);
-    }
+	delete pSnapshot;
 }
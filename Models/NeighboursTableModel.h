@@ -4,18 +4,21 @@
 #include <QAbstractTableModel>
 #include "types.h"
 #include <QList>
+#include <QHash>
 #include <QTime>
 #include <QMutex>
 #include <QIcon>
 
-class CG2Node;
+class CNeighbourSnapshot;
+struct CNeighbourStats;
 
 typedef struct
 {
-    CG2Node*    pNode;
+    quint32     nId;
+    IPv4_ENDPOINT oAddress;
     G2NodeType  nType;
     int         nState;
-    quint32     tConnected;
+    quint32     tConnected;     // when, not how long
     quint32     nPacketsIn;
     quint32     nPacketsOut;
     quint32     nBandwidthIn;
@@ -24,6 +27,7 @@ typedef struct
     quint64     nBytesReceived;
     float       nCompressionIn;
     float       nCompressionOut;
+    quint32     nCompressionMemory;
     quint32     nLeafCount;
     quint32     nLeafMax;
     quint32     nRTT;
@@ -39,6 +43,8 @@ class CNeighboursTableModel : public QAbstractTableModel
 
 protected:
     QList<sNeighbour>   m_lNodes;
+    QHash<quint32, int> m_lRows;    // node id -> row in m_lNodes
+    quint32             m_tNow;     // time of the snapshot shown
 public:
     explicit CNeighboursTableModel(QObject *parent = 0);
 	~CNeighboursTableModel();
@@ -57,15 +63,14 @@ public:
 protected:
     QString StateToString(int s) const;
     QString TypeToString(G2NodeType t) const;
+
+    void RemoveGone(CNeighbourSnapshot* pSnapshot);
+    void FillRow(sNeighbour& oRow, const CNeighbourStats& oStats);
+    bool UpdateRow(sNeighbour& oRow, const CNeighbourStats& oStats);
+    void EmitChanged(QList<int>& lRows);
 signals:
 
 public slots:
-	bool NodeExists(CG2Node* pNode);
-    void OnNodeAdded(CG2Node* pNode);
-	void AddNode(CG2Node* pNode, bool bSignal = true);
-    void UpdateNeighbourData(CG2Node* pNode);
-	void UpdateNode(CG2Node* pNode, bool bSignal = true);
-    void OnRemoveNode(CG2Node* pNode);
     void UpdateAll();
 };
 
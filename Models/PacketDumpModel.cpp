@@ -0,0 +1,128 @@
+#include "PacketDumpModel.h"
+
+#include <QDateTime>
+#include <QHostAddress>
+#include "PacketCapture.h"
+
+// Bytes shown in the HEX and ASCII columns, the tooltip has the whole capture
+#define DUMP_PREVIEW	64
+
+CPacketDumpModel::CPacketDumpModel(QObject *parent) :
+    QAbstractTableModel(parent)
+{
+	m_nMaxRows = 5000;
+}
+CPacketDumpModel::~CPacketDumpModel()
+{
+	m_lRecords.clear();
+}
+
+int CPacketDumpModel::rowCount(const QModelIndex& parent) const
+{
+    Q_UNUSED(parent);
+
+	return m_lRecords.count();
+}
+
+int CPacketDumpModel::columnCount(const QModelIndex& parent) const
+{
+    Q_UNUSED(parent);
+
+	return 7;
+}
+
+QVariant CPacketDumpModel::data(const QModelIndex& index, int role) const
+{
+    if( !index.isValid() )
+        return QVariant();
+
+    if( index.row() >= m_lRecords.size() || index.row() < 0 )
+        return QVariant();
+
+	const QByteArray& baRecord = m_lRecords.at(index.row());
+	const G2CaptureRecord* pRecord = CPacketCapture::Record(baRecord);
+
+    if( role == Qt::DisplayRole )
+    {
+        switch( index.column() )
+        {
+        case 0:
+			return QDateTime::fromTime_t(pRecord->tTime / 1000).toString("hh:mm:ss") + QString().sprintf(".%.3u", quint32(pRecord->tTime % 1000));
+        case 1:
+			return QString("%1:%2").arg(QHostAddress(pRecord->nAddress).toString()).arg(pRecord->nPort);
+        case 2:
+			return QString("%1 %2").arg(( pRecord->nFlags & capUDP ) ? "UDP" : "TCP").arg(( pRecord->nFlags & capOut ) ? "out" : "in");
+        case 3:
+			return CPacketCapture::TypeName(pRecord->nType);
+        case 4:
+			return pRecord->nLength;
+        case 5:
+			return CPacketCapture::FormatHex(baRecord, DUMP_PREVIEW);
+        case 6:
+			return CPacketCapture::FormatASCII(baRecord, DUMP_PREVIEW);
+        }
+    }
+	else if( role == Qt::ToolTipRole )
+	{
+		if( index.column() == 5 )
+			return CPacketCapture::FormatHex(baRecord);
+		if( index.column() == 6 )
+			return CPacketCapture::FormatASCII(baRecord);
+	}
+
+    return QVariant();
+}
+QVariant CPacketDumpModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if( role == Qt::DisplayRole && orientation == Qt::Horizontal )
+    {
+        switch( section )
+        {
+        case 0:
+               return tr("Time");
+        case 1:
+               return tr("Address");
+        case 2:
+               return tr("Protocol");
+        case 3:
+               return tr("Type");
+        case 4:
+               return tr("Length");
+        case 5:
+               return tr("HEX");
+        case 6:
+               return tr("ASCII");
+        }
+    }
+
+    return QVariant();
+}
+
+// Appends freshly captured records, dropping the oldest rows beyond m_nMaxRows
+void CPacketDumpModel::AddRecords(const QList<QByteArray>& lRecords)
+{
+	if( lRecords.isEmpty() )
+		return;
+
+	int nFirst = qMax(0, lRecords.size() - m_nMaxRows);
+	int nDrop = qMin(m_lRecords.size(), m_lRecords.size() + lRecords.size() - nFirst - m_nMaxRows);
+
+	if( nDrop > 0 )
+	{
+		beginRemoveRows(QModelIndex(), 0, nDrop - 1);
+		m_lRecords.erase(m_lRecords.begin(), m_lRecords.begin() + nDrop);
+		endRemoveRows();
+	}
+
+	beginInsertRows(QModelIndex(), m_lRecords.size(), m_lRecords.size() + lRecords.size() - nFirst - 1);
+	for( int i = nFirst; i < lRecords.size(); i++ )
+		m_lRecords.append(lRecords.at(i));
+	endInsertRows();
+}
+
+void CPacketDumpModel::Clear()
+{
+	beginResetModel();
+	m_lRecords.clear();
+	endResetModel();
+}
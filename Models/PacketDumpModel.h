@@ -0,0 +1,36 @@
+#ifndef PACKETDUMPMODEL_H
+#define PACKETDUMPMODEL_H
+
+#include <QAbstractTableModel>
+#include <QList>
+#include <QByteArray>
+
+// Rows are raw capture records as copied out of the PacketCapture ring;
+// text is only built in data(), i.e. for the rows the view actually paints.
+class CPacketDumpModel : public QAbstractTableModel
+{
+    Q_OBJECT
+
+protected:
+	QList<QByteArray>	m_lRecords;
+	int					m_nMaxRows;
+public:
+    explicit CPacketDumpModel(QObject *parent = 0);
+	~CPacketDumpModel();
+
+    int rowCount(const QModelIndex &parent) const;
+    int columnCount(const QModelIndex &parent) const;
+    QVariant data(const QModelIndex &index, int role) const;
+    QVariant headerData(int section, Qt::Orientation orientation, int role) const;
+
+	void SetMaxRows(int nMaxRows)
+	{
+		m_nMaxRows = nMaxRows;
+	}
+
+public slots:
+	void AddRecords(const QList<QByteArray>& lRecords);
+	void Clear();
+};
+
+#endif // PACKETDUMPMODEL_H
@@ -0,0 +1,335 @@
+#include "BufferChain.h"
+#include <stdlib.h>
+#include <string.h>
+
+CBufferPool BufferPool;
+
+//////////////////////////////////////////////////////////////////////
+// CBufferPool
+
+CBufferPool::CBufferPool()
+{
+	m_pFree = 0;
+	m_nFree = 0;
+	m_nBlocks = 0;
+	m_nLarge = 0;
+}
+
+CBufferPool::~CBufferPool()
+{
+	while( m_pFree )
+	{
+		CBufferBlock* pNext = m_pFree->m_pNext;
+		free(m_pFree);
+		m_pFree = pNext;
+	}
+}
+
+// Blocks bigger than BUFFER_BLOCK_SIZE are only made by Pullup() and never pooled
+CBufferBlock* CBufferPool::Allocate(quint32 nCapacity)
+{
+	CBufferBlock* pBlock = 0;
+
+	if( nCapacity <= BUFFER_BLOCK_SIZE )
+	{
+		nCapacity = BUFFER_BLOCK_SIZE;
+
+		m_pSection.lock();
+		if( m_pFree )
+		{
+			pBlock = m_pFree;
+			m_pFree = pBlock->m_pNext;
+			m_nFree--;
+		}
+		m_nBlocks++;
+		m_pSection.unlock();
+	}
+	else
+	{
+		m_pSection.lock();
+		m_nLarge++;
+		m_pSection.unlock();
+	}
+
+	if( !pBlock )
+	{
+		pBlock = static_cast<CBufferBlock*>( malloc(sizeof(CBufferBlock) + nCapacity) );
+		Q_CHECK_PTR(pBlock);
+		pBlock->m_nCapacity = nCapacity;
+	}
+
+	pBlock->m_pNext = 0;
+	pBlock->m_nBegin = pBlock->m_nEnd = 0;
+
+	return pBlock;
+}
+
+void CBufferPool::Free(CBufferBlock* pBlock)
+{
+	QMutexLocker l(&m_pSection);
+
+	if( pBlock->m_nCapacity != BUFFER_BLOCK_SIZE )
+	{
+		m_nLarge--;
+		free(pBlock);
+		return;
+	}
+
+	m_nBlocks--;
+
+	if( m_nFree >= BUFFER_POOL_KEEP )
+	{
+		free(pBlock);
+		return;
+	}
+
+	pBlock->m_pNext = m_pFree;
+	m_pFree = pBlock;
+	m_nFree++;
+}
+
+void CBufferPool::GetStats(CBufferPoolStats& oStats)
+{
+	QMutexLocker l(&m_pSection);
+
+	oStats.nBlocks = m_nBlocks;
+	oStats.nFree = m_nFree;
+	oStats.nLarge = m_nLarge;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CBufferChain construction
+
+CBufferChain::CBufferChain()
+{
+	m_pHead = m_pTail = 0;
+	m_nSize = 0;
+	m_nBlocks = 0;
+	m_nMemory = 0;
+}
+
+CBufferChain::~CBufferChain()
+{
+	Clear();
+}
+
+CBufferBlock* CBufferChain::Link(quint32 nCapacity)
+{
+	CBufferBlock* pBlock = BufferPool.Allocate(nCapacity);
+
+	if( m_pTail )
+		m_pTail->m_pNext = pBlock;
+	else
+		m_pHead = pBlock;
+	m_pTail = pBlock;
+
+	m_nBlocks++;
+	m_nMemory += pBlock->m_nCapacity;
+
+	return pBlock;
+}
+
+// Releases the head block
+void CBufferChain::Unlink()
+{
+	CBufferBlock* pBlock = m_pHead;
+
+	m_pHead = pBlock->m_pNext;
+	if( !m_pHead )
+		m_pTail = 0;
+
+	m_nBlocks--;
+	m_nMemory -= pBlock->m_nCapacity;
+
+	BufferPool.Free(pBlock);
+}
+
+void CBufferChain::Clear()
+{
+	while( m_pHead )
+		Unlink();
+
+	m_nSize = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CBufferChain write
+
+void CBufferChain::Append(const char* pData, quint32 nLength)
+{
+	while( nLength )
+	{
+		quint32 nAvailable = 0;
+		char* pOut = Reserve(1, nAvailable);
+		quint32 nCopy = qMin(nLength, nAvailable);
+
+		memcpy(pOut, pData, nCopy);
+		Commit(nCopy);
+
+		pData += nCopy;
+		nLength -= nCopy;
+	}
+}
+
+void CBufferChain::Append(const QByteArray& baData)
+{
+	Append(baData.constData(), baData.size());
+}
+
+// Moves all of pOther's blocks in front of ours
+void CBufferChain::Prepend(CBufferChain* pOther)
+{
+	if( !pOther->m_pHead )
+		return;
+
+	pOther->m_pTail->m_pNext = m_pHead;
+	if( !m_pTail )
+		m_pTail = pOther->m_pTail;
+	m_pHead = pOther->m_pHead;
+
+	m_nSize += pOther->m_nSize;
+	m_nBlocks += pOther->m_nBlocks;
+	m_nMemory += pOther->m_nMemory;
+
+	pOther->m_pHead = pOther->m_pTail = 0;
+	pOther->m_nSize = pOther->m_nBlocks = pOther->m_nMemory = 0;
+}
+
+// Returns at least nMinimum bytes of contiguous free space at the end of the chain,
+// nAvailable receives the actual amount. Nothing is buffered until Commit().
+char* CBufferChain::Reserve(quint32 nMinimum, quint32& nAvailable)
+{
+	if( !m_pTail || m_pTail->GetFree() < qMax(nMinimum, 1u) )
+		Link(nMinimum);
+
+	nAvailable = m_pTail->GetFree();
+	return m_pTail->Data() + m_pTail->m_nEnd;
+}
+
+void CBufferChain::Commit(quint32 nLength)
+{
+	Q_ASSERT( m_pTail && nLength <= m_pTail->GetFree() );
+
+	m_pTail->m_nEnd += nLength;
+	m_nSize += nLength;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CBufferChain read
+
+void CBufferChain::Consume(quint32 nLength)
+{
+	Q_ASSERT( nLength <= m_nSize );
+
+	nLength = qMin(nLength, m_nSize);
+	m_nSize -= nLength;
+
+	while( m_pHead )
+	{
+		quint32 nBlock = m_pHead->GetSize();
+
+		if( nLength < nBlock )
+		{
+			m_pHead->m_nBegin += nLength;
+			break;
+		}
+
+		// drained blocks go back to the pool right away, an idle connection holds no memory
+		nLength -= nBlock;
+		Unlink();
+	}
+}
+
+quint32 CBufferChain::Peek(char* pData, quint32 nLength, quint32 nOffset) const
+{
+	quint32 nCopied = 0;
+
+	for( const CBufferBlock* pBlock = m_pHead; pBlock && nCopied < nLength; pBlock = pBlock->m_pNext )
+	{
+		quint32 nBlock = pBlock->GetSize();
+
+		if( nOffset >= nBlock )
+		{
+			nOffset -= nBlock;
+			continue;
+		}
+
+		quint32 nCopy = qMin(nBlock - nOffset, nLength - nCopied);
+		memcpy(pData + nCopied, pBlock->Data() + pBlock->m_nBegin + nOffset, nCopy);
+		nCopied += nCopy;
+		nOffset = 0;
+	}
+
+	return nCopied;
+}
+
+QByteArray CBufferChain::Peek(quint32 nLength) const
+{
+	QByteArray baData;
+	baData.resize(qMin(nLength, m_nSize));
+	Peek(baData.data(), baData.size());
+	return baData;
+}
+
+quint32 CBufferChain::Read(char* pData, quint32 nLength)
+{
+	quint32 nRead = Peek(pData, nLength);
+	Consume(nRead);
+	return nRead;
+}
+
+QByteArray CBufferChain::Read(quint32 nLength)
+{
+	QByteArray baData = Peek(nLength);
+	Consume(baData.size());
+	return baData;
+}
+
+// Makes the first nLength bytes contiguous and returns them.
+// Only the bytes asked for are copied, into a single block at the head of the chain.
+const char* CBufferChain::Pullup(quint32 nLength)
+{
+	Q_ASSERT( nLength <= m_nSize );
+
+	nLength = qMin(nLength, m_nSize);
+
+	if( m_pHead && m_pHead->GetSize() >= nLength )
+		return m_pHead->Data() + m_pHead->m_nBegin;
+
+	CBufferBlock* pBlock = BufferPool.Allocate(nLength);
+	Peek(pBlock->Data(), nLength);
+	pBlock->m_nEnd = nLength;
+
+	Consume(nLength);
+
+	pBlock->m_pNext = m_pHead;
+	m_pHead = pBlock;
+	if( !m_pTail )
+		m_pTail = pBlock;
+
+	m_nSize += nLength;
+	m_nBlocks++;
+	m_nMemory += pBlock->m_nCapacity;
+
+	return pBlock->Data();
+}
+
+// Lists up to nMaximum runs covering at most nLimit bytes from the front, for a gather write
+int CBufferChain::GetFragments(CBufferFragment* pFragments, int nMaximum, quint32 nLimit) const
+{
+	int nCount = 0;
+
+	for( const CBufferBlock* pBlock = m_pHead; pBlock && nCount < nMaximum && nLimit; pBlock = pBlock->m_pNext )
+	{
+		quint32 nBlock = qMin(pBlock->GetSize(), nLimit);
+		if( !nBlock )
+			continue;
+
+		pFragments[nCount].pData = pBlock->Data() + pBlock->m_nBegin;
+		pFragments[nCount].nLength = nBlock;
+		nCount++;
+		nLimit -= nBlock;
+	}
+
+	return nCount;
+}
@@ -0,0 +1,147 @@
+#ifndef BUFFERCHAIN_H
+#define BUFFERCHAIN_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QMutex>
+
+// Data bytes in a pooled block
+#define BUFFER_BLOCK_SIZE	4096
+// Free blocks kept for reuse, anything above goes back to the heap
+#define BUFFER_POOL_KEEP	1024
+// Fragments handed to a single gather write
+#define BUFFER_GATHER_MAX	16
+
+struct CBufferBlock
+{
+	CBufferBlock*	m_pNext;
+	quint32		m_nCapacity;
+	quint32		m_nBegin;		// first unread byte
+	quint32		m_nEnd;			// first free byte
+
+	inline char* Data()
+	{
+		return reinterpret_cast<char*>(this + 1);
+	}
+	inline const char* Data() const
+	{
+		return reinterpret_cast<const char*>(this + 1);
+	}
+	inline quint32 GetSize() const
+	{
+		return m_nEnd - m_nBegin;
+	}
+	inline quint32 GetFree() const
+	{
+		return m_nCapacity - m_nEnd;
+	}
+};
+
+struct CBufferFragment
+{
+	const char*	pData;
+	quint32		nLength;
+};
+
+struct CBufferPoolStats
+{
+	quint32		nBlocks;		// blocks owned by chains
+	quint32		nFree;			// pooled blocks waiting for reuse
+	quint32		nLarge;			// oversized blocks owned by chains
+};
+
+// Fixed size blocks shared by all connections
+class CBufferPool
+{
+public:
+	CBufferPool();
+	~CBufferPool();
+
+protected:
+	QMutex			m_pSection;
+	CBufferBlock*	m_pFree;
+	quint32			m_nFree;
+	quint32			m_nBlocks;
+	quint32			m_nLarge;
+
+public:
+	CBufferBlock*	Allocate(quint32 nCapacity = BUFFER_BLOCK_SIZE);
+	void			Free(CBufferBlock* pBlock);
+	void			GetStats(CBufferPoolStats& oStats);
+};
+
+extern CBufferPool BufferPool;
+
+// A byte stream kept as a chain of pooled blocks.
+//
+// Appending fills the last block and links a new one when it is full, consuming releases
+// blocks from the front - neither ever moves buffered data. Readers that need a contiguous
+// view of a range spanning blocks use Pullup(), writers can gather several blocks at once
+// with GetFragments(), and producers like inflate/deflate or a socket read can fill
+// the tail in place with Reserve()/Commit().
+class CBufferChain
+{
+public:
+	CBufferChain();
+	~CBufferChain();
+
+protected:
+	CBufferBlock*	m_pHead;
+	CBufferBlock*	m_pTail;
+	quint32			m_nSize;
+	quint32			m_nBlocks;
+	quint32			m_nMemory;
+
+public:
+	void		Append(const char* pData, quint32 nLength);
+	void		Append(const QByteArray& baData);
+	void		Prepend(CBufferChain* pOther);
+	char*		Reserve(quint32 nMinimum, quint32& nAvailable);
+	void		Commit(quint32 nLength);
+	void		Consume(quint32 nLength);
+	void		Clear();
+
+	quint32		Peek(char* pData, quint32 nLength, quint32 nOffset = 0) const;
+	QByteArray	Peek(quint32 nLength) const;
+	quint32		Read(char* pData, quint32 nLength);
+	QByteArray	Read(quint32 nLength);
+	const char*	Pullup(quint32 nLength);
+	int			GetFragments(CBufferFragment* pFragments, int nMaximum, quint32 nLimit) const;
+
+	inline quint32 size() const
+	{
+		return m_nSize;
+	}
+	inline bool isEmpty() const
+	{
+		return m_nSize == 0;
+	}
+	// The first contiguous run of buffered bytes
+	inline const char* Data() const
+	{
+		return m_pHead ? m_pHead->Data() + m_pHead->m_nBegin : 0;
+	}
+	inline quint32 GetContiguous() const
+	{
+		return m_pHead ? m_pHead->GetSize() : 0;
+	}
+	// Bytes of block storage held, used or not
+	inline quint32 GetMemory() const
+	{
+		return m_nMemory;
+	}
+	inline quint32 GetBlockCount() const
+	{
+		return m_nBlocks;
+	}
+
+protected:
+	CBufferBlock*	Link(quint32 nCapacity);
+	void			Unlink();
+
+private:
+	CBufferChain(const CBufferChain&);
+	CBufferChain& operator=(const CBufferChain&);
+};
+
+#endif // BUFFERCHAIN_H
@@ -16,6 +16,13 @@ CCompressedConnection::CCompressedConnection(QObject *parent) :
     m_nNextDeflateFlush = 4096;
     m_bOutputPending = false;
 
+    m_bDeflateReady = false;
+    m_bDeflateStarted = false;
+    m_nDeflateWindow = MAX_WBITS;
+    m_nDeflateMemLevel = 8;
+    m_nInflateWindow = MAX_WBITS;
+    m_tLastDeflate = 0;
+
     memset(&m_sInput, 0, sizeof(z_stream));
     memset(&m_sOutput, 0, sizeof(z_stream));
 
@@ -59,12 +66,13 @@ bool CCompressedConnection::EnableOutputCompression(bool bEnable)
 }
 bool CCompressedConnection::SetupInputStream()
 {
-    m_pZInput = new QByteArray();
+    m_pZInput = new CBufferChain();
 
     if( m_pZInput == 0 )
         return false;
 
-    if( inflateInit(&m_sInput) != Z_OK )
+    // window size taken from the peer's zlib header, a small window costs a small buffer
+    if( inflateInit2(&m_sInput, 0) != Z_OK )
     {
         delete m_pZInput;
         m_pZInput = 0;
@@ -72,28 +80,97 @@ bool CCompressedConnection::SetupInputStream()
     }
     return true;
 }
+// The deflate stream itself is only created by the first Deflate()
 bool CCompressedConnection::SetupOutputStream()
 {
-    m_pZOutput = new QByteArray();
+    m_pZOutput = new CBufferChain();
     if( m_pZOutput == 0 )
         return false;
 
-    if( deflateInit(&m_sOutput, Z_DEFAULT_COMPRESSION) != Z_OK )
-    {
-        delete m_pZOutput;
-        m_pZOutput = 0;
-        return false;
-    }
     m_nNextDeflateFlush = m_nTotalOutput + 4096;
     m_tDeflateFlush.start();
 
     return true;
 }
+bool CCompressedConnection::InitDeflate()
+{
+    Q_ASSERT(!m_bDeflateReady);
+
+    // Only the first stream writes the zlib header. A stream recreated after an idle release
+    // continues the same zlib stream with raw deflate blocks, the peer cannot tell the difference.
+    int nWindowBits = m_bDeflateStarted ? -m_nDeflateWindow : m_nDeflateWindow;
+
+    memset(&m_sOutput, 0, sizeof(z_stream));
+    if( deflateInit2(&m_sOutput, Z_DEFAULT_COMPRESSION, Z_DEFLATED, nWindowBits, m_nDeflateMemLevel, Z_DEFAULT_STRATEGY) != Z_OK )
+        return false;
+
+    m_bDeflateReady = true;
+    m_bDeflateStarted = true;
+    return true;
+}
+// Link class settings. The window is fixed by the zlib header once the first stream started,
+// a bigger one would let later streams reach past what the peer keeps.
+void CCompressedConnection::SetDeflateParameters(int nWindowBits, int nMemLevel)
+{
+    if( !m_bDeflateStarted )
+        m_nDeflateWindow = qBound(9, nWindowBits, MAX_WBITS);
+    m_nDeflateMemLevel = qBound(1, nMemLevel, MAX_MEM_LEVEL);
+}
+// Drops the deflate stream of a link that had nothing to send for nIdle seconds.
+// A full flush ends the last block on a byte boundary and leaves nothing in the history
+// the next stream could miss, so it can simply start over on the next send.
+void CCompressedConnection::ReleaseIdleDeflate(quint32 tNow, quint32 nIdle)
+{
+    if( !m_bDeflateReady || !m_pZOutput->isEmpty() || tNow - m_tLastDeflate < nIdle )
+        return;
+
+    qint32 nRet;
+    do
+    {
+        quint32 nOut = 0;
+        char* pOut = m_pOutput->Reserve(2048, nOut);
+
+        m_sOutput.next_in = 0;
+        m_sOutput.avail_in = 0;
+        m_sOutput.next_out = (Bytef*)pOut;
+        m_sOutput.avail_out = nOut;
+
+        nRet = deflate(&m_sOutput, Z_FULL_FLUSH);
+
+        m_pOutput->Commit(nOut - m_sOutput.avail_out);
+        m_nTotalOutput += nOut - m_sOutput.avail_out;
+    }
+    while( nRet == Z_OK && m_sOutput.avail_out == 0 );
+
+    deflateEnd(&m_sOutput);
+    m_bDeflateReady = false;
+
+    if( !m_pOutput->isEmpty() )
+        emit readyToTransfer();
+}
+// zlib state, window and pending buffers held for this link
+quint32 CCompressedConnection::GetCompressionMemory() const
+{
+    quint32 nMemory = 0;
+
+    // sizes from zconf.h
+    if( m_bDeflateReady )
+        nMemory += ( 1u << ( m_nDeflateWindow + 2 ) ) + ( 1u << ( m_nDeflateMemLevel + 9 ) ) + 6 * 1024;
+    if( m_bCompressedInput )
+        nMemory += ( 1u << m_nInflateWindow ) + 7 * 1024;
+
+    if( m_pZInput )
+        nMemory += m_pZInput->GetMemory();
+    if( m_pZOutput )
+        nMemory += m_pZOutput->GetMemory();
+
+    return nMemory;
+}
 void CCompressedConnection::CleanupInputStream()
 {
     if( m_pZInput )
     {
-        m_pInput->insert(0, *m_pZInput);
+        m_pInput->Prepend(m_pZInput);
         delete m_pZInput;
         m_pZInput = 0;
     }
@@ -104,11 +181,16 @@ void CCompressedConnection::CleanupOutputStream()
 {
     if( m_pZOutput )
     {
-        m_pOutput->insert(0, *m_pZOutput);
+        m_pOutput->Prepend(m_pZOutput);
         delete m_pZOutput;
         m_pZOutput = 0;
     }
-    deflateEnd(&m_sOutput);
+
+    if( m_bDeflateReady )
+    {
+        deflateEnd(&m_sOutput);
+        m_bDeflateReady = false;
+    }
 }
 
 qint64 CCompressedConnection::readFromNetwork(qint64 nBytes)
@@ -120,9 +202,6 @@ qint64 CCompressedConnection::readFromNetwork(qint64 nBytes)
         Inflate();
         if( m_pZInput->size() )
             emit readyRead();
-
-		if( (uint)m_pZInput->capacity() > m_nInputSize &&(uint) m_pZInput->size() < m_nInputSize / 2 )
-			m_pZInput->squeeze();
     }
 
     return nRet;
@@ -134,8 +213,6 @@ qint64 CCompressedConnection::writeToNetwork(qint64 nBytes)
         if( m_pOutput->size() == 0 )
         {
             Deflate();
-			if( (uint)m_pZOutput->capacity() > m_nInputSize && (uint)m_pZOutput->size() < m_nInputSize / 2 )
-				m_pZOutput->squeeze();
         }
     }
 
@@ -143,47 +220,51 @@ qint64 CCompressedConnection::writeToNetwork(qint64 nBytes)
 }
 
 
+// Inflates straight from the raw input blocks into the free space of the last inflated block
 void CCompressedConnection::Inflate()
 {
     if( m_pInput->size() == 0 )
         return;
 
+    // CINFO of the zlib header, for the memory estimate
+    if( m_sInput.total_in == 0 )
+        m_nInflateWindow = qBound(8, ( (uchar)m_pInput->Data()[0] >> 4 ) + 8, MAX_WBITS);
+
     qint32 nRet = Z_OK;
+    bool bPending = false;
 
-    do
+    forever
     {
-        m_sInput.next_in   = (Bytef*)m_pInput->data();
-        m_sInput.avail_in  = m_pInput->size();
-        m_sInput.total_in  = 0u;
-
-        if( m_pZInput->capacity() - m_pZInput->size() < 2048 )
-        {
-            m_pZInput->reserve(m_pZInput->capacity() + 2048);
-        }
+        quint32 nIn = m_pInput->GetContiguous();
+        if( nIn == 0 && !bPending )
+            break;
 
-        qint32 oldSize = m_pZInput->size();
+        quint32 nOut = 0;
+        char* pOut = m_pZInput->Reserve(2048, nOut);
 
-        m_sInput.next_out  = (Bytef*)m_pZInput->data() + oldSize;
-        m_sInput.avail_out = qMax(m_pZInput->capacity() - oldSize, 2048);
-        m_sInput.total_out = 0u;
-        m_pZInput->resize(m_pZInput->capacity());
+        m_sInput.next_in   = (Bytef*)m_pInput->Data();
+        m_sInput.avail_in  = nIn;
+        m_sInput.next_out  = (Bytef*)pOut;
+        m_sInput.avail_out = nOut;
 
         nRet = inflate(&m_sInput, Z_SYNC_FLUSH);
 
-        switch( nRet )
-        {
-        case Z_MEM_ERROR:
-        case Z_NEED_DICT:
-        case Z_DATA_ERROR:
+        if( nRet == Z_MEM_ERROR || nRet == Z_NEED_DICT || nRet == Z_DATA_ERROR )
             break;
-        default:
-            m_pZInput->resize(oldSize + m_sInput.total_out);
-            m_pInput->remove(0, m_sInput.total_in);
 
-            m_nTotalInput += m_sInput.total_out;
+        quint32 nConsumed = nIn - m_sInput.avail_in;
+        quint32 nProduced = nOut - m_sInput.avail_out;
 
-        }
-    } while ( m_sInput.avail_out == 0u );
+        m_pZInput->Commit(nProduced);
+        m_pInput->Consume(nConsumed);
+        m_nTotalInput += nProduced;
+
+        // a full output block may leave more output inside zlib
+        bPending = ( m_sInput.avail_out == 0 );
+
+        if( nConsumed == 0 && nProduced == 0 )
+            break;
+    }
 
     if( nRet == Z_BUF_ERROR )
     {
@@ -198,11 +279,22 @@ void CCompressedConnection::Inflate()
     }
 }
 
+// Deflates from the queued blocks into the free space of the last output block.
+// Only the final input run carries the flush, so a sync flush ends the whole batch.
 void CCompressedConnection::Deflate()
 {
     if( m_pZOutput->size() == 0 )
         return;
 
+    if( !m_bDeflateReady && !InitDeflate() )
+    {
+        qDebug() << "Deflate init error!";
+        abort();
+        return;
+    }
+
+    m_tLastDeflate = time(0);
+
     qint32 nFlushMode = Z_NO_FLUSH;
 
     if( m_bOutputPending || m_tDeflateFlush.elapsed() > 250 || m_nTotalOutput > m_nNextDeflateFlush )
@@ -213,39 +305,39 @@ void CCompressedConnection::Deflate()
         m_tDeflateFlush.start();
     }
 
-    do
+    forever
     {
-        m_sOutput.next_in = (Bytef*)m_pZOutput->data();
-        m_sOutput.avail_in = m_pZOutput->size();
-        m_sOutput.total_in = 0u;
+        quint32 nIn = m_pZOutput->GetContiguous();
+        bool bLast = ( nIn == m_pZOutput->size() );
 
-        if( m_pOutput->capacity() - m_pOutput->size() < 2048 )
-        {
-            m_pOutput->reserve(m_pOutput->capacity() + 2048);
-        }
+        quint32 nOut = 0;
+        char* pOut = m_pOutput->Reserve(2048, nOut);
 
-        qint32 nOldSize = m_pOutput->size();
+        m_sOutput.next_in = (Bytef*)m_pZOutput->Data();
+        m_sOutput.avail_in = nIn;
+        m_sOutput.next_out = (Bytef*)pOut;
+        m_sOutput.avail_out = nOut;
 
-        m_sOutput.next_out = (Bytef*)m_pOutput->data() + nOldSize;
-        m_sOutput.avail_out = m_pOutput->capacity() - nOldSize;
-        m_sOutput.total_out = 0u;
-        m_pOutput->resize(m_pOutput->capacity());
+        qint32 nRet = deflate(&m_sOutput, bLast ? nFlushMode : Z_NO_FLUSH);
 
-        qint32 nRet = deflate(&m_sOutput, nFlushMode);
-
-        if( nRet == Z_OK || nRet == Z_BUF_ERROR )
-        {
-            m_pOutput->resize(nOldSize + m_sOutput.total_out);
-            m_pZOutput->remove(0, m_sOutput.total_in);
-            m_nTotalOutput += m_sOutput.total_out;
-        }
-        else
+        if( nRet != Z_OK && nRet != Z_BUF_ERROR )
         {
             qDebug() << "Error in compressor!" << nRet;
             abort();
             break;
         }
 
-    } while (m_sOutput.avail_in != 0);
+        quint32 nConsumed = nIn - m_sOutput.avail_in;
+        quint32 nProduced = nOut - m_sOutput.avail_out;
+
+        m_pOutput->Commit(nProduced);
+        m_pZOutput->Consume(nConsumed);
+        m_nTotalOutput += nProduced;
 
+        if( m_sOutput.avail_out != 0 && m_pZOutput->isEmpty() )
+            break;
+
+        if( nConsumed == 0 && nProduced == 0 )
+            break;
+    }
 }
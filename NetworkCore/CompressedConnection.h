@@ -6,8 +6,6 @@
 #include "zlib/zlib.h"
 
 
-class QByteArray;
-
 class CCompressedConnection : public CNetworkConnection
 {
     Q_OBJECT
@@ -17,19 +15,28 @@ protected:
     z_stream    m_sOutput;
     bool        m_bCompressedInput; // czy kompresja wlaczona?
     bool        m_bCompressedOutput;
-    QByteArray* m_pZInput;          // bufforki lokalne
-    QByteArray* m_pZOutput;
+    CBufferChain* m_pZInput;        // bufforki lokalne
+    CBufferChain* m_pZOutput;
     quint64     m_nTotalInput;      // statystyki
     quint64     m_nTotalOutput;
     quint64     m_nNextDeflateFlush;
     QTime       m_tDeflateFlush;
     bool        m_bOutputPending;
+    bool        m_bDeflateReady;    // m_sOutput initialized, created on first send
+    bool        m_bDeflateStarted;  // zlib header already sent, later streams are raw
+    int         m_nDeflateWindow;   // deflate windowBits and memLevel for this link
+    int         m_nDeflateMemLevel;
+    int         m_nInflateWindow;   // windowBits from the peer's zlib header
+    quint32     m_tLastDeflate;
 public:
     CCompressedConnection(QObject *parent = 0);
     virtual ~CCompressedConnection();
 
     bool EnableInputCompression(bool bEnable = true);
     bool EnableOutputCompression(bool bEnable = true);
+    void SetDeflateParameters(int nWindowBits, int nMemLevel);
+    void ReleaseIdleDeflate(quint32 tNow, quint32 nIdle);
+    quint32 GetCompressionMemory() const;
 
     virtual qint64 readFromNetwork(qint64 nBytes);
     virtual qint64 writeToNetwork(qint64 nBytes);
@@ -39,16 +46,17 @@ protected:
     bool SetupOutputStream();
     void CleanupInputStream();
     void CleanupOutputStream();
+    bool InitDeflate();
 
     void Inflate();
     void Deflate();
 
 public:
-    inline QByteArray* GetInputBuffer()
+    inline CBufferChain* GetInputBuffer()
     {
         return (m_bCompressedInput ? m_pZInput : m_pInput);
     }
-    inline QByteArray* GetOutputBuffer()
+    inline CBufferChain* GetOutputBuffer()
     {
         return (m_bCompressedOutput ? m_pZOutput : m_pOutput);
     }
@@ -0,0 +1,144 @@
+#include "EpollReactor.h"
+#include "NetworkConnection.h"
+
+#include <QSocketNotifier>
+#include <QtDebug>
+
+#ifdef Q_OS_LINUX
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+CEpollReactor::CEpollReactor()
+{
+	m_hEpoll = -1;
+	m_pNotifier = 0;
+	m_bDispatching = false;
+}
+
+CEpollReactor::~CEpollReactor()
+{
+	Stop();
+}
+
+// Call from the thread that owns the connections
+bool CEpollReactor::Start()
+{
+#ifdef Q_OS_LINUX
+	if( m_hEpoll != -1 )
+		return true;
+
+	m_hEpoll = epoll_create(EPOLL_BATCH);
+	if( m_hEpoll == -1 )
+	{
+		qDebug() << "epoll_create failed, errno" << errno;
+		return false;
+	}
+
+	m_pNotifier = new QSocketNotifier(m_hEpoll, QSocketNotifier::Read);
+	connect(m_pNotifier, SIGNAL(activated(int)), this, SLOT(OnEvents()));
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void CEpollReactor::Stop()
+{
+#ifdef Q_OS_LINUX
+	if( m_hEpoll == -1 )
+		return;
+
+	delete m_pNotifier;
+	m_pNotifier = 0;
+
+	::close(m_hEpoll);
+	m_hEpoll = -1;
+#endif
+}
+
+// Edge triggered - a connection hears about new data or buffer space once, and the rate
+// controller keeps it scheduled until it has taken everything.
+bool CEpollReactor::Add(int hSocket, CNetworkConnection* pConnection)
+{
+#ifdef Q_OS_LINUX
+	if( m_hEpoll == -1 )
+		return false;
+
+	struct epoll_event oEvent;
+	oEvent.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	oEvent.data.ptr = pConnection;
+
+	if( epoll_ctl(m_hEpoll, EPOLL_CTL_ADD, hSocket, &oEvent) == -1 )
+	{
+		qDebug() << "epoll_ctl add failed, errno" << errno;
+		return false;
+	}
+
+	m_lRemoved.remove(pConnection);
+	return true;
+#else
+	Q_UNUSED(hSocket);
+	Q_UNUSED(pConnection);
+	return false;
+#endif
+}
+
+void CEpollReactor::Remove(int hSocket, CNetworkConnection* pConnection)
+{
+#ifdef Q_OS_LINUX
+	if( m_hEpoll == -1 )
+		return;
+
+	struct epoll_event oEvent;	// ignored, but kernels before 2.6.9 want one
+	epoll_ctl(m_hEpoll, EPOLL_CTL_DEL, hSocket, &oEvent);
+
+	if( m_bDispatching )
+		m_lRemoved.insert(pConnection);
+#else
+	Q_UNUSED(hSocket);
+	Q_UNUSED(pConnection);
+#endif
+}
+
+void CEpollReactor::OnEvents()
+{
+#ifdef Q_OS_LINUX
+	struct epoll_event pEvents[EPOLL_BATCH];
+
+	forever
+	{
+		int nEvents = epoll_wait(m_hEpoll, pEvents, EPOLL_BATCH, 0);
+
+		if( nEvents < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			qDebug() << "epoll_wait failed, errno" << errno;
+			return;
+		}
+
+		m_bDispatching = true;
+
+		for( int i = 0; i < nEvents; i++ )
+		{
+			CNetworkConnection* pConnection = static_cast<CNetworkConnection*>(pEvents[i].data.ptr);
+
+			if( m_lRemoved.contains(pConnection) )
+				continue;
+
+			quint32 nFlags = pEvents[i].events;
+
+			pConnection->OnNativeEvent(nFlags & EPOLLIN, nFlags & EPOLLOUT, nFlags & (EPOLLRDHUP | EPOLLHUP), nFlags & EPOLLERR);
+		}
+
+		m_bDispatching = false;
+		m_lRemoved.clear();
+
+		if( nEvents < EPOLL_BATCH )
+			break;
+	}
+#endif
+}
@@ -0,0 +1,51 @@
+#ifndef EPOLLREACTOR_H
+#define EPOLLREACTOR_H
+
+#include <QObject>
+#include <QSet>
+
+class QSocketNotifier;
+class CNetworkConnection;
+
+// Events for a batch of neighbour sockets from a single epoll instance.
+//
+// Connections hand over their descriptor once connected (see CNetworkConnection::DetachSocket)
+// and from then on are read and written directly, without QTcpSocket's notifiers and buffers.
+// The Qt event loop watches only the epoll descriptor, so a thousand quiet leaves cost nothing
+// and a busy wakeup dispatches everything that is ready at once. Linux only - elsewhere
+// Start() fails and connections stay on QTcpSocket. Every network shard runs its own.
+
+#define EPOLL_BATCH		256
+
+class CEpollReactor : public QObject
+{
+	Q_OBJECT
+
+public:
+	CEpollReactor();
+	~CEpollReactor();
+
+// Attributes
+protected:
+	int					m_hEpoll;
+	QSocketNotifier*	m_pNotifier;
+	bool				m_bDispatching;
+	QSet<CNetworkConnection*> m_lRemoved;	// gone while dispatching, their events are stale
+
+// Operations
+public:
+	bool	Start();
+	void	Stop();
+	bool	Add(int hSocket, CNetworkConnection* pConnection);
+	void	Remove(int hSocket, CNetworkConnection* pConnection);
+
+	inline bool IsRunning() const
+	{
+		return m_hEpoll != -1;
+	}
+
+protected slots:
+	void	OnEvents();
+};
+
+#endif // EPOLLREACTOR_H
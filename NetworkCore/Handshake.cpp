@@ -10,10 +10,11 @@ CHandshake::CHandshake(QObject* parent)
     :QObject(parent)
 {
     m_pSocket = 0;
+    m_oTimeout.Init(this, 0);
 }
 void CHandshake::acceptFrom(int handle)
 {
-    m_tConnected = time(0);
+    m_oTimeout.Start(Network.m_pTimerWheel, 15000);
     m_pSocket = new QTcpSocket();
     m_pSocket->setReadBufferSize(1024);
 
@@ -43,10 +44,9 @@ CHandshake::~CHandshake()
     Handshakes.RemoveHandshake(this);
 }
 
-void CHandshake::OnTimer(quint32 tNow)
+void CHandshake::OnTimerExpired(int)
 {
-    //qDebug() << "handshake timer";
-	if( m_pSocket && tNow - m_tConnected > 15 )
+	if( m_pSocket )
     {
         qDebug() << "Timed out handshaking with " << m_pSocket->peerAddress().toString().toAscii().constData();
         m_pSocket->close();
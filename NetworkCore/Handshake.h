@@ -2,22 +2,23 @@
 #define HANDSHAKE_H
 
 #include <QObject>
+#include "TimerWheel.h"
 class QTcpSocket;
 
-class CHandshake:public QObject
+class CHandshake:public QObject, public CTimerTarget
 {
     Q_OBJECT
 
 protected:
     QTcpSocket* m_pSocket;
-    quint32     m_tConnected;
+    CWheelTimer m_oTimeout;
 
 public:
     CHandshake(QObject* parent = 0);
     void acceptFrom(int handle);
     ~CHandshake();
 
-    void OnTimer(quint32 tNow);
+    void OnTimerExpired(int nTimer);
 
 public slots:
     void OnRead();
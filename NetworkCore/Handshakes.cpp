@@ -44,16 +44,6 @@ void CHandshakes::incomingConnection(int handle)
     m_nAccepted++;
 }
 
-void CHandshakes::OnTimer(quint32 tNow)
-{
-    if( tNow == 0 )
-        tNow = time(0);
-
-    foreach(CHandshake* pHs, m_lHandshakes)
-    {
-        pHs->OnTimer(tNow);
-    }
-}
 void CHandshakes::RemoveHandshake(CHandshake *pHs)
 {
     m_lHandshakes.remove(pHs);
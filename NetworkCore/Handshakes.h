@@ -27,7 +27,6 @@ public:
 public slots:
     bool Listen();
     void Disconnect();
-    void OnTimer(quint32 tNow = 0);
     void changeThread(QThread* target);
 
 protected:
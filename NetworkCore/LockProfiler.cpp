@@ -0,0 +1,242 @@
+#include "LockProfiler.h"
+
+#include <QFile>
+#include <QCoreApplication>
+#include <QtDebug>
+#include <QtAlgorithms>
+
+#include <signal.h>
+#include <string.h>
+
+CLockProfiler LockProfiler;
+
+static volatile sig_atomic_t g_bDumpRequested = 0;
+
+static inline quint32 MicrosecondsSince(quint64 tStart)
+{
+	return quint32(qMin<quint64>(CMetrics::Now() - tStart, 0xFFFFFFFFu));
+}
+
+//////////////////////////////////////////////////////////////////////
+// CProfiledMutex
+
+CProfiledMutex::CProfiledMutex(const char* pszName, MetricLock nMetric)
+	: QMutex(QMutex::NonRecursive), m_pszName(pszName), m_nMetric(nMetric), m_pHolder(0), m_tLocked(0)
+{
+}
+
+void CProfiledMutex::lock(CLockSite* pSite)
+{
+	quint32 nWait = 0;
+
+	if( !QMutex::tryLock() )
+	{
+		quint64 tStart = CMetrics::Now();
+		QMutex::lock();
+		nWait = MicrosecondsSince(tStart);
+	}
+
+	OnLocked(pSite, nWait);
+}
+
+bool CProfiledMutex::tryLock(CLockSite* pSite, int nTimeout)
+{
+	quint32 nWait = 0;
+	bool bLocked = QMutex::tryLock();
+
+	if( !bLocked && nTimeout != 0 )
+	{
+		quint64 tStart = CMetrics::Now();
+		bLocked = QMutex::tryLock(nTimeout);
+		nWait = MicrosecondsSince(tStart);
+	}
+
+	if( !bLocked )
+	{
+		Metrics.Drop(mdrLockTimeout);
+		if( LockProfiler.IsEnabled() )
+			LockProfiler.GetStats(pSite, m_pszName)->m_oFailed.Add();
+		return false;
+	}
+
+	OnLocked(pSite, nWait);
+	return true;
+}
+
+void CProfiledMutex::unlock()
+{
+	// only the holder touches these
+	if( m_pHolder )
+	{
+		m_pHolder->m_oHold.Record(MicrosecondsSince(m_tLocked));
+		m_pHolder = 0;
+	}
+
+	QMutex::unlock();
+}
+
+void CProfiledMutex::OnLocked(CLockSite* pSite, quint32 nWait)
+{
+	Metrics.LockWait(m_nMetric, nWait);
+
+	if( !LockProfiler.IsEnabled() )
+	{
+		m_pHolder = 0;
+		return;
+	}
+
+	m_pHolder = LockProfiler.GetStats(pSite, m_pszName);
+	m_pHolder->m_oWait.Record(nWait);
+	m_tLocked = CMetrics::Now();
+}
+
+//////////////////////////////////////////////////////////////////////
+// CLockProfiler
+
+CLockProfiler::CLockProfiler()
+	: m_bEnabled(0), m_tEnabled(0)
+{
+}
+
+CLockProfiler::~CLockProfiler()
+{
+	// sites still point here, but nothing locks once statics are being torn down
+	qDeleteAll(m_lSites);
+}
+
+void CLockProfiler::SetEnabled(bool bEnabled)
+{
+	QMutexLocker l(&m_pSection);
+
+	if( bEnabled && !IsEnabled() )
+		m_tEnabled = CMetrics::Now();
+
+	m_bEnabled.fetchAndStoreOrdered(bEnabled ? 1 : 0);
+	qDebug() << "Lock profiler" << ( bEnabled ? "on" : "off" );
+}
+
+CLockSiteStats* CLockProfiler::GetStats(CLockSite* pSite, const char* pszLock)
+{
+	if( pSite->m_pStats )
+		return pSite->m_pStats;
+
+	QMutexLocker l(&m_pSection);
+
+	if( !pSite->m_pStats )
+	{
+		CLockSiteStats* pStats = new CLockSiteStats();
+		pStats->m_pSite = pSite;
+		pStats->m_pszLock = pszLock;
+		m_lSites.append(pStats);
+		pSite->m_pStats = pStats;
+	}
+
+	return pSite->m_pStats;
+}
+
+static bool MoreContended(const CLockSiteStats* pA, const CLockSiteStats* pB)
+{
+	if( pA->m_oWait.GetSum() != pB->m_oWait.GetSum() )
+		return pA->m_oWait.GetSum() > pB->m_oWait.GetSum();
+	return pA->m_oHold.GetSum() > pB->m_oHold.GetSum();
+}
+
+static QByteArray FormatTimes(const CMetricHistogram& oHistogram)
+{
+	return QByteArray::number(double(oHistogram.GetSum()) / 1000.0, 'f', 1) + " ms, p50 "
+			+ QByteArray::number(oHistogram.GetPercentile(50)) + " p99 "
+			+ QByteArray::number(oHistogram.GetPercentile(99)) + " max "
+			+ QByteArray::number(oHistogram.GetPercentile(100)) + " us";
+}
+
+// Sites that waited the longest first
+QByteArray CLockProfiler::Render()
+{
+	QMutexLocker l(&m_pSection);
+
+	QList<CLockSiteStats*> lSites = m_lSites;
+	for( int i = 0; i < lSites.size(); i++ )
+	{
+		lSites[i]->m_oWait.Collect();
+		lSites[i]->m_oHold.Collect();
+		lSites[i]->m_oFailed.Collect();
+	}
+
+	qSort(lSites.begin(), lSites.end(), MoreContended);
+
+	QByteArray baOut;
+	baOut += QByteArray("Lock profile over ") + QByteArray::number(IsEnabled() ? ( CMetrics::Now() - m_tEnabled ) / 1000000 : 0)
+			+ " s, " + QByteArray::number(lSites.size()) + " sites\n";
+
+	for( int i = 0; i < lSites.size(); i++ )
+	{
+		CLockSiteStats* pStats = lSites.at(i);
+		quint64 nLocked = pStats->m_oWait.GetCount();
+
+		baOut += QByteArray(pStats->m_pszLock) + " " + pStats->m_pSite->m_pszFile + ":" + QByteArray::number(pStats->m_pSite->m_nLine)
+				+ ": " + QByteArray::number(nLocked) + " locked, " + QByteArray::number(nLocked - pStats->m_oWait.GetCount(1)) + " contended\n";
+		baOut += QByteArray("    wait ") + FormatTimes(pStats->m_oWait) + "\n";
+		baOut += QByteArray("    hold ") + FormatTimes(pStats->m_oHold) + "\n";
+
+		if( pStats->m_oFailed.GetTotal() > 0 )
+		{
+			baOut += QByteArray("    failed tryLock ") + QByteArray::number(pStats->m_oFailed.GetTotal()) + ", dropped: "
+					+ ( pStats->m_pSite->m_pszDropped ? pStats->m_pSite->m_pszDropped : "unknown" ) + "\n";
+		}
+	}
+
+	return baOut;
+}
+
+void CLockProfiler::Dump()
+{
+	if( !IsEnabled() )
+	{
+		// nothing recorded yet, start now and report on the next dump
+		SetEnabled(true);
+		return;
+	}
+
+	QByteArray baText = Render();
+
+	foreach( const QByteArray& baLine, baText.split('\n') )
+	{
+		if( !baLine.isEmpty() )
+			qDebug() << baLine.constData();
+	}
+
+	QString sPath = qApp->applicationDirPath() + "/LockProfile.txt";
+	QFile oFile(sPath);
+	if( oFile.open(QIODevice::WriteOnly | QIODevice::Truncate) )
+		oFile.write(baText);
+	else
+		qDebug() << "Lock profiler: cannot open" << sPath;
+}
+
+#ifdef Q_OS_UNIX
+static void OnDumpSignal(int)
+{
+	g_bDumpRequested = 1;
+}
+#endif
+
+void CLockProfiler::InstallSignalHandler()
+{
+#ifdef Q_OS_UNIX
+	struct sigaction oAction;
+	memset(&oAction, 0, sizeof(oAction));
+	oAction.sa_handler = OnDumpSignal;
+	sigemptyset(&oAction.sa_mask);
+	oAction.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &oAction, 0);
+#endif
+}
+
+bool CLockProfiler::TakeDumpRequest()
+{
+	if( !g_bDumpRequested )
+		return false;
+
+	g_bDumpRequested = 0;
+	return true;
+}
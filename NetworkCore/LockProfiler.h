@@ -0,0 +1,133 @@
+#ifndef LOCKPROFILER_H
+#define LOCKPROFILER_H
+
+#include <QMutex>
+#include <QList>
+#include <QByteArray>
+#include "Metrics.h"
+
+// Contention profile of the core locks, per call site.
+//
+// Every lock and tryLock of a CProfiledMutex names its call site. Wait time always goes to the
+// lock's histogram in Metrics; with the profiler on, each site also gets wait and hold time
+// histograms and a count of the tryLocks that failed, along with what the caller skipped.
+
+struct CLockSiteStats;
+
+// Call sites are static aggregates, initialised at load time and registered on first use
+struct CLockSite
+{
+	const char*		m_pszFile;
+	int				m_nLine;
+	const char*		m_pszDropped;	// work a failed tryLock gives up, 0 for blocking sites
+	CLockSiteStats*	m_pStats;		// set by the profiler
+};
+
+#define LOCK_SITE(pszDropped)	{ __FILE__, __LINE__, pszDropped, 0 }
+
+// QMutexLocker on a CProfiledMutex, attributed to the line it is on
+#define PROFILED_LOCKER(oLocker, pMutex) \
+	static CLockSite oLocker##Site = LOCK_SITE(0); \
+	CProfiledLocker oLocker(pMutex, &oLocker##Site)
+
+struct CLockSiteStats
+{
+	CLockSite*			m_pSite;
+	const char*			m_pszLock;
+	CMetricHistogram	m_oWait;
+	CMetricHistogram	m_oHold;
+	CMetricCounter		m_oFailed;
+};
+
+// A QMutex that measures itself. Still a QMutex, so QWaitCondition and CThread take it, but
+// locking through the base class bypasses the profiler.
+class CProfiledMutex : public QMutex
+{
+protected:
+	const char*		m_pszName;
+	MetricLock		m_nMetric;
+	CLockSiteStats*	m_pHolder;		// site holding the lock, while the profiler is on
+	quint64			m_tLocked;
+
+public:
+	CProfiledMutex(const char* pszName, MetricLock nMetric);
+
+	void	lock(CLockSite* pSite);
+	bool	tryLock(CLockSite* pSite, int nTimeout = 0);
+	void	unlock();
+
+	inline const char* GetName() const
+	{
+		return m_pszName;
+	}
+
+protected:
+	void	OnLocked(CLockSite* pSite, quint32 nWait);
+};
+
+class CProfiledLocker
+{
+protected:
+	CProfiledMutex*	m_pMutex;
+	CLockSite*		m_pSite;
+	bool			m_bLocked;
+
+public:
+	inline CProfiledLocker(CProfiledMutex* pMutex, CLockSite* pSite)
+		: m_pMutex(pMutex), m_pSite(pSite), m_bLocked(true)
+	{
+		m_pMutex->lock(m_pSite);
+	}
+	inline ~CProfiledLocker()
+	{
+		if( m_bLocked )
+			m_pMutex->unlock();
+	}
+
+	inline void unlock()
+	{
+		Q_ASSERT(m_bLocked);
+		m_pMutex->unlock();
+		m_bLocked = false;
+	}
+	inline void relock()
+	{
+		Q_ASSERT(!m_bLocked);
+		m_pMutex->lock(m_pSite);
+		m_bLocked = true;
+	}
+};
+
+class CLockProfiler
+{
+public:
+	CLockProfiler();
+	~CLockProfiler();
+
+protected:
+	QMutex					m_pSection;		// site registration and Dump()
+	QList<CLockSiteStats*>	m_lSites;
+	QAtomicInt				m_bEnabled;
+	quint64					m_tEnabled;
+
+public:
+	inline bool IsEnabled() const
+	{
+		return int(m_bEnabled) != 0;
+	}
+	void	SetEnabled(bool bEnabled);
+
+	CLockSiteStats*	GetStats(CLockSite* pSite, const char* pszLock);
+
+	// Writes the table to the debug log and to LockProfile.txt
+	void		Dump();
+	QByteArray	Render();
+
+	// SIGUSR1 asks for a dump, polled from the GUI timer
+	void	InstallSignalHandler();
+	bool	TakeDumpRequest();
+};
+
+extern CLockProfiler LockProfiler;
+
+#endif // LOCKPROFILER_H
@@ -99,6 +99,8 @@ void CManagedSearch::Execute(quint32 tNow, quint32 *pnMaxPackets)
 
 void CManagedSearch::SearchNeighbours(quint32 tNow)
 {
+	// the query is the same for every neighbour, encode it once on first use
+	QByteArray baQuery;
 
     foreach(CG2Node* pNode, *Network.List())
     {
@@ -108,12 +110,18 @@ void CManagedSearch::SearchNeighbours(quint32 tNow)
             && !m_lSearchedNodes.contains(pNode->m_oAddress.ip)
             )
         {
-            G2Packet* pQuery = m_pQuery->ToG2Packet();
-            if( pQuery )
-            {
-                m_lSearchedNodes[pNode->m_oAddress.ip] = tNow;
-				pNode->SendPacket(pQuery, true, true);
-            }
+			if( baQuery.isEmpty() )
+			{
+				G2Packet* pQuery = m_pQuery->ToG2Packet();
+				if( pQuery == 0 )
+					return;
+
+				baQuery = pQuery->ToFrame();
+				pQuery->Release();
+			}
+
+			m_lSearchedNodes[pNode->m_oAddress.ip] = tNow;
+			pNode->SendFrame(baQuery, true);
         }
     }
 }
@@ -132,6 +140,10 @@ void CManagedSearch::SearchG2(quint32 tNow, quint32 *pnMaxPackets)
         if( !pHost->CanQuery(tNow) )
 			continue;
 
+		// stopped acking our datagrams, give it time before spending more upstream on it
+		if( Datagrams.IsBackingOff(pHost->m_oAddress.ip) )
+			continue;
+
         IPv4_ENDPOINT* pReceiver = 0;
 
         if( pHost->m_nQueryKey == 0 )
@@ -0,0 +1,359 @@
+#include "Metrics.h"
+
+
+#include <QTcpSocket>
+#include <QFile>
+#include <QDateTime>
+#include <QCoreApplication>
+#include <QtDebug>
+
+#ifdef Q_OS_WIN
+#include <qt_windows.h>
+#else
+#include <time.h>
+#endif
+
+CMetrics Metrics;
+
+static const char* g_pTransportNames[mtTransports] = { "tcp", "udp" };
+static const char* g_pDirectionNames[mdDirections] = { "in", "out" };
+static const char* g_pPacketNames[mpPackets] = { "PI", "PO", "LNI", "KHL", "QHT", "Q2", "QKR", "QKA", "QA", "QH2", "PUSH", "CRAWL", "other" };
+static const char* g_pDropNames[mdrReasons] = { "queue_full", "udp_frames", "udp_buffers", "lock_timeout", "malformed", "udp_unanswered" };
+static const char* g_pLockNames[mlLocks] = { "network", "datagrams", "searches", "packet_pool", "shares" };
+static const char* g_pGaugeNames[mgGauges] = { "quazaa_nodes", "quazaa_send_queue_bytes", "quazaa_udp_send_queue", "quazaa_udp_reassembly" };
+
+// Histogram buckets exported to Prometheus: 1 us to about 67 s in steps of four
+#define METRIC_EXPORT_FIRST		0
+#define METRIC_EXPORT_LAST		26
+#define METRIC_EXPORT_STEP		2
+
+//////////////////////////////////////////////////////////////////////
+// CMetricHistogram
+
+CMetricHistogram::CMetricHistogram()
+{
+	for( int i = 0; i < METRIC_BUCKETS; i++ )
+		m_pTotal[i] = 0;
+}
+
+void CMetricHistogram::Collect()
+{
+	for( int i = 0; i < METRIC_BUCKETS; i++ )
+		m_pTotal[i] += quint32(m_pDelta[i].fetchAndStoreRelaxed(0));
+
+	m_oSum.Collect();
+}
+
+quint64 CMetricHistogram::GetCount() const
+{
+	quint64 nCount = 0;
+	for( int i = 0; i < METRIC_BUCKETS; i++ )
+		nCount += m_pTotal[i];
+	return nCount;
+}
+
+quint64 CMetricHistogram::GetCount(quint32 nBelow) const
+{
+	quint64 nCount = 0;
+	for( int i = 0; i < METRIC_BUCKETS && BucketTop(i) < nBelow; i++ )
+		nCount += m_pTotal[i];
+	return nCount;
+}
+
+// Upper end of the bucket holding the given share of the values
+quint64 CMetricHistogram::GetPercentile(double dPercent) const
+{
+	quint64 nCount = GetCount();
+	if( nCount == 0 )
+		return 0;
+
+	quint64 nRank = quint64(dPercent / 100.0 * nCount + 0.5);
+	quint64 nSeen = 0;
+
+	for( int i = 0; i < METRIC_BUCKETS; i++ )
+	{
+		nSeen += m_pTotal[i];
+		if( nSeen >= nRank && nSeen > 0 )
+			return BucketTop(i);
+	}
+
+	return BucketTop(METRIC_BUCKETS - 1);
+}
+
+quint64 CMetricHistogram::BucketTop(int nBucket)
+{
+	if( nBucket < ( 1 << METRIC_SUB_BITS ) )
+		return nBucket;
+
+	int nShift = ( nBucket >> METRIC_SUB_BITS ) - 1;
+	quint64 nStep = ( nBucket & ( ( 1 << METRIC_SUB_BITS ) - 1 ) ) + ( 1 << METRIC_SUB_BITS );
+	return ( ( nStep + 1 ) << nShift ) - 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CMetrics
+
+CMetrics::CMetrics()
+{
+	m_tLastFile = 0;
+	m_bFile = false;
+	m_nFilePeriod = 60;
+	m_nFileSize = 4;
+}
+
+// Snapshot file options, the caller reads them from its settings
+void CMetrics::SetFile(bool bEnabled, int nPeriod, int nMaxSize)
+{
+	QMutexLocker l(&m_pSection);
+
+	m_bFile = bEnabled;
+	m_nFilePeriod = qMax(1, nPeriod);
+	m_nFileSize = qMax(1, nMaxSize);
+}
+
+MetricPacket CMetrics::PacketIndex(G2_PACKET nType)
+{
+	switch( nType )
+	{
+	case G2_PACKET_PING:			return mpPing;
+	case G2_PACKET_PONG:			return mpPong;
+	case G2_PACKET_LNI:				return mpLNI;
+	case G2_PACKET_KHL:				return mpKHL;
+	case G2_PACKET_QHT:				return mpQHT;
+	case G2_PACKET_QUERY:			return mpQuery;
+	case G2_PACKET_QUERY_KEY_REQ:	return mpQueryKeyReq;
+	case G2_PACKET_QUERY_KEY_ANS:	return mpQueryKeyAns;
+	case G2_PACKET_QUERY_ACK:		return mpQueryAck;
+	case G2_PACKET_HIT:				return mpHit;
+	case G2_PACKET_PUSH:			return mpPush;
+	case G2_PACKET_CRAWL_REQ:
+	case G2_PACKET_CRAWL_ANS:		return mpCrawl;
+	default:						return mpOther;
+	}
+}
+
+quint64 CMetrics::Now()
+{
+#ifdef Q_OS_WIN
+	static LARGE_INTEGER nFrequency = { 0 };
+	if( nFrequency.QuadPart == 0 )
+		QueryPerformanceFrequency(&nFrequency);
+
+	LARGE_INTEGER nCounter;
+	QueryPerformanceCounter(&nCounter);
+	return quint64(nCounter.QuadPart) * 1000000 / quint64(nFrequency.QuadPart);
+#else
+	struct timespec tNow;
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return quint64(tNow.tv_sec) * 1000000 + tNow.tv_nsec / 1000;
+#endif
+}
+
+void CMetrics::Collect()
+{
+	QMutexLocker l(&m_pSection);
+
+	for( int t = 0; t < mtTransports; t++ )
+	{
+		for( int d = 0; d < mdDirections; d++ )
+		{
+			for( int p = 0; p < mpPackets; p++ )
+				m_pPackets[t][d][p].Collect();
+
+			m_pBytes[t][d].Collect();
+		}
+
+		for( int p = 0; p < mpPackets; p++ )
+			m_pHandler[t][p].Collect();
+	}
+
+	for( int i = 0; i < mdrReasons; i++ )
+		m_pDrops[i].Collect();
+
+	for( int i = 0; i < mlLocks; i++ )
+		m_pLockWait[i].Collect();
+
+	quint32 tNow = time(0);
+	if( m_bFile && tNow - m_tLastFile >= quint32(m_nFilePeriod) )
+	{
+		m_tLastFile = tNow;
+		l.unlock();
+		WriteFile(Render());
+	}
+}
+
+static void RenderHistogram(QByteArray& baOut, const char* pszName, const QByteArray& baLabels, const CMetricHistogram& oHistogram)
+{
+	QByteArray baPrefix = QByteArray(pszName) + "_bucket{" + baLabels + ( baLabels.isEmpty() ? "le=\"" : ",le=\"" );
+
+	for( int k = METRIC_EXPORT_FIRST; k <= METRIC_EXPORT_LAST; k += METRIC_EXPORT_STEP )
+	{
+		quint32 nBelow = 1u << k;
+		baOut += baPrefix + QByteArray::number(double(nBelow) / 1000000.0, 'g', 6) + "\"} " + QByteArray::number(oHistogram.GetCount(nBelow)) + "\n";
+	}
+
+	quint64 nCount = oHistogram.GetCount();
+	QByteArray baBraces = baLabels.isEmpty() ? QByteArray() : QByteArray("{") + baLabels + "}";
+
+	baOut += baPrefix + "+Inf\"} " + QByteArray::number(nCount) + "\n";
+	baOut += QByteArray(pszName) + "_sum" + baBraces + " " + QByteArray::number(double(oHistogram.GetSum()) / 1000000.0, 'g', 10) + "\n";
+	baOut += QByteArray(pszName) + "_count" + baBraces + " " + QByteArray::number(nCount) + "\n";
+}
+
+// Totals as of the last Collect()
+QByteArray CMetrics::Render()
+{
+	QMutexLocker l(&m_pSection);
+
+	QByteArray baOut;
+	baOut.reserve(16384);
+
+	baOut += "# HELP quazaa_packets_total G2 packets by transport, direction and type.\n";
+	baOut += "# TYPE quazaa_packets_total counter\n";
+	for( int t = 0; t < mtTransports; t++ )
+	{
+		for( int d = 0; d < mdDirections; d++ )
+		{
+			for( int p = 0; p < mpPackets; p++ )
+			{
+				baOut += QByteArray("quazaa_packets_total{transport=\"") + g_pTransportNames[t] + "\",direction=\"" + g_pDirectionNames[d]
+						+ "\",type=\"" + g_pPacketNames[p] + "\"} " + QByteArray::number(m_pPackets[t][d][p].GetTotal()) + "\n";
+			}
+		}
+	}
+
+	baOut += "# HELP quazaa_bytes_total Bytes on the wire by transport and direction.\n";
+	baOut += "# TYPE quazaa_bytes_total counter\n";
+	for( int t = 0; t < mtTransports; t++ )
+	{
+		for( int d = 0; d < mdDirections; d++ )
+		{
+			baOut += QByteArray("quazaa_bytes_total{transport=\"") + g_pTransportNames[t] + "\",direction=\"" + g_pDirectionNames[d]
+					+ "\"} " + QByteArray::number(m_pBytes[t][d].GetTotal()) + "\n";
+		}
+	}
+
+	baOut += "# HELP quazaa_drops_total Packets and frames dropped, by reason.\n";
+	baOut += "# TYPE quazaa_drops_total counter\n";
+	for( int i = 0; i < mdrReasons; i++ )
+		baOut += QByteArray("quazaa_drops_total{reason=\"") + g_pDropNames[i] + "\"} " + QByteArray::number(m_pDrops[i].GetTotal()) + "\n";
+
+	for( int i = 0; i < mgGauges; i++ )
+	{
+		baOut += QByteArray("# TYPE ") + g_pGaugeNames[i] + " gauge\n";
+		baOut += QByteArray(g_pGaugeNames[i]) + " " + QByteArray::number(int(m_pGauges[i])) + "\n";
+	}
+
+	baOut += "# HELP quazaa_lock_wait_seconds Time spent waiting for core locks.\n";
+	baOut += "# TYPE quazaa_lock_wait_seconds histogram\n";
+	for( int i = 0; i < mlLocks; i++ )
+		RenderHistogram(baOut, "quazaa_lock_wait_seconds", QByteArray("lock=\"") + g_pLockNames[i] + "\"", m_pLockWait[i]);
+
+	// wall time with the core lock held, packet handlers do not block on I/O
+	baOut += "# HELP quazaa_handler_seconds Time spent in packet handlers.\n";
+	baOut += "# TYPE quazaa_handler_seconds histogram\n";
+	for( int t = 0; t < mtTransports; t++ )
+	{
+		for( int p = 0; p < mpPackets; p++ )
+		{
+			if( m_pHandler[t][p].GetCount() == 0 )
+				continue;
+
+			RenderHistogram(baOut, "quazaa_handler_seconds", QByteArray("transport=\"") + g_pTransportNames[t] + "\",type=\"" + g_pPacketNames[p] + "\"", m_pHandler[t][p]);
+		}
+	}
+
+	return baOut;
+}
+
+// Appends a snapshot to Metrics.prom, the previous file is kept as Metrics.prom.1 when it is full
+void CMetrics::WriteFile(const QByteArray& baText)
+{
+	QString sPath = qApp->applicationDirPath() + "/Metrics.prom";
+	QFile oFile(sPath);
+
+	if( oFile.size() + baText.size() > qint64(m_nFileSize) * 1024 * 1024 )
+	{
+		QFile::remove(sPath + ".1");
+		QFile::rename(sPath, sPath + ".1");
+	}
+
+	if( !oFile.open(QIODevice::WriteOnly | QIODevice::Append) )
+	{
+		qDebug() << "Metrics: cannot open" << sPath;
+		return;
+	}
+
+	oFile.write(QByteArray("# snapshot ") + QDateTime::currentDateTime().toUTC().toString(Qt::ISODate).toAscii() + "\n");
+	oFile.write(baText);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Scoped helpers
+
+CMetricHandlerTimer::~CMetricHandlerTimer()
+{
+	Metrics.Handled(m_nTransport, m_nType, quint32(qMin<quint64>(CMetrics::Now() - m_tStart, 0xFFFFFFFFu)));
+}
+
+//////////////////////////////////////////////////////////////////////
+// CMetricsServer
+
+CMetricsServer::CMetricsServer(QObject* parent)
+	: QTcpServer(parent)
+{
+	connect(this, SIGNAL(newConnection()), this, SLOT(OnConnection()));
+}
+
+bool CMetricsServer::Listen(quint16 nPort)
+{
+	if( !listen(QHostAddress::LocalHost, nPort) )
+	{
+		qDebug() << "Metrics: cannot listen on port" << nPort << errorString();
+		return false;
+	}
+
+	qDebug() << "Metrics served on http://127.0.0.1:" << nPort << "/metrics";
+	return true;
+}
+
+void CMetricsServer::OnConnection()
+{
+	while( QTcpSocket* pSocket = nextPendingConnection() )
+	{
+		connect(pSocket, SIGNAL(readyRead()), this, SLOT(OnRequest()));
+		connect(pSocket, SIGNAL(disconnected()), pSocket, SLOT(deleteLater()));
+	}
+}
+
+// Any complete request gets the metrics, there is nothing else to ask for
+void CMetricsServer::OnRequest()
+{
+	QTcpSocket* pSocket = qobject_cast<QTcpSocket*>(sender());
+	if( !pSocket )
+		return;
+
+	if( pSocket->bytesAvailable() > 4096 )
+	{
+		pSocket->abort();
+		pSocket->deleteLater();
+		return;
+	}
+
+	if( !pSocket->peek(pSocket->bytesAvailable()).contains("\r\n\r\n") )
+		return;
+
+	pSocket->readAll();
+
+	QByteArray baBody = Metrics.Render();
+	QByteArray baResp;
+	baResp += "HTTP/1.0 200 OK\r\n";
+	baResp += "Content-Type: text/plain; version=0.0.4\r\n";
+	baResp += QByteArray("Content-Length: ") + QByteArray::number(baBody.size()) + "\r\n";
+	baResp += "Connection: close\r\n";
+	baResp += "\r\n";
+	baResp += baBody;
+
+	pSocket->write(baResp);
+	pSocket->disconnectFromHost();
+}
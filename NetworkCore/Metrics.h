@@ -0,0 +1,223 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QMutex>
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QString>
+#include <QTcpServer>
+#include "g2packettypes.h"
+
+// Counters, gauges and latency histograms of the network core, exported in Prometheus text format.
+//
+// Updates are single relaxed atomic adds and may come from any thread. The 32-bit cells only
+// hold what changed since the last Collect(), which folds them into 64-bit totals - the network
+// thread collects every second, far more often than a cell can wrap.
+
+enum MetricTransport { mtTCP, mtUDP, mtTransports };
+enum MetricDirection { mdIn, mdOut, mdDirections };
+
+// Packet types with series of their own, the rest is counted as "other"
+enum MetricPacket
+{
+	mpPing, mpPong, mpLNI, mpKHL, mpQHT, mpQuery, mpQueryKeyReq, mpQueryKeyAns,
+	mpQueryAck, mpHit, mpPush, mpCrawl, mpOther, mpPackets
+};
+
+enum MetricDrop
+{
+	mdrQueueFull,		// neighbour send queue over its limit
+	mdrUdpFrames,		// no free UDP datagram slot
+	mdrUdpBuffers,		// no free UDP fragment buffer
+	mdrLockTimeout,		// gave up waiting for a lock
+	mdrMalformed,		// packet failed to parse
+	mdrUdpUnanswered,	// resends given up on a host that stopped acking
+	mdrReasons
+};
+
+// Core locks, see CProfiledMutex
+enum MetricLock { mlNetwork, mlDatagrams, mlSearches, mlPacketPool, mlShares, mlLocks };
+
+enum MetricGauge
+{
+	mgNodes,			// neighbours, all states
+	mgSendQueueBytes,	// buffered in neighbour send queues
+	mgUdpSendQueue,		// datagrams waiting to go out or for an ack
+	mgUdpReassembly,	// datagrams being reassembled
+	mgGauges
+};
+
+// 8 linear steps per power of two, about 12% precision from 8 up to 2^32
+#define METRIC_SUB_BITS		3
+#define METRIC_BUCKETS		( ( 1 << METRIC_SUB_BITS ) * ( 33 - METRIC_SUB_BITS ) )
+
+class CMetricCounter
+{
+protected:
+	QAtomicInt	m_nDelta;
+	quint64		m_nTotal;
+
+public:
+	CMetricCounter()
+		: m_nDelta(0), m_nTotal(0)
+	{
+	}
+
+	inline void Add(quint32 nValue = 1)
+	{
+		m_nDelta.fetchAndAddRelaxed(int(nValue));
+	}
+	inline quint64 Collect()
+	{
+		m_nTotal += quint32(m_nDelta.fetchAndStoreRelaxed(0));
+		return m_nTotal;
+	}
+	inline quint64 GetTotal() const
+	{
+		return m_nTotal;
+	}
+};
+
+// Log-linear histogram of microseconds, in the manner of HdrHistogram
+class CMetricHistogram
+{
+protected:
+	QAtomicInt	m_pDelta[METRIC_BUCKETS];
+	quint64		m_pTotal[METRIC_BUCKETS];
+	CMetricCounter m_oSum;
+
+public:
+	CMetricHistogram();
+
+	inline void Record(quint32 nValue)
+	{
+		m_pDelta[Bucket(nValue)].fetchAndAddRelaxed(1);
+		m_oSum.Add(nValue);
+	}
+
+	void	Collect();
+	quint64	GetCount() const;
+	quint64	GetCount(quint32 nBelow) const;	// values under nBelow, nBelow a power of two
+	quint64	GetPercentile(double dPercent) const;
+
+	inline quint64 GetSum() const
+	{
+		return m_oSum.GetTotal();
+	}
+
+	static inline int Bucket(quint32 nValue)
+	{
+		if( nValue < ( 1u << METRIC_SUB_BITS ) )
+			return nValue;
+
+		int nExponent = 31;
+		while( !( nValue & ( 1u << nExponent ) ) )
+			nExponent--;
+
+		int nShift = nExponent - METRIC_SUB_BITS;
+		return ( ( nShift + 1 ) << METRIC_SUB_BITS ) + ( ( nValue >> nShift ) & ( ( 1 << METRIC_SUB_BITS ) - 1 ) );
+	}
+	static quint64 BucketTop(int nBucket);
+};
+
+class CMetrics
+{
+public:
+	CMetrics();
+
+// Attributes
+protected:
+	QMutex				m_pSection;		// Collect() and Render()
+	CMetricCounter		m_pPackets[mtTransports][mdDirections][mpPackets];
+	CMetricCounter		m_pBytes[mtTransports][mdDirections];
+	CMetricCounter		m_pDrops[mdrReasons];
+	CMetricHistogram	m_pLockWait[mlLocks];
+	CMetricHistogram	m_pHandler[mtTransports][mpPackets];
+	QAtomicInt			m_pGauges[mgGauges];
+	quint32				m_tLastFile;
+	bool				m_bFile;		// Metrics.prom snapshots, off until SetFile()
+	int					m_nFilePeriod;	// seconds
+	int					m_nFileSize;	// MB
+
+// Operations
+public:
+	inline void PacketIn(MetricTransport nTransport, G2_PACKET nType)
+	{
+		m_pPackets[nTransport][mdIn][PacketIndex(nType)].Add();
+	}
+	inline void PacketOut(MetricTransport nTransport, G2_PACKET nType)
+	{
+		m_pPackets[nTransport][mdOut][PacketIndex(nType)].Add();
+	}
+	inline void Bytes(MetricTransport nTransport, MetricDirection nDirection, quint32 nBytes)
+	{
+		m_pBytes[nTransport][nDirection].Add(nBytes);
+	}
+	inline void Drop(MetricDrop nReason)
+	{
+		m_pDrops[nReason].Add();
+	}
+	inline void LockWait(MetricLock nLock, quint32 nMicroseconds)
+	{
+		m_pLockWait[nLock].Record(nMicroseconds);
+	}
+	inline void Handled(MetricTransport nTransport, G2_PACKET nType, quint32 nMicroseconds)
+	{
+		m_pHandler[nTransport][PacketIndex(nType)].Record(nMicroseconds);
+	}
+	inline void SetGauge(MetricGauge nGauge, int nValue)
+	{
+		m_pGauges[nGauge].fetchAndStoreRelaxed(nValue);
+	}
+	inline void AddGauge(MetricGauge nGauge, int nDelta)
+	{
+		m_pGauges[nGauge].fetchAndAddRelaxed(nDelta);
+	}
+
+	// Network thread, every second
+	void		SetFile(bool bEnabled, int nPeriod, int nMaxSize);
+	void		Collect();
+	QByteArray	Render();
+
+	static MetricPacket	PacketIndex(G2_PACKET nType);
+	static quint64		Now();		// monotonic, microseconds
+
+protected:
+	void	WriteFile(const QByteArray& baText);
+};
+
+// Times a scope into a handler histogram
+class CMetricHandlerTimer
+{
+protected:
+	MetricTransport	m_nTransport;
+	G2_PACKET		m_nType;
+	quint64			m_tStart;
+
+public:
+	inline CMetricHandlerTimer(MetricTransport nTransport, G2_PACKET nType)
+		: m_nTransport(nTransport), m_nType(nType), m_tStart(CMetrics::Now())
+	{
+	}
+	~CMetricHandlerTimer();
+};
+
+// Serves Render() over HTTP on the loopback interface, for Prometheus or curl.
+// Lives in the network thread.
+class CMetricsServer : public QTcpServer
+{
+	Q_OBJECT
+
+public:
+	CMetricsServer(QObject* parent = 0);
+
+	bool	Listen(quint16 nPort);
+
+protected slots:
+	void	OnConnection();
+	void	OnRequest();
+};
+
+extern CMetrics Metrics;
+
+#endif // METRICS_H
@@ -0,0 +1,70 @@
+#ifndef NEIGHBOURSTATS_H
+#define NEIGHBOURSTATS_H
+
+#include <QVector>
+#include <QString>
+#include <QAtomicPointer>
+#include "types.h"
+
+// What the neighbours view shows of one node, copied out by the shard that owns it
+struct CNeighbourStats
+{
+	quint32			nId;			// CG2Node::m_nId, pointers may be reused
+	IPv4_ENDPOINT	oAddress;
+	G2NodeType		nType;
+	int				nState;
+	quint32			tConnected;
+	quint32			nPacketsIn;
+	quint32			nPacketsOut;
+	quint32			nBandwidthIn;
+	quint32			nBandwidthOut;
+	quint64			nBytesReceived;
+	quint64			nBytesSent;
+	quint64			nDecompressedIn;
+	quint64			nCompressedOut;
+	quint32			nCompressionMemory;
+	quint16			nLeafCount;
+	quint16			nLeafMax;
+	quint32			nRTT;
+	QString			sUserAgent;
+};
+
+// All neighbours as of one network tick. Never modified once published.
+class CNeighbourSnapshot
+{
+public:
+	quint32						m_nSerial;
+	QVector<CNeighbourStats>	m_lNodes;
+};
+
+// Hands snapshots from the network thread to a single reader without a lock.
+// The slot holds at most one unread snapshot: Publish() replaces it, freeing one the reader
+// never took, and Take() empties it. Each side owns what it holds, so nothing is freed
+// under the other's feet.
+class CNeighbourStatsMailbox
+{
+protected:
+	QAtomicPointer<CNeighbourSnapshot>	m_pSlot;
+
+public:
+	CNeighbourStatsMailbox()
+		: m_pSlot(0)
+	{
+	}
+	~CNeighbourStatsMailbox()
+	{
+		delete m_pSlot.fetchAndStoreOrdered(0);
+	}
+
+	inline void Publish(CNeighbourSnapshot* pSnapshot)
+	{
+		delete m_pSlot.fetchAndStoreOrdered(pSnapshot);
+	}
+	// 0 if nothing new was published since the last call
+	inline CNeighbourSnapshot* Take()
+	{
+		return m_pSlot.fetchAndStoreOrdered(0);
+	}
+};
+
+#endif // NEIGHBOURSTATS_H
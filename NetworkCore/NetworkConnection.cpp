@@ -1,8 +1,20 @@
 #include "NetworkConnection.h"
+#include "EpollReactor.h"
+#include "Metrics.h"
 
 #include <QHostAddress>
 #include <QMetaType>
 
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
 CNetworkConnection::CNetworkConnection(QObject* parent)
     :QTcpSocket(parent)
 {
@@ -17,6 +29,8 @@ CNetworkConnection::CNetworkConnection(QObject* parent)
     //qDebug() << "CNetworkConnection constructor";
 
     m_pSocket = 0;
+    m_hSocket = -1;
+    m_pReactor = 0;
 
     m_pInput = 0;
     m_pOutput = 0;
@@ -28,18 +42,29 @@ CNetworkConnection::CNetworkConnection(QObject* parent)
     m_tLastRotate = time(0);
 
     m_nTotalInput = m_nTotalOutput = 0;
+    m_bRateActive = false;
+    m_bControlPending = false;
 
     memset(&m_nInput, 0, sizeof(m_nInput));
     memset(&m_nOutput, 0, sizeof(m_nOutput));
 
 	connect(this, SIGNAL(readyRead()), this, SIGNAL(readyToTransfer()), Qt::QueuedConnection);
     connect(this, SIGNAL(connected()), this, SIGNAL(readyToTransfer()));
+	connect(this, SIGNAL(bytesWritten(qint64)), this, SIGNAL(readyToTransfer()), Qt::QueuedConnection);
 	connect(this, SIGNAL(aboutToClose()), this, SLOT(OnAboutToClose()));
 }
 CNetworkConnection::~CNetworkConnection()
 {
     //qDebug() << "CNetworkConnection destructor";
 
+#ifdef Q_OS_UNIX
+    if( m_hSocket != -1 )
+    {
+        m_pReactor->Remove(m_hSocket, this);
+        ::close(m_hSocket);
+    }
+#endif
+
     if( m_pInput )
         delete m_pInput;
     if( m_pOutput )
@@ -66,8 +91,8 @@ void CNetworkConnection::connectToHost(IPv4_ENDPOINT oAddress)
 
     Q_ASSERT(m_pInput == 0);
     Q_ASSERT(m_pOutput == 0);
-    m_pInput = new QByteArray();
-    m_pOutput = new QByteArray();
+    m_pInput = new CBufferChain();
+    m_pOutput = new CBufferChain();
     Q_ASSERT(m_pSocket == 0);
 
 	m_pSocket = new QTcpSocket();
@@ -94,8 +119,8 @@ void CNetworkConnection::AttachTo(QTcpSocket *pOther)
 
     Q_ASSERT(m_pInput == 0);
     Q_ASSERT(m_pOutput == 0);
-    m_pInput = new QByteArray();
-    m_pOutput = new QByteArray();
+    m_pInput = new CBufferChain();
+    m_pOutput = new CBufferChain();
 
     m_oAddress.ip = m_pSocket->peerAddress().toIPv4Address();
     m_oAddress.port = m_pSocket->peerPort();
@@ -103,6 +128,9 @@ void CNetworkConnection::AttachTo(QTcpSocket *pOther)
     initializeSocket();
     //GetInputBuffer()->append(pOther->readAll());
     //emit readyToTransfer();
+
+    // the socket may still be inside one of its own signals
+    QMetaObject::invokeMethod(this, "DetachSocket", Qt::QueuedConnection);
 }
 void CNetworkConnection::initializeSocket()
 {
@@ -121,36 +149,190 @@ void CNetworkConnection::initializeSocket()
     connect(m_pSocket, SIGNAL(stateChanged(QAbstractSocket::SocketState)),
             this, SLOT(socketStateChanged(QAbstractSocket::SocketState)));
 	connect(m_pSocket, SIGNAL(aboutToClose()), this, SIGNAL(aboutToClose()));
+	connect(m_pSocket, SIGNAL(connected()), this, SLOT(DetachSocket()), Qt::QueuedConnection);
     setOpenMode(m_pSocket->openMode());
     setSocketState(m_pSocket->state());
 }
 
+// Hands a connected socket over to the epoll reactor, if it runs. The descriptor is
+// duplicated before QTcpSocket closes its own, so the connection itself is not touched;
+// whatever QTcpSocket had buffered is moved to the input first.
+void CNetworkConnection::DetachSocket()
+{
+#ifdef Q_OS_UNIX
+    if( !m_pReactor || !m_pReactor->IsRunning() || m_hSocket != -1 || !m_pSocket )
+        return;
+
+    if( m_pSocket->state() != ConnectedState || m_pSocket->bytesToWrite() > 0 || m_pSocket->socketDescriptor() == -1 )
+        return;
+
+    int hSocket = ::dup(m_pSocket->socketDescriptor());
+    if( hSocket == -1 )
+        return;
+
+    ::fcntl(hSocket, F_SETFL, ::fcntl(hSocket, F_GETFL) | O_NONBLOCK);
+
+    if( !m_pReactor->Add(hSocket, this) )
+    {
+        ::close(hSocket);
+        return;
+    }
+
+    m_pInput->Append(m_pSocket->readAll());
+
+    m_pSocket->disconnect(this);
+    m_pSocket->abort();
+    m_hSocket = hSocket;
+
+    if( !m_pInput->isEmpty() )
+        emit readyRead();
+    emit readyToTransfer();
+#endif
+}
+
+void CNetworkConnection::OnNativeEvent(bool bRead, bool bWrite, bool bHangup, bool bError)
+{
+#ifdef Q_OS_UNIX
+    if( bError || bHangup )
+    {
+        int nError = 0;
+        socklen_t nSize = sizeof(nError);
+        if( bError )
+            ::getsockopt(m_hSocket, SOL_SOCKET, SO_ERROR, &nError, &nSize);
+
+        // whatever the peer sent before it left is still ours
+        QByteArray baRest = socketReadAll();
+        if( !baRest.isEmpty() )
+        {
+            m_pInput->Append(baRest);
+            AddIn(baRest.size());
+            emit readyRead();
+        }
+
+        closeNative(nError ? ( nError == ECONNRESET ? QAbstractSocket::RemoteHostClosedError : QAbstractSocket::NetworkError )
+                           : QAbstractSocket::RemoteHostClosedError);
+        return;
+    }
+
+    if( bRead )
+        emit readyRead();
+    if( bWrite )
+        emit bytesWritten(0);
+#else
+    Q_UNUSED(bRead);
+    Q_UNUSED(bWrite);
+    Q_UNUSED(bHangup);
+    Q_UNUSED(bError);
+#endif
+}
+
+void CNetworkConnection::closeNative(QAbstractSocket::SocketError nError)
+{
+#ifdef Q_OS_UNIX
+    m_pReactor->Remove(m_hSocket, this);
+    ::close(m_hSocket);
+    m_hSocket = -1;
+#endif
+
+    setSocketError(nError);
+    setSocketState(UnconnectedState);
+    emit error(nError);
+    emit stateChanged(UnconnectedState);
+    emit disconnected();
+}
+
+qint64 CNetworkConnection::socketRead(char* pData, qint64 nLength)
+{
+#ifdef Q_OS_UNIX
+    if( m_hSocket != -1 )
+    {
+        ssize_t nRead;
+        do
+        {
+            nRead = ::recv(m_hSocket, pData, nLength, 0);
+        }
+        while( nRead < 0 && errno == EINTR );
+
+        // end of stream and errors are reported by the reactor
+        return qMax<qint64>(0, nRead);
+    }
+#endif
+
+    return m_pSocket->read(pData, nLength);
+}
+QByteArray CNetworkConnection::socketReadAll()
+{
+    if( m_hSocket == -1 )
+        return m_pSocket ? m_pSocket->readAll() : QByteArray();
+
+    QByteArray baData;
+    forever
+    {
+        int nOffset = baData.size();
+        baData.resize(nOffset + 4096);
+
+        qint64 nRead = socketRead(baData.data() + nOffset, 4096);
+        baData.resize(nOffset + nRead);
+
+        if( nRead < 4096 )
+            break;
+    }
+    return baData;
+}
+qint64 CNetworkConnection::socketBytesAvailable() const
+{
+#ifdef Q_OS_UNIX
+    if( m_hSocket != -1 )
+    {
+        int nAvailable = 0;
+        if( ::ioctl(m_hSocket, FIONREAD, &nAvailable) == -1 )
+            return 0;
+        return nAvailable;
+    }
+#endif
+
+    return m_pSocket->bytesAvailable();
+}
+
+// Socket data goes straight into the free space of the last input block
 qint64 CNetworkConnection::readFromNetwork(qint64 nBytes)
 {
     Q_ASSERT(m_pInput != 0);
     Q_ASSERT(nBytes >= 0);
 
-    int nOldSize = m_pInput->size();
-    m_pInput->resize(nOldSize + nBytes);
-    //qint64 nBytesRead = m_pSocket->readData(m_pInput->data() + nOldSize, nBytes);
-    qint64 nBytesRead = m_pSocket->read(m_pInput->data() + nOldSize, nBytes);
-    m_pInput->resize((nBytesRead <= 0 ? nOldSize : nOldSize + nBytesRead));
+    qint64 nBytesRead = 0;
 
-    if( m_pSocket->state() != ConnectedState )
+    while( nBytesRead < nBytes )
     {
-        m_pInput->append(m_pSocket->readAll());
-        nBytesRead += m_pInput->size() - (nOldSize + nBytesRead);
+        quint32 nAvailable = 0;
+        char* pOut = m_pInput->Reserve(1, nAvailable);
+        qint64 nToRead = qMin<qint64>(nAvailable, nBytes - nBytesRead);
+
+        qint64 nRead = socketRead(pOut, nToRead);
+        if( nRead <= 0 )
+            break;
+
+        m_pInput->Commit(nRead);
+        nBytesRead += nRead;
+
+        if( nRead < nToRead )
+            break;
+    }
+
+    if( !socketConnected() )
+    {
+        QByteArray baRest = socketReadAll();
+        m_pInput->Append(baRest);
+        nBytesRead += baRest.size();
     }
 
     if( nBytesRead > 0 )
     {
         AddIn(nBytesRead);
+        Metrics.Bytes(mtTCP, mdIn, nBytesRead);
         emit readyRead();
     }
 
-	if( (uint)m_pInput->capacity() > m_nInputSize && (uint)m_pInput->size() < m_nInputSize / 2 )
-		m_pInput->squeeze();
-
     return nBytesRead;
 }
 qint64 CNetworkConnection::writeToNetwork(qint64 nBytes)
@@ -158,17 +340,72 @@ qint64 CNetworkConnection::writeToNetwork(qint64 nBytes)
     Q_ASSERT(m_pOutput != 0);
     Q_ASSERT(nBytes >= 0);
 
-    //qint64 nBytesWritten = m_pSocket->writeData(m_pOutput->data(), qMin((qint64)m_pOutput->size(), nBytes));
-    qint64 nBytesWritten = m_pSocket->write(m_pOutput->data(), qMin((qint64)m_pOutput->size(), nBytes));
+    qint64 nBytesWritten = writeGather(qMin<qint64>(m_pOutput->size(), nBytes));
 
     if( nBytesWritten <= 0 )
         return nBytesWritten;
 
-    m_pOutput->remove(0, nBytesWritten);
+    m_pOutput->Consume(nBytesWritten);
     AddOut(nBytesWritten);
+    Metrics.Bytes(mtTCP, mdOut, nBytesWritten);
+
+    return nBytesWritten;
+}
+// Writes up to nBytes from the front of the output chain without consuming them.
+// Native sockets take several blocks in one writev(). A QTcpSocket is always fed through
+// write(): writing to its descriptor behind its back would leave it without a write
+// notifier or bytesWritten() after a short write, and the link would wait for the retry.
+qint64 CNetworkConnection::writeGather(qint64 nBytes)
+{
+    CBufferFragment pFragments[BUFFER_GATHER_MAX];
+    int nFragments = m_pOutput->GetFragments(pFragments, BUFFER_GATHER_MAX, nBytes);
+
+    if( nFragments == 0 )
+        return 0;
+
+#ifdef Q_OS_UNIX
+    if( m_hSocket != -1 )
+    {
+        struct iovec pVector[BUFFER_GATHER_MAX];
+
+        for( int i = 0; i < nFragments; i++ )
+        {
+            pVector[i].iov_base = const_cast<char*>(pFragments[i].pData);
+            pVector[i].iov_len = pFragments[i].nLength;
+        }
+
+        ssize_t nWritten;
+        do
+        {
+            nWritten = ::writev(m_hSocket, pVector, nFragments);
+        }
+        while( nWritten < 0 && errno == EINTR );
+
+        if( nWritten >= 0 )
+            return nWritten;
+
+        if( errno == EAGAIN || errno == EWOULDBLOCK )
+            return 0;
+
+        // the reactor reports the error
+        return -1;
+    }
+#endif
 
-	if( (uint)m_pOutput->capacity() > m_nInputSize && (uint)m_pOutput->size() < m_nInputSize / 2 )
-		m_pOutput->squeeze();
+    qint64 nBytesWritten = 0;
+
+    for( int i = 0; i < nFragments; i++ )
+    {
+        qint64 nWritten = m_pSocket->write(pFragments[i].pData, pFragments[i].nLength);
+
+        if( nWritten <= 0 )
+            return nBytesWritten ? nBytesWritten : nWritten;
+
+        nBytesWritten += nWritten;
+
+        if( nWritten < pFragments[i].nLength )
+            break;
+    }
 
     return nBytesWritten;
 }
@@ -176,19 +413,14 @@ qint64 CNetworkConnection::readData(char* data, qint64 maxlen)
 {
     Q_ASSERT(m_pInput != 0);
 
-    int nBytesRead = qMin<qint64>(maxlen, m_pInput->size());
-    memcpy(data, m_pInput->constData(), nBytesRead);
-    m_pInput->remove(0, nBytesRead);
+    qint64 nBytesRead = m_pInput->Read(data, qMin<qint64>(maxlen, m_pInput->size()));
 
-    if( m_pSocket->state() != ConnectedState )
+    if( !socketConnected() )
     {
-        int nOldSize = m_pInput->size();
-        m_pInput->resize(nOldSize + m_pSocket->bytesAvailable());
-        //m_pSocket->readData(m_pInput->data() + nOldSize, m_pInput->size() - nOldSize);
-        m_pSocket->read(m_pInput->data() + nOldSize, m_pInput->size() - nOldSize);
+        m_pInput->Append(socketReadAll());
     }
 
-    return (qint64)nBytesRead;
+    return nBytesRead;
 }
 qint64 CNetworkConnection::readLineData(char* data, qint64 maxlen)
 {
@@ -199,25 +431,20 @@ qint64 CNetworkConnection::writeData(const char* data, qint64 len)
 {
     Q_ASSERT(m_pOutput != 0);
 
-    int nOldSize = m_pOutput->size();
-    m_pOutput->resize(nOldSize + len);
-    memcpy(m_pOutput->data() + nOldSize, data, len);
+    m_pOutput->Append(data, len);
     emit readyToTransfer();
     return len;
 }
 
 qint64 CNetworkConnection::peek(char *data, qint64 maxlen)
 {
-    qint64 nBytes = qMin((qint64)GetInputBuffer()->size(), maxlen);
-    memcpy(data, GetInputBuffer()->constData(), nBytes);
-
-    return nBytes;
+    return GetInputBuffer()->Peek(data, qMin((qint64)GetInputBuffer()->size(), maxlen));
 }
 QByteArray CNetworkConnection::peek(qint64 maxlen)
 {
     qint64 nBytes = qMin((qint64)GetInputBuffer()->size(), maxlen);
 
-    return GetInputBuffer()->left(nBytes);
+    return GetInputBuffer()->Peek(nBytes);
 }
 qint64 CNetworkConnection::read(char *data, qint64 maxlen)
 {
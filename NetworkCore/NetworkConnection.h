@@ -4,22 +4,25 @@
 #include <QTcpSocket>
 
 #include "types.h"
+#include "BufferChain.h"
+#include "RateController.h"
 class QThread;
-
-class QByteArray;
+class CEpollReactor;
 
 class CNetworkConnection : public QTcpSocket
 {
     Q_OBJECT
 public:
     QTcpSocket* m_pSocket;  // sockecik ;)
+    int         m_hSocket;  // descriptor driven by the epoll reactor, -1 while m_pSocket does the I/O
+    CEpollReactor* m_pReactor;  // reactor of the owning thread, 0 if it has none
 
     // Adres hosta
     IPv4_ENDPOINT   m_oAddress;
 
     // Bufory I/O
-    QByteArray* m_pInput;
-    QByteArray* m_pOutput;
+    CBufferChain* m_pInput;
+    CBufferChain* m_pOutput;
     quint64     m_nInputSize;
 
     bool    m_bInitiated;
@@ -34,6 +37,9 @@ public:
     quint64 m_nTotalInput;  // ilosc danych odebranych z sieci
     quint64 m_nTotalOutput;
 
+    bool    m_bRateActive;  // listed by the rate controller as having work
+    bool    m_bControlPending;  // output holds a control packet, may use the control lane
+
 public:
     CNetworkConnection(QObject* parent = 0);
     virtual ~CNetworkConnection();
@@ -57,6 +63,29 @@ protected:
     virtual qint64 writeData(const char* data, qint64 len);
 
     void initializeSocket();
+    qint64 writeGather(qint64 nBytes);
+
+    // I/O on whichever backend has the connection
+    qint64 socketRead(char* pData, qint64 nLength);
+    QByteArray socketReadAll();
+    qint64 socketBytesAvailable() const;
+    void closeNative(QAbstractSocket::SocketError nError);
+
+public:
+    void OnNativeEvent(bool bRead, bool bWrite, bool bHangup, bool bError);
+
+    inline bool socketConnected() const
+    {
+        if( m_hSocket != -1 )
+            return true;
+        return m_pSocket && m_pSocket->state() == ConnectedState;
+    }
+    inline qint64 socketBytesToWrite() const
+    {
+        if( m_hSocket != -1 || !m_pSocket )
+            return 0;
+        return m_pSocket->bytesToWrite();
+    }
 
 public:
     inline quint64  GetTotalIn() const
@@ -146,6 +175,12 @@ public:
         return m_oAddress;
     }
 
+    // Budget the rate controller charges this connection to
+    inline virtual RateClass GetRateClass() const
+    {
+        return rcPeer;
+    }
+
     inline virtual bool HasData()
     {
         if( !m_pSocket )
@@ -164,12 +199,9 @@ public:
     {
         Q_ASSERT(m_pInput != 0);
 
-        if( m_pSocket->state() != ConnectedState )
+        if( !socketConnected() )
         {
-            /*int nOldSize = m_pInput->size();
-            m_pInput->resize(nOldSize + m_pSocket->bytesAvailable());
-            m_pSocket->readData(m_pInput->data() + nOldSize, m_pInput->size() - nOldSize);*/
-            m_pInput->append(m_pSocket->readAll());
+            m_pInput->Append(socketReadAll());
         }
 
         return m_pInput->size();
@@ -179,14 +211,14 @@ public:
         if( !m_pSocket )
             return 0;
 
-        return m_pSocket->bytesToWrite() + m_pOutput->size();
+        return socketBytesToWrite() + m_pOutput->size();
     }
     inline bool isValid() const
     {
         if( m_pSocket == 0 || m_pInput == 0 || m_pOutput == 0 )
             return false;
 
-        return m_pSocket->isValid();
+        return m_hSocket != -1 || m_pSocket->isValid();
     }
     inline qint64 networkBytesAvailable() const
     {
@@ -195,19 +227,19 @@ public:
 
         if( m_nInputSize > 0 )
         {
-            return qMax(qint64(0), qMin(m_pSocket->bytesAvailable(), qint64(m_nInputSize - m_pInput->size())));
+            return qMax(qint64(0), qMin(socketBytesAvailable(), qint64(m_nInputSize - m_pInput->size())));
         }
 
-        return m_pSocket->bytesAvailable();
+        return socketBytesAvailable();
     }
 
-    inline virtual QByteArray* GetInputBuffer()
+    inline virtual CBufferChain* GetInputBuffer()
     {
         Q_ASSERT(m_pInput != 0);
 
         return m_pInput;
     }
-    inline virtual QByteArray* GetOutputBuffer()
+    inline virtual CBufferChain* GetOutputBuffer()
     {
         Q_ASSERT(m_pOutput != 0);
 
@@ -216,7 +248,7 @@ public:
     inline void setReadBufferSize(qint64 nSize)
     {
         m_nInputSize = nSize;
-        if( m_pSocket )
+        if( m_pSocket && m_hSocket == -1 )
             m_pSocket->setReadBufferSize(nSize);
     }
 
@@ -225,6 +257,7 @@ signals:
 
 private slots:
     void socketStateChanged(QAbstractSocket::SocketState state);
+    void DetachSocket();
 
 protected slots:
     void connectToHostImplementation(const QString &hostName,
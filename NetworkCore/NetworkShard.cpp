@@ -0,0 +1,173 @@
+#include "NetworkShard.h"
+#include "network.h"
+#include "g2node.h"
+#include "RateController.h"
+#include "EpollReactor.h"
+#include "TimerWheel.h"
+#include "Metrics.h"
+
+#include "quazaasettings.h"
+
+#include <QTimer>
+#include <QCoreApplication>
+
+CNetworkShard::CNetworkShard(int nIndex)
+{
+	static bool bMetaRegistered = false;
+	if( !bMetaRegistered )
+	{
+		qRegisterMetaType<CG2Node*>("CG2Node*");
+		bMetaRegistered = true;
+	}
+
+	m_nIndex = nIndex;
+	m_pTimer = 0;
+	m_pRateController = 0;
+	m_pReactor = 0;
+	m_pTimerWheel = 0;
+	m_nQueueBytes = 0;
+
+	setObjectName(QString("Network shard %1").arg(nIndex));
+}
+
+CNetworkShard::~CNetworkShard()
+{
+	Stop();
+}
+
+void CNetworkShard::Start()
+{
+	QMutexLocker l(&m_pSection);
+
+	if( m_oThread.isRunning() )
+		return;
+
+	m_oThread.start(&m_pSection, this);
+}
+
+// Nodes are deleted on the way out, and their destructors take Network.m_pSection -
+// the caller must not hold it.
+void CNetworkShard::Stop()
+{
+	QMutexLocker l(&m_pSection);
+
+	if( m_oThread.isRunning() )
+		m_oThread.exit(0);
+}
+
+void CNetworkShard::SetupThread()
+{
+	qDebug() << objectName() << "ThreadID:" << QThread::currentThreadId();
+
+	Q_ASSERT(m_pTimer == 0 && m_pRateController == 0 && m_pReactor == 0 && m_pTimerWheel == 0);
+
+	m_pTimer = new QTimer();
+	connect(m_pTimer, SIGNAL(timeout()), this, SLOT(OnTimer()));
+	m_pTimer->start(1000);
+
+	m_pRateController = new CRateController();
+	m_pRateController->setObjectName(objectName() + " rate controller");
+	Network.ApplyRateLimits(m_pRateController, true);
+
+	m_pTimerWheel = new CTimerWheel();
+
+	m_pReactor = new CEpollReactor();
+	if( quazaaSettings.Connection.UseEpoll && !m_pReactor->Start() )
+		qWarning() << "epoll reactor not available, neighbours stay on QTcpSocket";
+}
+
+void CNetworkShard::CleanupThread()
+{
+	qDebug() << "Stopping" << objectName();
+
+	m_pTimer->stop();
+	delete m_pTimer;
+	m_pTimer = 0;
+
+	// nodes that were still on their way in
+	QCoreApplication::sendPostedEvents();
+
+	while( !m_lNodes.isEmpty() )
+	{
+		CG2Node* pNode = m_lNodes.first();
+		pNode->abort();
+		delete pNode;	// takes itself off m_lNodes
+	}
+
+	delete m_pTimerWheel;
+	m_pTimerWheel = 0;
+
+	{
+		PROFILED_LOCKER(l, &Network.m_pSection);
+		m_lStats.clear();
+	}
+
+	Metrics.AddGauge(mgSendQueueBytes, -m_nQueueBytes);
+	m_nQueueBytes = 0;
+
+	delete m_pReactor;
+	m_pReactor = 0;
+
+	delete m_pRateController;
+	m_pRateController = 0;
+
+	moveToThread(qApp->thread());
+}
+
+void CNetworkShard::Assign(CG2Node* pNode)
+{
+	m_nNodes.ref();
+
+	// set before the move, an accepted socket may be detached by the first event in our thread
+	pNode->m_pShard = this;
+	pNode->m_pReactor = m_pReactor;
+	pNode->moveToThread(&m_oThread);
+
+	QMetaObject::invokeMethod(this, "OnAssigned", Qt::QueuedConnection, Q_ARG(CG2Node*, pNode));
+}
+
+void CNetworkShard::OnAssigned(CG2Node* pNode)
+{
+	m_lNodes.append(pNode);
+	m_pRateController->AddSocket(pNode);
+	pNode->ArmTimer(CG2Node::ntConnect, quazaaSettings.Connection.TimeoutConnect * 1000);
+
+	// outbound nodes are dialled from here, so their socket is born in our thread
+	if( pNode->m_nState == nsClosed )
+		pNode->connectToHost(pNode->m_oAddress);
+}
+
+void CNetworkShard::RemoveNode(CG2Node* pNode)
+{
+	Q_ASSERT(QThread::currentThread() == &m_oThread);
+
+	if( m_pRateController )
+		m_pRateController->RemoveSocket(pNode);
+
+	m_lNodes.removeOne(pNode);
+	m_nNodes.deref();
+}
+
+void CNetworkShard::OnTimer()
+{
+	quint32 tNow = time(0);
+
+	QVector<CNeighbourStats> lStats(m_lNodes.size());
+	int nQueueBytes = 0;
+	for( int i = 0; i < m_lNodes.size(); i++ )
+	{
+		m_lNodes.at(i)->GetStats(lStats[i], tNow);
+		nQueueBytes += m_lNodes.at(i)->m_nQueueTotal;
+	}
+
+	Metrics.AddGauge(mgSendQueueBytes, nQueueBytes - m_nQueueBytes);
+	m_nQueueBytes = nQueueBytes;
+
+	{
+		// the core merges these into the snapshot for the GUI
+		PROFILED_LOCKER(l, &Network.m_pSection);
+		m_lStats = lStats;
+	}
+
+	Network.ApplyRateLimits(m_pRateController, true);
+}
@@ -0,0 +1,72 @@
+#ifndef NETWORKSHARD_H
+#define NETWORKSHARD_H
+
+#include <QObject>
+#include <QMutex>
+#include <QList>
+#include <QAtomicInt>
+#include "Thread.h"
+#include "NeighbourStats.h"
+
+class QTimer;
+class CG2Node;
+class CRateController;
+class CEpollReactor;
+class CTimerWheel;
+
+// Upper bound for Connection.NetworkThreads, and for the automatic choice
+#define NETWORK_SHARDS_MAX	8
+
+// An I/O worker of the network core.
+//
+// Every neighbour belongs to exactly one shard and is only ever touched from the shard's thread:
+// socket I/O, inflate and deflate, framing, rate control and the node timers all run there,
+// without Network.m_pSection. Packet handlers still take it, but only around the shared state
+// they use - the host cache, the route table and the other nodes. Anyone outside the shard
+// talks to a node by message: frames are posted with CG2Node::SendFrame and disconnects with
+// CG2Node::OnDisconnectRequest, both queued to the shard's event loop, so nothing waits
+// on and nothing is dropped for a node that is busy.
+class CNetworkShard : public QObject
+{
+	Q_OBJECT
+
+public:
+	int					m_nIndex;
+	CThread				m_oThread;
+	QMutex				m_pSection;			// start/stop handshake with m_oThread only
+	QTimer*				m_pTimer;
+	CRateController*	m_pRateController;
+	CEpollReactor*		m_pReactor;
+	CTimerWheel*		m_pTimerWheel;		// pings, timeouts and flushes of our nodes
+	QList<CG2Node*>		m_lNodes;			// shard thread only
+	QAtomicInt			m_nNodes;			// placed here, read by the core to balance new nodes
+	QVector<CNeighbourStats> m_lStats;	// our nodes as of the last tick, under Network.m_pSection
+	int					m_nQueueBytes;		// our part of the mgSendQueueBytes gauge
+
+public:
+	CNetworkShard(int nIndex);
+	~CNetworkShard();
+
+	void Start();
+	void Stop();
+
+	// Core thread: hands a new node over, the shard starts it from its own thread
+	void Assign(CG2Node* pNode);
+	// Shard thread, from the node's destructor
+	void RemoveNode(CG2Node* pNode);
+
+	inline int GetLoad() const
+	{
+		return m_nNodes;
+	}
+
+public slots:
+	void SetupThread();
+	void CleanupThread();
+
+protected slots:
+	void OnAssigned(CG2Node* pNode);
+	void OnTimer();
+};
+
+#endif // NETWORKSHARD_H
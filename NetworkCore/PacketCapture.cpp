@@ -0,0 +1,352 @@
+#include "PacketCapture.h"
+#include <QDateTime>
+#include <QtDebug>
+
+CPacketCapture PacketCapture;
+
+static inline quint32 CaptureAlign(quint32 nSize)
+{
+	return ( nSize + G2_CAPTURE_ALIGN - 1 ) & ~( G2_CAPTURE_ALIGN - 1 );
+}
+
+CPacketCapture::CPacketCapture()
+{
+	m_pMap = 0;
+	m_pHeader = 0;
+	m_pRing = 0;
+}
+
+CPacketCapture::~CPacketCapture()
+{
+	Close();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Ring file
+
+// Creates a fresh ring of nCapacity bytes in sPath and starts capturing into it
+bool CPacketCapture::Open(const QString& sPath, quint32 nCapacity)
+{
+	Close();
+
+	QMutexLocker l(&m_pSection);
+
+	nCapacity = qMax<quint32>( CaptureAlign( nCapacity ), G2_CAPTURE_MIN );
+	qint64 nMapSize = sizeof(G2CaptureHeader) + nCapacity;
+
+	m_oFile.setFileName(sPath);
+	if( !m_oFile.open(QIODevice::ReadWrite | QIODevice::Truncate) )
+	{
+		qDebug() << "Packet capture: cannot open" << sPath;
+		return false;
+	}
+
+	if( !m_oFile.resize(nMapSize) || !( m_pMap = m_oFile.map(0, nMapSize) ) )
+	{
+		qDebug() << "Packet capture: cannot map" << sPath;
+		m_oFile.close();
+		return false;
+	}
+
+	m_pHeader = reinterpret_cast<G2CaptureHeader*>(m_pMap);
+	m_pRing = reinterpret_cast<char*>(m_pMap) + sizeof(G2CaptureHeader);
+
+	memset(m_pHeader, 0, sizeof(G2CaptureHeader));
+	m_pHeader->nMagic = G2_CAPTURE_MAGIC;
+	m_pHeader->nVersion = G2_CAPTURE_VERSION;
+	m_pHeader->nHeaderSize = sizeof(G2CaptureHeader);
+	m_pHeader->nCapacity = nCapacity;
+
+	m_nEnabled = 1;
+
+	qDebug() << "Packet capture started," << nCapacity / 1024 << "KB ring in" << sPath;
+
+	return true;
+}
+
+void CPacketCapture::Close()
+{
+	QMutexLocker l(&m_pSection);
+
+	m_nEnabled = 0;
+
+	if( m_pMap )
+	{
+		m_oFile.unmap(m_pMap);
+		m_pMap = 0;
+		m_pHeader = 0;
+		m_pRing = 0;
+	}
+
+	if( m_oFile.isOpen() )
+		m_oFile.close();
+}
+
+void CPacketCapture::SetFilter(const G2CaptureFilter& oFilter)
+{
+	QMutexLocker l(&m_pSection);
+	m_oFilter = oFilter;
+	m_oFilter.nTypes = qMin<quint32>( m_oFilter.nTypes, G2_CAPTURE_TYPES );
+}
+
+G2CaptureFilter CPacketCapture::GetFilter()
+{
+	QMutexLocker l(&m_pSection);
+	return m_oFilter;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Capture
+
+// Called by the network core for every frame it sends or receives while the tap is open.
+// pFrame is a complete frame, control byte included.
+void CPacketCapture::Capture(quint32 nFlags, const IPv4_ENDPOINT& oAddress, const char* pFrame, quint32 nLength)
+{
+	G2_PACKET nType = PeekType(pFrame, nLength);
+
+	QMutexLocker l(&m_pSection);
+
+	if( !m_pHeader || !Match(nFlags, oAddress, nType) )
+		return;
+
+	// a single record never takes more than a quarter of the ring
+	quint32 nCaptured = qMin( nLength, m_oFilter.nSnapLength );
+	nCaptured = qMin<quint32>( nCaptured, m_pHeader->nCapacity / 4 - sizeof(G2CaptureRecord) );
+	quint32 nSize = CaptureAlign( sizeof(G2CaptureRecord) + nCaptured );
+
+	G2CaptureRecord* pRecord = reinterpret_cast<G2CaptureRecord*>( Reserve(nSize) );
+
+	pRecord->nSize = nSize;
+	pRecord->nLength = nLength;
+	pRecord->nCaptured = nCaptured;
+	pRecord->nFlags = nFlags;
+	pRecord->nSequence = ++m_pHeader->nSequence;
+	pRecord->tTime = QDateTime::currentMSecsSinceEpoch();
+	pRecord->nType = nType;
+	pRecord->nAddress = oAddress.ip;
+	pRecord->nPort = oAddress.port;
+	pRecord->nReserved = 0;
+
+	memcpy(pRecord + 1, pFrame, nCaptured);
+}
+
+bool CPacketCapture::Match(quint32 nFlags, const IPv4_ENDPOINT& oAddress, G2_PACKET nType) const
+{
+	if( ( nFlags & m_oFilter.nFlags & ( capIn | capOut ) ) == 0 )
+		return false;
+	if( ( nFlags & m_oFilter.nFlags & ( capTCP | capUDP ) ) == 0 )
+		return false;
+	if( m_oFilter.nAddress && m_oFilter.nAddress != oAddress.ip )
+		return false;
+
+	if( m_oFilter.nTypes == 0 )
+		return true;
+
+	for( quint32 i = 0; i < m_oFilter.nTypes; i++ )
+	{
+		if( m_oFilter.pTypes[i] == nType )
+			return true;
+	}
+	return false;
+}
+
+// Returns nSize contiguous bytes at the head, evicting the oldest records as needed.
+// A record that does not fit before the end of the ring starts over at offset 0; the
+// space left behind becomes a pad record, or an implicit gap if it is too small for one.
+char* CPacketCapture::Reserve(quint32 nSize)
+{
+	G2CaptureHeader* pHeader = m_pHeader;
+
+	if( pHeader->nHead + nSize > pHeader->nCapacity )
+	{
+		quint32 nGap = pHeader->nCapacity - pHeader->nHead;
+
+		while( pHeader->nCapacity - pHeader->nUsed < nGap )
+			Evict();
+
+		if( nGap >= sizeof(G2CaptureRecord) )
+		{
+			G2CaptureRecord* pPad = reinterpret_cast<G2CaptureRecord*>( m_pRing + pHeader->nHead );
+			memset(pPad, 0, sizeof(G2CaptureRecord));
+			pPad->nSize = nGap;
+			pPad->nFlags = capPad;
+		}
+
+		pHeader->nUsed += nGap;
+		pHeader->nHead = 0;
+	}
+
+	while( pHeader->nCapacity - pHeader->nUsed < nSize )
+		Evict();
+
+	char* pOut = m_pRing + pHeader->nHead;
+
+	pHeader->nHead += nSize;
+	pHeader->nUsed += nSize;
+
+	return pOut;
+}
+
+void CPacketCapture::Evict()
+{
+	G2CaptureHeader* pHeader = m_pHeader;
+
+	Q_ASSERT( pHeader->nUsed > 0 );
+
+	quint32 nGap = pHeader->nCapacity - pHeader->nTail;
+	quint32 nSize;
+
+	if( nGap < sizeof(G2CaptureRecord) )
+	{
+		nSize = nGap;
+	}
+	else
+	{
+		const G2CaptureRecord* pRecord = reinterpret_cast<const G2CaptureRecord*>( m_pRing + pHeader->nTail );
+		nSize = pRecord->nSize;
+
+		if( !( pRecord->nFlags & capPad ) )
+			pHeader->nEvicted++;
+	}
+
+	pHeader->nUsed -= nSize;
+	pHeader->nTail += nSize;
+
+	if( pHeader->nTail >= pHeader->nCapacity )
+		pHeader->nTail = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Reading
+
+// Copies the records newer than nAfter, oldest first. Returns the last sequence copied.
+quint64 CPacketCapture::Read(QList<QByteArray>& lRecords, quint64 nAfter, int nMaximum)
+{
+	QMutexLocker l(&m_pSection);
+
+	if( !m_pMap )
+		return nAfter;
+
+	return ReadRing(reinterpret_cast<const char*>(m_pMap), sizeof(G2CaptureHeader) + m_pHeader->nCapacity, lRecords, nAfter, nMaximum);
+}
+
+// Walks a ring image, either the live mapping or a file loaded by the offline decoder.
+// Stops at the first inconsistent record, so a ring cut short by a crash still decodes up to it.
+quint64 CPacketCapture::ReadRing(const char* pMap, quint32 nMapSize, QList<QByteArray>& lRecords, quint64 nAfter, int nMaximum)
+{
+	if( nMapSize < sizeof(G2CaptureHeader) )
+		return nAfter;
+
+	const G2CaptureHeader* pHeader = reinterpret_cast<const G2CaptureHeader*>(pMap);
+
+	if( pHeader->nMagic != G2_CAPTURE_MAGIC || pHeader->nVersion != G2_CAPTURE_VERSION )
+		return nAfter;
+	if( pHeader->nHeaderSize < sizeof(G2CaptureHeader) || pHeader->nHeaderSize + quint64(pHeader->nCapacity) > nMapSize )
+		return nAfter;
+	if( pHeader->nTail >= pHeader->nCapacity || pHeader->nUsed > pHeader->nCapacity )
+		return nAfter;
+
+	// nothing new - the common case when polled from a timer
+	if( pHeader->nSequence <= nAfter )
+		return nAfter;
+
+	const char* pRing = pMap + pHeader->nHeaderSize;
+	quint32 nCapacity = pHeader->nCapacity;
+	quint32 nPosition = pHeader->nTail;
+	quint32 nLeft = pHeader->nUsed;
+	quint64 nLast = nAfter;
+
+	while( nLeft && nMaximum > 0 )
+	{
+		quint32 nGap = nCapacity - nPosition;
+
+		if( nGap < sizeof(G2CaptureRecord) )
+		{
+			nLeft -= qMin( nGap, nLeft );
+			nPosition = 0;
+			continue;
+		}
+
+		const G2CaptureRecord* pRecord = reinterpret_cast<const G2CaptureRecord*>( pRing + nPosition );
+
+		if( pRecord->nSize < sizeof(G2CaptureRecord) || pRecord->nSize > nLeft || pRecord->nSize > nGap )
+			break;
+
+		if( !( pRecord->nFlags & capPad ) && pRecord->nSequence > nAfter )
+		{
+			if( sizeof(G2CaptureRecord) + pRecord->nCaptured > pRecord->nSize )
+				break;
+
+			lRecords.append( QByteArray( reinterpret_cast<const char*>(pRecord), sizeof(G2CaptureRecord) + pRecord->nCaptured ) );
+			nLast = pRecord->nSequence;
+			nMaximum--;
+		}
+
+		nLeft -= pRecord->nSize;
+		nPosition += pRecord->nSize;
+		if( nPosition >= nCapacity )
+			nPosition = 0;
+	}
+
+	return nLast;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Formatting
+
+G2_PACKET CPacketCapture::PeekType(const char* pFrame, quint32 nLength)
+{
+	return G2PacketTypeFromFrame(pFrame, nLength);
+}
+
+QString CPacketCapture::TypeName(G2_PACKET nType)
+{
+	char sType[9];
+	int nLength = 0;
+
+	for( ; nLength < 8 && ( nType >> ( nLength * 8 ) ) & 0xFF; nLength++ )
+		sType[nLength] = char( ( nType >> ( nLength * 8 ) ) & 0xFF );
+
+	return QString::fromAscii(sType, nLength);
+}
+
+QString CPacketCapture::FormatHex(const QByteArray& baRecord, int nMaximum)
+{
+	static const char* pszHex = "0123456789ABCDEF";
+
+	const uchar* pFrame = reinterpret_cast<const uchar*>( Frame(baRecord) );
+	int nLength = qMin<int>( Record(baRecord)->nCaptured, nMaximum );
+
+	if( nLength <= 0 )
+		return QString();
+
+	QByteArray baDump;
+	baDump.resize(nLength * 3 - 1);
+	char* pszDump = baDump.data();
+
+	for( int i = 0; i < nLength; i++ )
+	{
+		if( i ) *pszDump++ = ' ';
+		*pszDump++ = pszHex[ pFrame[i] >> 4 ];
+		*pszDump++ = pszHex[ pFrame[i] & 0x0F ];
+	}
+
+	return QString::fromAscii(baDump.constData(), baDump.size());
+}
+
+QString CPacketCapture::FormatASCII(const QByteArray& baRecord, int nMaximum)
+{
+	const uchar* pFrame = reinterpret_cast<const uchar*>( Frame(baRecord) );
+	int nLength = qMin<int>( Record(baRecord)->nCaptured, nMaximum );
+
+	if( nLength <= 0 )
+		return QString();
+
+	QByteArray baDump;
+	baDump.resize(nLength);
+
+	for( int i = 0; i < nLength; i++ )
+		baDump[i] = ( pFrame[i] >= 32 && pFrame[i] < 127 ) ? pFrame[i] : '.';
+
+	return QString::fromAscii(baDump.constData(), baDump.size());
+}
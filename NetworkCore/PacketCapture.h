@@ -0,0 +1,143 @@
+#ifndef PACKETCAPTURE_H
+#define PACKETCAPTURE_H
+
+#include "types.h"
+#include "g2packettypes.h"
+#include <QFile>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// Raw G2 frame capture.
+//
+// Frames are copied as they cross the network core into a fixed size ring that lives in a
+// memory mapped file, so a capture survives a crash and can be decoded offline by g2capture.
+// Nothing is formatted on the network thread - readers copy the raw records and format only
+// what they show. With the tap closed the cost per frame is one atomic load.
+
+#define G2_CAPTURE_MAGIC	0x50414332	// "2CAP"
+#define G2_CAPTURE_VERSION	1
+#define G2_CAPTURE_ALIGN	8
+#define G2_CAPTURE_TYPES	16
+#define G2_CAPTURE_SNAP		4096
+#define G2_CAPTURE_MIN		65536
+
+enum G2CaptureFlags
+{
+	capIn		= 0x01,
+	capOut		= 0x02,
+	capTCP		= 0x04,
+	capUDP		= 0x08,
+	capAll		= capIn | capOut | capTCP | capUDP,
+	capPad		= 0x80		// filler closing the end of the ring, not a frame
+};
+
+#pragma pack(push, 1)
+
+struct G2CaptureHeader
+{
+	quint32		nMagic;
+	quint16		nVersion;
+	quint16		nHeaderSize;	// ring data starts here
+	quint32		nCapacity;		// ring data size
+	quint32		nHead;			// next record goes here
+	quint32		nTail;			// oldest record
+	quint32		nUsed;			// bytes between tail and head, padding included
+	quint64		nSequence;		// last record written
+	quint64		nEvicted;		// records overwritten by newer ones
+	quint8		pReserved[24];
+};
+
+struct G2CaptureRecord
+{
+	quint32		nSize;			// whole record, aligned to G2_CAPTURE_ALIGN
+	quint32		nLength;		// frame length on the wire
+	quint32		nCaptured;		// frame bytes stored after the record
+	quint32		nFlags;			// G2CaptureFlags
+	quint64		nSequence;
+	qint64		tTime;			// ms since the epoch
+	G2_PACKET	nType;
+	quint32		nAddress;
+	quint16		nPort;
+	quint16		nReserved;
+};
+
+#pragma pack(pop)
+
+// Evaluated on the network thread before anything is copied
+struct G2CaptureFilter
+{
+	quint32		nFlags;			// directions and transports to keep
+	quint32		nAddress;		// 0 for any host
+	quint32		nSnapLength;	// frame bytes kept per record
+	quint32		nTypes;			// 0 for any type
+	G2_PACKET	pTypes[G2_CAPTURE_TYPES];
+
+	G2CaptureFilter()
+	{
+		nFlags = capAll;
+		nAddress = 0;
+		nSnapLength = G2_CAPTURE_SNAP;
+		nTypes = 0;
+	}
+};
+
+class CPacketCapture
+{
+public:
+	CPacketCapture();
+	~CPacketCapture();
+
+// Attributes
+protected:
+	QMutex			m_pSection;
+	QFile			m_oFile;
+	uchar*			m_pMap;
+	G2CaptureHeader* m_pHeader;
+	char*			m_pRing;
+	G2CaptureFilter	m_oFilter;
+	QAtomicInt		m_nEnabled;
+
+// Operations
+public:
+	bool	Open(const QString& sPath, quint32 nCapacity);
+	void	Close();
+	void	SetFilter(const G2CaptureFilter& oFilter);
+	G2CaptureFilter GetFilter();
+
+	void	Capture(quint32 nFlags, const IPv4_ENDPOINT& oAddress, const char* pFrame, quint32 nLength);
+	quint64	Read(QList<QByteArray>& lRecords, quint64 nAfter, int nMaximum = 0x7FFFFFFF);
+
+	inline bool IsEnabled() const
+	{
+		return m_nEnabled != 0;
+	}
+
+protected:
+	bool	Match(quint32 nFlags, const IPv4_ENDPOINT& oAddress, G2_PACKET nType) const;
+	char*	Reserve(quint32 nSize);
+	void	Evict();
+
+// Offline access and formatting, shared by the dump widget and g2capture
+public:
+	static quint64	ReadRing(const char* pMap, quint32 nMapSize, QList<QByteArray>& lRecords, quint64 nAfter, int nMaximum = 0x7FFFFFFF);
+	static G2_PACKET PeekType(const char* pFrame, quint32 nLength);
+	static QString	TypeName(G2_PACKET nType);
+	static QString	FormatHex(const QByteArray& baRecord, int nMaximum = 0x7FFFFFFF);
+	static QString	FormatASCII(const QByteArray& baRecord, int nMaximum = 0x7FFFFFFF);
+
+	static inline const G2CaptureRecord* Record(const QByteArray& baRecord)
+	{
+		return reinterpret_cast<const G2CaptureRecord*>(baRecord.constData());
+	}
+	static inline const char* Frame(const QByteArray& baRecord)
+	{
+		return baRecord.constData() + sizeof(G2CaptureRecord);
+	}
+};
+
+extern CPacketCapture PacketCapture;
+
+#endif // PACKETCAPTURE_H
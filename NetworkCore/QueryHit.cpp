@@ -23,8 +23,6 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet *pPacket, QSharedPointer<QueryHitInfo>
 	if( !pPacket->m_bCompound )
         return 0;
 
-	pPacket->m_nPosition = 0; // reset packet position
-
     bool bHaveHits = false;
     bool bFirstHit = true;
 
@@ -32,15 +30,17 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet *pPacket, QSharedPointer<QueryHitInfo>
 
 	try
 	{
-		char szType[9], szTypeX[9];
-		quint32 nLength = 0, nLengthX = 0, nNext = 0, nNextX = 0;
-		bool bCompound = false;
+		G2_PACKET nTypeX = 0;
+		quint32 nLengthX = 0, nNext = 0, nNextX = 0;
 
-		while( pPacket->ReadPacket(&szType[0], nLength, &bCompound) )
+		// the child index was built by the shallow parse in CSearchManager::OnQueryHit,
+		// only the /H children are visited here
+		for( const G2PacketChild* pChild = pPacket->FindChild(G2_PACKET_HIT_DESCRIPTOR); pChild; pChild = pPacket->FindChild(G2_PACKET_HIT_DESCRIPTOR, pChild) )
 		{
-			nNext = pPacket->m_nPosition + nLength;
+			pPacket->m_nPosition = pChild->nOffset;
+			nNext = pChild->nOffset + pChild->nLength;
 
-			if( strcmp("H", szType) == 0 && bCompound )
+			if( pChild->bCompound )
 			{
 				CQueryHit* pHit = (bFirstHit ? pThisHit : new CQueryHit());
 
@@ -59,97 +59,111 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet *pPacket, QSharedPointer<QueryHitInfo>
 				bool bHaveDN = false;
 				bool bHaveURN = false;
 
-				while( pPacket->m_nPosition < nNext && pPacket->ReadPacket(&szTypeX[0], nLengthX))
+				while( pPacket->m_nPosition < nNext && pPacket->ReadPacket(nTypeX, nLengthX))
 				{
 					nNextX = pPacket->m_nPosition + nLengthX;
 
-					if( strcmp("URN", szTypeX) == 0 )
+					switch( nTypeX )
 					{
-						QString sURN;
-						char hashBuff[256];
-						sURN = pPacket->ReadString();
-
-						if( nLengthX >= 44u && sURN.compare("bp") == 0 )
+					case G2_PACKET_URN:
 						{
-							pPacket->Read(&hashBuff[0], CSHA1::ByteCount());
-							if( pHit->m_oSha1.FromRawData(&hashBuff[0], CSHA1::ByteCount()) )
+							QString sURN;
+							char hashBuff[256];
+							sURN = pPacket->ReadString();
+
+							if( nLengthX >= 44u && sURN.compare("bp") == 0 )
 							{
-								bHaveURN = true;
+								pPacket->Read(&hashBuff[0], CSHA1::ByteCount());
+								if( pHit->m_oSha1.FromRawData(&hashBuff[0], CSHA1::ByteCount()) )
+								{
+									bHaveURN = true;
+								}
+								else
+								{
+									pHit->m_oSha1.Clear();
+								}
 							}
-							else
+							else if( nLengthX >= CSHA1::ByteCount() + 5u && sURN.compare("sha1") == 0 )
 							{
-								pHit->m_oSha1.Clear();
+								pPacket->Read(&hashBuff[0], CSHA1::ByteCount());
+								if( pHit->m_oSha1.FromRawData(&hashBuff[0], CSHA1::ByteCount()) )
+								{
+									bHaveURN = true;
+								}
+								else
+								{
+									pHit->m_oSha1.Clear();
+								}
 							}
+
+
+						}
+						break;
+					case G2_PACKET_URL:
+						if( nLengthX )
+						{
+							// if url empty - try uri-res resolver or a node do not have this object
+							// bez sensu...
+							pHit->m_sURL = pPacket->ReadString();
 						}
-						else if( nLengthX >= CSHA1::ByteCount() + 5u && sURN.compare("sha1") == 0 )
+						break;
+					case G2_PACKET_DESCRIPTIVE_NAME:
 						{
-							pPacket->Read(&hashBuff[0], CSHA1::ByteCount());
-							if( pHit->m_oSha1.FromRawData(&hashBuff[0], CSHA1::ByteCount()) )
+							if( bHaveSize )
 							{
-								bHaveURN = true;
+								pHit->m_sDescriptiveName = pPacket->ReadString(nLengthX);
 							}
-							else
+							else if( nLengthX > 4 )
 							{
-								pHit->m_oSha1.Clear();
+								baTemp.resize(4);
+								pPacket->Read(baTemp.data(), 4);
+								pHit->m_sDescriptiveName = pPacket->ReadString(nLengthX - 4);
 							}
-						}
 
-
-					}
-					else if( strcmp("URL", szTypeX) == 0 && nLengthX )
-					{
-						// if url empty - try uri-res resolver or a node do not have this object
-						// bez sensu...
-						pHit->m_sURL = pPacket->ReadString();
-					}
-					else if( strcmp("DN", szTypeX) == 0 )
-					{
-						if( bHaveSize )
-						{
-							pHit->m_sDescriptiveName = pPacket->ReadString(nLengthX);
+							bHaveDN = true;
 						}
-						else if( nLengthX > 4 )
+						break;
+					case G2_PACKET_METADATA:
 						{
-							baTemp.resize(4);
-							pPacket->Read(baTemp.data(), 4);
-							pHit->m_sDescriptiveName = pPacket->ReadString(nLengthX - 4);
+							pHit->m_sMetadata = pPacket->ReadString();
 						}
-
-						bHaveDN = true;
-					}
-					else if( strcmp("MD", szTypeX) == 0 )
-					{
-						pHit->m_sMetadata = pPacket->ReadString();
-					}
-					else if( strcmp("SZ", szTypeX) == 0 && nLengthX >= 4 )
-					{
-						if( nLengthX >= 8 )
+						break;
+					case G2_PACKET_SIZE:
+						if( nLengthX >= 4 )
 						{
-							if( !baTemp.isEmpty() )
+							if( nLengthX >= 8 )
 							{
-								pHit->m_sDescriptiveName.prepend(baTemp);
+								if( !baTemp.isEmpty() )
+								{
+									pHit->m_sDescriptiveName.prepend(baTemp);
+								}
+								pHit->m_nObjectSize = pPacket->ReadIntLE<quint64>();
+								bHaveSize = true;
 							}
-							pHit->m_nObjectSize = pPacket->ReadIntLE<quint64>();
-							bHaveSize = true;
-						}
-						else if( nLengthX >= 4 )
-						{
-							if( !baTemp.isEmpty() )
+							else if( nLengthX >= 4 )
 							{
-								pHit->m_sDescriptiveName.prepend(baTemp);
+								if( !baTemp.isEmpty() )
+								{
+									pHit->m_sDescriptiveName.prepend(baTemp);
+								}
+								pHit->m_nObjectSize = pPacket->ReadIntLE<quint32>();
+								bHaveSize = true;
 							}
-							pHit->m_nObjectSize = pPacket->ReadIntLE<quint32>();
-							bHaveSize = true;
 						}
-					}
-					else if( strcmp("CSC", szTypeX) == 0 && nLengthX >= 2 )
-					{
-						pHit->m_nCachedSources = pPacket->ReadIntLE<quint16>();
-					}
-					else if( strcmp("PART", szTypeX) == 0 && nLengthX >= 4 )
-					{
-						pHit->m_bIsPartial = true;
-						pHit->m_nPartialBytesAvailable = pPacket->ReadIntLE<quint32>();
+						break;
+					case G2_PACKET_CACHED_SOURCES:
+						if( nLengthX >= 2 )
+						{
+							pHit->m_nCachedSources = pPacket->ReadIntLE<quint16>();
+						}
+						break;
+					case G2_PACKET_PARTIAL:
+						if( nLengthX >= 4 )
+						{
+							pHit->m_bIsPartial = true;
+							pHit->m_nPartialBytesAvailable = pPacket->ReadIntLE<quint32>();
+						}
+						break;
 					}
 					pPacket->m_nPosition = nNextX;
 				}
@@ -186,9 +200,9 @@ CQueryHit* CQueryHit::ReadPacket(G2Packet *pPacket, QSharedPointer<QueryHitInfo>
 					}
 				}
 			}
-
-			pPacket->m_nPosition = nNext;
 		}
+
+		pPacket->m_nPosition = pPacket->GetPayloadOffset();
 	}
 	catch(...) // packet incomplete, packet error, parser takes care of stream end
 	{
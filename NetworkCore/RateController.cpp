@@ -2,144 +2,423 @@
 #include "NetworkConnection.h"
 
 #include <limits>
-#include <QAtomicInt>
+
+//////////////////////////////////////////////////////////////////////
+// CRateBucket
+
+CRateBucket::CRateBucket()
+{
+	m_pParent = 0;
+	m_nRate = 0;
+	m_nTokens = 0;
+	m_nFraction = 0;
+}
+
+void CRateBucket::SetRate(qint64 nRate)
+{
+	if( nRate < 0 )
+		nRate = 0;
+
+	// a bucket that was unlimited starts out full
+	if( m_nRate == 0 )
+		m_nTokens = nRate * RATE_BURST_MSEC / 1000;
+
+	m_nRate = nRate;
+	m_nTokens = qMin(m_nTokens, GetBurst());
+}
+
+void CRateBucket::Refill(qint64 nMsecs)
+{
+	if( m_nRate == 0 )
+		return;
+
+	qint64 nAdd = m_nRate * nMsecs + m_nFraction;
+	m_nTokens = qMin(m_nTokens + nAdd / 1000, GetBurst());
+	m_nFraction = nAdd % 1000;
+}
+
+qint64 CRateBucket::Available() const
+{
+	qint64 nAvailable = m_nRate ? m_nTokens : RATE_UNLIMITED;
+
+	if( m_pParent )
+		nAvailable = qMin(nAvailable, m_pParent->Available());
+
+	return qMax(qint64(0), nAvailable);
+}
+
+// May overdraw, the debt is paid off by the next refills
+void CRateBucket::Consume(qint64 nBytes)
+{
+	if( m_nRate )
+		m_nTokens -= nBytes;
+
+	if( m_pParent )
+		m_pParent->Consume(nBytes);
+}
+
+// ms until nBytes are available here and in every parent, 0 if they already are
+qint64 CRateBucket::GetRefillTime(qint64 nBytes) const
+{
+	qint64 nMsecs = 0;
+
+	if( m_nRate )
+	{
+		qint64 nMissing = qMin(nBytes, GetBurst()) - m_nTokens;
+		if( nMissing > 0 )
+			nMsecs = ( nMissing * 1000 - m_nFraction + m_nRate - 1 ) / m_nRate;
+	}
+
+	if( m_pParent )
+		nMsecs = qMax(nMsecs, m_pParent->GetRefillTime(nBytes));
+
+	return nMsecs;
+}
+
+//////////////////////////////////////////////////////////////////////
+// CRateController construction
 
 CRateController::CRateController(QObject* parent): QObject(parent)
 {
-	m_bTransferSheduled = false;
-    m_nUploadLimit = std::numeric_limits<qint32>::max() / 2;
-    //m_nUploadLimit = 0x7fffffff;
-    m_nDownloadLimit = std::numeric_limits<qint32>::max() / 2;
-    //m_nDownloadLimit = 0x7fffffff;
+	m_nNow = 0;
+	m_nDeadline = -1;
+	m_nUploadLimit = 0;
+	m_nDownloadLimit = 0;
 
     m_nDownload = m_nUpload = 0;
     m_nDownloadAvg = m_nUploadAvg = 0;
 	m_bTransferring = false;
 
+	for( int i = 0; i < rcCount; i++ )
+	{
+		m_oIn[i].m_pParent = &m_oRootIn;
+		m_oOut[i].m_pParent = &m_oRootOut;
+	}
+
+	m_oControlIn.SetRate(RATE_CONTROL);
+	m_oControlOut.SetRate(RATE_CONTROL);
+
     m_tMeterTimer.start();
+	m_tRefill.start();
 
-	m_tTransferTimer.setInterval(100);
+	m_tTransferTimer.setSingleShot(true);
 	connect(&m_tTransferTimer, SIGNAL(timeout()), this, SLOT(transfer()), Qt::QueuedConnection);
 }
 
+void CRateController::SetDownloadLimit(qint64 nLimit)
+{
+	m_nDownloadLimit = nLimit;
+	m_oRootIn.SetRate(nLimit);
+}
+void CRateController::SetUploadLimit(qint64 nLimit)
+{
+	m_nUploadLimit = nLimit;
+	m_oRootOut.SetRate(nLimit);
+}
+void CRateController::SetClassLimits(RateClass nClass, qint64 nDownload, qint64 nUpload)
+{
+	m_oIn[nClass].SetRate(nDownload);
+	m_oOut[nClass].SetRate(nUpload);
+}
+
+//////////////////////////////////////////////////////////////////////
+// CRateController sockets
+
 void CRateController::AddSocket(CNetworkConnection* pSock)
 {
     //qDebug() << "CRC /" << objectName() << "/ AddSocket " << pSock;
-	connect(pSock, SIGNAL(readyToTransfer()), this, SLOT(transfer()));
+	connect(pSock, SIGNAL(readyToTransfer()), this, SLOT(OnReadyToTransfer()));
     pSock->setReadBufferSize(8192);
-    m_lSockets.insert(pSock);
+	pSock->m_bRateActive = false;
+	Activate(pSock);
     sheduleTransfer();
 }
 void CRateController::RemoveSocket(CNetworkConnection* pSock)
 {
     //qDebug() << "CRC /" << objectName() << "/ RemoveSocket " << pSock;
-	disconnect(pSock, SIGNAL(readyToTransfer()), this, SLOT(transfer()));
+	disconnect(pSock, SIGNAL(readyToTransfer()), this, SLOT(OnReadyToTransfer()));
     pSock->setReadBufferSize(0);
-    m_lSockets.remove(pSock);
+
+	// the class may have changed since the socket was listed
+	if( pSock->m_bRateActive )
+	{
+		for( int i = 0; i < rcCount; i++ )
+			m_lActive[i].removeOne(pSock);
+		pSock->m_bRateActive = false;
+	}
 }
-void CRateController::sheduleTransfer()
+
+void CRateController::Activate(CNetworkConnection* pSock)
 {
-	if( m_bTransferSheduled )
-        return;
+	if( pSock->m_bRateActive )
+		return;
 
-    m_bTransferSheduled = true;
-	//QTimer::singleShot(100, this, SLOT(transfer()));
-	m_tTransferTimer.start();
+	pSock->m_bRateActive = true;
+	m_lActive[pSock->GetRateClass()].append(pSock);
 }
-void CRateController::transfer()
+
+void CRateController::OnReadyToTransfer()
 {
-	m_bTransferSheduled = false;
-	m_tTransferTimer.stop();
+	CNetworkConnection* pSock = qobject_cast<CNetworkConnection*>(sender());
+	if( pSock )
+	{
+		Activate(pSock);
+
+		if( !m_bTransferring )
+			TransferControl(pSock);
+	}
+
+	transfer();
+}
+
+// Lets a control packet through right away when the socket's class is waiting for tokens
+void CRateController::TransferControl(CNetworkConnection* pSock)
+{
+	if( !pSock->isValid() )
+		return;
+
+	RateClass nClass = pSock->GetRateClass();
+
+	Refill();
+
+	qint64 nAvailable = pSock->networkBytesAvailable();
+	qint64 nClassIn = m_oIn[nClass].Available();
+	if( nAvailable > nClassIn && nAvailable <= RATE_CONTROL_PACKET && nAvailable <= nClassIn + m_oControlIn.Available() )
+	{
+		qint64 nReadBytes = pSock->readFromNetwork(nAvailable);
+		if( nReadBytes > 0 )
+		{
+			m_oIn[nClass].Consume(nReadBytes);
+			m_oControlIn.Consume(qMax(qint64(0), nReadBytes - nClassIn));
+			m_nDownload += nReadBytes;
+		}
+	}
+
+	if( pSock->m_bControlPending )
+	{
+		pSock->m_bControlPending = false;
+
+		// anything the class can pay for goes out with the normal transfer
+		qint64 nClassOut = m_oOut[nClass].Available();
+		qint64 nControl = m_oControlOut.Available();
+		if( pSock->bytesToWrite() + pSock->GetOutputBuffer()->size() > nClassOut && nControl > 0 )
+		{
+			qint64 nBytesWritten = pSock->writeToNetwork(nClassOut + nControl);
+			if( nBytesWritten > 0 )
+			{
+				m_oOut[nClass].Consume(nBytesWritten);
+				m_oControlOut.Consume(qMax(qint64(0), nBytesWritten - nClassOut));
+				m_nUpload += nBytesWritten;
+			}
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// CRateController transfer
+
+void CRateController::Refill()
+{
+	// against a fixed start, so calls under a millisecond apart lose nothing - the
+	// time they skip is still there for the next refill
+	qint64 nNow = m_tRefill.elapsed();
+	qint64 nMsecs = nNow - m_nNow;
+	if( nMsecs <= 0 )
+		return;
+
+	m_nNow = nNow;
+
+	m_oRootIn.Refill(nMsecs);
+	m_oRootOut.Refill(nMsecs);
+	m_oControlIn.Refill(nMsecs);
+	m_oControlOut.Refill(nMsecs);
+
+	for( int i = 0; i < rcCount; i++ )
+	{
+		m_oIn[i].Refill(nMsecs);
+		m_oOut[i].Refill(nMsecs);
+	}
+}
+
+qint64 CRateController::GetAvailable(RateClass nClass)
+{
+	Refill();
+	return m_oOut[nClass].Available();
+}
+void CRateController::Consumed(RateClass nClass, qint64 nBytes)
+{
+	m_oOut[nClass].Consume(nBytes);
+}
+// ms until nBytes can go out in the class, 0 if they can now
+qint64 CRateController::GetRefillTime(RateClass nClass, qint64 nBytes)
+{
+	Refill();
+	return m_oOut[nClass].GetRefillTime(nBytes);
+}
 
-    int nMsecs = 1000;
-    if( !m_tStopWatch.isNull() )
-        nMsecs = qMin(nMsecs, m_tStopWatch.elapsed());
+// Arms the timer for nMsecs from now, unless it already fires sooner
+void CRateController::sheduleTransfer(qint64 nMsecs)
+{
+	Refill();
+
+	qint64 nDeadline = m_nNow + nMsecs;
+	if( m_nDeadline >= 0 && m_nDeadline <= nDeadline )
+		return;
 
-    qint64 nToRead = (m_nDownloadLimit * nMsecs) / 1000;
-    qint64 nToWrite = (m_nUploadLimit * nMsecs) / 1000;
+	m_nDeadline = nDeadline;
+	m_tTransferTimer.start(nMsecs);
+}
+
+// ms until the first busy class that is out of tokens gets a quantum back.
+// Classes that have tokens but still have busy sockets wait on the socket buffers or on their
+// owner to drain the input, and are woken up by readyToTransfer - the retry is only a safety net.
+qint64 CRateController::GetNextDeadline() const
+{
+	qint64 nWait = RATE_RETRY_MSEC;
 
-	if( ( nToRead <= 0 && nToWrite <= 0 ) || m_bTransferring )
+	for( int i = 0; i < rcCount; i++ )
+	{
+		if( m_lActive[i].isEmpty() )
+			continue;
+
+		qint64 nIn = m_oIn[i].GetRefillTime(RATE_QUANTUM);
+		qint64 nOut = m_oOut[i].GetRefillTime(RATE_QUANTUM);
+
+		if( nIn > 0 && nOut > 0 )
+			nWait = qMin(nWait, qMin(nIn, nOut));
+		else if( nIn > 0 || nOut > 0 )
+			nWait = qMin(nWait, qMax(nIn, nOut));
+	}
+
+	return qMax(qint64(1), nWait);
+}
+
+// Each round offers every class with busy sockets an equal share of what is left in the root,
+// capped by the class' own bucket. A class with hundreds of busy sockets thus gets no more than
+// one with a few, and whatever a class leaves unused is offered again in the next round.
+void CRateController::transfer()
+{
+	m_nDeadline = -1;
+	m_tTransferTimer.stop();
+
+	if( m_bTransferring )
     {
         sheduleTransfer();
         return;
     }
 
-    QSet<CNetworkConnection*> lSockets;
-    foreach(CNetworkConnection* pSock, m_lSockets)
-    {
-        if( pSock->HasData() )
-            lSockets.insert(pSock);
-    }
+	Refill();
+	m_bTransferring = true;
+
+	bool bCanTransferMore = true;
 
-    if( lSockets.isEmpty() )
+	while( bCanTransferMore )
 	{
-        return;
-	}
+		bCanTransferMore = false;
 
-    m_tStopWatch.start();
-	m_bTransferring = true;
+		int nBusy = 0;
+		for( int i = 0; i < rcCount; i++ )
+		{
+			if( !m_lActive[i].isEmpty() )
+				nBusy++;
+		}
 
-    bool bCanTransferMore = false;
+		qint64 nToRead = m_oRootIn.Available();
+		qint64 nToWrite = m_oRootOut.Available();
 
-    do
-    {
-        bCanTransferMore = false;
-		qint64 nWriteChunk = qMax(qint64(1), nToWrite / lSockets.size());
-		qint64 nReadChunk = qMax(qint64(1), nToRead / lSockets.size());
-
-        QSetIterator<CNetworkConnection*> it(lSockets);
-        while( it.hasNext() && (nToRead > 0 || nToWrite > 0))
-        {
-            CNetworkConnection* pConn = it.next();
-
-            bool bDataTransferred = false;
-			qint64 nAvailable = qMin(nReadChunk, pConn->networkBytesAvailable());
-            if( nAvailable > 0 )
-            {
-				qint64 nReadBytes = pConn->readFromNetwork(qMin(nAvailable, nToRead));
-                if( nReadBytes > 0 )
-                {
-                    nToRead -= nReadBytes;
-                    m_nDownload += nReadBytes;
-                    bDataTransferred = true;
-                }
-            }
-
-			if( m_nUploadLimit * 2 > pConn->m_pSocket->bytesToWrite() )
-            {
-				qint64 nChunkSize = qMin(qMin(nWriteChunk, nToWrite), m_nUploadLimit * 2 - pConn->bytesToWrite());
-
-                if( nChunkSize > 0 )
-                {
-                    qint64 nBytesWritten = pConn->writeToNetwork(nChunkSize);
-                    if( nBytesWritten > 0)
-                    {
-                        nToWrite -= nBytesWritten;
-                        m_nUpload += nBytesWritten;
-                        bDataTransferred = true;
-                    }
-                }
-            }
-
-            if( bDataTransferred && pConn->HasData() )
-            {
-                bCanTransferMore = true;
-            }
-            else
-            {
-                lSockets.remove(pConn);
-            }
-        }
-    }
-	while ( bCanTransferMore && (nToRead > 0 || nToWrite > 0) && !lSockets.isEmpty() );
+		if( nBusy == 0 || (nToRead <= 0 && nToWrite <= 0) )
+			break;
+
+		qint64 nReadQuota = qMax(qint64(1), nToRead / nBusy);
+		qint64 nWriteQuota = qMax(qint64(1), nToWrite / nBusy);
+
+		for( int i = 0; i < rcCount; i++ )
+		{
+			if( !m_lActive[i].isEmpty() && TransferClass(i, nReadQuota, nWriteQuota) )
+				bCanTransferMore = true;
+		}
+	}
 
     if( m_tMeterTimer.elapsed() > 1000 )
         UpdateStats();
 
 	m_bTransferring = false;
 
-	if( bCanTransferMore )
-        sheduleTransfer();
+	// busy sockets left over are waiting for tokens or socket buffer space
+	for( int i = 0; i < rcCount; i++ )
+	{
+		if( !m_lActive[i].isEmpty() )
+		{
+			sheduleTransfer(GetNextDeadline());
+			break;
+		}
+	}
+}
+
+// One round robin pass over the busy sockets of a class, returns true if it moved data
+// and still has sockets with work left
+bool CRateController::TransferClass(int nClass, qint64 nReadQuota, qint64 nWriteQuota)
+{
+	QList<CNetworkConnection*>& lActive = m_lActive[nClass];
+
+	qint64 nToRead = qMin(nReadQuota, m_oIn[nClass].Available());
+	qint64 nToWrite = qMin(nWriteQuota, m_oOut[nClass].Available());
+
+	if( nToRead <= 0 && nToWrite <= 0 )
+		return false;
+
+	int nSockets = lActive.size();
+	qint64 nReadChunk = qMax(qint64(1), nToRead / nSockets);
+	qint64 nWriteChunk = qMax(qint64(1), nToWrite / nSockets);
+	qint64 nWriteWindow = m_nUploadLimit ? m_nUploadLimit * 2 : std::numeric_limits<qint32>::max();
+
+	bool bTransferred = false;
+
+	for( int i = 0; i < nSockets && !lActive.isEmpty() && (nToRead > 0 || nToWrite > 0); i++ )
+	{
+		CNetworkConnection* pConn = lActive.takeFirst();
+
+		qint64 nAvailable = qMin(qMin(nReadChunk, nToRead), pConn->networkBytesAvailable());
+		if( nAvailable > 0 )
+		{
+			qint64 nReadBytes = pConn->readFromNetwork(nAvailable);
+			if( nReadBytes > 0 )
+			{
+				nToRead -= nReadBytes;
+				m_oIn[nClass].Consume(nReadBytes);
+				m_nDownload += nReadBytes;
+				bTransferred = true;
+			}
+		}
+
+		if( pConn->m_pSocket && nWriteWindow > pConn->socketBytesToWrite() )
+		{
+			qint64 nChunkSize = qMin(qMin(nWriteChunk, nToWrite), nWriteWindow - pConn->bytesToWrite());
+
+			if( nChunkSize > 0 )
+			{
+				qint64 nBytesWritten = pConn->writeToNetwork(nChunkSize);
+				if( nBytesWritten > 0 )
+				{
+					nToWrite -= nBytesWritten;
+					m_oOut[nClass].Consume(nBytesWritten);
+					m_nUpload += nBytesWritten;
+					bTransferred = true;
+				}
+			}
+		}
+
+		if( pConn->m_pOutput && pConn->m_pOutput->isEmpty() )
+			pConn->m_bControlPending = false;
+
+		// back of the line under its current class, or off the list until it signals again
+		if( pConn->HasData() )
+			m_lActive[pConn->GetRateClass()].append(pConn);
+		else
+			pConn->m_bRateActive = false;
+	}
+
+	return bTransferred && !lActive.isEmpty();
 }
 
 void CRateController::UpdateStats()
@@ -154,18 +433,4 @@ void CRateController::UpdateStats()
     m_nDownload = 0;
     m_nUploadAvg = (m_nUploadAvg + m_nUpload) / 2;
     m_nUpload = 0;
-
-    /*
-    qint32 nSteps = tElapsed / 125;
-
-    for( ; nSteps > 0; nSteps-- )
-    {
-        for( int i = 62; i > 0; i-- )
-        {
-            m_nDownloadSlots[i + 1] = m_nDownloadSlots[i];
-            m_nUploadSlots[i + 1] = m_nUploadSlots[i];
-        }
-        m_nDownloadSlots[0] = 0;
-        m_nUploadSlots[0] = 0;
-    }*/
 }
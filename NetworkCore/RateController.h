@@ -4,12 +4,63 @@
 #include <QtGlobal>
 #include <QObject>
 #include <QTime>
-#include <QSet>
+#include <QElapsedTimer>
+#include <QList>
 #include <QTimer>
 
+// Tokens a bucket may save up, in ms of its rate
+#define RATE_BURST_MSEC		500
+// Smallest burst, so a slow class can still move a whole block or datagram
+#define RATE_BURST_MIN		4096
+// Tokens a deadline waits for, so a starved class is not woken for a handful of bytes
+#define RATE_QUANTUM		1024
+// Longest sleep while sockets wait on something other than tokens
+#define RATE_RETRY_MSEC		1000
+// Reserved rate of the control lane, each way
+#define RATE_CONTROL		2048
+// Reads this small go through the control lane when the class is out of tokens
+#define RATE_CONTROL_PACKET	256
+// Available() of a bucket with no limit anywhere up its chain
+#define RATE_UNLIMITED		Q_INT64_C(0x3FFFFFFFFFFFFFFF)
+
+// Traffic classes, each with its own budget under the root
+enum RateClass
+{
+	rcHub,			// hub to hub and leaf to hub links
+	rcLeaf,			// our leaves
+	rcPeer,			// links still negotiating their role
+	rcUDP,			// datagrams, outbound only
+	rcCount
+};
 
 class CNetworkConnection;
 
+// A token bucket refilled at m_nRate bytes/s, up to its burst allowance.
+// Tokens are taken from the parent too, so a child never exceeds its parent's budget;
+// a bucket with no rate of its own is limited by its parent only.
+class CRateBucket
+{
+public:
+	CRateBucket*	m_pParent;
+	qint64			m_nRate;
+	qint64			m_nTokens;
+	qint64			m_nFraction;	// refill remainder, in 1/1000 bytes
+
+public:
+	CRateBucket();
+
+	void	SetRate(qint64 nRate);
+	void	Refill(qint64 nMsecs);
+	qint64	Available() const;
+	void	Consume(qint64 nBytes);
+	qint64	GetRefillTime(qint64 nBytes) const;
+
+	inline qint64 GetBurst() const
+	{
+		return qMax(m_nRate * RATE_BURST_MSEC / 1000, qint64(RATE_BURST_MIN));
+	}
+};
+
 class CRateController : public QObject
 {
     Q_OBJECT
@@ -21,12 +72,24 @@ protected:
     quint32 m_nUploadAvg;
     quint32 m_nDownload;
     quint32 m_nDownloadAvg;
-    QTime   m_tStopWatch;
-	bool    m_bTransferSheduled;
+	QElapsedTimer	m_tRefill;	// monotonic, never restarted
+	qint64	m_nNow;				// ms since construction, as of the last refill
+	qint64	m_nDeadline;		// when m_tTransferTimer fires, -1 if it is not armed
 	QTimer	m_tTransferTimer;
 	bool	m_bTransferring;
 
-    QSet<CNetworkConnection*>   m_lSockets;
+	CRateBucket	m_oRootIn;
+	CRateBucket	m_oRootOut;
+	CRateBucket	m_oIn[rcCount];
+	CRateBucket	m_oOut[rcCount];
+
+	// Small reserved budget for control packets, spent only when their class has run dry.
+	// The bytes are still charged to the class, so the lane borrows rather than adds bandwidth.
+	CRateBucket	m_oControlIn;
+	CRateBucket	m_oControlOut;
+
+	// Only sockets with pending work are listed, each under its current class
+	QList<CNetworkConnection*>	m_lActive[rcCount];
 public:
     CRateController(QObject* parent = 0);
     void AddSocket(CNetworkConnection* pSock);
@@ -34,23 +97,24 @@ public:
 
     void UpdateStats();
 
-    void SetDownloadLimit(qint32 nLimit)
-    {
-        m_nDownloadLimit = nLimit;
-    }
-    void SetUploadLimit(qint32 nLimit)
-    {
-        m_nUploadLimit = nLimit;
-    }
-    qint32 UploadLimit() const
+	// 0 means no limit
+	void SetDownloadLimit(qint64 nLimit);
+	void SetUploadLimit(qint64 nLimit);
+	void SetClassLimits(RateClass nClass, qint64 nDownload, qint64 nUpload);
+	qint64 UploadLimit() const
     {
         return m_nUploadLimit;
     }
-    qint32 DownloadLimit() const
+	qint64 DownloadLimit() const
     {
         return m_nDownloadLimit;
     }
 
+	// For traffic sent outside of the socket scheduler, i.e. datagrams
+	qint64 GetAvailable(RateClass nClass);
+	void Consumed(RateClass nClass, qint64 nBytes);
+	qint64 GetRefillTime(RateClass nClass, qint64 nBytes);
+
     quint32 DownloadSpeed()
     {
         UpdateStats();
@@ -62,9 +126,18 @@ public:
         return m_nUploadAvg;
     }
 
+protected:
+	void Refill();
+	void Activate(CNetworkConnection* pSock);
+	bool TransferClass(int nClass, qint64 nReadQuota, qint64 nWriteQuota);
+	void TransferControl(CNetworkConnection* pSock);
+	qint64 GetNextDeadline() const;
+
 public slots:
-    void sheduleTransfer();
+	void sheduleTransfer(qint64 nMsecs = 0);
     void transfer();
+protected slots:
+	void OnReadyToTransfer();
 };
 
 #endif // RATECONTROLLER_H
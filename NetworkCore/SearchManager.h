@@ -6,6 +6,7 @@
 #include <QMutex>
 #include "types.h"
 #include "QueryHit.h"
+#include "LockProfiler.h"
 
 class CManagedSearch;
 class G2Packet;
@@ -17,7 +18,7 @@ class CSearchManager : public QObject
 
 public:
 	QHash<QUuid,CManagedSearch*> m_lSearches;
-    QMutex  m_pSection;
+    CProfiledMutex  m_pSection;
     quint32 m_nPruneCounter;
 	quint32 m_nCookie;
 
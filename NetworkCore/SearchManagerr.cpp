@@ -14,7 +14,7 @@ CSearchManager SearchManager;
 const quint32 PacketsPerSec = 8;
 
 CSearchManager::CSearchManager(QObject *parent) :
-    QObject(parent)
+    QObject(parent), m_pSection("searches", mlSearches)
 {
     m_nPruneCounter = 0;
 	m_nCookie = 0;
@@ -24,7 +24,7 @@ CSearchManager::CSearchManager(QObject *parent) :
 
 void CSearchManager::Add(CManagedSearch *pSearch)
 {
-    QMutexLocker l(&m_pSection);
+    PROFILED_LOCKER(l, &m_pSection);
 
 	Q_ASSERT(!m_lSearches.contains(pSearch->m_oGUID));
 	m_lSearches.insert(pSearch->m_oGUID, pSearch);
@@ -34,7 +34,7 @@ void CSearchManager::Add(CManagedSearch *pSearch)
 
 void CSearchManager::Remove(CManagedSearch *pSearch)
 {
-    QMutexLocker l(&m_pSection);
+    PROFILED_LOCKER(l, &m_pSection);
 
 	Q_ASSERT(m_lSearches.contains(pSearch->m_oGUID));
 	m_lSearches.remove(pSearch->m_oGUID);
@@ -47,7 +47,7 @@ CManagedSearch* CSearchManager::Find(QUuid &oGUID)
 
 void CSearchManager::OnTimer()
 {
-    QMutexLocker l(&m_pSection);
+    PROFILED_LOCKER(l, &m_pSection);
 
     quint32 nSearches = m_lSearches.size();
     quint32 nPacketsLeft = PacketsPerSec;
@@ -94,13 +94,17 @@ bool CSearchManager::OnQueryAcknowledge(G2Packet *pPacket, IPv4_ENDPOINT &addr,
 	if( !pPacket->m_bCompound )
         return false;
 
-	pPacket->SkipCompound();			// skip children to get search GUID
+	// the child index gives the search GUID without a walk, and is reused below
+	quint32 nChildren = 0;
+	const G2PacketChild* pChildren = pPacket->GetChildren(nChildren);
+
+	pPacket->m_nPosition = pPacket->GetPayloadOffset();
 	if( pPacket->GetRemaining() < 16 )	// must be at least 16 bytes for GUID
 		return false;
 
 	oGUID = pPacket->ReadGUID();		// Read search GUID
 
-	QMutexLocker l(&m_pSection);
+	PROFILED_LOCKER(l, &m_pSection);
 
 	if( CManagedSearch* pSearch = Find(oGUID) )	// is it our Query Ack?
 	{
@@ -114,69 +118,81 @@ bool CSearchManager::OnQueryAcknowledge(G2Packet *pPacket, IPv4_ENDPOINT &addr,
 
 		quint32 nHubs = 0, nLeaves = 0, nSuggestedHubs = 0;
 
-		pPacket->m_nPosition = 0;	// reset position
+		for( quint32 nChild = 0; nChild < nChildren; nChild++ )
+		{
+			const G2PacketChild& oChild = pChildren[nChild];
+			quint32 nLength = oChild.nLength;
 
-		char szType[9];
-		quint32 nLength = 0, nNext = 0;
+			pPacket->m_nPosition = oChild.nOffset;
 
-		while( pPacket->ReadPacket(&szType[0], nLength) )
-		{
-			nNext = pPacket->m_nPosition + nLength;
+			if( oChild.bCompound )
+				pPacket->SkipCompound(nLength);
 
-			if( strcmp("D", szType) == 0 && nLength >= 4 )
+			switch( oChild.nType )
 			{
-				quint32 nIp = pPacket->ReadIntBE<quint32>();
-				lDone.append(nIp);
-
-				if( nLength >= 6 )
+			case G2_PACKET_QUERY_DONE:
+				if( nLength >= 4 )
 				{
-					quint16 nPort = pPacket->ReadIntLE<quint16>();
-					IPv4_ENDPOINT a(nIp, nPort);
-					HostCache.Add(a, tNow);
+					quint32 nIp = pPacket->ReadIntBE<quint32>();
+					lDone.append(nIp);
+
+					if( nLength >= 6 )
+					{
+						quint16 nPort = pPacket->ReadIntLE<quint16>();
+						IPv4_ENDPOINT a(nIp, nPort);
+						HostCache.Add(a, tNow);
+					}
+
+					if( nLength >= 8 )
+					{
+						nLeaves += pPacket->ReadIntLE<quint16>();
+					}
+					nHubs++;
 				}
-
-				if( nLength >= 8 )
+				break;
+			case G2_PACKET_QUERY_SEARCH:
+				if( nLength >= 6 )
 				{
-					nLeaves += pPacket->ReadIntLE<quint16>();
-				}
-				nHubs++;
-			}
-			else if( strcmp("S", szType) == 0 && nLength >= 6 )
-			{
-				IPv4_ENDPOINT a;
-				pPacket->ReadHostAddress(&a);
-				quint32 tSeen = (nLength >= 10) ? pPacket->ReadIntLE<quint32>() + tAdjust : tNow;
+					IPv4_ENDPOINT a;
+					pPacket->ReadHostAddress(&a);
+					quint32 tSeen = (nLength >= 10) ? pPacket->ReadIntLE<quint32>() + tAdjust : tNow;
 
-				HostCache.Add(a, tSeen);
-				nSuggestedHubs++;
-			}
-			else if( strcmp("TS", szType) == 0 && nLength >= 4 )
-			{
-				tAdjust = tNow - pPacket->ReadIntLE<quint32>();
-			}
-			else if( strcmp("RA", szType) == 0 && nLength >= 2 )
-			{
+					HostCache.Add(a, tSeen);
+					nSuggestedHubs++;
+				}
+				break;
+			case G2_PACKET_TIMESTAMP:
 				if( nLength >= 4 )
 				{
-					nRetryAfter = pPacket->ReadIntLE<quint32>();
+					tAdjust = tNow - pPacket->ReadIntLE<quint32>();
 				}
-				else if( nLength >= 2 )
+				break;
+			case G2_PACKET_RETRY_AFTER:
+				if( nLength >= 2 )
 				{
-					nRetryAfter = pPacket->ReadIntLE<quint16>();
+					if( nLength >= 4 )
+					{
+						nRetryAfter = pPacket->ReadIntLE<quint32>();
+					}
+					else if( nLength >= 2 )
+					{
+						nRetryAfter = pPacket->ReadIntLE<quint16>();
+					}
+
+					CHostCacheHost* pHost = HostCache.Find(IPv4_ENDPOINT(nFromIp));
+					if( pHost )
+					{
+						pHost->m_tRetryAfter = tNow + nRetryAfter;
+					}
 				}
-
-				CHostCacheHost* pHost = HostCache.Find(IPv4_ENDPOINT(nFromIp));
-				if( pHost )
+				break;
+			case G2_PACKET_FROM_ADDRESS:
+				if( nLength >= 4 )
 				{
-					pHost->m_tRetryAfter = tNow + nRetryAfter;
+					nFromIp = pPacket->ReadIntBE<quint32>();
 				}
+				break;
 			}
-			else if( strcmp("FR", szType) == 0 && nLength >= 4 )
-			{
-				nFromIp = pPacket->ReadIntBE<quint32>();
-			}
-
-			pPacket->m_nPosition = nNext;
 		}
 
 		// we already know QA GUID
@@ -210,7 +226,7 @@ void CSearchManager::OnQueryHit(G2Packet *pPacket, CG2Node *pNode, IPv4_ENDPOINT
 	if( pEndpoint )
 		qDebug() << pEndpoint->toString();
 
-	QMutexLocker l(&m_pSection);
+	PROFILED_LOCKER(l, &m_pSection);
 
 	// caller must check if it is compound...
 
@@ -218,10 +234,6 @@ void CSearchManager::OnQueryHit(G2Packet *pPacket, CG2Node *pNode, IPv4_ENDPOINT
 
 	QSharedPointer<QueryHitInfo> pHitInfo(new QueryHitInfo());
 
-	char szType[9];
-	quint32 nLength = 0, nNext = 0;
-	bool bCompound = false;
-
 	bool bHaveHits = false;
 	bool bHaveNA = false;
 	bool bHaveGUID = false;
@@ -232,55 +244,73 @@ void CSearchManager::OnQueryHit(G2Packet *pPacket, CG2Node *pNode, IPv4_ENDPOINT
 		bHaveNA = true;
 	}
 
-	while( pPacket->ReadPacket(&szType[0], nLength, &bCompound) )
+	// the index built here is reused by CQueryHit::ReadPacket and GetTo when routing
+	quint32 nChildren = 0;
+	const G2PacketChild* pChildren = pPacket->GetChildren(nChildren);
+
+	for( quint32 nChild = 0; nChild < nChildren; nChild++ )
 	{
-		nNext = pPacket->m_nPosition + nLength;
+		const G2PacketChild& oChild = pChildren[nChild];
+		quint32 nLength = oChild.nLength;
 
-		if( strcmp("H", szType) == 0 && bCompound )
+		if( oChild.nType == G2_PACKET_HIT_DESCRIPTOR && oChild.bCompound )
 		{
 			bHaveHits = true;
 			continue;
 		}
 
-		if( bCompound )
-			pPacket->SkipCompound();
+		pPacket->m_nPosition = oChild.nOffset;
 
-		if( strcmp("NA", szType) == 0 && nLength >= 6 )
+		if( oChild.bCompound )
+			pPacket->SkipCompound(nLength);
+
+		switch( oChild.nType )
 		{
-			IPv4_ENDPOINT oNodeAddr;
-			pPacket->ReadHostAddress(&oNodeAddr);
-			if( oNodeAddr.ip != 0 && oNodeAddr.port != 0 )
+		case G2_PACKET_NODE_ADDRESS:
+			if( nLength >= 6 )
 			{
-				pHitInfo->m_oNodeAddress = oNodeAddr;
-				bHaveNA = true;
+				IPv4_ENDPOINT oNodeAddr;
+				pPacket->ReadHostAddress(&oNodeAddr);
+				if( oNodeAddr.ip != 0 && oNodeAddr.port != 0 )
+				{
+					pHitInfo->m_oNodeAddress = oNodeAddr;
+					bHaveNA = true;
+				}
 			}
-		}
-		else if( strcmp("GU", szType) == 0 && nLength >= 16 )
-		{
-			QUuid oNodeGUID = pPacket->ReadGUID();
-			if( !oNodeGUID.isNull() )
+			break;
+		case G2_PACKET_NODE_GUID:
+			if( nLength >= 16 )
+			{
+				QUuid oNodeGUID = pPacket->ReadGUID();
+				if( !oNodeGUID.isNull() )
+				{
+					pHitInfo->m_oNodeGUID = oNodeGUID;
+					bHaveGUID = true;
+				}
+			}
+			break;
+		case G2_PACKET_NEIGHBOUR_HUB:
+			if( nLength >= 6 )
 			{
-				pHitInfo->m_oNodeGUID = oNodeGUID;
-				bHaveGUID = true;
+				IPv4_ENDPOINT oNH;
+				pPacket->ReadHostAddress(&oNH);
+				if( oNH.ip != 0 && oNH.port != 0 )
+				{
+					pHitInfo->m_lNeighbouringHubs.append(oNH);
+				}
 			}
-		}
-		else if( strcmp("NH", szType) == 0 && nLength >= 6 )
-		{
-			IPv4_ENDPOINT oNH;
-			pPacket->ReadHostAddress(&oNH);
-			if( oNH.ip != 0 && oNH.port != 0 )
+			break;
+		case G2_PACKET_VENDOR:
+			if( nLength >= 4 )
 			{
-				pHitInfo->m_lNeighbouringHubs.append(oNH);
+				pHitInfo->m_sVendor = pPacket->ReadString(4);
 			}
+			break;
 		}
-		else if( strcmp("V", szType) == 0 && nLength >= 4 )
-		{
-			pHitInfo->m_sVendor = pPacket->ReadString(4);
-		}
-
-		pPacket->m_nPosition = nNext;
 	}
 
+	pPacket->m_nPosition = pPacket->GetPayloadOffset();
+
 	if( pPacket->GetRemaining() < 17 || !bHaveHits || !bHaveNA || !bHaveGUID )
 	{
 		qDebug() << "Malformatted hit in CSearchManager" << pPacket->GetRemaining() << bHaveHits << bHaveNA << bHaveGUID;
@@ -311,7 +341,7 @@ void CSearchManager::OnQueryHit(G2Packet *pPacket, CG2Node *pNode, IPv4_ENDPOINT
 		return;
 
 	// m_nPosition - 1 = hop count
-	pPacket->m_oBuffer[pPacket->m_nPosition - 17] = ++pHitInfo->m_nHops;
+	pPacket->m_pBuffer[pPacket->m_nPosition - 17] = ++pHitInfo->m_nHops;
 
 	if( pNode || pEndpoint )
 	{
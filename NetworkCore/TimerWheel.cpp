@@ -0,0 +1,235 @@
+#include "TimerWheel.h"
+
+//////////////////////////////////////////////////////////////////////
+// CWheelTimer
+
+CWheelTimer::CWheelTimer()
+{
+	m_pNext = m_pPrev = this;
+	m_nExpires = 0;
+	m_pWheel = 0;
+	m_pTarget = 0;
+	m_nTimer = 0;
+}
+
+CWheelTimer::~CWheelTimer()
+{
+	Stop();
+}
+
+void CWheelTimer::Init(CTimerTarget* pTarget, int nTimer)
+{
+	m_pTarget = pTarget;
+	m_nTimer = nTimer;
+}
+
+void CWheelTimer::Start(CTimerWheel* pWheel, qint64 nMsecs)
+{
+	Q_ASSERT(pWheel != 0 && m_pTarget != 0);
+
+	if( m_pWheel )
+		m_pWheel->Remove(this);
+
+	pWheel->Add(this, pWheel->Now() + qMax(nMsecs, qint64(0)));
+}
+
+void CWheelTimer::Stop()
+{
+	if( m_pWheel )
+		m_pWheel->Remove(this);
+}
+
+//////////////////////////////////////////////////////////////////////
+// CTimerWheel
+
+CTimerWheel::CTimerWheel(QObject* parent)
+	: QObject(parent)
+{
+	m_nTick = 0;
+	m_nClock = 0;
+	m_tClock.start();
+	m_nWake = -1;
+	m_nPending = 0;
+
+	m_tTick.setSingleShot(true);
+	connect(&m_tTick, SIGNAL(timeout()), this, SLOT(OnTick()));
+}
+
+CTimerWheel::~CTimerWheel()
+{
+	// timers outliving us just forget they were armed
+	const int nSlots = sizeof(m_pSlots) / sizeof(m_pSlots[0]);
+	for( int i = 0; i <= nSlots; i++ )
+	{
+		CWheelTimer* pSlot = ( i < nSlots ? &m_pSlots[i] : &m_oExpired );
+		while( pSlot->m_pNext != pSlot )
+		{
+			CWheelTimer* pTimer = pSlot->m_pNext;
+			pTimer->Unlink();
+			pTimer->m_pWheel = 0;
+		}
+	}
+}
+
+qint64 CTimerWheel::Now()
+{
+	// read against a fixed start, adding restart() deltas would drop the sub-ms remainders
+	m_nClock = m_tClock.elapsed();
+	return m_nClock;
+}
+
+void CTimerWheel::Add(CWheelTimer* pTimer, qint64 nExpires)
+{
+	// an empty wheel does not tick, catch up before placing against m_nTick
+	if( m_nPending == 0 && m_nTick < m_nClock )
+		m_nTick = m_nClock;
+
+	pTimer->m_pWheel = this;
+	pTimer->m_nExpires = nExpires;
+	m_nPending++;
+	Place(pTimer);
+
+	if( m_nWake == -1 || nExpires < m_nWake )
+		Schedule();
+}
+
+void CTimerWheel::Remove(CWheelTimer* pTimer)
+{
+	Q_ASSERT(pTimer->m_pWheel == this);
+
+	pTimer->Unlink();
+	pTimer->m_pWheel = 0;
+	m_nPending--;
+
+	if( m_nPending == 0 )
+	{
+		m_tTick.stop();
+		m_nWake = -1;
+	}
+}
+
+void CTimerWheel::Place(CWheelTimer* pTimer)
+{
+	// late timers go to the next tick
+	qint64 nExpires = qMax(pTimer->m_nExpires, m_nTick + 1);
+	qint64 nDelta = nExpires - m_nTick;
+
+	int nLevel = 0;
+	for( int nBits = WHEEL_BITS_0; nLevel < WHEEL_LEVELS - 1 && nDelta >= ( Q_INT64_C(1) << nBits ); nBits += WHEEL_BITS_N )
+		nLevel++;
+
+	// beyond the outer level: park it in the last slot in range, it is placed again from there
+	if( nDelta >= WHEEL_RANGE )
+		nExpires = m_nTick + WHEEL_RANGE - 1;
+
+	pTimer->LinkBefore(GetSlot(nLevel, nExpires));
+}
+
+void CTimerWheel::Cascade(int nLevel, qint64 nTick)
+{
+	CWheelTimer* pSlot = GetSlot(nLevel, nTick);
+
+	while( pSlot->m_pNext != pSlot )
+	{
+		CWheelTimer* pTimer = pSlot->m_pNext;
+		pTimer->Unlink();
+		Place(pTimer);
+	}
+}
+
+void CTimerWheel::Advance(qint64 nNow)
+{
+	if( m_nPending == 0 )
+	{
+		m_nTick = qMax(m_nTick, nNow);
+		return;
+	}
+
+	while( m_nTick < nNow && m_nPending > 0 )
+	{
+		qint64 nTick = ++m_nTick;
+
+		// a turn of the inner level completed, move the next slot of each outer level in
+		if( ( nTick & ( WHEEL_SLOTS_0 - 1 ) ) == 0 )
+		{
+			for( int nLevel = 1; nLevel < WHEEL_LEVELS; nLevel++ )
+			{
+				Cascade(nLevel, nTick);
+
+				int nShift = WHEEL_BITS_0 + WHEEL_BITS_N * ( nLevel - 1 );
+				if( ( ( nTick >> nShift ) & ( WHEEL_SLOTS_N - 1 ) ) != 0 )
+					break;
+			}
+		}
+
+		CWheelTimer* pSlot = GetSlot(0, nTick);
+		if( pSlot->m_pNext == pSlot )
+			continue;
+
+		// take the whole slot out first, handlers may arm and cancel anything
+		m_oExpired.m_pNext = pSlot->m_pNext;
+		m_oExpired.m_pPrev = pSlot->m_pPrev;
+		m_oExpired.m_pNext->m_pPrev = &m_oExpired;
+		m_oExpired.m_pPrev->m_pNext = &m_oExpired;
+		pSlot->m_pNext = pSlot->m_pPrev = pSlot;
+
+		while( m_oExpired.m_pNext != &m_oExpired )
+		{
+			CWheelTimer* pTimer = m_oExpired.m_pNext;
+			pTimer->Unlink();
+			pTimer->m_pWheel = 0;
+			m_nPending--;
+
+			pTimer->m_pTarget->OnTimerExpired(pTimer->m_nTimer);
+		}
+	}
+
+	if( m_nPending == 0 && m_nTick < nNow )
+		m_nTick = nNow;
+}
+
+// First tick with work: a busy slot of the inner level, or a cascade that moves timers in.
+// Turns of the third level and up are not looked into, the wheel wakes at each of them.
+qint64 CTimerWheel::GetNextWake()
+{
+	const qint64 nOuterSpan = Q_INT64_C(1) << ( WHEEL_BITS_0 + WHEEL_BITS_N );
+	qint64 nWake = ( m_nTick | ( nOuterSpan - 1 ) ) + 1;
+
+	// the inner level reaches a full turn ahead, past the next cascade
+	for( qint64 nTick = m_nTick + 1; nTick <= m_nTick + WHEEL_SLOTS_0 && nTick < nWake; nTick++ )
+	{
+		if( !IsEmpty(0, nTick) )
+		{
+			nWake = nTick;
+			break;
+		}
+	}
+
+	for( qint64 nTick = ( m_nTick | ( WHEEL_SLOTS_0 - 1 ) ) + 1; nTick < nWake; nTick += WHEEL_SLOTS_0 )
+	{
+		if( !IsEmpty(1, nTick) )
+			return nTick;
+	}
+
+	return nWake;
+}
+
+void CTimerWheel::Schedule()
+{
+	if( m_nPending == 0 )
+	{
+		m_tTick.stop();
+		m_nWake = -1;
+		return;
+	}
+
+	m_nWake = GetNextWake();
+	m_tTick.start(int(qMax(m_nWake - Now(), qint64(0))));
+}
+
+void CTimerWheel::OnTick()
+{
+	m_nWake = -1;
+	Advance(Now());
+	Schedule();
+}
@@ -0,0 +1,136 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+// Slots of the innermost level, one per ms
+#define WHEEL_BITS_0		8
+// Slots of each outer level, each slot spans a whole turn of the level inside it
+#define WHEEL_BITS_N		6
+#define WHEEL_LEVELS		4
+#define WHEEL_SLOTS_0		( 1 << WHEEL_BITS_0 )
+#define WHEEL_SLOTS_N		( 1 << WHEEL_BITS_N )
+// Longest delay the wheel holds exactly (about 18 hours), later timers are carried along
+#define WHEEL_RANGE			( Q_INT64_C(1) << ( WHEEL_BITS_0 + WHEEL_BITS_N * ( WHEEL_LEVELS - 1 ) ) )
+
+class CTimerWheel;
+
+// Gets the timers it armed back when they expire
+class CTimerTarget
+{
+public:
+	virtual ~CTimerTarget() {}
+	virtual void OnTimerExpired(int nTimer) = 0;
+};
+
+// A deadline on a timer wheel, kept inside the object it belongs to. Arming and cancelling
+// link and unlink it, nothing is allocated; destroying an armed timer cancels it.
+// A timer may only be used from the thread of its wheel.
+class CWheelTimer
+{
+public:
+	CWheelTimer();
+	~CWheelTimer();
+
+	void	Init(CTimerTarget* pTarget, int nTimer);
+
+	// Fires once, nMsecs from now. Starting an armed timer moves it.
+	void	Start(CTimerWheel* pWheel, qint64 nMsecs);
+	void	Stop();
+
+	inline bool IsActive() const
+	{
+		return m_pWheel != 0;
+	}
+
+protected:
+	CWheelTimer*	m_pNext;
+	CWheelTimer*	m_pPrev;
+	qint64			m_nExpires;		// wheel clock, ms
+	CTimerWheel*	m_pWheel;		// 0 while not armed
+	CTimerTarget*	m_pTarget;
+	int				m_nTimer;
+
+	inline void Unlink()
+	{
+		m_pPrev->m_pNext = m_pNext;
+		m_pNext->m_pPrev = m_pPrev;
+		m_pNext = m_pPrev = this;
+	}
+	inline void LinkBefore(CWheelTimer* pHead)
+	{
+		m_pNext = pHead;
+		m_pPrev = pHead->m_pPrev;
+		pHead->m_pPrev->m_pNext = this;
+		pHead->m_pPrev = this;
+	}
+
+	friend class CTimerWheel;
+};
+
+// Hashed hierarchical timer wheel with 1 ms resolution.
+//
+// The inner level has a slot per ms for the next 256 ms, each outer level a slot per turn of the
+// level inside it. A timer goes into the finest level that reaches its deadline and moves inward
+// when the wheel turns past its slot, so arming, cancelling and expiring are O(1) and a tick only
+// touches what is due. The wheel sleeps until the next busy slot of the two inner levels, a set
+// of idle connections with far deadlines costs nothing.
+//
+// Each network thread runs its own wheel; timers are armed and fire in that thread.
+class CTimerWheel : public QObject
+{
+	Q_OBJECT
+
+protected:
+	CWheelTimer	m_pSlots[WHEEL_SLOTS_0 + ( WHEEL_LEVELS - 1 ) * WHEEL_SLOTS_N];	// list heads, inner level first
+	CWheelTimer	m_oExpired;				// being run by Advance()
+	qint64		m_nTick;				// last tick processed
+	qint64		m_nClock;				// ms since construction, as of the last Now()
+	QElapsedTimer	m_tClock;			// monotonic, never restarted
+	qint64		m_nWake;				// when m_tTick fires, -1 if it is not armed
+	QTimer		m_tTick;
+	quint32		m_nPending;
+
+public:
+	CTimerWheel(QObject* parent = 0);
+	~CTimerWheel();
+
+	qint64 Now();
+
+	inline quint32 GetPending() const
+	{
+		return m_nPending;
+	}
+
+protected:
+	inline CWheelTimer* GetSlot(int nLevel, qint64 nTick)
+	{
+		if( nLevel == 0 )
+			return &m_pSlots[nTick & ( WHEEL_SLOTS_0 - 1 )];
+
+		int nShift = WHEEL_BITS_0 + WHEEL_BITS_N * ( nLevel - 1 );
+		return &m_pSlots[WHEEL_SLOTS_0 + WHEEL_SLOTS_N * ( nLevel - 1 ) + ( ( nTick >> nShift ) & ( WHEEL_SLOTS_N - 1 ) )];
+	}
+	inline bool IsEmpty(int nLevel, qint64 nTick)
+	{
+		CWheelTimer* pSlot = GetSlot(nLevel, nTick);
+		return pSlot->m_pNext == pSlot;
+	}
+
+	void Add(CWheelTimer* pTimer, qint64 nExpires);
+	void Remove(CWheelTimer* pTimer);
+	void Place(CWheelTimer* pTimer);
+	void Cascade(int nLevel, qint64 nTick);
+	void Advance(qint64 nNow);
+	void Schedule();
+	qint64 GetNextWake();
+
+protected slots:
+	void OnTick();
+
+	friend class CWheelTimer;
+};
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,265 @@
+#include "UdpBatch.h"
+
+#include <QSocketNotifier>
+#include <QtDebug>
+
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+struct CUdpBatchBuffers
+{
+	char				pRecv[UDP_BATCH][UDP_SLOT_SIZE];
+	struct mmsghdr		pRecvMsg[UDP_BATCH];
+	struct iovec		pRecvVec[UDP_BATCH];
+	struct sockaddr_in	pRecvFrom[UDP_BATCH];
+
+	char				pSend[UDP_BATCH][UDP_SLOT_SIZE];
+	struct mmsghdr		pSendMsg[UDP_BATCH];
+	struct iovec		pSendVec[UDP_BATCH];
+	struct sockaddr_in	pSendTo[UDP_BATCH];
+};
+
+static inline void ToSockAddr(const IPv4_ENDPOINT& oAddress, struct sockaddr_in& oSockAddr)
+{
+	oSockAddr.sin_family = AF_INET;
+	oSockAddr.sin_addr.s_addr = htonl(oAddress.ip);
+	oSockAddr.sin_port = htons(oAddress.port);
+}
+#else
+struct CUdpBatchBuffers
+{
+};
+#endif
+
+CUdpBatch::CUdpBatch(QObject* parent)
+	: QObject(parent)
+{
+	m_hSocket = -1;
+	m_pNotifier = 0;
+	m_pBuffers = 0;
+	m_nReceived = 0;
+	m_nQueued = 0;
+}
+
+CUdpBatch::~CUdpBatch()
+{
+	Close();
+}
+
+// Call from the thread that reads the socket
+bool CUdpBatch::Open(quint16 nPort)
+{
+#ifdef Q_OS_LINUX
+	if( m_hSocket != -1 )
+		return true;
+
+	m_hSocket = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if( m_hSocket == -1 )
+	{
+		qDebug() << "UDP batch: socket failed, errno" << errno;
+		return false;
+	}
+
+	// as QUdpSocket binds by default
+	int nReuse = 1;
+	::setsockopt(m_hSocket, SOL_SOCKET, SO_REUSEADDR, &nReuse, sizeof(nReuse));
+
+	struct sockaddr_in oLocal;
+	memset(&oLocal, 0, sizeof(oLocal));
+	ToSockAddr(IPv4_ENDPOINT(INADDR_ANY, nPort), oLocal);
+
+	if( ::bind(m_hSocket, (struct sockaddr*)&oLocal, sizeof(oLocal)) == -1 )
+	{
+		qDebug() << "UDP batch: bind to port" << nPort << "failed, errno" << errno;
+		::close(m_hSocket);
+		m_hSocket = -1;
+		return false;
+	}
+
+	m_pBuffers = new CUdpBatchBuffers;
+	memset(m_pBuffers->pRecvMsg, 0, sizeof(m_pBuffers->pRecvMsg));
+	memset(m_pBuffers->pSendMsg, 0, sizeof(m_pBuffers->pSendMsg));
+
+	for( int i = 0; i < UDP_BATCH; i++ )
+	{
+		m_pBuffers->pRecvVec[i].iov_base = m_pBuffers->pRecv[i];
+		m_pBuffers->pRecvVec[i].iov_len = UDP_SLOT_SIZE;
+		m_pBuffers->pRecvMsg[i].msg_hdr.msg_iov = &m_pBuffers->pRecvVec[i];
+		m_pBuffers->pRecvMsg[i].msg_hdr.msg_iovlen = 1;
+		m_pBuffers->pRecvMsg[i].msg_hdr.msg_name = &m_pBuffers->pRecvFrom[i];
+
+		memset(&m_pBuffers->pSendTo[i], 0, sizeof(struct sockaddr_in));
+		m_pBuffers->pSendVec[i].iov_base = m_pBuffers->pSend[i];
+		m_pBuffers->pSendMsg[i].msg_hdr.msg_iov = &m_pBuffers->pSendVec[i];
+		m_pBuffers->pSendMsg[i].msg_hdr.msg_iovlen = 1;
+		m_pBuffers->pSendMsg[i].msg_hdr.msg_name = &m_pBuffers->pSendTo[i];
+		m_pBuffers->pSendMsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	m_nReceived = m_nQueued = 0;
+
+	m_pNotifier = new QSocketNotifier(m_hSocket, QSocketNotifier::Read, this);
+	connect(m_pNotifier, SIGNAL(activated(int)), this, SIGNAL(readyRead()));
+
+	return true;
+#else
+	Q_UNUSED(nPort);
+	return false;
+#endif
+}
+
+void CUdpBatch::Close()
+{
+#ifdef Q_OS_LINUX
+	if( m_hSocket == -1 )
+		return;
+
+	delete m_pNotifier;
+	m_pNotifier = 0;
+
+	::close(m_hSocket);
+	m_hSocket = -1;
+
+	delete m_pBuffers;
+	m_pBuffers = 0;
+
+	m_nReceived = m_nQueued = 0;
+#endif
+}
+
+int CUdpBatch::Receive()
+{
+	m_nReceived = 0;
+
+#ifdef Q_OS_LINUX
+	if( m_hSocket == -1 )
+		return 0;
+
+	for( int i = 0; i < UDP_BATCH; i++ )
+		m_pBuffers->pRecvMsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+	int nCount = ::recvmmsg(m_hSocket, m_pBuffers->pRecvMsg, UDP_BATCH, MSG_DONTWAIT, 0);
+	if( nCount == -1 )
+	{
+		if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+			qDebug() << "UDP batch: recvmmsg failed, errno" << errno;
+		return 0;
+	}
+
+	m_nReceived = nCount;
+#endif
+
+	return m_nReceived;
+}
+
+const char* CUdpBatch::GetData(int nIndex) const
+{
+	Q_ASSERT(nIndex >= 0 && nIndex < m_nReceived);
+#ifdef Q_OS_LINUX
+	return m_pBuffers->pRecv[nIndex];
+#else
+	return 0;
+#endif
+}
+
+quint32 CUdpBatch::GetLength(int nIndex) const
+{
+	Q_ASSERT(nIndex >= 0 && nIndex < m_nReceived);
+#ifdef Q_OS_LINUX
+	return qMin<quint32>(m_pBuffers->pRecvMsg[nIndex].msg_len, UDP_SLOT_SIZE);
+#else
+	return 0;
+#endif
+}
+
+bool CUdpBatch::IsTruncated(int nIndex) const
+{
+	Q_ASSERT(nIndex >= 0 && nIndex < m_nReceived);
+#ifdef Q_OS_LINUX
+	return ( m_pBuffers->pRecvMsg[nIndex].msg_hdr.msg_flags & MSG_TRUNC ) != 0;
+#else
+	return false;
+#endif
+}
+
+IPv4_ENDPOINT CUdpBatch::GetSender(int nIndex) const
+{
+	Q_ASSERT(nIndex >= 0 && nIndex < m_nReceived);
+#ifdef Q_OS_LINUX
+	const struct sockaddr_in& oFrom = m_pBuffers->pRecvFrom[nIndex];
+	return IPv4_ENDPOINT(ntohl(oFrom.sin_addr.s_addr), ntohs(oFrom.sin_port));
+#else
+	return IPv4_ENDPOINT();
+#endif
+}
+
+void CUdpBatch::Queue(const IPv4_ENDPOINT& oTo, const char* pData, quint32 nLength)
+{
+#ifdef Q_OS_LINUX
+	if( m_hSocket == -1 )
+		return;
+
+	if( nLength > UDP_SLOT_SIZE )
+	{
+		// keep the order, then send it straight from the caller's buffer
+		Flush();
+
+		struct sockaddr_in oAddr;
+		memset(&oAddr, 0, sizeof(oAddr));
+		ToSockAddr(oTo, oAddr);
+		::sendto(m_hSocket, pData, nLength, MSG_DONTWAIT, (struct sockaddr*)&oAddr, sizeof(oAddr));
+		return;
+	}
+
+	if( m_nQueued == UDP_BATCH )
+		Flush();
+
+	int i = m_nQueued++;
+	memcpy(m_pBuffers->pSend[i], pData, nLength);
+	m_pBuffers->pSendVec[i].iov_len = nLength;
+	ToSockAddr(oTo, m_pBuffers->pSendTo[i]);
+#else
+	Q_UNUSED(oTo);
+	Q_UNUSED(pData);
+	Q_UNUSED(nLength);
+#endif
+}
+
+// What does not fit into the socket buffer is lost, as with a failed writeDatagram().
+// Acknowledged datagrams are sent again on their resend timeout.
+int CUdpBatch::Flush()
+{
+	int nSent = 0;
+
+#ifdef Q_OS_LINUX
+	int nDone = 0;
+
+	while( nDone < m_nQueued )
+	{
+		int nResult = ::sendmmsg(m_hSocket, m_pBuffers->pSendMsg + nDone, m_nQueued - nDone, MSG_DONTWAIT);
+		if( nResult == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			if( errno == EAGAIN || errno == EWOULDBLOCK )
+				break;
+
+			// this one will not go, try the rest
+			qDebug() << "UDP batch: sendmmsg failed, errno" << errno;
+			nDone++;
+			continue;
+		}
+
+		nDone += nResult;
+		nSent += nResult;
+	}
+
+	m_nQueued = 0;
+#endif
+
+	return nSent;
+}
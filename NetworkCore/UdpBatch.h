@@ -0,0 +1,67 @@
+#ifndef UDPBATCH_H
+#define UDPBATCH_H
+
+#include <QObject>
+#include "types.h"
+
+class QSocketNotifier;
+struct CUdpBatchBuffers;
+
+// Datagram I/O in batches on a UDP socket of our own.
+//
+// Receive() drains up to UDP_BATCH datagrams into preallocated slots with a single recvmmsg,
+// Queue() copies outgoing datagrams into slots and Flush() hands them all to one sendmmsg.
+// The addresses are kept as sockaddrs, nothing is allocated per datagram. Linux only -
+// elsewhere Open() fails and CDatagrams stays on QUdpSocket.
+
+#define UDP_BATCH			32
+// GND fragments are an MTU (UdpMTU) long, larger datagrams are dropped on receive and sent alone
+#define UDP_SLOT_SIZE		8192
+
+class CUdpBatch : public QObject
+{
+	Q_OBJECT
+
+public:
+	CUdpBatch(QObject* parent = 0);
+	~CUdpBatch();
+
+// Attributes
+protected:
+	int					m_hSocket;
+	QSocketNotifier*	m_pNotifier;
+	CUdpBatchBuffers*	m_pBuffers;
+	int					m_nReceived;
+	int					m_nQueued;
+
+// Operations
+public:
+	bool	Open(quint16 nPort);
+	void	Close();
+
+	inline bool IsOpen() const
+	{
+		return m_hSocket != -1;
+	}
+
+	// Replaces the previous batch, returns how many datagrams arrived
+	int				Receive();
+	const char*		GetData(int nIndex) const;
+	quint32			GetLength(int nIndex) const;
+	bool			IsTruncated(int nIndex) const;
+	IPv4_ENDPOINT	GetSender(int nIndex) const;
+
+	// A full batch is flushed on the way
+	void	Queue(const IPv4_ENDPOINT& oTo, const char* pData, quint32 nLength);
+	int		Flush();
+
+	inline int GetQueued() const
+	{
+		return m_nQueued;
+	}
+
+signals:
+	void	readyRead();
+};
+
+#endif // UDPBATCH_H
@@ -1,66 +1,149 @@
 #include "ZLibUtils.h"
 #include "zlib/zlib.h"
 
-QMutex ZLibUtils::m_oMutex;
-QByteArray ZLibUtils::m_oCompressBuffer;
+#include <string.h>
 
-bool ZLibUtils::Compress(QByteArray &pSrc, bool bIfSmaller)
+// Streams are initialised on first use and reset between calls, the buffer only grows
+class ZLibContext
 {
-    QMutexLocker l(&ZLibUtils::m_oMutex);
+public:
+    z_stream    m_sDeflate;
+    z_stream    m_sInflate;
+    bool        m_bDeflate;
+    bool        m_bInflate;
+    QByteArray  m_baBuffer;
+
+    ZLibContext()
+    {
+        memset(&m_sDeflate, 0, sizeof(z_stream));
+        memset(&m_sInflate, 0, sizeof(z_stream));
+        m_bDeflate = m_bInflate = false;
+    }
+    ~ZLibContext()
+    {
+        if( m_bDeflate )
+            deflateEnd(&m_sDeflate);
+        if( m_bInflate )
+            inflateEnd(&m_sInflate);
+    }
+};
 
-    if( bIfSmaller && pSrc.size() < 64 )
-        return false;
+QThreadStorage<ZLibContext*> ZLibUtils::m_oContext;
+
+ZLibContext* ZLibUtils::GetContext()
+{
+    ZLibContext* pContext = m_oContext.localData();
+
+    if( pContext == 0 )
+    {
+        pContext = new ZLibContext();
+        m_oContext.setLocalData(pContext);
+    }
 
-    ulong nCompress = qMax(ZLibUtils::m_oCompressBuffer.size(), pSrc.size() * 2);
+    return pContext;
+}
 
-    ZLibUtils::m_oCompressBuffer.resize(nCompress);
+bool ZLibUtils::Compress(QByteArray &pSrc, bool bIfSmaller, int nMinimum)
+{
+    if( bIfSmaller && pSrc.size() < nMinimum )
+        return false;
 
-    int nRet = ::compress((Bytef*)ZLibUtils::m_oCompressBuffer.data(), &nCompress, (const Bytef*)pSrc.data(), pSrc.size());
+    ZLibContext* pContext = GetContext();
+    z_stream& sDeflate = pContext->m_sDeflate;
 
-    if( nRet != Z_OK )
+    if( !pContext->m_bDeflate )
+    {
+        if( deflateInit(&sDeflate, Z_DEFAULT_COMPRESSION) != Z_OK )
+            return false;
+        pContext->m_bDeflate = true;
+    }
+    else if( deflateReset(&sDeflate) != Z_OK )
     {
-        Q_ASSERT(nRet != Z_BUF_ERROR);
         return false;
     }
 
-    ZLibUtils::m_oCompressBuffer.resize(nCompress);
+    // when it has to be smaller, running out of room means it is not worth it
+    int nRoom = bIfSmaller ? pSrc.size() : int(deflateBound(&sDeflate, pSrc.size()));
+
+    if( pContext->m_baBuffer.size() < nRoom )
+        pContext->m_baBuffer.resize(nRoom);
+
+    sDeflate.next_in = (Bytef*)pSrc.constData();
+    sDeflate.avail_in = pSrc.size();
+    sDeflate.next_out = (Bytef*)pContext->m_baBuffer.data();
+    sDeflate.avail_out = nRoom;
 
-    if( bIfSmaller && ZLibUtils::m_oCompressBuffer.size() > pSrc.size() )
+    int nRet = deflate(&sDeflate, Z_FINISH);
+
+    if( nRet != Z_STREAM_END )
+    {
+        Q_ASSERT(bIfSmaller);
         return false;
+    }
 
-    pSrc.clear();
-    pSrc.append(ZLibUtils::m_oCompressBuffer);
+    // copied back, so pSrc keeps its own allocation
+    int nCompressed = nRoom - sDeflate.avail_out;
+    pSrc.resize(nCompressed);
+    memcpy(pSrc.data(), pContext->m_baBuffer.constData(), nCompressed);
 
     return true;
 }
 
-bool ZLibUtils::Uncompress(QByteArray &pSrc)
+bool ZLibUtils::Uncompress(QByteArray &pSrc, int nLimit)
 {
-    QMutexLocker l(&ZLibUtils::m_oMutex);
+    ZLibContext* pContext = GetContext();
+    z_stream& sInflate = pContext->m_sInflate;
 
-    for( ulong nSize = qMax(pSrc.size() * 6u, 1024u); ; nSize *= 2 )
+    if( !pContext->m_bInflate )
     {
-        ZLibUtils::m_oCompressBuffer.resize(nSize);
+        if( inflateInit(&sInflate) != Z_OK )
+            return false;
+        pContext->m_bInflate = true;
+    }
+    else if( inflateReset(&sInflate) != Z_OK )
+    {
+        return false;
+    }
+
+    sInflate.next_in = (Bytef*)pSrc.constData();
+    sInflate.avail_in = pSrc.size();
 
-        ulong nCompress = ZLibUtils::m_oCompressBuffer.size();
+    int nOut = 0;
 
-        int nRet = ::uncompress((Bytef*)ZLibUtils::m_oCompressBuffer.data(), &nCompress, (Bytef*)pSrc.data(), pSrc.size());
+    forever
+    {
+        int nRoom = qMin(pContext->m_baBuffer.size(), nLimit);
 
-        if( nRet == Z_OK )
+        if( nOut >= nRoom )
         {
-            ZLibUtils::m_oCompressBuffer.resize(nCompress);
-            pSrc.clear();
-            pSrc.append(ZLibUtils::m_oCompressBuffer);
+            if( nOut >= nLimit )
+                return false;
 
-            break;
+            pContext->m_baBuffer.resize(qMin(nLimit, qMax(pContext->m_baBuffer.size() * 2, qMax(pSrc.size() * 4, 1024))));
+            nRoom = qMin(pContext->m_baBuffer.size(), nLimit);
         }
 
-        if( nRet != Z_BUF_ERROR )
-        {
+        sInflate.next_out = (Bytef*)pContext->m_baBuffer.data() + nOut;
+        sInflate.avail_out = nRoom - nOut;
+
+        int nRet = inflate(&sInflate, Z_NO_FLUSH);
+
+        nOut = nRoom - sInflate.avail_out;
+
+        if( nRet == Z_STREAM_END )
+            break;
+
+        if( nRet != Z_OK && nRet != Z_BUF_ERROR )
+            return false;
+
+        // room left over but no end of stream - the input was cut short
+        if( sInflate.avail_out > 0 )
             return false;
-        }
     }
 
+    pSrc.resize(nOut);
+    memcpy(pSrc.data(), pContext->m_baBuffer.constData(), nOut);
+
     return true;
 
 }
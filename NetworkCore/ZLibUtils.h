@@ -2,18 +2,28 @@
 #define ZLIBUTILS_H
 
 #include <QByteArray>
-#include <QMutex>
-#include <QMutexLocker>
+#include <QThreadStorage>
 
+// Smallest input Compress(bIfSmaller) bothers with by default
+#define ZLIB_COMPRESS_MIN	64
+// Most Uncompress() inflates to by default, anything longer is rejected
+#define ZLIB_INFLATE_MAX	(256 * 1024)
+
+class ZLibContext;
+
+// One-shot compression on zlib streams kept per thread, so callers on different threads
+// never wait for each other and nothing is allocated per call once a thread has warmed up
 class ZLibUtils
 {
 public:
 
-    static QMutex m_oMutex;
-    static QByteArray m_oCompressBuffer;
+    static QThreadStorage<ZLibContext*> m_oContext;
+
+    static bool Compress(QByteArray& pSrc, bool bIfSmaller = false, int nMinimum = ZLIB_COMPRESS_MIN);
+    static bool Uncompress(QByteArray& pSrc, int nLimit = ZLIB_INFLATE_MAX);
 
-    static bool Compress(QByteArray& pSrc, bool bIfSmaller = false);
-    static bool Uncompress(QByteArray& pSrc);
+protected:
+    static ZLibContext* GetContext();
 };
 
 #endif // ZLIBUTILS_H
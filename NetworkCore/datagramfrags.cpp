@@ -8,6 +8,9 @@
 
 DatagramIn::DatagramIn()
 {
+    m_nKey = 0;
+    m_pList = 0;
+    m_pPrev = m_pNext = 0;
     m_pBuffer = 0;
     m_bLocked = 0;
     m_nBuffer = 0;
@@ -90,6 +93,14 @@ DatagramOut::DatagramOut()
     m_pBuffer = 0;
     m_nLocked = 0;
     m_bAck = false;
+    m_nNext = 0;
+    m_pQueue = 0;
+    memset(&m_oQueueLink, 0, sizeof(m_oQueueLink));
+    memset(&m_oAgeLink, 0, sizeof(m_oAgeLink));
+    m_oResend.Init(this, 0);
+    m_tPass = 0;
+    m_nPasses = 0;
+    m_bAnswered = false;
 }
 DatagramOut::~DatagramOut()
 {
@@ -97,6 +108,18 @@ DatagramOut::~DatagramOut()
         delete[] m_pLocked;
 }
 void DatagramOut::Create(IPv4_ENDPOINT oAddr, G2Packet *pPacket, quint16 nSequence, QByteArray *pBuffer, bool bAck)
+{
+    pPacket->ToBuffer(pBuffer);
+    Pack(oAddr, nSequence, pBuffer, bAck);
+}
+void DatagramOut::Create(IPv4_ENDPOINT oAddr, const QByteArray &baFrame, quint16 nSequence, QByteArray *pBuffer, bool bAck)
+{
+    // the buffer is empty, so this shares the frame - compression or the GND headers make the copy
+    pBuffer->append(baFrame);
+    Pack(oAddr, nSequence, pBuffer, bAck);
+}
+// Compresses and splits the encoded packet in pBuffer into GND fragments
+void DatagramOut::Pack(IPv4_ENDPOINT oAddr, quint16 nSequence, QByteArray *pBuffer, bool bAck)
 {
     Q_ASSERT(m_pBuffer == 0);
 
@@ -104,9 +127,7 @@ void DatagramOut::Create(IPv4_ENDPOINT oAddr, G2Packet *pPacket, quint16 nSequen
     m_nSequence = nSequence;
     m_pBuffer = pBuffer;
 
-    pPacket->ToBuffer(m_pBuffer);
-
-    m_bCompressed = ZLibUtils::Compress(*m_pBuffer, true);
+    m_bCompressed = ZLibUtils::Compress(*m_pBuffer, true, quazaaSettings.Gnutella2.UdpCompressMin);
 
 	m_nPacket = quazaaSettings.Gnutella2.UdpMTU;
     m_nCount = quint8((m_pBuffer->size() + m_nPacket - 1) / m_nPacket);
@@ -140,34 +161,21 @@ void DatagramOut::Create(IPv4_ENDPOINT oAddr, G2Packet *pPacket, quint16 nSequen
 
     memset(m_pLocked, 0x00, sizeof(quint32) * m_nLocked);
 
+    m_nNext = 0;
+    m_tPass = 0;
+    m_nPasses = 0;
+    m_bAnswered = false;
     m_tSent = time(0);
 }
-bool DatagramOut::GetPacket(quint32 tNow, char**ppPacket, quint32 *pnPacket, bool bResend)
+// Next part of this pass that has not been acknowledged
+bool DatagramOut::GetPacket(char**ppPacket, quint32 *pnPacket)
 {
     Q_ASSERT(m_pBuffer != 0);
 
-    int nPart = 0;
-    for( ; nPart < m_nCount; nPart++ )
-    {
-        if( m_pLocked[nPart] < 0xFFFFFFFF )
-        {
-            if( bResend )
-            {
-				if( tNow - m_pLocked[nPart] >= quazaaSettings.Gnutella2.UdpOutResend )
-                    break;
-            }
-            else
-            {
-                if( m_pLocked[nPart] == 0 )
-                    break;
-            }
-        }
-    }
-
-    if( nPart >= m_nCount )
+    if( !HasMore() )
         return false;
 
-    m_pLocked[nPart] = bResend ? tNow : 0xFFFFFFFF;
+    int nPart = m_nNext++;
 
     quint32 nPacket = m_nPacket + sizeof(GND_HEADER);
     *ppPacket = m_pBuffer->data() + ( nPart * nPacket );
@@ -176,6 +184,20 @@ bool DatagramOut::GetPacket(quint32 tNow, char**ppPacket, quint32 *pnPacket, boo
     return true;
 
 }
+bool DatagramOut::HasMore()
+{
+    while( m_nNext < m_nCount && m_pLocked[m_nNext] == 0xFFFFFFFF )
+        m_nNext++;
+
+    return m_nNext < m_nCount;
+}
+
+void DatagramOut::OnTimerExpired(int nTimer)
+{
+    Q_UNUSED(nTimer);
+    Datagrams.OnResend(this);
+}
+
 bool DatagramOut::Acknowledge(quint8 nPart)
 {
     if ( nPart > 0 && nPart <= m_nCount && m_nAcked > 0 )
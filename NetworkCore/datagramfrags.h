@@ -2,14 +2,22 @@
 #define DATAGRAMFRAGS_H
 
 #include "types.h"
+#include "TimerWheel.h"
 
 class QByteArray;
 class G2Packet;
+class DatagramInList;
 
 class DatagramIn
 {
 protected:
     IPv4_ENDPOINT   m_oAddress;
+    quint64         m_nKey;         // in CDatagrams::m_RecvCache
+
+    // age list the datagram is on, see CDatagrams
+    DatagramInList* m_pList;
+    DatagramIn*     m_pPrev;
+    DatagramIn*     m_pNext;
 
     quint16 m_nSequence;
     quint8  m_nCount;
@@ -28,13 +36,83 @@ public:
     bool Add(quint8 nPart, const void* pData, qint32 nLength);
     G2Packet* ToG2Packet();
 
+    static inline quint64 MakeKey(const IPv4_ENDPOINT& oHost, quint16 nSequence)
+    {
+        return ( quint64(oHost.ip) << 32 ) | ( quint32(nSequence) << 16 ) | oHost.port;
+    }
 
     friend class CDatagrams;
+    friend class DatagramInList;
+};
+
+// Intrusive list of datagrams in the order they were last touched, oldest first
+class DatagramInList
+{
+protected:
+    DatagramIn* m_pFirst;
+    DatagramIn* m_pLast;
+
+public:
+    DatagramInList()
+    {
+        m_pFirst = m_pLast = 0;
+    }
+
+    inline DatagramIn* First() const
+    {
+        return m_pFirst;
+    }
+    inline bool IsEmpty() const
+    {
+        return m_pFirst == 0;
+    }
+
+    inline void Append(DatagramIn* pDG)
+    {
+        Q_ASSERT(pDG->m_pList == 0);
+
+        pDG->m_pList = this;
+        pDG->m_pPrev = m_pLast;
+        pDG->m_pNext = 0;
+
+        if( m_pLast )
+            m_pLast->m_pNext = pDG;
+        else
+            m_pFirst = pDG;
+        m_pLast = pDG;
+    }
+    inline void Unlink(DatagramIn* pDG)
+    {
+        Q_ASSERT(pDG->m_pList == this);
+
+        if( pDG->m_pPrev )
+            pDG->m_pPrev->m_pNext = pDG->m_pNext;
+        else
+            m_pFirst = pDG->m_pNext;
+
+        if( pDG->m_pNext )
+            pDG->m_pNext->m_pPrev = pDG->m_pPrev;
+        else
+            m_pLast = pDG->m_pPrev;
+
+        pDG->m_pList = 0;
+        pDG->m_pPrev = pDG->m_pNext = 0;
+    }
 };
 
 class DatagramWatcher;
+class DatagramOut;
+class DatagramOutList;
+class DatagramQueue;
+
+struct DatagramOutLink
+{
+    DatagramOutList*    m_pList;
+    DatagramOut*        m_pPrev;
+    DatagramOut*        m_pNext;
+};
 
-class DatagramOut
+class DatagramOut : public CTimerTarget
 {
 protected:
     IPv4_ENDPOINT   m_oAddress;
@@ -53,16 +131,126 @@ protected:
     void*               m_pParam;
     QByteArray* m_pBuffer;
 
+    quint8          m_nNext;        // next part of the current pass over the unacknowledged ones
+    DatagramQueue*  m_pQueue;       // waiting to be sent to its host, 0 otherwise
+    DatagramOutLink m_oQueueLink;   // in m_pQueue
+    DatagramOutLink m_oAgeLink;     // in CDatagrams::m_SendCache
+    CWheelTimer     m_oResend;      // next pass, while waiting for acks
+    qint64          m_tPass;        // ms when the current pass started, 0 until it does
+    quint8          m_nPasses;
+    bool            m_bAnswered;    // acked since the current pass started
+
 public:
     DatagramOut();
     ~DatagramOut();
 
     void Create(IPv4_ENDPOINT oAddr, G2Packet* pPacket, quint16 nSequence, QByteArray* pBuffer, bool bAck = false);
-    bool GetPacket(quint32 tNow, char** ppPacket, quint32* pnPacket, bool bResend = false);
+    void Create(IPv4_ENDPOINT oAddr, const QByteArray& baFrame, quint16 nSequence, QByteArray* pBuffer, bool bAck = false);
+    bool GetPacket(char** ppPacket, quint32* pnPacket);
+    bool HasMore();
     bool Acknowledge(quint8 nPart);
 
+    void OnTimerExpired(int nTimer);
+
+protected:
+    void Pack(IPv4_ENDPOINT oAddr, quint16 nSequence, QByteArray* pBuffer, bool bAck);
+
     friend class CDatagrams;
+    friend class DatagramOutList;
+    friend class DatagramQueue;
+
+};
+
+// Intrusive FIFO of DatagramOut, threaded through one of its links
+class DatagramOutList
+{
+protected:
+    DatagramOutLink DatagramOut::*  m_pLink;
+    DatagramOut*    m_pFirst;
+    DatagramOut*    m_pLast;
+    int             m_nCount;
+
+public:
+    DatagramOutList(DatagramOutLink DatagramOut::* pLink)
+    {
+        m_pLink = pLink;
+        m_pFirst = m_pLast = 0;
+        m_nCount = 0;
+    }
+
+    inline DatagramOut* First() const
+    {
+        return m_pFirst;
+    }
+    inline bool IsEmpty() const
+    {
+        return m_pFirst == 0;
+    }
+    inline int GetCount() const
+    {
+        return m_nCount;
+    }
+    inline bool Contains(DatagramOut* pDG) const
+    {
+        return (pDG->*m_pLink).m_pList == this;
+    }
+
+    inline void Append(DatagramOut* pDG)
+    {
+        DatagramOutLink& oLink = pDG->*m_pLink;
+        Q_ASSERT(oLink.m_pList == 0);
+
+        oLink.m_pList = this;
+        oLink.m_pPrev = m_pLast;
+        oLink.m_pNext = 0;
+
+        if( m_pLast )
+            (m_pLast->*m_pLink).m_pNext = pDG;
+        else
+            m_pFirst = pDG;
+        m_pLast = pDG;
+        m_nCount++;
+    }
+    inline void Unlink(DatagramOut* pDG)
+    {
+        DatagramOutLink& oLink = pDG->*m_pLink;
+        Q_ASSERT(oLink.m_pList == this);
+
+        if( oLink.m_pPrev )
+            (oLink.m_pPrev->*m_pLink).m_pNext = oLink.m_pNext;
+        else
+            m_pFirst = oLink.m_pNext;
+
+        if( oLink.m_pNext )
+            (oLink.m_pNext->*m_pLink).m_pPrev = oLink.m_pPrev;
+        else
+            m_pLast = oLink.m_pPrev;
+
+        oLink.m_pList = 0;
+        oLink.m_pPrev = oLink.m_pNext = 0;
+        m_nCount--;
+    }
+};
+
+// Datagrams waiting to go to one host. Hosts with something to send form a ring that
+// CDatagrams::FlushSendCache serves a fragment at a time.
+class DatagramQueue
+{
+public:
+    quint64         m_nKey;
+    DatagramOutList m_lQueue;
+    DatagramQueue*  m_pPrev;
+    DatagramQueue*  m_pNext;
+
+    DatagramQueue()
+        : m_nKey(0), m_lQueue(&DatagramOut::m_oQueueLink), m_pPrev(0), m_pNext(0)
+    {
+    }
 
+    static inline quint64 MakeKey(const IPv4_ENDPOINT& oHost)
+    {
+        return ( quint64(oHost.ip) << 16 ) | oHost.port;
+    }
 };
 
 #endif // DATAGRAMFRAGS_H
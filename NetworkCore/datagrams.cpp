@@ -3,10 +3,14 @@
 #include "datagramfrags.h"
 #include "g2node.h"
 #include "g2packet.h"
+#include "g2packetwriter.h"
 #include <QTimer>
 #include "hostcache.h"
 #include "SearchManager.h"
 #include "QueryHit.h"
+#include "PacketCapture.h"
+#include "Metrics.h"
+#include "UdpBatch.h"
 
 #include "quazaaglobals.h"
 #include "quazaasettings.h"
@@ -17,20 +21,41 @@
 CDatagrams Datagrams;
 CThread DatagramsThread;
 
+// Batches drained per wakeup, the socket notifier fires again while more is waiting
+#define UDP_BATCH_ROUNDS	4
+
+// Shortest resend timeout a round trip estimate may give, ms
+#define UDP_RTO_MIN			500
+// Unanswered passes in a row before a host gets no more resends and searches leave it alone
+#define UDP_HOST_SILENT		3
+// Doublings of the resend timeout and of the search backoff
+#define UDP_BACKOFF_MAX		4
+// Loss, per mille, over which a host gets one doubling of the resend timeout to begin with
+#define UDP_HOST_LOSSY		500
+// Hosts we have not sent to for this long are forgotten, ms
+#define UDP_HOST_IDLE		600000
+#define UDP_HOST_PRUNE		60000
+
 CDatagrams::CDatagrams()
+    : m_pSection("datagrams", mlDatagrams), m_SendCache(&DatagramOut::m_oAgeLink)
 {
-	m_nUploadLimit = 8192; // TODO it
 
     m_pRecvBuffer = new QByteArray();
     m_pHostAddress = new QHostAddress();
     m_nSequence = 0;
+    m_pSendNext = 0;
 
     m_bActive = false;
 
     m_pSocket = 0;
+    m_pBatch = 0;
     m_tSender = 0;
     m_bFirewalled = true;
 
+    m_oRecvExpire.Init(this, dtRecvExpire);
+    m_oSendPace.Init(this, dtSendPace);
+    m_oHostPrune.Init(this, dtHostPrune);
+
 }
 CDatagrams::~CDatagrams()
 {
@@ -40,6 +65,9 @@ CDatagrams::~CDatagrams()
     if( m_pSocket )
         delete m_pSocket;
 
+    if( m_pBatch )
+        delete m_pBatch;
+
     if( m_tSender )
         delete m_tSender;
 
@@ -55,15 +83,37 @@ void CDatagrams::SetupThread()
     qDebug() << "Thread id: " << QThread::currentThreadId();
 
     Q_ASSERT(m_pSocket == 0);
+    Q_ASSERT(m_pBatch == 0);
     Q_ASSERT(m_tSender == 0);
 
-    m_pSocket = new QUdpSocket(this);
     m_tSender = new QTimer(this);
 
     IPv4_ENDPOINT addr = Network.GetLocalAddress();
-    if( m_pSocket->bind(addr.port) )
+    bool bBound = false;
+
+    m_pBatch = new CUdpBatch(this);
+    if( quazaaSettings.Connection.UdpBatch && m_pBatch->Open(addr.port) )
+    {
+        qDebug() << "Datagrams listening on " << addr.port << "(batched)";
+        connect(m_pBatch, SIGNAL(readyRead()), this, SLOT(OnDatagram()));
+        bBound = true;
+    }
+    else
+    {
+        delete m_pBatch;
+        m_pBatch = 0;
+
+        m_pSocket = new QUdpSocket(this);
+        if( m_pSocket->bind(addr.port) )
+        {
+            qDebug() << "Datagrams listening on " << m_pSocket->localPort() << addr.port;
+            connect(m_pSocket, SIGNAL(readyRead()), this, SLOT(OnDatagram()), Qt::QueuedConnection);
+            bBound = true;
+        }
+    }
+
+    if( bBound )
     {
-		qDebug() << "Datagrams listening on " << m_pSocket->localPort() << addr.port;
         m_nDiscarded = 0;
 
 		for( int i = 0; i < quazaaSettings.Gnutella2.UdpBuffers; i++ )
@@ -83,7 +133,6 @@ void CDatagrams::SetupThread()
 
         connect(this, SIGNAL(SendQueueUpdated()), this, SLOT(FlushSendCache()), Qt::QueuedConnection);
         connect(m_tSender, SIGNAL(timeout()), this, SLOT(FlushSendCache()), Qt::QueuedConnection);
-		connect(m_pSocket, SIGNAL(readyRead()), this, SLOT(OnDatagram()), Qt::QueuedConnection);
 
         m_tSender->setInterval(200);
 
@@ -129,10 +178,27 @@ void CDatagrams::CleanupThread()
         m_pSocket = 0;
     }
 
+    if( m_pBatch )
+    {
+        m_pBatch->Close();
+        m_pBatch->disconnect();
+        delete m_pBatch;
+        m_pBatch = 0;
+    }
+
     disconnect(SIGNAL(SendQueueUpdated()));
 
-    while( !m_SendCache.isEmpty() )
-        Remove(m_SendCache.pop());
+    m_oRecvExpire.Stop();
+    m_oSendPace.Stop();
+    m_oHostPrune.Stop();
+
+    while( !m_SendCache.IsEmpty() )
+        Remove(m_SendCache.First());
+
+    while( !m_FreeQueues.isEmpty() )
+        delete m_FreeQueues.pop();
+
+    m_Hosts.clear();
 
     while( !m_RecvCache.isEmpty() )
         RemoveOldIn(true);
@@ -159,13 +225,36 @@ void CDatagrams::OnDatagram()
     if( !m_bActive )
         return;
 
-	if( !Network.m_pSection.tryLock(50) )
+	// The socket and the batch are ours alone. Reassembly and the handlers take
+	// Network.m_pSection for one datagram at a time, so shards are not held up for a batch.
+	if( m_pBatch )
 	{
-		// receive and discard datagram, g2 reliability layer should retransmit
-		m_nBandwidthIn += m_pSocket->pendingDatagramSize();
-		m_pSocket->readDatagram(0, 0, 0, 0);
+		for( int nRound = 0; nRound < UDP_BATCH_ROUNDS; nRound++ )
+		{
+			int nCount = m_pBatch->Receive();
+
+			for( int i = 0; i < nCount; i++ )
+			{
+				quint32 nLength = m_pBatch->GetLength(i);
+				m_nBandwidthIn += nLength;
+				Metrics.Bytes(mtUDP, mdIn, nLength);
+
+				if( m_pBatch->IsTruncated(i) )
+				{
+					Metrics.Drop(mdrMalformed);
+					continue;
+				}
+
+				IPv4_ENDPOINT oFrom = m_pBatch->GetSender(i);
+				ProcessDatagram(m_pBatch->GetData(i), nLength, oFrom);
+			}
 
-		qWarning() << "Can't get lock in CDatagrams::OnDatagram. Network core overloaded.";
+			if( nCount < UDP_BATCH )
+				break;
+		}
+
+		// acks for the whole lot in one call
+		m_pBatch->Flush();
 		return;
 	}
 
@@ -178,47 +267,67 @@ void CDatagrams::OnDatagram()
         qint64 nReadSize = m_pSocket->readDatagram(m_pRecvBuffer->data(), nSize, m_pHostAddress, &m_nPort);
 
         m_nBandwidthIn += nReadSize;
+        Metrics.Bytes(mtUDP, mdIn, nReadSize);
 
         if( nReadSize < 8 )
 			continue;
 			//return;
 
-        GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
-        if( strncmp((char*)&pHeader->szTag, "GND", 3) == 0 && pHeader->nPart > 0 && (pHeader->nCount == 0 || pHeader->nPart <= pHeader->nCount) )
+        IPv4_ENDPOINT oFrom(m_pHostAddress->toIPv4Address(), m_nPort);
+        ProcessDatagram(m_pRecvBuffer->constData(), nReadSize, oFrom);
+    }
+}
+
+void CDatagrams::ProcessDatagram(const char* pData, quint32 nLength, IPv4_ENDPOINT& oFrom)
+{
+    if( nLength < sizeof(GND_HEADER) )
+        return;
+
+    const GND_HEADER* pHeader = (const GND_HEADER*)pData;
+    if( strncmp((const char*)&pHeader->szTag, "GND", 3) == 0 && pHeader->nPart > 0 && (pHeader->nCount == 0 || pHeader->nPart <= pHeader->nCount) )
+    {
+        if( pHeader->nCount == 0 )
         {
-            if( pHeader->nCount == 0 )
-            {
-                // ACK
-                OnAcknowledgeGND();
-            }
-            else
-            {
-                // DG
-                OnReceiveGND();
-            }           
+            // ACK
+            PROFILED_LOCKER(l, &Network.m_pSection);
+            OnAcknowledgeGND(pData, oFrom);
+        }
+        else
+        {
+            // DG
+            OnReceiveGND(pData, nLength, oFrom);
         }
     }
+}
 
-	Network.m_pSection.unlock();
+// Through the batch when there is one, whoever started the I/O flushes it
+void CDatagrams::WriteDatagram(IPv4_ENDPOINT& oTo, const char* pData, quint32 nLength)
+{
+    if( m_pBatch )
+        m_pBatch->Queue(oTo, pData, nLength);
+    else
+        m_pSocket->writeDatagram(pData, nLength, QHostAddress(oTo.ip), oTo.port);
 }
 
-void CDatagrams::OnReceiveGND()
+void CDatagrams::OnReceiveGND(const char* pData, quint32 nLength, IPv4_ENDPOINT& oFrom)
 {
+    PROFILED_LOCKER(l, &Network.m_pSection);
 
-    GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
-    quint32 nIp = m_pHostAddress->toIPv4Address();
-    quint32 nSeq = ((pHeader->nSequence << 16) & 0xFFFF0000) + (m_nPort & 0x0000FFFF);
+    const GND_HEADER* pHeader = (const GND_HEADER*)pData;
+    quint64 nKey = DatagramIn::MakeKey(oFrom, pHeader->nSequence);
 
-	//qDebug("Received GND from %s:%u nSequence = %u nPart = %u nCount = %u", m_pHostAddress->toString().toAscii().constData(), m_nPort, pHeader->nSequence, pHeader->nPart, pHeader->nCount);
-    DatagramIn* pDG = 0;
+	//qDebug("Received GND from %s nSequence = %u nPart = %u nCount = %u", oFrom.toString().toAscii().constData(), pHeader->nSequence, pHeader->nPart, pHeader->nCount);
+    DatagramIn* pDG = m_RecvCache.value(nKey, 0);
 
-    if( m_RecvCache.contains(nIp) && m_RecvCache[nIp].contains(nSeq) )
+    if( pDG )
     {
-        pDG = m_RecvCache[nIp][nSeq];
-
         // Zeby dac szanse wiekszym pakietom ;)
         if( pDG->m_nLeft )
+        {
             pDG->m_tStarted = time(0);
+            m_RecvPending.Unlink(pDG);
+            m_RecvPending.Append(pDG);
+        }
     }
     else
     {
@@ -235,6 +344,7 @@ void CDatagrams::OnReceiveGND()
                 {
                     qDebug() << "UDP in frames exhausted";
                     m_nDiscarded++;
+                    Metrics.Drop(mdrUdpFrames);
                     return;
                 }
             }
@@ -245,12 +355,13 @@ void CDatagrams::OnReceiveGND()
         if( m_FreeBuffer.size() < pHeader->nCount )
         {
             m_nDiscarded++;
+            Metrics.Drop(mdrUdpBuffers);
             m_FreeDGIn.push(pDG);
             RemoveOldIn(false);
             return;
         }
 
-        pDG->Create(IPv4_ENDPOINT(m_pHostAddress->toIPv4Address(), m_nPort), pHeader->nFlags, pHeader->nSequence, pHeader->nCount);
+        pDG->Create(oFrom, pHeader->nFlags, pHeader->nSequence, pHeader->nCount);
 
         for( int i = 0; i < pHeader->nCount; i++ )
         {
@@ -258,7 +369,10 @@ void CDatagrams::OnReceiveGND()
             pDG->m_pBuffer[i] = m_FreeBuffer.pop();
         }
 
-        m_RecvCache[nIp][nSeq] = pDG;
+        pDG->m_nKey = nKey;
+        m_RecvCache.insert(nKey, pDG);
+        m_RecvPending.Append(pDG);
+        ScheduleExpireIn();
     }
 
     // Dopiero tutaj, na wypadek gdybysmy nie mieli wolnych datagramow
@@ -270,51 +384,169 @@ void CDatagrams::OnReceiveGND()
         memcpy(&oAck, pHeader, sizeof(GND_HEADER));
         oAck.nCount = 0;
         oAck.nFlags = 0;
-		//qDebug() << "Sending UDP ACK to " << m_pHostAddress->toString() << m_nPort;
-        m_pSocket->writeDatagram((char*)&oAck, sizeof(GND_HEADER), *m_pHostAddress, m_nPort);
+		//qDebug() << "Sending UDP ACK to " << oFrom.toString();
+        WriteDatagram(oFrom, (char*)&oAck, sizeof(GND_HEADER));
+        Metrics.Bytes(mtUDP, mdOut, sizeof(GND_HEADER));
     }
 
-    if( pDG->Add(pHeader->nPart, m_pRecvBuffer->constData() + sizeof(GND_HEADER), m_pRecvBuffer->size() - sizeof(GND_HEADER)) )
+    if( !pDG->Add(pHeader->nPart, pData + sizeof(GND_HEADER), nLength - sizeof(GND_HEADER)) )
+        return;
+
+    G2Packet* pPacket = 0;
+    try
+    {
+        pPacket = pDG->ToG2Packet();
+    }
+    catch(...)
     {
+        Metrics.Drop(mdrMalformed);
+    }
 
-		G2Packet* pPacket = 0;
-        try
-        {
-			IPv4_ENDPOINT addr(m_pHostAddress->toIPv4Address(), m_nPort);
-			pPacket = pDG->ToG2Packet();
-            if( pPacket )
-            {
-                OnPacket(addr, pPacket);
-			}
+    Remove(pDG, true);
 
-        }
-        catch(...)
-        {
+    // the packet is ours now, OnPacket locks again for the handler
+    l.unlock();
 
-        }
-		if( pPacket )
-			pPacket->Release();
+    if( !pPacket )
+        return;
+
+    Metrics.PacketIn(mtUDP, pPacket->m_nType);
 
-        Remove(pDG, true);
+    if( PacketCapture.IsEnabled() )
+    {
+        QByteArray baFrame = pPacket->ToFrame();
+        PacketCapture.Capture(capIn | capUDP, oFrom, baFrame.constData(), baFrame.size());
     }
 
+    OnPacket(oFrom, pPacket);
+    pPacket->Release();
+
 }
 
-void CDatagrams::OnAcknowledgeGND()
+void CDatagrams::OnAcknowledgeGND(const char* pData, IPv4_ENDPOINT& oFrom)
 {
-    GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
+    const GND_HEADER* pHeader = (const GND_HEADER*)pData;
+
+	//qDebug() << "UDP received GND ACK, seq" << pHeader->nSequence << "part" << pHeader->nPart;
 
-	//qDebug() << "UDP received GND ACK from" << m_pHostAddress->toString().toAscii().constData() << "seq" << pHeader->nSequence << "part" << pHeader->nPart;
+    DatagramOut* pDG = m_SendCacheMap.value(pHeader->nSequence, 0);
 
-    if( !m_SendCacheMap.contains(pHeader->nSequence) )
+    // sequences are ours, but anyone can send an ack
+    if( !pDG || pDG->m_oAddress.ip != oFrom.ip )
         return;
 
-    DatagramOut* pDG = m_SendCacheMap.value(pHeader->nSequence);
+    OnHostAck(pDG);
 
     if( pDG->Acknowledge(pHeader->nPart) )
+    {
+        DatagramHost* pHost = GetHost(pDG->m_oAddress.ip);
+        pHost->m_nLoss -= pHost->m_nLoss / 8;
+
         Remove(pDG);
+    }
+}
+
+DatagramHost* CDatagrams::GetHost(quint32 nIP)
+{
+    QHash<quint32, DatagramHost>::iterator itHost = m_Hosts.find(nIP);
+
+    if( itHost == m_Hosts.end() )
+    {
+        DatagramHost oHost;
+        memset(&oHost, 0, sizeof(oHost));
+        itHost = m_Hosts.insert(nIP, oHost);
+
+        if( !m_oHostPrune.IsActive() && Network.m_pTimerWheel )
+            m_oHostPrune.Start(Network.m_pTimerWheel, UDP_HOST_PRUNE);
+    }
+
+    return &itHost.value();
+}
+
+// Any ack shows the host is there. The first one of a datagram that went out once gives a
+// round trip sample - after a resend there is no telling which pass it answers.
+void CDatagrams::OnHostAck(DatagramOut *pDG)
+{
+    DatagramHost* pHost = GetHost(pDG->m_oAddress.ip);
+    qint64 tNow = Network.m_pTimerWheel ? Network.m_pTimerWheel->Now() : 0;
+
+    pHost->m_tLastAck = tNow;
+    pHost->m_nAcks++;
+    pHost->m_nBackoff = 0;
+
+    if( pDG->m_bAnswered )
+        return;
+
+    pDG->m_bAnswered = true;
+
+    if( pDG->m_nPasses != 1 || !pDG->m_tPass || tNow < pDG->m_tPass )
+        return;
+
+    quint32 nRTT = quint32(qMin(tNow - pDG->m_tPass, qint64(0xFFFFFF)));
+
+    // RFC 6298
+    if( pHost->m_nSRTT == 0 )
+    {
+        pHost->m_nSRTT = qMax(nRTT, 1u);
+        pHost->m_nRTTVar = nRTT / 2;
+    }
+    else
+    {
+        quint32 nDelta = nRTT > pHost->m_nSRTT ? nRTT - pHost->m_nSRTT : pHost->m_nSRTT - nRTT;
+        pHost->m_nRTTVar = ( pHost->m_nRTTVar * 3 + nDelta ) / 4;
+        pHost->m_nSRTT = qMax(( pHost->m_nSRTT * 7 + nRTT ) / 8, 1u);
+    }
+}
+
+// From the round trip once there is one, doubled for a lossy host and for every unanswered pass
+qint64 CDatagrams::GetResendDelay(const DatagramHost* pHost)
+{
+    qint64 nDelay = qint64(quazaaSettings.Gnutella2.UdpOutResend) * 1000;
+
+    if( pHost->m_nSRTT )
+        nDelay = qBound(qint64(UDP_RTO_MIN), qint64(pHost->m_nSRTT) + 4 * pHost->m_nRTTVar, nDelay);
+
+    quint32 nDoublings = pHost->m_nBackoff + ( pHost->m_nLoss > UDP_HOST_LOSSY ? 1 : 0 );
+    nDelay <<= qMin(nDoublings, quint32(UDP_BACKOFF_MAX));
+
+    return qMin(nDelay, qint64(quazaaSettings.Gnutella2.UdpOutExpire) * 1000);
+}
+
+// A host that stopped answering is left alone for a while, twice as long after every pass
+// it did not answer since. Searches skip it instead of spending upstream on a dead hub.
+bool CDatagrams::IsBackingOff(quint32 nIP)
+{
+    QHash<quint32, DatagramHost>::const_iterator itHost = m_Hosts.constFind(nIP);
+
+    if( itHost == m_Hosts.constEnd() || itHost.value().m_nBackoff < UDP_HOST_SILENT )
+        return false;
+
+    if( !Network.m_pTimerWheel )
+        return false;
+
+    qint64 nWait = qint64(quazaaSettings.Gnutella2.UdpOutExpire) * 1000;
+    nWait <<= qMin(itHost.value().m_nBackoff - UDP_HOST_SILENT, quint32(UDP_BACKOFF_MAX));
+
+    return Network.m_pTimerWheel->Now() - itHost.value().m_tLastSent < nWait;
+}
+
+void CDatagrams::PruneHosts()
+{
+    qint64 tNow = Network.m_pTimerWheel->Now();
+
+    for( QHash<quint32, DatagramHost>::iterator itHost = m_Hosts.begin(); itHost != m_Hosts.end(); )
+    {
+        if( tNow - qMax(itHost.value().m_tLastSent, itHost.value().m_tLastAck) > UDP_HOST_IDLE )
+            itHost = m_Hosts.erase(itHost);
+        else
+            ++itHost;
+    }
+
+    if( !m_Hosts.isEmpty() )
+        m_oHostPrune.Start(Network.m_pTimerWheel, UDP_HOST_PRUNE);
 }
 
+// bReclaim: the datagram is complete, it keeps its place in the cache without buffers
 void CDatagrams::Remove(DatagramIn *pDG, bool bReclaim)
 {
 
@@ -328,81 +560,110 @@ void CDatagrams::Remove(DatagramIn *pDG, bool bReclaim)
         }
     }
 
-    if( bReclaim )
+    if( !pDG->m_pList )
         return;
 
-    bool bFound = false;
+    pDG->m_pList->Unlink(pDG);
 
-    for( QHash<quint32, QHash<quint32, DatagramIn*> >::iterator it = m_RecvCache.begin(); it != m_RecvCache.end(); it++ )
+    if( bReclaim )
     {
-        for( QHash<quint32, DatagramIn*>::iterator it2 = it.value().begin(); it2 != it.value().end(); it2++ )
-        {
-            if( it2.value() == pDG )
-            {
-                bFound = true;
-                m_RecvCache[it.key()].remove(it2.key());
-                m_FreeDGIn.push(pDG);
-                break;
-            }
-        }
-
-        if( bFound )
-        {
-            if( it.value().size() == 0 )
-            {
-                m_RecvCache.remove(it.key());
-                break;
-            }
-        }
+        // expires like the incomplete ones, from now
+        pDG->m_tStarted = time(0);
+        m_RecvDone.Append(pDG);
+        ScheduleExpireIn();
+        return;
     }
+
+    m_RecvCache.remove(pDG->m_nKey);
+    m_FreeDGIn.push(pDG);
 }
 
-// Usuwa jeden pakiet z cache'u odbioru
+// Usuwa jeden pakiet z cache'u odbioru: the oldest complete one, else the oldest incomplete
+// one if it expired or bForce
 void CDatagrams::RemoveOldIn(bool bForce)
 {
-    DatagramIn* pOldest = 0;
+    if( !m_RecvDone.IsEmpty() )
+    {
+        Remove(m_RecvDone.First());
+        return;
+    }
+
+    DatagramIn* pOldest = m_RecvPending.First();
+    if( pOldest && ( bForce || quint32(time(0)) - pOldest->m_tStarted > quint32(quazaaSettings.Gnutella2.UdpInExpire) ) )
+        Remove(pOldest);
+}
+
+// Both lists are in m_tStarted order, only their heads can be due
+void CDatagrams::ExpireIn()
+{
     quint32 tNow = time(0);
+    quint32 nExpire = quazaaSettings.Gnutella2.UdpInExpire;
 
-    for( QHash<quint32, QHash<quint32, DatagramIn*> >::iterator it = m_RecvCache.begin(); it != m_RecvCache.end(); it++ )
-    {
-        for( QHash<quint32, DatagramIn*>::iterator itPacket = it.value().begin(); itPacket != it.value().end(); itPacket++ )
-        {
-            if( pOldest )
-            {
-				if( pOldest->m_tStarted < itPacket.value()->m_tStarted && (bForce || tNow - itPacket.value()->m_tStarted > quazaaSettings.Gnutella2.UdpInExpire || itPacket.value()->m_nLeft == 0) )
-                {
-                    pOldest = itPacket.value();
-                }
-            }
-            else
-            {
-				if( bForce || tNow - itPacket.value()->m_tStarted > quazaaSettings.Gnutella2.UdpInExpire || itPacket.value()->m_nLeft == 0 )
-                {
-                    pOldest = itPacket.value();
-                }
+    while( !m_RecvPending.IsEmpty() && tNow - m_RecvPending.First()->m_tStarted > nExpire )
+        Remove(m_RecvPending.First());
 
-            }
-        }
-    }
+    while( !m_RecvDone.IsEmpty() && tNow - m_RecvDone.First()->m_tStarted > nExpire )
+        Remove(m_RecvDone.First());
+}
+
+// Arms m_oRecvExpire for the oldest datagram. A timer armed for one that has gone since
+// just fires early and finds nothing to do.
+void CDatagrams::ScheduleExpireIn()
+{
+    if( m_oRecvExpire.IsActive() || !Network.m_pTimerWheel )
+        return;
+
+    DatagramIn* pOldest = m_RecvPending.First();
+    if( !m_RecvDone.IsEmpty() && ( !pOldest || m_RecvDone.First()->m_tStarted < pOldest->m_tStarted ) )
+        pOldest = m_RecvDone.First();
 
-    if( pOldest )
+    if( !pOldest )
+        return;
+
+    qint64 nDelay = ( qint64(pOldest->m_tStarted) + quazaaSettings.Gnutella2.UdpInExpire + 1 - time(0) ) * 1000;
+    m_oRecvExpire.Start(Network.m_pTimerWheel, nDelay);
+}
+
+// Network thread, from m_pTimerWheel
+void CDatagrams::OnTimerExpired(int nTimer)
+{
+    if( nTimer == dtSendPace )
     {
-        Remove(pOldest);
+        FlushSendCache();
+        return;
     }
 
+    PROFILED_LOCKER(l, &Network.m_pSection);
+
+    if( !m_bActive )
+        return;
 
+    switch( nTimer )
+    {
+    case dtRecvExpire:
+        ExpireIn();
+        ScheduleExpireIn();
+        break;
+
+    case dtHostPrune:
+        PruneHosts();
+        break;
+    }
 }
 
 void CDatagrams::Remove(DatagramOut *pDG)
 {
-    if( m_SendCache.isEmpty() )
+    if( !m_SendCache.Contains(pDG) )
         return;
 
-    m_SendCacheMap.remove(pDG->m_nSequence);
-    int nIndex = m_SendCache.indexOf(pDG);
-    if( nIndex == -1 )
-        return;
-    m_SendCache.remove(nIndex);
+    Unqueue(pDG);
+    pDG->m_oResend.Stop();
+    m_SendCache.Unlink(pDG);
+
+    // the sequence may have wrapped around to a newer datagram
+    if( m_SendCacheMap.value(pDG->m_nSequence, 0) == pDG )
+        m_SendCacheMap.remove(pDG->m_nSequence);
+
     m_FreeDGOut.push(pDG);
     if( pDG->m_pBuffer )
     {
@@ -412,77 +673,181 @@ void CDatagrams::Remove(DatagramOut *pDG)
     }
 }
 
-void CDatagrams::FlushSendCache()
+// Puts the datagram at the end of its host's queue, the host joins the ring if it was idle
+void CDatagrams::Enqueue(DatagramOut *pDG)
 {
-	QMutexLocker l(&Network.m_pSection);
+    if( pDG->m_pQueue )
+        return;
 
-    quint32 tNow = time(0);
+    quint64 nKey = DatagramQueue::MakeKey(pDG->m_oAddress);
+    DatagramQueue* pQueue = m_SendQueues.value(nKey, 0);
+
+    if( !pQueue )
+    {
+        pQueue = m_FreeQueues.isEmpty() ? new DatagramQueue() : m_FreeQueues.pop();
+        pQueue->m_nKey = nKey;
+        m_SendQueues.insert(nKey, pQueue);
+
+        if( m_pSendNext )
+        {
+            // last in the round
+            pQueue->m_pNext = m_pSendNext;
+            pQueue->m_pPrev = m_pSendNext->m_pPrev;
+            pQueue->m_pPrev->m_pNext = pQueue;
+            m_pSendNext->m_pPrev = pQueue;
+        }
+        else
+        {
+            pQueue->m_pPrev = pQueue->m_pNext = pQueue;
+            m_pSendNext = pQueue;
+        }
+    }
 
-    qint32 nMsecs = 1000;
-    if( !m_tStopWatch.isNull() )
-        nMsecs = qMin(nMsecs, m_tStopWatch.elapsed());
+    pQueue->m_lQueue.Append(pDG);
+    pDG->m_pQueue = pQueue;
+}
+
+void CDatagrams::Unqueue(DatagramOut *pDG)
+{
+    DatagramQueue* pQueue = pDG->m_pQueue;
+    if( !pQueue )
+        return;
+
+    pQueue->m_lQueue.Unlink(pDG);
+    pDG->m_pQueue = 0;
+
+    if( !pQueue->m_lQueue.IsEmpty() )
+        return;
+
+    if( pQueue->m_pNext == pQueue )
+    {
+        m_pSendNext = 0;
+    }
+    else
+    {
+        if( m_pSendNext == pQueue )
+            m_pSendNext = pQueue->m_pNext;
+        pQueue->m_pPrev->m_pNext = pQueue->m_pNext;
+        pQueue->m_pNext->m_pPrev = pQueue->m_pPrev;
+    }
+
+    pQueue->m_pPrev = pQueue->m_pNext = 0;
+    m_SendQueues.remove(pQueue->m_nKey);
+    m_FreeQueues.push(pQueue);
+}
+
+// Sends one fragment per host in turn, so a large datagram or a busy host does not hold up
+// the rest. Datagrams waiting for acks leave the ring once all their parts are out and come
+// back on their resend timer; expired ones are dropped as they come up.
+void CDatagrams::FlushSendCache()
+{
+	PROFILED_LOCKER(l, &Network.m_pSection);
 
-    quint32 nToWrite = (m_nUploadLimit * nMsecs) / 1000;
+    quint32 tNow = time(0);
+    quint32 nExpire = quazaaSettings.Gnutella2.UdpOutExpire;
 
-    quint32 nLastHost = 0;
+    // UDP is a class of its own under the network's upload budget
+    qint64 nToWrite = Network.m_pRateController ? Network.m_pRateController->GetAvailable(rcUDP) : 0;
 
-    while( nToWrite > 0 && !m_SendCache.isEmpty() )
+    while( nToWrite > 0 && m_pSendNext )
     {
-        bool bSent = false;
+        DatagramQueue* pQueue = m_pSendNext;
+        DatagramOut* pDG = pQueue->m_lQueue.First();
 
         char* pPacket;
         quint32 nPacket;
 
-        for( int i = m_SendCache.size() - 1; i >= 0; i--)
+        // TODO: sprawdzenie UDP na firewallu - mog? by? 3 stany udp
+        if( tNow - pDG->m_tSent > nExpire || !pDG->GetPacket(&pPacket, &nPacket) )
         {
-            DatagramOut* pDG = m_SendCache[i];
+            Remove(pDG);
+            continue;
+        }
 
-            if( pDG->m_oAddress.ip == nLastHost )
-                continue;
+        //qDebug() << "UDP sending to " << pDG->m_oAddress.toString().toAscii().constData() << "seq" << pDG->m_nSequence << "nPart" << ((GND_HEADER*)&pPacket)->nPart << "count" << pDG->m_nCount;
 
-			// TODO: sprawdzenie UDP na firewallu - mog? by? 3 stany udp
-            if( pDG->GetPacket(tNow, &pPacket, &nPacket, true) )
-            {
-				//qDebug() << "UDP sending to " << pDG->m_oAddress.toString().toAscii().constData() << "seq" << pDG->m_nSequence << "nPart" << ((GND_HEADER*)&pPacket)->nPart << "count" << pDG->m_nCount;
+        if( pDG->m_bAck && !pDG->m_tPass )
+        {
+            pDG->m_tPass = qMax(Network.m_pTimerWheel ? Network.m_pTimerWheel->Now() : 0, qint64(1));
+            pDG->m_nPasses++;
+            pDG->m_bAnswered = false;
+            GetHost(pDG->m_oAddress.ip)->m_tLastSent = pDG->m_tPass;
+        }
 
-                m_pSocket->writeDatagram(pPacket, nPacket, QHostAddress(pDG->m_oAddress.ip), pDG->m_oAddress.port);
+        WriteDatagram(pDG->m_oAddress, pPacket, nPacket);
 
-                nLastHost = pDG->m_oAddress.ip;
+        nToWrite -= nPacket;
+        Network.m_pRateController->Consumed(rcUDP, nPacket);
 
-                if( nToWrite >= nPacket )
-                    nToWrite -= nPacket;
-                else
-                    nToWrite = 0;
+        m_nBandwidthOut += nPacket;
+        Metrics.Bytes(mtUDP, mdOut, nPacket);
 
-                m_nBandwidthOut += nPacket;
+        if( !pDG->HasMore() )
+        {
+            if( pDG->m_bAck )
+            {
+                Unqueue(pDG);
+                if( Network.m_pTimerWheel )
+                    pDG->m_oResend.Start(Network.m_pTimerWheel, GetResendDelay(GetHost(pDG->m_oAddress.ip)));
+            }
+            else
+            {
+                Remove(pDG);
+            }
+        }
 
-                if( !pDG->m_bAck )
-                    Remove(pDG);
+        // the host may have left the ring above
+        if( m_pSendNext == pQueue )
+            m_pSendNext = pQueue->m_pNext;
+    }
 
-                bSent = true;
+    // fragments were copied into the batch, removing their datagrams above was fine
+    if( m_pBatch )
+        m_pBatch->Flush();
 
-                break;
-            }
-        }
+    // out of tokens with work left, come back as soon as a fragment can go
+    if( m_pSendNext && Network.m_pTimerWheel && Network.m_pRateController )
+    {
+        qint64 nWait = Network.m_pRateController->GetRefillTime(rcUDP, quazaaSettings.Gnutella2.UdpMTU + sizeof(GND_HEADER));
+        m_oSendPace.Start(Network.m_pTimerWheel, qMax(nWait, qint64(1)));
+    }
+}
+
+// Network thread, from DatagramOut::m_oResend: another pass over the unacknowledged parts
+void CDatagrams::OnResend(DatagramOut *pDG)
+{
+    PROFILED_LOCKER(l, &Network.m_pSection);
+
+    if( !m_bActive || !m_SendCache.Contains(pDG) )
+        return;
 
-        if( m_SendCache.isEmpty() || !bSent )
-            break;
+    if( quint32(time(0)) - pDG->m_tSent > quazaaSettings.Gnutella2.UdpOutExpire )
+    {
+        Remove(pDG);
+        return;
     }
 
-    for( int i = 0; i < m_SendCache.size(); )
+    DatagramHost* pHost = GetHost(pDG->m_oAddress.ip);
+
+    // a partly acked pass is slow, not lost
+    if( !pDG->m_bAnswered )
     {
-        DatagramOut* pDG = m_SendCache.at(i);
+        pHost->m_nLoss += ( 1000 - pHost->m_nLoss ) / 8;
+        pHost->m_nBackoff++;
 
-		if( tNow - pDG->m_tSent > quazaaSettings.Gnutella2.UdpOutExpire )
+        if( pHost->m_nBackoff >= UDP_HOST_SILENT )
         {
+            Metrics.Drop(mdrUdpUnanswered);
             Remove(pDG);
-        }
-        else
-        {
-            i++;
+            return;
         }
     }
-    
+
+    pDG->m_nNext = 0;
+    pDG->m_tPass = 0;
+    Enqueue(pDG);
+
+    emit SendQueueUpdated();
 }
 
 void CDatagrams::SendPacket(IPv4_ENDPOINT &oAddr, G2Packet *pPacket, bool bAck, DatagramWatcher *pWatcher, void *pParam)
@@ -490,10 +855,49 @@ void CDatagrams::SendPacket(IPv4_ENDPOINT &oAddr, G2Packet *pPacket, bool bAck,
     Q_UNUSED(pWatcher);
     Q_UNUSED(pParam);
 
+	Metrics.PacketOut(mtUDP, pPacket->m_nType);
+
+	if( PacketCapture.IsEnabled() )
+	{
+		QByteArray baFrame = pPacket->ToFrame();
+		PacketCapture.Capture(capOut | capUDP, oAddr, baFrame.constData(), baFrame.size());
+	}
+
+    DatagramOut* pDG = AllocateOut();
+    if( !pDG )
+        return;
+
+    pDG->Create(oAddr, pPacket, m_nSequence++, m_FreeBuffer.pop(), bAck);
+
+    // TODO: Powiadomienia do obiektow nasluchujacych, jesli podano
+
+    QueueOut(pDG);
+}
+
+// Sends an already encoded packet, the same frame can go to many hosts
+void CDatagrams::SendFrame(IPv4_ENDPOINT &oAddr, const QByteArray &baFrame, bool bAck)
+{
+	Metrics.PacketOut(mtUDP, G2PacketTypeFromFrame(baFrame.constData(), baFrame.size()));
+
+	if( PacketCapture.IsEnabled() )
+		PacketCapture.Capture(capOut | capUDP, oAddr, baFrame.constData(), baFrame.size());
+
+    DatagramOut* pDG = AllocateOut();
+    if( !pDG )
+        return;
+
+    pDG->Create(oAddr, baFrame, m_nSequence++, m_FreeBuffer.pop(), bAck);
+
+    QueueOut(pDG);
+}
+
+DatagramOut* CDatagrams::AllocateOut()
+{
     if( m_FreeDGOut.isEmpty() )
     {
-        Remove(m_SendCache.first());
+        Remove(m_SendCache.First());
         qDebug() << "UDP out frames exhausted";
+        Metrics.Drop(mdrUdpFrames);
     }
 
     if( m_FreeBuffer.isEmpty() )
@@ -503,50 +907,64 @@ void CDatagrams::SendPacket(IPv4_ENDPOINT &oAddr, G2Packet *pPacket, bool bAck,
         if( m_FreeBuffer.isEmpty() )
         {
             qDebug() << "UDP out discarded, out of buffers";
-            return;
+            Metrics.Drop(mdrUdpBuffers);
+            return 0;
         }
     }
 
-    DatagramOut* pDG = m_FreeDGOut.pop();
-    pDG->Create(oAddr, pPacket, m_nSequence++, m_FreeBuffer.pop(), bAck);
+    return m_FreeDGOut.pop();
+}
 
-    m_SendCache.push(pDG);
+void CDatagrams::QueueOut(DatagramOut *pDG)
+{
+    m_SendCache.Append(pDG);
     m_SendCacheMap[pDG->m_nSequence] = pDG;
+    Enqueue(pDG);
 
-    // TODO: Powiadomienia do obiektow nasluchujacych, jesli podano
-
-	//qDebug() << "UDP queued for " << oAddr.toString().toAscii().constData() << "seq" << pDG->m_nSequence << "parts" << pDG->m_nCount;
-
+	//qDebug() << "UDP queued for " << pDG->m_oAddress.toString().toAscii().constData() << "seq" << pDG->m_nSequence << "parts" << pDG->m_nCount;
 
     emit SendQueueUpdated();
-
 }
 
 
 void CDatagrams::OnPacket(IPv4_ENDPOINT addr, G2Packet *pPacket)
 {
+	CMetricHandlerTimer oTimer(mtUDP, pPacket->m_nType);
+
 	try
     {
-        if(pPacket->IsType("PI"))
-            OnPing(addr, pPacket);
-        else if(pPacket->IsType("PO"))
-            OnPong(addr, pPacket);
-        else if(pPacket->IsType("CRAWLR"))
-            OnCRAWLR(addr, pPacket);
-        else if(pPacket->IsType("QKA"))
-            OnQKA(addr, pPacket);
-		else if(pPacket->IsType("QA"))
-            OnQA(addr, pPacket);
-        else if(pPacket->IsType("QH2"))
-			OnQH2(addr, pPacket);
-        else
+		// UDP handlers all work on shared state: host cache, searches, nodes and our send queue
+		PROFILED_LOCKER(l, &Network.m_pSection);
+
+		switch( pPacket->m_nType )
 		{
+		case G2_PACKET_PING:
+			OnPing(addr, pPacket);
+			break;
+		case G2_PACKET_PONG:
+			OnPong(addr, pPacket);
+			break;
+		case G2_PACKET_CRAWL_REQ:
+			OnCRAWLR(addr, pPacket);
+			break;
+		case G2_PACKET_QUERY_KEY_ANS:
+			OnQKA(addr, pPacket);
+			break;
+		case G2_PACKET_QUERY_ACK:
+			OnQA(addr, pPacket);
+			break;
+		case G2_PACKET_HIT:
+			OnQH2(addr, pPacket);
+			break;
+		default:
 			//qDebug() << "UDP RECEIVED unknown packet " << pPacket->GetType();
+			break;
 		}
-    }
+	}
     catch(...)
     {
         qDebug() << "malformed packet";
+        Metrics.Drop(mdrMalformed);
 	}
 }
 
@@ -561,14 +979,14 @@ void CDatagrams::OnPong(IPv4_ENDPOINT &addr, G2Packet *pPacket)
 {
 	if( pPacket->m_bCompound )
     {
-		char szType[9];
+		G2_PACKET nType = 0;
 		quint32 nLength = 0, nNext = 0;
 
-		while( pPacket->ReadPacket(&szType[0], nLength) )
+		while( pPacket->ReadPacket(nType, nLength) )
 		{
 			nNext = pPacket->m_nPosition + nLength;
 
-			if( strcmp("RELAY", szType) == 0 )
+			if( nType == G2_PACKET_RELAY )
 			{
 				if( !Network.IsConnectedTo(addr) )
 				{
@@ -590,59 +1008,70 @@ void CDatagrams::OnCRAWLR(IPv4_ENDPOINT &addr, G2Packet *pPacket)
 	if( !pPacket->m_bCompound )
 		return;
 
-	char szType[9];
+	G2_PACKET nType = 0;
 	quint32 nLength = 0, nNext = 0;
 
-	while( pPacket->ReadPacket(&szType[0], nLength) )
+	while( pPacket->ReadPacket(nType, nLength) )
 	{
 		nNext = pPacket->m_nPosition + nLength;
 
-		if( strcmp("RLEAF", szType) == 0 )
+		switch( nType )
+		{
+		case G2_PACKET_CRAWL_RLEAF:
 			bRLeaf = true;
-		else if( strcmp("RNAME", szType) == 0 )
+			break;
+		case G2_PACKET_CRAWL_RNAME:
 			bRNick = true;
-		else if( strcmp("RGPS", szType) == 0 )
+			break;
+		case G2_PACKET_CRAWL_RGPS:
 			bRGPS = true;
-		else if( strcmp("REXT", szType) == 0 )
+			break;
+		case G2_PACKET_CRAWL_REXT:
 			bRExt = true;
+			break;
+		}
 
 		pPacket->m_nPosition = nNext;
 	}
 
 
 	G2Packet* pCA = G2Packet::New("CRAWLA", true);
-
-	G2Packet* pTmp = G2Packet::New("SELF", true);
-    if( Network.isHub() )
-		pTmp->WritePacket("HUB", 0);
-    else
-		pTmp->WritePacket("LEAF", 0);
-	pTmp->WritePacket("NA", 6)->WriteHostAddress(&Network.m_oAddress);
-	pTmp->WritePacket("CV", quazaaGlobals.UserAgentString().toUtf8().size())->WriteString(quazaaGlobals.UserAgentString(), false);
-	pTmp->WritePacket("V", 4)->WriteString(quazaaGlobals.VendorCode(), false);;
-	if( !quazaaSettings.Profile.GnutellaScreenName.isEmpty() )
-		pTmp->WritePacket("NAME", quazaaSettings.Profile.GnutellaScreenName.left(255).toUtf8().size())->WriteString(quazaaSettings.Profile.GnutellaScreenName.left(255));
-
-	pCA->WritePacket(pTmp);
-	pTmp->Release();
+	G2PacketWriter oCA(pCA);
+
+	oCA.Open("SELF");
+		if( Network.isHub() )
+			oCA.Open("HUB");
+		else
+			oCA.Open("LEAF");
+		oCA.Close();
+		oCA.Open("NA");
+			pCA->WriteHostAddress(&Network.m_oAddress);
+		oCA.Close();
+		oCA.Open("CV");
+			pCA->WriteString(quazaaGlobals.UserAgentString(), false);
+		oCA.Close();
+		oCA.Open("V");
+			pCA->WriteString(quazaaGlobals.VendorCode(), false);
+		oCA.Close();
+		if( !quazaaSettings.Profile.GnutellaScreenName.isEmpty() )
+		{
+			oCA.Open("NAME");
+				pCA->WriteString(quazaaSettings.Profile.GnutellaScreenName.left(255));
+			oCA.Close();
+		}
+	oCA.Close();
 
 	foreach( CG2Node* pNode, Network.m_lNodes )
 	{
 		if( pNode->m_nState == nsConnected )
 		{
-			if( pNode->m_nType == G2_HUB )
+			if( pNode->m_nType == G2_HUB || pNode->m_nType == G2_LEAF )
 			{
-				G2Packet* pNH = G2Packet::New("NH");
-				pNH->WritePacket("NA", 6)->WriteHostAddress(&pNode->m_oAddress);
-				pCA->WritePacket(pNH);
-				pNH->Release();
-			}
-			else if( pNode->m_nType == G2_LEAF )
-			{
-				G2Packet* pNL = G2Packet::New("NL");
-				pNL->WritePacket("NA", 6)->WriteHostAddress(&pNode->m_oAddress);
-				pCA->WritePacket(pNL);
-				pNL->Release();
+				oCA.Open(pNode->m_nType == G2_HUB ? "NH" : "NL");
+					oCA.Open("NA");
+						pCA->WriteHostAddress(&pNode->m_oAddress);
+					oCA.Close();
+				oCA.Close();
 			}
 		}
 	}
@@ -659,21 +1088,28 @@ void CDatagrams::OnQKA(IPv4_ENDPOINT &addr, G2Packet *pPacket)
     quint32 nKey = 0;
 	quint32 nKeyHost = 0;
 
-	char szType[9];
+	G2_PACKET nType = 0;
 	quint32 nLength = 0, nNext = 0;
 
-	while( pPacket->ReadPacket(&szType[0], nLength) )
+	while( pPacket->ReadPacket(nType, nLength) )
     {
 		nNext = pPacket->m_nPosition + nLength;
 
-		if( strcmp("QK", szType) == 0 && nLength >= 4 )
-        {
-			pPacket->ReadIntLE(&nKey);
-        }
-		else if( strcmp("SNA", szType) == 0 && nLength >= 4 )
-        {
-			pPacket->ReadIntBE(&nKeyHost);
-        }
+		switch( nType )
+		{
+		case G2_PACKET_QUERY_KEY:
+			if( nLength >= 4 )
+			{
+				pPacket->ReadIntLE(&nKey);
+			}
+			break;
+		case G2_PACKET_SEND_ADDRESS:
+			if( nLength >= 4 )
+			{
+				pPacket->ReadIntBE(&nKeyHost);
+			}
+			break;
+		}
 		pPacket->m_nPosition = nNext;
     }
 
@@ -690,17 +1126,10 @@ void CDatagrams::OnQKA(IPv4_ENDPOINT &addr, G2Packet *pPacket)
 		{
 			qDebug() << "Forwarding Query Key to " << pNode->m_oAddress.toString().toAscii().constData();
 
-			char* pOut = pPacket->WriteGetPointer(11, 0);
-			*pOut++ = 0x50;
-			*pOut++ = 6;
-			*pOut++ = 'Q';
-			*pOut++ = 'N';
-			*pOut++ = 'A';
-
-			char assm[6];
-			*(quint32*)&assm[0] = qToBigEndian(addr.ip);
-			*(quint16*)&assm[4] = qToLittleEndian(addr.port);
-			memcpy(pOut, &assm[0], 6);
+			// the packet came off the wire with headroom in front, so this doesn't move the payload
+			char* pOut = pPacket->PrependPacket("QNA", 6);
+			*(quint32*)&pOut[0] = qToBigEndian(addr.ip);
+			*(quint16*)&pOut[4] = qToLittleEndian(addr.port);
 
 			pPacket->AddRef();
 			pNode->SendPacket(pPacket, true, true);
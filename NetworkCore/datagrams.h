@@ -8,6 +8,9 @@
 #include <QStack>
 #include <QTimer>
 #include <QTime>
+#include "LockProfiler.h"
+#include "TimerWheel.h"
+#include "datagramfrags.h"
 
 class G2Packet;
 
@@ -19,36 +22,60 @@ public:
     virtual void OnFailure(void* pParam) = 0;
 };
 
+// What the acks to our datagrams tell about a host
+struct DatagramHost
+{
+    qint64      m_tLastSent;    // ms on the timer wheel, when the last pass started
+    qint64      m_tLastAck;     // 0 if it never acked
+    quint32     m_nSRTT;        // smoothed round trip, ms, 0 until the first sample
+    quint32     m_nRTTVar;
+    quint32     m_nLoss;        // unanswered passes, per mille, moving average
+    quint32     m_nBackoff;     // unanswered passes in a row
+    quint32     m_nAcks;
+};
+
 class DatagramOut;
 class DatagramIn;
+class CUdpBatch;
 class QByteArray;
 class QHostAddress;
 
 
-class CDatagrams : public QObject
+class CDatagrams : public QObject, public CTimerTarget
 {
     Q_OBJECT
 
 public:
-    QMutex      m_pSection;
-protected:
-    quint32 m_nUploadLimit;
+    enum DatagramsTimer { dtRecvExpire, dtSendPace, dtHostPrune };
 
+
+    CProfiledMutex  m_pSection;
+protected:
     QUdpSocket* m_pSocket;
+    CUdpBatch*  m_pBatch;       // replaces m_pSocket where batched I/O is available
 
     bool m_bFirewalled;
 
     QTimer*     m_tSender;
-    QTime       m_tStopWatch;
 
     QHash<quint16, DatagramOut*>     m_SendCacheMap;    // zeby szybko odszukac pakiety po sekwencji
-    QStack<DatagramOut*>             m_SendCache;       // kolejka LIFO
+    DatagramOutList                  m_SendCache;       // all datagrams out, oldest first
+    QHash<quint64, DatagramQueue*>   m_SendQueues;      // hosts with datagrams to send
+    DatagramQueue*                   m_pSendNext;       // ring of m_SendQueues, the host whose turn it is
+    QStack<DatagramQueue*>           m_FreeQueues;
     QStack<DatagramOut*>             m_FreeDGOut;
     quint16                          m_nSequence;
+    CWheelTimer                      m_oSendPace;       // waiting for UDP tokens with work left
+
+    QHash<quint32, DatagramHost>     m_Hosts;           // by ip, hosts we wanted acks from lately
+    CWheelTimer                      m_oHostPrune;
 
-    QHash<quint32,
-        QHash<quint32, DatagramIn*>
-        >                   m_RecvCache;
+    // datagrams being reassembled by (ip, port, sequence), and after completion for as long as
+    // they could still be resent to us, so a late fragment is not taken for a new datagram
+    QHash<quint64, DatagramIn*> m_RecvCache;
+    DatagramInList          m_RecvPending;      // incomplete, oldest first
+    DatagramInList          m_RecvDone;         // complete, buffers released, oldest first
+    CWheelTimer             m_oRecvExpire;
     QStack<DatagramIn*>     m_FreeDGIn;
 
     QStack<QByteArray*>     m_FreeBuffer;
@@ -75,12 +102,34 @@ public:
     void Disconnect();
 
     void SendPacket(IPv4_ENDPOINT& oAddr, G2Packet* pPacket, bool bAck = false, DatagramWatcher* pWatcher = 0, void* pParam = 0);
+    void SendFrame(IPv4_ENDPOINT& oAddr, const QByteArray& baFrame, bool bAck = false);
+protected:
+    DatagramOut* AllocateOut();
+    void QueueOut(DatagramOut* pDG);
+    void Enqueue(DatagramOut* pDG);
+    void Unqueue(DatagramOut* pDG);
+public:
 
     void RemoveOldIn(bool bForce = false);
     void Remove(DatagramIn* pDG, bool bReclaim = false);
     void Remove(DatagramOut* pDG);
-    void OnReceiveGND();
-    void OnAcknowledgeGND();
+protected:
+    void ProcessDatagram(const char* pData, quint32 nLength, IPv4_ENDPOINT& oFrom);
+    void WriteDatagram(IPv4_ENDPOINT& oTo, const char* pData, quint32 nLength);
+public:
+    void OnReceiveGND(const char* pData, quint32 nLength, IPv4_ENDPOINT& oFrom);
+    void OnAcknowledgeGND(const char* pData, IPv4_ENDPOINT& oFrom);
+    void OnTimerExpired(int nTimer);
+    void OnResend(DatagramOut* pDG);
+protected:
+    void ExpireIn();
+    void ScheduleExpireIn();
+    DatagramHost* GetHost(quint32 nIP);
+    void OnHostAck(DatagramOut* pDG);
+    qint64 GetResendDelay(const DatagramHost* pHost);
+    void PruneHosts();
+public:
+    bool IsBackingOff(quint32 nIP);
 
     void OnPacket(IPv4_ENDPOINT addr, G2Packet* pPacket);
     // pierdołki
@@ -120,7 +169,7 @@ public:
     }
     inline bool isListening()
     {
-        return (m_bActive && m_pSocket && m_pSocket->isValid());
+        return (m_bActive && ( m_pBatch || ( m_pSocket && m_pSocket->isValid() ) ));
     }
 
 public slots:
@@ -1,20 +1,238 @@
 #include "g2node.h"
 #include "network.h"
 #include "g2packet.h"
+#include "g2schema.h"
 #include "hostcache.h"
 #include "parser.h"
 #include "datagrams.h"
 #include "SearchManager.h"
 #include "QueryHit.h"
+#include "PacketCapture.h"
+#include "NetworkShard.h"
+#include "NeighbourStats.h"
+#include "Metrics.h"
 
 #include "quazaasettings.h"
 #include "quazaaglobals.h"
 
 //#define _DISABLE_COMPRESSION
 
+//////////////////////////////////////////////////////////////////////
+// Child packet schemas
+
+struct PingChildren
+{
+	IPv4_ENDPOINT	oUdp;
+	bool			bUdp;
+	bool			bRelay;
+	bool			bTestFirewall;
+};
+
+static void ReadPingUDP(PingChildren& o, G2PacketView* pPacket, quint32)
+{
+	pPacket->ReadHostAddress(&o.oUdp);
+	o.bUdp = ( o.oUdp.ip != 0 && o.oUdp.port != 0 );
+}
+static void ReadPingRelay(PingChildren& o, G2PacketView*, quint32)
+{
+	o.bRelay = true;
+}
+static void ReadPingTFW(PingChildren& o, G2PacketView*, quint32)
+{
+	o.bTestFirewall = true;
+}
+
+typedef G2ChildSchema<G2PacketView, PingChildren> PingSchema;
+static const PingSchema::Rule g_pPingRules[] =
+{
+	{ G2_PACKET_UDP,	6,	false,	ReadPingUDP },
+	{ G2_PACKET_RELAY,	0,	false,	ReadPingRelay },
+	{ G2_PACKET_TFW,	0,	false,	ReadPingTFW },
+	{ 0, 0, false, 0 }
+};
+static const PingSchema g_oPingSchema(g_pPingRules);
+
+struct LNIChildren
+{
+	IPv4_ENDPOINT	oAddress;
+	bool			bHasNA;
+	QUuid			oGUID;
+	bool			bHasGUID;
+	bool			bHasHS;
+	quint16			nLeafCount;
+	quint16			nLeafMax;
+	bool			bCachedKeys;
+	bool			bG2Core;
+};
+
+static void ReadLNIAddress(LNIChildren& o, G2PacketView* pPacket, quint32)
+{
+	pPacket->ReadHostAddress(&o.oAddress);
+	o.bHasNA = ( o.oAddress.ip != 0 && o.oAddress.port != 0 );
+}
+static void ReadLNIGUID(LNIChildren& o, G2PacketView* pPacket, quint32)
+{
+	o.oGUID = pPacket->ReadGUID();
+	o.bHasGUID = true;
+}
+static void ReadLNIHubStatus(LNIChildren& o, G2PacketView* pPacket, quint32)
+{
+	pPacket->ReadIntLE(&o.nLeafCount);
+	pPacket->ReadIntLE(&o.nLeafMax);
+	o.bHasHS = true;
+}
+static void ReadLNIQueryKey(LNIChildren& o, G2PacketView*, quint32)
+{
+	o.bCachedKeys = true;
+}
+static void ReadLNIG2Core(LNIChildren& o, G2PacketView*, quint32)
+{
+	o.bG2Core = true;
+}
+
+typedef G2ChildSchema<G2PacketView, LNIChildren> LNISchema;
+static const LNISchema::Rule g_pLNIRules[] =
+{
+	{ G2_PACKET_NODE_ADDRESS,	6,	false,	ReadLNIAddress },
+	{ G2_PACKET_NODE_GUID,		16,	false,	ReadLNIGUID },
+	{ G2_PACKET_HUB_STATUS,		4,	false,	ReadLNIHubStatus },
+	{ G2_PACKET_QUERY_KEY,		0,	false,	ReadLNIQueryKey },
+	{ G2_PACKET_G2CORE,			0,	false,	ReadLNIG2Core },
+	{ 0, 0, false, 0 }
+};
+static const LNISchema g_oLNISchema(g_pLNIRules);
+
+struct KHLChildren
+{
+	CG2Node*	pNode;
+	quint32		tNow;
+	qint64		nDiff;
+};
+
+static void ReadKHLNeighbour(KHLChildren& o, G2PacketView* pPacket, quint32 nLength)
+{
+	quint32 nEnd = pPacket->m_nPosition + nLength;
+
+	QUuid pGUID;
+	G2_PACKET nInner = 0;
+	quint32 nInnerLength = 0, nInnerNext = 0;
+
+	while( pPacket->m_nPosition < nEnd && pPacket->ReadPacket(nInner, nInnerLength) )
+	{
+		nInnerNext = pPacket->m_nPosition + nInnerLength;
+
+		if( nInner == G2_PACKET_NODE_GUID && nInnerLength >= 16 )
+		{
+			pGUID = pPacket->ReadGUID();
+		}
+
+		pPacket->m_nPosition = nInnerNext;
+	}
+
+	if( !pGUID.isNull() && nEnd - pPacket->m_nPosition >= 6 )
+	{
+		IPv4_ENDPOINT pAddr;
+		pPacket->ReadHostAddress(&pAddr);
+
+		Network.m_oRoutingTable.Add(pGUID, o.pNode, &pAddr, false);
+	}
+}
+static void ReadKHLCachedHub(KHLChildren& o, G2PacketView* pPacket, quint32)
+{
+	IPv4_ENDPOINT ip4;
+	quint32 nTs = 0;
+	pPacket->ReadHostAddress(&ip4);
+	pPacket->ReadIntLE(&nTs);
+
+	HostCache.Add(ip4, o.tNow + o.nDiff);
+}
+static void ReadKHLTimestamp(KHLChildren& o, G2PacketView* pPacket, quint32)
+{
+	quint32 nTimestamp = 0;
+	pPacket->ReadIntLE(&nTimestamp);
+	o.nDiff = o.tNow - nTimestamp;
+}
+
+typedef G2ChildSchema<G2PacketView, KHLChildren> KHLSchema;
+static const KHLSchema::Rule g_pKHLRules[] =
+{
+	{ G2_PACKET_NEIGHBOUR_HUB,	0,	true,	ReadKHLNeighbour },
+	{ G2_PACKET_CACHED_HUB,		10,	false,	ReadKHLCachedHub },
+	{ G2_PACKET_TIMESTAMP,		4,	false,	ReadKHLTimestamp },
+	{ 0, 0, false, 0 }
+};
+static const KHLSchema g_oKHLSchema(g_pKHLRules);
+
+struct QKRChildren
+{
+	IPv4_ENDPOINT	oAddress;
+	bool			bCacheOK;
+};
+
+static void ReadQKRAddress(QKRChildren& o, G2PacketView* pPacket, quint32)
+{
+	pPacket->ReadHostAddress(&o.oAddress);
+}
+static void ReadQKRRefresh(QKRChildren& o, G2PacketView*, quint32)
+{
+	o.bCacheOK = false;
+}
+
+typedef G2ChildSchema<G2PacketView, QKRChildren> QKRSchema;
+static const QKRSchema::Rule g_pQKRRules[] =
+{
+	{ G2_PACKET_QUERY_ADDRESS,	6,	false,	ReadQKRAddress },
+	{ G2_PACKET_REFRESH,		0,	false,	ReadQKRRefresh },
+	{ 0, 0, false, 0 }
+};
+static const QKRSchema g_oQKRSchema(g_pQKRRules);
+
+struct QKAChildren
+{
+	quint32			nKey;
+	IPv4_ENDPOINT	oAddress;
+};
+
+static void ReadQKAKey(QKAChildren& o, G2PacketView* pPacket, quint32)
+{
+	pPacket->ReadIntLE(&o.nKey);
+}
+static void ReadQKAAddress(QKAChildren& o, G2PacketView* pPacket, quint32 nLength)
+{
+	if( nLength >= 6 )
+	{
+		pPacket->ReadHostAddress(&o.oAddress);
+	}
+	else
+	{
+		pPacket->ReadIntBE(&o.oAddress.ip);
+		o.oAddress.port = 6346;
+	}
+}
+
+typedef G2ChildSchema<G2PacketView, QKAChildren> QKASchema;
+static const QKASchema::Rule g_pQKARules[] =
+{
+	{ G2_PACKET_QUERY_KEY,		4,	false,	ReadQKAKey },
+	{ G2_PACKET_QUERY_ADDRESS,	4,	false,	ReadQKAAddress },
+	{ 0, 0, false, 0 }
+};
+static const QKASchema g_oQKASchema(g_pQKARules);
+
+//////////////////////////////////////////////////////////////////////
+// CG2Node
+
+static QAtomicInt g_nNextNodeId(1);
+
+// Buffered frames wait this long for company before the stream is flushed
+#define G2_FLUSH_DELAY	1000
+// Grace period for a closing node to go away by itself
+#define G2_CLOSE_WAIT	20000
+
 CG2Node::CG2Node(QObject *parent) :
     CCompressedConnection(parent)
 {
+    m_nId = g_nNextNodeId.fetchAndAddRelaxed(1);
     m_nState = nsClosed;
     m_nType = G2_UNKNOWN;
     m_tLastPacketIn = m_tLastPacketOut = 0;
@@ -27,12 +245,23 @@ CG2Node::CG2Node(QObject *parent) :
     m_tLastQuery = 0;
     m_tKeyRequest= 0;
 	m_bCachedKeys = false;
+	m_pShard = 0;
+
+	for( int i = 0; i < ntCount; i++ )
+		m_pTimers[i].Init(this, i);
+
+	m_nQueueTotal = 0;
+	for( int i = 0; i < qcCount; i++ )
+	{
+		m_nQueueBytes[i] = 0;
+		m_nQueueDrops[i] = 0;
+	}
 }
 
 CG2Node::~CG2Node()
 {
-    while( m_lSendQueue.size() )
-        m_lSendQueue.dequeue()->Release();
+	for( int i = 0; i < qcCount; i++ )
+		m_lSendQueue[i].clear();
 
     Network.RemoveNode(this);
 }
@@ -46,39 +275,108 @@ void CG2Node::connectToHost(IPv4_ENDPOINT oAddress)
 
 void CG2Node::SendPacket(G2Packet* pPacket, bool bBuffered, bool bRelease)
 {
+	if( bBuffered || thread() != QThread::currentThread() )
+	{
+		SendFrame(pPacket->ToFrame(), bBuffered);
+	}
+	else
+	{
+		m_nPacketsOut++;
+		Metrics.PacketOut(mtTCP, pPacket->m_nType);
+
+		CBufferChain* pOutput = GetOutputBuffer();
+		quint32 nBefore = pOutput->size();
+		pPacket->ToBuffer(pOutput);
+
+		// pings, pongs, query keys and the like skip the wait for tokens
+		if( pOutput->size() - nBefore <= RATE_CONTROL_PACKET )
+			m_bControlPending = true;
+
+		if( PacketCapture.IsEnabled() )
+		{
+			QByteArray baFrame = pPacket->ToFrame();
+			PacketCapture.Capture(capOut | capTCP, m_oAddress, baFrame.constData(), baFrame.size());
+		}
+
+		FlushSendQueue(true);
+	}
+
+	if( bRelease )
+		pPacket->Release();
+}
+
+// Sends an already encoded packet. Frames sent to many nodes are encoded only once
+// and shared by all the send queues.
+void CG2Node::SendFrame(const QByteArray& baFrame, bool bBuffered)
+{
+	// another shard or the core - the frame travels to our thread as a message
+	if( thread() != QThread::currentThread() )
+	{
+		QMetaObject::invokeMethod(this, "OnPostedFrame", Qt::QueuedConnection, Q_ARG(QByteArray, baFrame), Q_ARG(bool, bBuffered));
+		return;
+	}
+
     m_nPacketsOut++;
+	Metrics.PacketOut(mtTCP, G2PacketTypeFromFrame(baFrame.constData(), baFrame.size()));
+
+	if( PacketCapture.IsEnabled() )
+		PacketCapture.Capture(capOut | capTCP, m_oAddress, baFrame.constData(), baFrame.size());
 
 	if( bBuffered )
 	{
-		pPacket->AddRef(); // FlushSendQueue will release
+		EnqueueFrame(baFrame);
 
-		if( m_lSendQueue.size() < 128 )
-			m_lSendQueue.enqueue(pPacket);
-		else
-			pPacket->Release();
+		if( !m_pTimers[ntFlush].IsActive() )
+			ArmTimer(ntFlush, G2_FLUSH_DELAY);
 	}
 	else
 	{
-		//m_lSendQueue.prepend(pPacket);
-		pPacket->ToBuffer(GetOutputBuffer());
-	}
+		GetOutputBuffer()->Append(baFrame);
 
-	if( bRelease )
-		pPacket->Release();
+		if( baFrame.size() <= RATE_CONTROL_PACKET )
+			m_bControlPending = true;
+	}
 
     FlushSendQueue(!bBuffered);
 }
+// From the node's own thread, the GUI reads the copy
+void CG2Node::GetStats(CNeighbourStats& oStats, quint32 tNow)
+{
+	oStats.nId = m_nId;
+	oStats.oAddress = m_oAddress;
+	oStats.nType = m_nType;
+	oStats.nState = m_nState;
+	oStats.tConnected = m_tConnected;
+	oStats.nPacketsIn = m_nPacketsIn;
+	oStats.nPacketsOut = m_nPacketsOut;
+	oStats.nBandwidthIn = AvgIn(tNow);
+	oStats.nBandwidthOut = AvgOut(tNow);
+	oStats.nBytesReceived = GetTotalIn();
+	oStats.nBytesSent = GetTotalOut();
+	oStats.nDecompressedIn = GetTotalInDecompressed();
+	oStats.nCompressedOut = GetTotalOutCompressed();
+	oStats.nCompressionMemory = GetCompressionMemory();
+	oStats.nLeafCount = m_nLeafCount;
+	oStats.nLeafMax = m_nLeafMax;
+	oStats.nRTT = m_tRTT;
+	oStats.sUserAgent = m_sUserAgent;
+}
+
+void CG2Node::OnPostedFrame(QByteArray baFrame, bool bBuffered)
+{
+	if( m_nState == nsConnected )
+		SendFrame(baFrame, bBuffered);
+}
+
 void CG2Node::FlushSendQueue(bool bFullFlush)
 {
-    QByteArray* pOutput = GetOutputBuffer();
+    CBufferChain* pOutput = GetOutputBuffer();
 
-	while( bytesToWrite() == 0 && m_lSendQueue.size() )
+	while( bytesToWrite() == 0 && m_nQueueTotal )
 	{
-		while( pOutput->size() < 4096 && m_lSendQueue.size() )
+		while( pOutput->size() < 4096 && m_nQueueTotal )
 		{
-			G2Packet* pPacket = m_lSendQueue.dequeue();
-			pPacket->ToBuffer(pOutput);
-			pPacket->Release();
+			pOutput->Append(DequeueFrame());
 		}
 		emit readyToTransfer();
 	}
@@ -94,6 +392,92 @@ void CG2Node::FlushSendQueue(bool bFullFlush)
         emit readyToTransfer();
 }
 
+//////////////////////////////////////////////////////////////////////
+// CG2Node send queues
+
+// Bytes each class may hold on its own, and all of them together. The classes add up to more
+// than the total, so a busy class can use space the others leave, at the expense of the least
+// important ones.
+static const quint32 g_nQueueLimit[qcCount] = { 16 * 1024, 128 * 1024, 64 * 1024, 64 * 1024 };
+#define G2_QUEUE_TOTAL	( 160 * 1024 )
+
+G2QueueClass CG2Node::GetQueueClass(G2_PACKET nType)
+{
+	switch( nType )
+	{
+	case G2_PACKET_PING:
+	case G2_PACKET_PONG:
+	case G2_PACKET_LNI:
+	case G2_PACKET_QUERY_KEY_REQ:
+	case G2_PACKET_QUERY_KEY_ANS:
+		return qcControl;
+	case G2_PACKET_QUERY_ACK:
+	case G2_PACKET_HIT:
+	case G2_PACKET_PUSH:
+		return qcRouted;
+	case G2_PACKET_QUERY:
+		return qcQuery;
+	default:
+		return qcBulk;
+	}
+}
+
+// Makes room by dropping the oldest frames, first of the frame's own class if it is over its
+// limit, then of less important classes if all queues together are. A frame that still does
+// not fit is dropped itself.
+void CG2Node::EnqueueFrame(const QByteArray& baFrame)
+{
+	int nClass = GetQueueClass(G2PacketTypeFromFrame(baFrame.constData(), baFrame.size()));
+	quint32 nSize = baFrame.size();
+
+	while( !m_lSendQueue[nClass].isEmpty() && m_nQueueBytes[nClass] + nSize > g_nQueueLimit[nClass] )
+		DropOldest(nClass);
+
+	for( int nVictim = qcCount - 1; nVictim > nClass && m_nQueueTotal + nSize > G2_QUEUE_TOTAL; )
+	{
+		if( m_lSendQueue[nVictim].isEmpty() )
+			nVictim--;
+		else
+			DropOldest(nVictim);
+	}
+
+	if( m_nQueueBytes[nClass] + nSize > g_nQueueLimit[nClass] || m_nQueueTotal + nSize > G2_QUEUE_TOTAL )
+	{
+		m_nQueueDrops[nClass]++;
+		Metrics.Drop(mdrQueueFull);
+		return;
+	}
+
+	m_lSendQueue[nClass].enqueue(baFrame);
+	m_nQueueBytes[nClass] += nSize;
+	m_nQueueTotal += nSize;
+}
+
+QByteArray CG2Node::DequeueFrame()
+{
+	for( int i = 0; i < qcCount; i++ )
+	{
+		if( !m_lSendQueue[i].isEmpty() )
+		{
+			QByteArray baFrame = m_lSendQueue[i].dequeue();
+			m_nQueueBytes[i] -= baFrame.size();
+			m_nQueueTotal -= baFrame.size();
+			return baFrame;
+		}
+	}
+
+	return QByteArray();
+}
+
+void CG2Node::DropOldest(int nClass)
+{
+	quint32 nSize = m_lSendQueue[nClass].dequeue().size();
+	m_nQueueBytes[nClass] -= nSize;
+	m_nQueueTotal -= nSize;
+	m_nQueueDrops[nClass]++;
+	Metrics.Drop(mdrQueueFull);
+}
+
 void CG2Node::SetupSlots()
 {
 	connect(this, SIGNAL(connected()), this, SLOT(OnConnect()), Qt::QueuedConnection);
@@ -105,7 +489,7 @@ void CG2Node::SetupSlots()
 
 void CG2Node::OnConnect()
 {
-	QMutexLocker l(&Network.m_pSection);
+	PROFILED_LOCKER(l, &Network.m_pSection);
 
     //qDebug("OnConnect()");
 
@@ -135,7 +519,7 @@ void CG2Node::OnConnect()
 }
 void CG2Node::OnDisconnect()
 {
-	QMutexLocker l(&Network.m_pSection);
+	PROFILED_LOCKER(l, &Network.m_pSection);
     //qDebug("OnDisconnect()");
 	systemLog.postLog(tr("Remote host closed connection: ") + m_oAddress.toString(), LogSeverity::Notice);
     deleteLater();
@@ -143,17 +527,13 @@ void CG2Node::OnDisconnect()
 
 void CG2Node::OnRead()
 {
-	if( !Network.m_pSection.tryLock(50) )
-	{
-		emit readyRead(); // it is a queued connection, lets requeue the missed signal
-		return;
-	}
-
     //qDebug() << "CG2Node::OnRead";
     if( m_nState == nsHandshaking )
     {
         if( peek(bytesAvailable()).indexOf("\r\n\r\n") != -1 )
         {
+			PROFILED_LOCKER(l, &Network.m_pSection);
+
             if( m_bInitiated )
             {
                 ParseOutgoingHandshake();
@@ -166,40 +546,65 @@ void CG2Node::OnRead()
     }
     else if ( m_nState == nsConnected )
     {
+		// Packets are parsed in place from the first input block, only a packet that spans
+		// blocks is pulled up into one. Appending never moves buffered data, so the view
+		// stays valid if a handler triggers a network read.
+		CBufferChain* pBuffer = GetInputBuffer();
 
-		G2Packet* pPacket = 0;
+		G2PacketView oPacket;
         try
         {
-			while( (pPacket = G2Packet::ReadBuffer(GetInputBuffer())) )
+			while( !pBuffer->isEmpty() )
             {
-				m_tLastPacketIn = time(0);
-				m_nPacketsIn++;
-
-				OnPacket(pPacket);
-
-				pPacket->Release();
+				const char* pData = pBuffer->Data();
+				quint32 nPacket = oPacket.ReadBuffer(pData, pBuffer->GetContiguous());
+
+				if( nPacket == 0 )
+				{
+					if( pBuffer->GetContiguous() == pBuffer->size() )
+						break;
+
+					char pHeader[12];
+					quint32 nFrame = G2PacketView::GetFrameLength(pHeader, pBuffer->Peek(pHeader, sizeof(pHeader)));
+					if( nFrame == 0 || nFrame > pBuffer->size() )
+						break;
+
+					pData = pBuffer->Pullup(nFrame);
+					nPacket = oPacket.ReadBuffer(pData, nFrame);
+					if( nPacket == 0 )
+						break;
+				}
+
+				if( oPacket.m_sType[0] )
+				{
+					if( PacketCapture.IsEnabled() )
+						PacketCapture.Capture(capIn | capTCP, m_oAddress, pData, nPacket);
+
+					m_tLastPacketIn = time(0);
+					m_nPacketsIn++;
+					Metrics.PacketIn(mtTCP, oPacket.m_nType);
+
+					// handlers lock Network.m_pSection themselves, only around the shared state
+					CMetricHandlerTimer oTimer(mtTCP, oPacket.m_nType);
+					OnPacket(&oPacket);
+				}
+
+				pBuffer->Consume(nPacket);
             }
         }
 		catch(...)
         {
-			if( pPacket )
-			{
-				qDebug() << pPacket->ToHex() << "\n" << pPacket->ToASCII();
-				pPacket->Release();
-			}
-
-            qDebug() << "Packet error - " << m_oAddress.toString().toAscii();
+			qDebug() << "Packet error in " << oPacket.GetType() << " - " << m_oAddress.toString().toAscii();
+			Metrics.Drop(mdrMalformed);
             m_nState = nsClosing;
             emit NodeStateChanged();
             deleteLater();
         }
     }
-
-	Network.m_pSection.unlock();
 }
 void CG2Node::OnError(QAbstractSocket::SocketError e)
 {
-	QMutexLocker l(&Network.m_pSection);
+	PROFILED_LOCKER(l, &Network.m_pSection);
 
     if( e != QAbstractSocket::RemoteHostClosedError )
     {
@@ -217,75 +622,112 @@ void CG2Node::OnStateChange(QAbstractSocket::SocketState s)
     //qDebug() << "OnStateChange(" << s << ")";
 }
 
-void CG2Node::OnTimer(quint32 tNow)
+void CG2Node::OnDisconnectRequest(bool bClose)
 {
+	if( bClose )
+		close();
+	else
+		disconnectFromHost();
+}
 
-    if( m_nState < nsConnected )
-    {
-		if( tNow - m_tConnected > quazaaSettings.Connection.TimeoutConnect )
-        {
-            if( m_bInitiated )
-                HostCache.OnFailure(m_oAddress);
-            m_nState = nsClosing;
-            disconnectFromHost();
-            return;
-        }
-    }
-    else if( m_nState == nsConnected )
-    {
-		if( tNow - m_tLastPacketIn > quazaaSettings.Connection.TimeoutTraffic )
-        {
-            qDebug() << "Closing connection with " << m_oAddress.toString().toAscii() << "minute dead";
-            m_nState = nsClosing;
-            emit NodeStateChanged();
-            deleteLater();
-            return;
-        }
+void CG2Node::ArmTimer(NodeTimer nTimer, qint64 nMsecs)
+{
+	if( m_pShard && m_pShard->m_pTimerWheel )
+		m_pTimers[nTimer].Start(m_pShard->m_pTimerWheel, nMsecs);
+}
 
-		if( m_nPingsWaiting == 0 && (tNow - m_tLastPacketIn >= 30 || tNow - m_tLastPingOut >= quazaaSettings.Gnutella2.PingRate) )
-        {
-            // Jesli dostalismy ostatni pakiet co najmniej 30 sekund temu
-            // lub wyslalismy ostatniego pinga co najmniej 2 minuty temu
-            // no i nie oczekujemy odpowiedzi na wczesniejszego pinga
-            // to wysylamy keep-alive ping, przy okazji merzac RTT
-			G2Packet* pPacket = G2Packet::New("PI", false);
-			SendPacket(pPacket, false, true); // niebuforowany, zeby dokladniej zmierzyc RTT
-            m_nPingsWaiting++;
-            m_tLastPingOut = tNow;
-            m_tRTTTimer.start();
-        }
+// The first ping goes out right away to measure RTT. Traffic is not re-armed on every packet:
+// the timer fires at the old deadline and moves itself to the one m_tLastPacketIn gives by then.
+void CG2Node::ArmConnectedTimers()
+{
+	m_pTimers[ntConnect].Stop();
+	ArmTimer(ntPing, 1000);
+	ArmTimer(ntTraffic, ( quazaaSettings.Connection.TimeoutTraffic + 1 ) * 1000);
 
-		if( m_nPingsWaiting > 0 && tNow - m_tLastPingOut > quazaaSettings.Gnutella2.PingTimeout && tNow - m_tLastPacketIn > quazaaSettings.Connection.TimeoutTraffic )
-        {
-            qDebug() << "Closing connection with " << m_oAddress.toString().toAscii() << "ping timed out";
-            m_nState = nsClosing;
-            emit NodeStateChanged();
-            deleteLater();
-            return;
-        }
+	if( m_bCompressedOutput )
+		ArmTimer(ntDeflate, quazaaSettings.Gnutella2.DeflateIdleRelease * 1000);
+}
 
-		/*if( m_tKeyRequest > 0 && tNow - m_tKeyRequest > 90 )
-        {
-            qDebug() << "Closing connection with " << m_oAddress.toString().toAscii() << "QueryKey wait timeout reached";
-            m_nState = nsClosing;
-            emit NodeStateChanged();
-            deleteLater();
-            return;
-		}*/
+void CG2Node::OnTimerExpired(int nTimer)
+{
+	quint32 tNow = time(0);
 
-        FlushSendQueue(true);
-    }
-    else if( m_nState == nsClosing )
-    {
-        if( m_nType == G2_UNKNOWN && tNow - m_tConnected > 20 )
-        {
-            deleteLater();
-        }
-        else if( tNow - m_tLastPacketIn > 20)
-        {
-            deleteLater();
-        }
-    }
+	switch( nTimer )
+	{
+	case ntConnect:
+		if( m_nState < nsConnected )
+		{
+			if( m_bInitiated )
+			{
+				PROFILED_LOCKER(l, &Network.m_pSection);
+				HostCache.OnFailure(m_oAddress);
+			}
+			m_nState = nsClosing;
+			disconnectFromHost();
+			ArmTimer(ntClose, G2_CLOSE_WAIT);
+		}
+		break;
+
+	case ntTraffic:
+		if( m_nState == nsConnected )
+		{
+			quint32 nIdle = tNow - m_tLastPacketIn;
+			if( nIdle > quazaaSettings.Connection.TimeoutTraffic )
+			{
+				qDebug() << "Closing connection with " << m_oAddress.toString().toAscii() << "minute dead";
+				m_nState = nsClosing;
+				emit NodeStateChanged();
+				deleteLater();
+			}
+			else
+			{
+				ArmTimer(ntTraffic, ( quazaaSettings.Connection.TimeoutTraffic - nIdle + 1 ) * 1000);
+			}
+		}
+		break;
+
+	case ntPing:
+		if( m_nState == nsConnected )
+		{
+			if( m_nPingsWaiting == 0 && (tNow - m_tLastPacketIn >= 30 || tNow - m_tLastPingOut >= quazaaSettings.Gnutella2.PingRate) )
+			{
+				// Jesli dostalismy ostatni pakiet co najmniej 30 sekund temu
+				// lub wyslalismy ostatniego pinga co najmniej 2 minuty temu
+				// no i nie oczekujemy odpowiedzi na wczesniejszego pinga
+				// to wysylamy keep-alive ping, przy okazji merzac RTT
+				G2Packet* pPacket = G2Packet::New("PI", false);
+				SendPacket(pPacket, false, true); // niebuforowany, zeby dokladniej zmierzyc RTT
+				m_nPingsWaiting++;
+				m_tLastPingOut = tNow;
+				m_tRTTTimer.start();
+			}
+
+			// a pong is still out: look again later, the traffic timer handles a dead link
+			qint64 nWait = 30;
+			if( m_nPingsWaiting == 0 )
+				nWait = qMin<qint64>(qint64(m_tLastPacketIn) + 30, qint64(m_tLastPingOut) + quazaaSettings.Gnutella2.PingRate) - tNow;
+			ArmTimer(ntPing, qMax<qint64>(nWait, 1) * 1000);
+		}
+		break;
+
+	case ntFlush:
+		FlushSendQueue(true);
+		if( m_nQueueTotal )
+			ArmTimer(ntFlush, G2_FLUSH_DELAY);
+		break;
+
+	case ntDeflate:
+		if( m_bCompressedOutput )
+		{
+			ReleaseIdleDeflate(tNow, quazaaSettings.Gnutella2.DeflateIdleRelease);
+			ArmTimer(ntDeflate, quazaaSettings.Gnutella2.DeflateIdleRelease * 1000);
+		}
+		break;
+
+	case ntClose:
+		deleteLater();
+		break;
+	}
 }
 
 void CG2Node::ParseIncomingHandshake()
@@ -392,7 +834,7 @@ void CG2Node::ParseIncomingHandshake()
 
         if( m_bAcceptDeflate )
         {
-            if( !EnableOutputCompression() )
+            if( !EnableLinkCompression() )
             {
                 qDebug() << "Deflate init error!";
                 abort();
@@ -407,6 +849,7 @@ void CG2Node::ParseIncomingHandshake()
 
         SendStartups();
         m_tLastPacketIn = m_tLastPacketOut = time(0);
+        ArmConnectedTimers();
 
 
     }
@@ -416,6 +859,7 @@ void CG2Node::ParseIncomingHandshake()
         m_nState = nsClosing;
         emit NodeStateChanged();
         close();
+        ArmTimer(ntClose, G2_CLOSE_WAIT);
     }
 }
 
@@ -526,7 +970,7 @@ void CG2Node::ParseOutgoingHandshake()
 #ifndef _DISABLE_COMPRESSION
     if( bAcceptDeflate )
     {
-        if( !EnableOutputCompression() )
+        if( !EnableLinkCompression() )
         {
             qDebug() << "Deflate init error!";
             abort();
@@ -541,6 +985,7 @@ void CG2Node::ParseOutgoingHandshake()
 
     SendStartups();
     m_tLastPacketIn = m_tLastPacketOut = time(0);
+    ArmConnectedTimers();
 
 }
 void CG2Node::Send_ConnectError(QString sReason)
@@ -562,6 +1007,17 @@ void CG2Node::Send_ConnectError(QString sReason)
 
 	close();
 }
+// Output compression sized for the link class, the stream itself is created on the first send
+bool CG2Node::EnableLinkCompression()
+{
+	if( m_nType == G2_HUB )
+		SetDeflateParameters(quazaaSettings.Gnutella2.DeflateHubWindowBits, quazaaSettings.Gnutella2.DeflateHubMemLevel);
+	else
+		SetDeflateParameters(quazaaSettings.Gnutella2.DeflateLeafWindowBits, quazaaSettings.Gnutella2.DeflateLeafMemLevel);
+
+	return EnableOutputCompression();
+}
+
 void CG2Node::Send_ConnectOK(bool bReply, bool bDeflated)
 {
     QByteArray sHs;
@@ -624,6 +1080,12 @@ void CG2Node::SendStartups()
 }
 
 void CG2Node::SendLNI()
+{
+	SendFrame(LNIFrame());
+}
+
+// Our LNI is the same for every neighbour
+QByteArray CG2Node::LNIFrame()
 {
 	G2Packet* pLNI = G2Packet::New("LNI", true);
 	pLNI->WritePacket("NA", 6)->WriteHostAddress(&Network.m_oAddress);
@@ -641,106 +1103,84 @@ void CG2Node::SendLNI()
 
 	pLNI->WritePacket("g2core", 0);
 
-	SendPacket(pLNI, false, true);
+	QByteArray baFrame = pLNI->ToFrame();
+	pLNI->Release();
+
+	return baFrame;
 }
 
 
-void CG2Node::OnPacket(G2Packet* pPacket)
+void CG2Node::OnPacket(G2PacketView* pPacket)
 {
-	//qDebug() << "Got packet " << pPacket->GetType() << pPacket->ToHex() << pPacket->ToASCII();
+	//qDebug() << "Got packet " << pPacket->GetType();
 
-	//try
-	//{
-        if( !Network.RoutePacket(pPacket) )
-        {
+	QUuid oTarget;
+	if( pPacket->GetTo(oTarget) && oTarget != quazaaSettings.Profile.GUID )
+	{
+		// addressed to someone else, it has to outlive the input buffer
+		G2Packet* pRouted = pPacket->ToPacket();
+		{
+			PROFILED_LOCKER(l, &Network.m_pSection);
+			Network.RoutePacket(pRouted);
+		}
+		pRouted->Release();
+		return;
+	}
 
-            if( pPacket->IsType("PI") )
-            {
-                OnPing(pPacket);
-            }
-            else if( pPacket->IsType("PO") )
-            {
-                OnPong(pPacket);
-            }
-            else if( pPacket->IsType("LNI") )
-            {
-                OnLNI(pPacket);
-            }
-            else if( pPacket->IsType("KHL") )
-            {
-                OnKHL(pPacket);
-            }
-            else if( pPacket->IsType("QHT") )
-            {
-                //OnQHT(pPacket);
-            }
-            else if( pPacket->IsType("Q2") )
-            {
-				OnQuery(pPacket);
-            }
-			else if( pPacket->IsType("QKR") )
-			{
-				OnQKR(pPacket);
-			}
-            else if( pPacket->IsType("QKA") )
-            {
-                OnQKA(pPacket);
-            }
-            else if( pPacket->IsType("QA") )
-            {
-                OnQA(pPacket);
-            }
-            else if( pPacket->IsType("QH2") )
-            {
-                OnQH2(pPacket);
-            }
-            else
-            {
-                qDebug() << "Unknown packet " << pPacket->GetType();
-            }
-        }
-	/*}
-    catch(...)
-    {
-        qDebug() << "Packet error in child packets";
-	}*/
+	switch( pPacket->m_nType )
+	{
+	case G2_PACKET_PING:
+		OnPing(pPacket);
+		break;
+	case G2_PACKET_PONG:
+		OnPong(pPacket);
+		break;
+	case G2_PACKET_LNI:
+		OnLNI(pPacket);
+		break;
+	case G2_PACKET_KHL:
+		OnKHL(pPacket);
+		break;
+	case G2_PACKET_QHT:
+		//OnQHT(pPacket);
+		break;
+	case G2_PACKET_QUERY:
+		OnQuery(pPacket);
+		break;
+	case G2_PACKET_QUERY_KEY_REQ:
+		OnQKR(pPacket);
+		break;
+	case G2_PACKET_QUERY_KEY_ANS:
+		OnQKA(pPacket);
+		break;
+	case G2_PACKET_QUERY_ACK:
+		{
+			G2Packet* pQA = pPacket->ToPacket();
+			OnQA(pQA);
+			pQA->Release();
+		}
+		break;
+	case G2_PACKET_HIT:
+		{
+			// hits may be routed back, so materialize them
+			G2Packet* pQH2 = pPacket->ToPacket();
+			OnQH2(pQH2);
+			pQH2->Release();
+		}
+		break;
+	default:
+		qDebug() << "Unknown packet " << pPacket->GetType();
+	}
 }
 
-void CG2Node::OnPing(G2Packet* pPacket)
+void CG2Node::OnPing(G2PacketView* pPacket)
 {
-	bool bUdp = false;
-    bool bRelay = false;
-    bool bTestFirewall = false;
-    IPv4_ENDPOINT addr;
-
-	if( pPacket->m_bCompound )
-    {
-		char szType[9];
-		quint32 nLength = 0, nNext = 0;
+	PingChildren oPing = { IPv4_ENDPOINT(), false, false, false };
+	g_oPingSchema.Read(pPacket, oPing);
 
-		while( pPacket->ReadPacket(&szType[0], nLength) )
-		{
-			nNext = pPacket->m_nPosition + nLength;
-
-			if( strcmp("UDP", szType) == 0 && nLength >= 6)
-			{
-				pPacket->ReadHostAddress(&addr);
-				if( addr.ip != 0 && addr.port != 0)
-					bUdp = true;
-			}
-			else if( strcmp("RELAY", szType) == 0 )
-			{
-				bRelay = true;
-			}
-			else if( strcmp("TFW", szType) == 0 )
-			{
-				bTestFirewall = true;
-			}
-
-			pPacket->m_nPosition = nNext;
-		}
-
-    }
+	bool bUdp = oPing.bUdp;
+	bool bRelay = oPing.bRelay;
+	IPv4_ENDPOINT addr = oPing.oUdp;
 
     if( !bUdp && !bRelay )
     {
@@ -750,18 +1190,21 @@ void CG2Node::OnPing(G2Packet* pPacket)
         return;
     }
 
+    PROFILED_LOCKER(l, &Network.m_pSection);
+
     if( bUdp && !bRelay )
     {
         // /PI/UDP
 
         if( Network.isHub() )
         {
-			char* pRelay = pPacket->WriteGetPointer(7, 0);
-			*pRelay++ = 0x60;
-			*pRelay++ = 0;
-			*pRelay++ = 'R'; *pRelay++ = 'E'; *pRelay++ = 'L';
-			*pRelay++ = 'A'; *pRelay++ = 'Y';
+			// relayed copy - the view can't be modified nor kept
+			G2Packet* pRelayed = pPacket->ToPacket();
+			pRelayed->PrependPacket("RELAY", 0);
 
+			// encoded once, every neighbour queues the same frame
+			QByteArray baFrame = pRelayed->ToFrame();
+			pRelayed->Release();
 
             QList<CG2Node*> lToRelay;
 
@@ -774,9 +1217,8 @@ void CG2Node::OnPing(G2Packet* pPacket)
 			for( int nCount = 0; nCount < quazaaSettings.Gnutella2.PingRelayLimit && lToRelay.size(); nCount++ )
             {
                 int nIndex = qrand() % lToRelay.size();
-                pPacket->AddRef();
                 CG2Node* pNode = lToRelay.at(nIndex);
-				pNode->SendPacket(pPacket, true, true);
+				pNode->SendFrame(baFrame, true);
                 lToRelay.removeAt(nIndex);
             }
 
@@ -792,8 +1234,11 @@ void CG2Node::OnPing(G2Packet* pPacket)
         pPong->Release();
 	}
 }
-void CG2Node::OnPong(G2Packet* pPacket)
+void CG2Node::OnPong(G2PacketView* pPacket)
 {
+   // searches read the RTT from the core
+   PROFILED_LOCKER(l, &Network.m_pSection);
+
    if( m_nPingsWaiting > 0 )
    {
        m_nPingsWaiting--;
@@ -805,141 +1250,59 @@ void CG2Node::OnPong(G2Packet* pPacket)
    }
 }
 
-void CG2Node::OnLNI(G2Packet* pPacket)
+void CG2Node::OnLNI(G2PacketView* pPacket)
 {
-	if( !pPacket->m_bCompound )
-        return;
+	LNIChildren oLNI;
+	oLNI.bHasNA = oLNI.bHasGUID = oLNI.bHasHS = false;
+	oLNI.nLeafCount = oLNI.nLeafMax = 0;
+	oLNI.bCachedKeys = oLNI.bG2Core = false;
 
-    bool hasNA = false;
-    QUuid pGUID;
-    bool hasGUID = false;
-
-    IPv4_ENDPOINT hostAddr;
+	if( !g_oLNISchema.Read(pPacket, oLNI) )
+		return;
 
-	char szType[9];
-	quint32 nLength = 0, nNext = 0;
+	// the address and keys are read by searches, the GUID goes into the route table
+	PROFILED_LOCKER(l, &Network.m_pSection);
 
-	while( pPacket->ReadPacket(&szType[0], nLength) )
+	if( oLNI.bHasNA )
 	{
-		nNext = pPacket->m_nPosition + nLength;
-
-		if( strcmp("NA", szType) == 0 && nLength >= 6 )
-		{
-			pPacket->ReadHostAddress(&hostAddr);
-			if( hostAddr.ip != 0 && hostAddr.port != 0 )
-			{
-				hasNA = true;
-				if( !m_bInitiated )
-					m_oAddress.ip = hostAddr.ip;
-				m_oAddress.port = hostAddr.port;
-			}
-
-		}
-		else if( strcmp("GU", szType) == 0 && nLength >= 16 )
-		{
-			hasGUID = true;
-			pGUID = pPacket->ReadGUID();
-		}
-		else if( strcmp("HS", szType) == 0 && nLength >= 4 )
-		{
-			if( m_nType == G2_HUB )
-			{
-				pPacket->ReadIntLE(&m_nLeafCount);
-				pPacket->ReadIntLE(&m_nLeafMax);
-			}
-		}
-		else if( strcmp("QK", szType) == 0 )
-		{
-			m_bCachedKeys = true;
-		}
-		else if( strcmp("g2core", szType) == 0 )
-		{
-			m_bG2Core = true;
-		}
+		if( !m_bInitiated )
+			m_oAddress.ip = oLNI.oAddress.ip;
+		m_oAddress.port = oLNI.oAddress.port;
+	}
 
-		pPacket->m_nPosition = nNext;
+	if( oLNI.bHasHS && m_nType == G2_HUB )
+	{
+		m_nLeafCount = oLNI.nLeafCount;
+		m_nLeafMax = oLNI.nLeafMax;
 	}
 
-    if( hasNA && hasGUID )
-    {
-        Network.m_oRoutingTable.Add(pGUID, this, true);
+	if( oLNI.bCachedKeys )
+		m_bCachedKeys = true;
+	if( oLNI.bG2Core )
+		m_bG2Core = true;
+
+	if( oLNI.bHasNA && oLNI.bHasGUID )
+	{
+		Network.m_oRoutingTable.Add(oLNI.oGUID, this, true);
 	}
 
 }
-void CG2Node::OnKHL(G2Packet* pPacket)
+void CG2Node::OnKHL(G2PacketView* pPacket)
 {
-	if( !pPacket->m_bCompound )
-        return;
-
-    quint32 tNow = time(0);
-    quint32 nTimestamp = tNow;
-    qint64 nDiff = 0;
-
-	char szType[9], szInner[9];
-	quint32 nLength = 0, nInnerLength = 0;
-	bool bCompound = false;
-	quint32 nNext = 0, nInnerNext = 0;
-
-	while( pPacket->ReadPacket(&szType[0], nLength, &bCompound) )
-    {
-		nNext = pPacket->m_nPosition + nLength;
-
-		if( strcmp("NH", szType) == 0 && bCompound )
-        {
-            QUuid pGUID;
-
-			while( pPacket->m_nPosition < nNext && pPacket->ReadPacket(&szInner[0], nInnerLength) )
-            {
-				nInnerNext = pPacket->m_nPosition + nInnerLength;
-
-				if( strcmp("GU", szInner) && nInnerLength >= 16 )
-                {
-					pGUID = pPacket->ReadGUID();
-                }
-
-				pPacket->m_nPosition = nInnerNext;
-            }
-
-			if( !pGUID.isNull() && nLength >= 6 )
-            {
-                IPv4_ENDPOINT pAddr;
-				pPacket->ReadHostAddress(&pAddr);
-
-                Network.m_oRoutingTable.Add(pGUID, this, &pAddr, false);
-            }
-        }
-		else if( strcmp("CH", szType) == 0 )
-        {
-			if( bCompound )
-				pPacket->SkipCompound(nLength);
-
-			if( nLength >= 10 )
-			{
-				IPv4_ENDPOINT ip4;
-				quint32 nTs = 0;
-				pPacket->ReadHostAddress(&ip4);
-				pPacket->ReadIntLE(&nTs);
-
-				HostCache.Add(ip4, tNow + nDiff);
-			}
-        }
-		else if( strcmp("TS", szType) == 0 )
-        {
-			if( bCompound )
-				pPacket->SkipCompound(nLength);
-
-			if( nLength >= 4 )
-			{
-				pPacket->ReadIntLE(&nTimestamp);
-				nDiff = tNow - nTimestamp;
-			}
-        }
-		pPacket->m_nPosition = nNext;
-	}
+	KHLChildren oKHL;
+	oKHL.pNode = this;
+	oKHL.tNow = time(0);
+	oKHL.nDiff = 0;
+
+	// the schema's handlers fill the host cache as they go
+	PROFILED_LOCKER(l, &Network.m_pSection);
+	g_oKHLSchema.Read(pPacket, oKHL);
 }
 
-void CG2Node::OnQHT(G2Packet* pPacket)
+void CG2Node::OnQHT(G2PacketView* pPacket)
 {
+    PROFILED_LOCKER(l, &Network.m_pSection);
+
     if( !Network.isHub() )
     {
         qDebug() << "Received unexpected Query Routing Table, ignoring";
@@ -947,35 +1310,23 @@ void CG2Node::OnQHT(G2Packet* pPacket)
     }
 }
 
-void CG2Node::OnQKR(G2Packet *pPacket)
+void CG2Node::OnQKR(G2PacketView* pPacket)
 {
 	if( !pPacket->m_bCompound || m_nType != G2_LEAF )
 		return;
 
-	char szType[9];
-	quint32 nLength = 0, nNext = 0;
-	bool bCacheOK = true;
-	IPv4_ENDPOINT addr;
+	QKRChildren oQKR;
+	oQKR.bCacheOK = true;
+	g_oQKRSchema.Read(pPacket, oQKR);
 
-	while( pPacket->ReadPacket(&szType[0], nLength) )
-	{
-		nNext = pPacket->m_nPosition + nLength;
-
-		if( strcmp("QNA", szType) == 0 && nLength >= 6 )
-		{
-			pPacket->ReadHostAddress(&addr);
-		}
-		else if( strcmp("REF", szType) == 0 )
-		{
-			bCacheOK = false;
-		}
-
-		pPacket->m_nPosition = nNext;
-	}
+	bool bCacheOK = oQKR.bCacheOK;
+	IPv4_ENDPOINT addr = oQKR.oAddress;
 
 	if( addr.ip == 0 || addr.port == 0 ) // TODO: sprawdzene czy adres jest za fw
 		return;
 
+	PROFILED_LOCKER(l, &Network.m_pSection);
+
 	CHostCacheHost* pHost = bCacheOK ? HostCache.Find(addr) : 0;
 
 	if( pHost != 0 && pHost->m_nQueryKey != 0 && pHost->m_nKeyHost == Network.m_oAddress.ip && time(0) - pHost->m_nKeyTime < quazaaSettings.Gnutella2.QueryKeyTime )
@@ -984,7 +1335,7 @@ void CG2Node::OnQKR(G2Packet *pPacket)
 		pQKA->WritePacket("QNA", 6)->WriteHostAddress(&addr);
 		pQKA->WritePacket("QK", 4)->WriteIntBE(pHost->m_nQueryKey);
 		pQKA->WritePacket("CACHED", 0);
-		SendPacket(pQKA, true, true);
+		SendPacket(pQKA, false, true);
 	}
 	else
 	{
@@ -995,42 +1346,20 @@ void CG2Node::OnQKR(G2Packet *pPacket)
 	}
 }
 
-void CG2Node::OnQKA(G2Packet *pPacket)
+void CG2Node::OnQKA(G2PacketView* pPacket)
 {
-	if( !pPacket->m_bCompound )
-        return;
+	QKAChildren oQKA;
+	oQKA.nKey = 0;
 
-    m_tKeyRequest = 0;
-
-    quint32 nKey;
-    IPv4_ENDPOINT addr;
-
-	char szType[9];
-	quint32 nLength = 0, nNext = 0;
+	if( !g_oQKASchema.Read(pPacket, oQKA) )
+		return;
 
-	while( pPacket->ReadPacket(&szType[0], nLength) )
-	{
-		nNext = pPacket->m_nPosition + nLength;
+	PROFILED_LOCKER(l, &Network.m_pSection);
 
-		if( strcmp("QK", szType) == 0 && nLength >= 4 )
-        {
-			pPacket->ReadIntLE(&nKey);
-        }
-		else if( strcmp("QNA", szType) == 0 )
-        {
-			if( nLength >= 6 )
-            {
-				pPacket->ReadHostAddress(&addr);
-            }
-			else if( nLength >= 4 )
-            {
-				pPacket->ReadIntBE(&addr.ip);
-                addr.port = 6346;
-            }
-        }
+    m_tKeyRequest = 0;
 
-		pPacket->m_nPosition = nNext;
-    }
+	quint32 nKey = oQKA.nKey;
+	IPv4_ENDPOINT addr = oQKA.oAddress;
 
     CHostCacheHost* pCache = HostCache.Add(addr, 0);
     if( pCache )
@@ -1043,6 +1372,7 @@ void CG2Node::OnQKA(G2Packet *pPacket)
 void CG2Node::OnQA(G2Packet *pPacket)
 {
    QUuid oGUID;
+   PROFILED_LOCKER(l, &Network.m_pSection);
    SearchManager.OnQueryAcknowledge(pPacket, m_oAddress, oGUID);
 
    // TCP /QA - no need for routing, it's either for us or to be dropped
@@ -1053,9 +1383,10 @@ void CG2Node::OnQH2(G2Packet *pPacket)
 	if( !pPacket->m_bCompound )
 		return;
 
+	PROFILED_LOCKER(l, &Network.m_pSection);
 	SearchManager.OnQueryHit(pPacket, this);
 }
-void CG2Node::OnQuery(G2Packet *pPacket)
+void CG2Node::OnQuery(G2PacketView* pPacket)
 {
 	// just read guid for now to have it in routing table
 
@@ -1066,6 +1397,8 @@ void CG2Node::OnQuery(G2Packet *pPacket)
 	if( pPacket->GetRemaining() >= 16 )
 	{
 		oGUID = pPacket->ReadGUID();
+
+		PROFILED_LOCKER(l, &Network.m_pSection);
 		Network.m_oRoutingTable.Add(oGUID, this, false);
 
 		if( m_nType == G2_LEAF ) // temporary
@@ -2,18 +2,34 @@
 #define G2NODE_H
 
 #include "CompressedConnection.h"
+#include "g2packettypes.h"
+#include "TimerWheel.h"
 #include <QTime>
 #include <QQueue>
 
 class G2Packet;
+class G2PacketView;
+class CNetworkShard;
+struct CNeighbourStats;
 
 enum G2NodeState { nsClosed, nsConnecting, nsHandshaking, nsConnected, nsClosing, nsError };
 
-class CG2Node : public CCompressedConnection
+// Classes of buffered outbound frames, drained in this order
+enum G2QueueClass
+{
+    qcControl,  // pings, LNI, query keys
+    qcRouted,   // query acks, hits and pushes routed back through us
+    qcQuery,    // forwarded queries
+    qcBulk,     // KHL, QHT and anything else
+    qcCount
+};
+
+class CG2Node : public CCompressedConnection, public CTimerTarget
 {
     Q_OBJECT
 
 public:
+    quint32         m_nId;  // unique for the session, unlike the pointer
     quint32         m_tLastPacketIn;
     quint32         m_tLastPacketOut;
     quint32         m_nPacketsIn;
@@ -36,7 +52,16 @@ public:
 
     quint32         m_tKeyRequest;
 
-    QQueue<G2Packet*>   m_lSendQueue;
+    CNetworkShard*  m_pShard;   // owner, the node is only touched from its thread
+
+    // Deadlines on the shard's timer wheel, each checked only when it is due
+    enum NodeTimer { ntConnect, ntPing, ntTraffic, ntFlush, ntDeflate, ntClose, ntCount };
+    CWheelTimer     m_pTimers[ntCount];
+
+    QQueue<QByteArray>  m_lSendQueue[qcCount];	// encoded frames, possibly shared with other nodes
+    quint32             m_nQueueBytes[qcCount];
+    quint32             m_nQueueTotal;
+    quint32             m_nQueueDrops[qcCount];	// frames dropped for lack of queue space
 
 public:
     CG2Node(QObject *parent = 0);
@@ -51,20 +76,46 @@ public:
     }
 
 	void SendPacket(G2Packet* pPacket, bool bBuffered = false, bool bRelease = false);
+	void SendFrame(const QByteArray& baFrame, bool bBuffered = false);
     void FlushSendQueue(bool bFullFlush = false);
 
+    void GetStats(CNeighbourStats& oStats, quint32 tNow);
+
+    inline quint32 GetQueueDrops(G2QueueClass nClass) const
+    {
+        return m_nQueueDrops[nClass];
+    }
+
+    inline RateClass GetRateClass() const
+    {
+        if( m_nType == G2_HUB )
+            return rcHub;
+        if( m_nType == G2_LEAF )
+            return rcLeaf;
+        return rcPeer;
+    }
+
 protected:
     void SetupSlots();
 
+    static G2QueueClass GetQueueClass(G2_PACKET nType);
+    void EnqueueFrame(const QByteArray& baFrame);
+    QByteArray DequeueFrame();
+    void DropOldest(int nClass);
+
     void ParseOutgoingHandshake();
     void ParseIncomingHandshake();
 
     void Send_ConnectError(QString sReason);
     void Send_ConnectOK(bool bReply, bool bDeflated = false);
     void SendStartups();
+    bool EnableLinkCompression();
+
+    void ArmTimer(NodeTimer nTimer, qint64 nMsecs);
+    void ArmConnectedTimers();
 
 public:
-    void OnTimer(quint32 tNow);
+    void OnTimerExpired(int nTimer);
 signals:
     void NodeStateChanged();
 public slots:
@@ -73,24 +124,30 @@ public slots:
     void OnRead();
     void OnError(QAbstractSocket::SocketError e);
     void OnStateChange(QAbstractSocket::SocketState s);
+    // For callers outside the node's shard, always through a queued call
+    void OnDisconnectRequest(bool bClose);
+protected slots:
+    void OnPostedFrame(QByteArray baFrame, bool bBuffered);
 
 public:
     void SendLNI();
+	static QByteArray LNIFrame();
 protected:
-    void OnPacket(G2Packet* pPacket);
-    void OnPing(G2Packet* pPacket);
-    void OnPong(G2Packet* pPacket);
-    void OnLNI(G2Packet* pPacket);
-    void OnKHL(G2Packet* pPacket);
-    void OnQHT(G2Packet* pPacket);
-	void OnQKR(G2Packet* pPacket);
-    void OnQKA(G2Packet* pPacket);
+    void OnPacket(G2PacketView* pPacket);
+    void OnPing(G2PacketView* pPacket);
+    void OnPong(G2PacketView* pPacket);
+    void OnLNI(G2PacketView* pPacket);
+    void OnKHL(G2PacketView* pPacket);
+    void OnQHT(G2PacketView* pPacket);
+	void OnQKR(G2PacketView* pPacket);
+    void OnQKA(G2PacketView* pPacket);
     void OnQA(G2Packet* pPacket);
     void OnQH2(G2Packet* pPacket);
-	void OnQuery(G2Packet* pPacket);
+	void OnQuery(G2PacketView* pPacket);
 
 
     friend class CNetwork;
+    friend class CNetworkShard;
 };
 
 #endif // G2NODE_H
@@ -1,4 +1,5 @@
 #include "g2packet.h"
+#include "BufferChain.h"
 
 G2PacketPool G2Packets;
 
@@ -7,9 +8,18 @@ G2Packet::G2Packet()
 	m_pNext			= 0;
 	m_nReference	= 0;
 
+	SetStorage(&m_pInline[0], G2_PACKET_INLINE);
+	m_nLength		= 0;
 	m_nPosition		= 0;
 
+	m_pIndex		= 0;
+	m_nIndex		= 0;
+	m_nIndexSize	= 0;
+	m_nIndexed		= 0xFFFFFFFF;
+	m_nPayload		= 0;
+
 	memset(&m_sType[0], 0, sizeof(m_sType));
+	m_nType = 0;
 	m_bCompound = false;
 }
 
@@ -20,6 +30,21 @@ G2Packet::~G2Packet()
 		qDebug() << "not released " << (char*)&m_sType[0];
 	}
 	Q_ASSERT( m_nReference == 0 );
+
+	if( GetStorage() != &m_pInline[0] )
+		G2Packets.FreeBuffer(GetStorage(), m_nHeadroom + m_nBuffer);
+
+	free(m_pIndex);
+}
+
+// Points the payload at a new storage block, G2_PACKET_HEADROOM bytes in
+void G2Packet::SetStorage(char* pStorage, quint32 nStorage)
+{
+	Q_ASSERT( nStorage > G2_PACKET_HEADROOM );
+
+	m_pBuffer	= pStorage + G2_PACKET_HEADROOM;
+	m_nBuffer	= nStorage - G2_PACKET_HEADROOM;
+	m_nHeadroom	= G2_PACKET_HEADROOM;
 }
 
 void G2Packet::Reset()
@@ -27,44 +52,99 @@ void G2Packet::Reset()
 	Q_ASSERT( m_nReference == 0 );
 
 	m_pNext			= 0;
-	m_oBuffer.clear();
+	m_nLength		= 0;
 	m_nPosition		= 0;
 
+	// small slabs are kept, so a recycled packet doesn't go to the allocator again
+	char* pStorage = GetStorage();
+	quint32 nStorage = m_nHeadroom + m_nBuffer;
+
+	if( nStorage > G2_PACKET_KEEP )
+	{
+		G2Packets.FreeBuffer(pStorage, nStorage);
+		pStorage = &m_pInline[0];
+		nStorage = G2_PACKET_INLINE;
+	}
+
+	SetStorage(pStorage, nStorage);
+
+	m_nIndex	= 0;
+	m_nIndexed	= 0xFFFFFFFF;
+	m_nPayload	= 0;
+
+	if( m_nIndexSize > G2_INDEX_KEEP )
+	{
+		free(m_pIndex);
+		m_pIndex = 0;
+		m_nIndexSize = 0;
+	}
+
 	memset(&m_sType[0], 0, sizeof(m_sType));
+	m_nType = 0;
 	m_bCompound = false;
 }
 
+// Grows the payload buffer so nLength more bytes fit
+void G2Packet::Ensure(quint32 nLength)
+{
+	if ( m_nLength + nLength <= m_nBuffer ) return;
+
+	quint32 nStorage = 0;
+	char* pStorage = G2Packets.AllocBuffer( G2_PACKET_HEADROOM + qMax( m_nLength + nLength, m_nBuffer * 2 ), nStorage );
+
+	memcpy( pStorage + G2_PACKET_HEADROOM, m_pBuffer, m_nLength );
+
+	if ( GetStorage() != &m_pInline[0] )
+		G2Packets.FreeBuffer( GetStorage(), m_nHeadroom + m_nBuffer );
+
+	SetStorage( pStorage, nStorage );
+}
+
 void G2Packet::Seek(quint32 nPosition, int nRelative)
 {
 	if ( nRelative == seekStart )
 	{
-		m_nPosition = qMax( 0u, qMin<quint32>( m_oBuffer.size(), nPosition ) );
+		m_nPosition = qMax( 0u, qMin<quint32>( m_nLength, nPosition ) );
 	}
 	else
 	{
-		m_nPosition = qMax( 0u, qMin<quint32>( m_oBuffer.size(), m_oBuffer.size() - nPosition ) );
+		m_nPosition = qMax( 0u, qMin<quint32>( m_nLength, m_nLength - nPosition ) );
 	}
 }
 
 
 char* G2Packet::WriteGetPointer(quint32 nLength, quint32 nOffset)
 {
-	if ( nOffset == 0xFFFFFFFF ) nOffset = m_oBuffer.size();
+	if ( nOffset == 0xFFFFFFFF ) nOffset = m_nLength;
 
-	if ( (quint32)m_oBuffer.size() + nLength > (quint32)m_oBuffer.capacity() )
-	{
-		m_oBuffer.reserve(qMax(m_oBuffer.capacity() + nLength, m_oBuffer.capacity() + 128u));
-	}
+	if ( nOffset == 0 && nLength <= m_nHeadroom )
+		return Prepend( nLength );
 
-	quint32 nOldSize = m_oBuffer.size();
-	m_oBuffer.resize(m_oBuffer.size() + nLength);
+	Ensure( nLength );
 
-	if ( nOffset != nOldSize )
+	if ( nOffset != m_nLength )
 	{
-		memmove(m_oBuffer.data() + nOffset + nLength, m_oBuffer.data() + nOffset, nOldSize - nOffset);
+		memmove( m_pBuffer + nOffset + nLength, m_pBuffer + nOffset, m_nLength - nOffset );
 	}
 
-	return m_oBuffer.data() + nOffset;
+	m_nLength += nLength;
+
+	return m_pBuffer + nOffset;
+}
+
+// Makes room for nLength bytes in front of the payload.
+// Takes the headroom when it is big enough, otherwise the payload is moved.
+char* G2Packet::Prepend(quint32 nLength)
+{
+	if ( nLength > m_nHeadroom )
+		return WriteGetPointer( nLength, 0 );
+
+	m_pBuffer	-= nLength;
+	m_nBuffer	+= nLength;
+	m_nHeadroom	-= nLength;
+	m_nLength	+= nLength;
+
+	return m_pBuffer;
 }
 
 char* G2Packet::GetType() const
@@ -84,6 +164,7 @@ G2Packet* G2Packet::New(const char* pszType, bool bCompound)
 		size_t nLength = strlen(pszType);
 		strncpy( pPacket->m_sType, pszType, nLength );
 		pPacket->m_sType[nLength] = 0;
+		pPacket->m_nType = G2PacketTypeFromString( pszType, nLength );
 	}
 
 	pPacket->m_bCompound = bCompound;
@@ -122,6 +203,7 @@ G2Packet* G2Packet::New(char* pSource)
 		*pszType++ = *pSource++;
 	}
 	*pszType++ = 0;
+	pPacket->m_nType = G2PacketTypeFromString( pPacket->m_sType, pszType - pPacket->m_sType - 1 );
 
 	pPacket->Write( pSource, nLength );
 
@@ -129,22 +211,12 @@ G2Packet* G2Packet::New(char* pSource)
 }
 
 
-G2PacketPool::G2PacketPool()
-{
-	m_pFree = 0;
-	m_nFree = 0;
-}
-
-G2PacketPool::~G2PacketPool()
-{
-	Clear();
-}
 
 G2Packet* G2Packet::WritePacket(G2Packet* pPacket)
 {
 	if ( pPacket == 0 ) return 0;
-	WritePacket( pPacket->m_sType, pPacket->m_oBuffer.size(), pPacket->m_bCompound );
-	Write( pPacket->m_oBuffer.data(), pPacket->m_oBuffer.size() );
+	WritePacket( pPacket->m_sType, pPacket->m_nLength, pPacket->m_bCompound );
+	Write( pPacket->m_pBuffer, pPacket->m_nLength );
 	return this;
 }
 
@@ -153,33 +225,56 @@ G2Packet* G2Packet::WritePacket(const char* pszType, quint32 nLength, bool bComp
 	Q_ASSERT( strlen( pszType ) > 0 );
 	Q_ASSERT( nLength <= 0xFFFFFF );
 
-	char nTypeLen	= (char)( strlen( pszType ) - 1 ) & 0x07;
-	char nLenLen	= 0;
+	quint32 nTypeLen = qMin<quint32>( strlen( pszType ), 8 );
+	quint32 nHeader = GetHeaderLength( nTypeLen, nLength );
 
-	if( nLength )
-	{
-		nLenLen++;
-		if( nLength > 0xFF )
-		{
-			nLenLen++;
-			if( nLength > 0xFFFF )
-				nLenLen++;
-		}
-	}
+	Ensure( nHeader );
+	WriteHeader( m_pBuffer + m_nLength, pszType, nTypeLen, nLength, bCompound );
+	m_nLength += nHeader;
 
-	char nFlags = ( nLenLen << 6 ) + ( nTypeLen << 3 );
+	m_bCompound = true;
 
-	if ( bCompound ) nFlags |= G2_FLAG_COMPOUND;
+	return this;
+}
 
-	Write( &nFlags, 1 );
+// Inserts a child header (and room for nLength bytes of its payload) in front of the payload,
+// returns the child payload. Cheap as long as it fits in the headroom.
+char* G2Packet::PrependPacket(const char* pszType, quint32 nLength, bool bCompound)
+{
+	Q_ASSERT( strlen( pszType ) > 0 );
+	Q_ASSERT( nLength <= 0xFFFFFF );
 
-	Write( &nLength, nLenLen );
+	quint32 nTypeLen = qMin<quint32>( strlen( pszType ), 8 );
+	quint32 nHeader = GetHeaderLength( nTypeLen, nLength );
 
-	Write( const_cast<char*>(pszType), nTypeLen + 1 );
+	char* pOut = WriteGetPointer( nHeader + nLength, 0 );
+	WriteHeader( pOut, pszType, nTypeLen, nLength, bCompound );
 
 	m_bCompound = true;
 
-	return this;
+	return pOut + nHeader;
+}
+
+quint32 G2Packet::GetHeaderLength(quint32 nTypeLen, quint32 nLength)
+{
+	quint32 nLenLen = ( nLength > 0xFFFF ) ? 3 : ( nLength > 0xFF ) ? 2 : ( nLength ) ? 1 : 0;
+	return 1 + nLenLen + nTypeLen;
+}
+
+// Control byte, little endian length, name
+void G2Packet::WriteHeader(char* pOut, const char* pszType, quint32 nTypeLen, quint32 nLength, bool bCompound)
+{
+	quint32 nLenLen = ( nLength > 0xFFFF ) ? 3 : ( nLength > 0xFF ) ? 2 : ( nLength ) ? 1 : 0;
+
+	char nFlags = ( nLenLen << 6 ) + ( ( ( nTypeLen - 1 ) & 0x07 ) << 3 );
+	if ( bCompound ) nFlags |= G2_FLAG_COMPOUND;
+
+	*pOut++ = nFlags;
+
+	for ( quint32 i = 0 ; i < nLenLen ; i++ )
+		*pOut++ = char( nLength >> ( i * 8 ) );
+
+	memcpy( pOut, pszType, nTypeLen );
 }
 
 bool G2Packet::ReadPacket(char* pszType, quint32& nLength, bool* pbCompound)
@@ -215,11 +310,44 @@ bool G2Packet::ReadPacket(char* pszType, quint32& nLength, bool* pbCompound)
 	return true;
 }
 
+bool G2Packet::ReadPacket(G2_PACKET& nType, quint32& nLength, bool* pbCompound)
+{
+	if ( GetRemaining() == 0 ) return false;
+
+	char nInput = ReadByte();
+	if ( nInput == 0 ) return false;
+
+	char nLenLen	= ( nInput & 0xC0 ) >> 6;
+	char nTypeLen	= ( nInput & 0x38 ) >> 3;
+	char nFlags		= ( nInput & 0x07 );
+
+	if ( GetRemaining() < nTypeLen + nLenLen + 1 ) throw packet_error();
+
+	nLength = 0;
+	Read( &nLength, nLenLen );
+
+	if ( GetRemaining() < (int)nLength + nTypeLen + 1 ) throw packet_error();
+
+	nType = G2PacketTypeFromString( m_pBuffer + m_nPosition, nTypeLen + 1 );
+	m_nPosition += nTypeLen + 1;
+
+	if ( pbCompound )
+	{
+		*pbCompound = ( nFlags & G2_FLAG_COMPOUND ) == G2_FLAG_COMPOUND;
+	}
+	else
+	{
+		if ( nFlags & G2_FLAG_COMPOUND ) SkipCompound( nLength );
+	}
+
+	return true;
+}
+
 bool G2Packet::SkipCompound()
 {
 	if ( m_bCompound )
 	{
-		quint32 nLength = m_oBuffer.size();
+		quint32 nLength = m_nLength;
 		if ( ! SkipCompound( nLength ) ) return false;
 	}
 
@@ -264,13 +392,13 @@ void G2Packet::ToBuffer(QByteArray* pBuffer) const
 	Q_ASSERT( strlen( m_sType ) > 0 );
 
 	char nLenLen	= 0;
-	if( m_oBuffer.size() )
+	if( m_nLength )
 	{
 		nLenLen++;
-		if( m_oBuffer.size() > 0xFF )
+		if( m_nLength > 0xFF )
 		{
 			nLenLen++;
-			if( m_oBuffer.size() > 0xFFFF )
+			if( m_nLength > 0xFFFF )
 			{
 				nLenLen++;
 			}
@@ -285,12 +413,46 @@ void G2Packet::ToBuffer(QByteArray* pBuffer) const
 
 	pBuffer->append( (char*)&nFlags, 1 );
 
-	quint32 nLength = m_oBuffer.size();
+	quint32 nLength = m_nLength;
 	pBuffer->append( (char*)&nLength, nLenLen );
 
 	pBuffer->append( (char*)&m_sType[0], nTypeLen + 1 );
 
-	pBuffer->append( m_oBuffer );
+	pBuffer->append( m_pBuffer, m_nLength );
+}
+
+void G2Packet::ToBuffer(CBufferChain* pBuffer) const
+{
+	Q_ASSERT( strlen( m_sType ) > 0 );
+
+	quint32 nTypeLen = qMin<quint32>( strlen( m_sType ), 8 );
+	quint32 nHeader = GetHeaderLength( nTypeLen, m_nLength );
+
+	char pHeader[12];
+	WriteHeader( pHeader, m_sType, nTypeLen, m_nLength, m_bCompound );
+
+	pBuffer->Append( pHeader, nHeader );
+	pBuffer->Append( m_pBuffer, m_nLength );
+}
+
+// Encodes the packet once into a frame of its own.
+// The frame is implicitly shared, so it can be queued on any number of connections
+// and is only copied when it lands in a socket or deflate buffer.
+QByteArray G2Packet::ToFrame() const
+{
+	Q_ASSERT( strlen( m_sType ) > 0 );
+
+	quint32 nTypeLen = qMin<quint32>( strlen( m_sType ), 8 );
+	quint32 nHeader = GetHeaderLength( nTypeLen, m_nLength );
+
+	QByteArray baFrame;
+	baFrame.resize( nHeader + m_nLength );
+
+	char* pOut = baFrame.data();
+	WriteHeader( pOut, m_sType, nTypeLen, m_nLength, m_bCompound );
+	memcpy( pOut + nHeader, m_pBuffer, m_nLength );
+
+	return baFrame;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -343,11 +505,11 @@ G2Packet* G2Packet::ReadBuffer(QByteArray* pBuffer)
 
 QString G2Packet::ReadString(quint32 nMaximum)
 {
-	nMaximum = qMin<quint32>(nMaximum, m_oBuffer.size() - m_nPosition);
+	nMaximum = qMin<quint32>(nMaximum, m_nLength - m_nPosition);
 	if( !nMaximum )
 		return QString();
 
-	const char* pInput = m_oBuffer.data() + m_nPosition;
+	const char* pInput = m_pBuffer + m_nPosition;
 	char* pScan = const_cast<char*>(pInput);
 
 	quint32 nLength = 0;
@@ -364,9 +526,10 @@ QString G2Packet::ReadString(quint32 nMaximum)
 }
 void G2Packet::WriteString(QString sToWrite, bool bTerminate)
 {
-	m_oBuffer += sToWrite.toUtf8();
+	QByteArray baString = sToWrite.toUtf8();
+	Write(baString.constData(), baString.size());
 	if( bTerminate )
-		m_oBuffer += "\x00";
+		WriteByte(0);
 }
 
 QString G2Packet::ToHex() const
@@ -374,12 +537,12 @@ QString G2Packet::ToHex() const
 	const char* pszHex = "0123456789ABCDEF";
 	QByteArray strDump;
 
-	strDump.resize(m_oBuffer.size() * 3);
+	strDump.resize(m_nLength * 3);
 	char* pszDump = strDump.data();
 
-	for ( qint32 i = 0 ; i < m_oBuffer.size() ; i++ )
+	for ( quint32 i = 0 ; i < m_nLength ; i++ )
 	{
-		int nChar = m_oBuffer[i];
+		int nChar = (uchar)m_pBuffer[i];
 		if ( i ) *pszDump++ = ' ';
 		*pszDump++ = pszHex[ nChar >> 4 ];
 		*pszDump++ = pszHex[ nChar & 0x0F ];
@@ -394,12 +557,12 @@ QString G2Packet::ToASCII() const
 {
 	QByteArray strDump;
 
-	strDump.resize(m_oBuffer.size() + 1);
+	strDump.resize(m_nLength + 1);
 	char* pszDump = strDump.data();
 
-	for ( int i = 0 ; i < m_oBuffer.size() ; i++ )
+	for ( quint32 i = 0 ; i < m_nLength ; i++ )
 	{
-		int nChar = m_oBuffer[i];
+		int nChar = (uchar)m_pBuffer[i];
 		*pszDump++ = ( nChar >= 32 ? nChar : '.' );
 	}
 
@@ -409,11 +572,340 @@ QString G2Packet::ToASCII() const
 }
 
 bool G2Packet::GetTo(QUuid& pGUID)
+{
+	if ( m_bCompound == false ) return false;
+
+	quint32 nPosition = m_nPosition;
+
+	if ( IsIndexed() )
+	{
+		if ( m_nIndex == 0 || m_pIndex[0].nType != G2_PACKET_TO || m_pIndex[0].nLength < 16 ) return false;
+
+		m_nPosition = m_pIndex[0].nOffset;
+	}
+	else
+	{
+		if ( m_nLength < 4 + 16 ) return false;
+
+		char* pTest = m_pBuffer;
+
+		if ( pTest[0] != 0x48 ) return false;
+		if ( pTest[1] != 0x10 ) return false;
+		if ( pTest[2] != 'T' ) return false;
+		if ( pTest[3] != 'O' ) return false;
+
+		m_nPosition = 4;
+	}
+
+	pGUID = ReadGUID();
+	m_nPosition = nPosition;
+
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// G2Packet child index
+
+// Walks the top level children once and remembers where they are, so every later
+// consumer of the packet (routing, shallow parse, full parse) can jump to what it needs.
+// Throws packet_error on a malformed packet, like ReadPacket.
+void G2Packet::BuildIndex()
+{
+	m_nIndex	= 0;
+	m_nPayload	= 0;
+
+	if ( m_bCompound )
+	{
+		quint32 nPosition = 0;
+
+		while ( nPosition < m_nLength )
+		{
+			char nInput = m_pBuffer[nPosition++];
+			if ( nInput == 0 ) break;
+
+			quint32 nLenLen		= ( nInput & 0xC0 ) >> 6;
+			quint32 nTypeLen	= ( ( nInput & 0x38 ) >> 3 ) + 1;
+
+			if ( nPosition + nLenLen + nTypeLen > m_nLength ) throw packet_error();
+
+			quint32 nLength = 0;
+			memcpy( &nLength, m_pBuffer + nPosition, nLenLen );
+			nPosition += nLenLen;
+
+			if ( nPosition + nTypeLen + nLength > m_nLength ) throw packet_error();
+
+			if ( m_nIndex == m_nIndexSize )
+			{
+				quint32 nSize = qMax<quint32>( G2_INDEX_MIN, m_nIndexSize * 2 );
+				G2PacketChild* pIndex = (G2PacketChild*)realloc( m_pIndex, nSize * sizeof(G2PacketChild) );
+				if ( pIndex == 0 )
+					qFatal("G2Packet: out of memory");
+				m_pIndex = pIndex;
+				m_nIndexSize = nSize;
+			}
+
+			G2PacketChild& oChild = m_pIndex[m_nIndex++];
+			oChild.nType		= G2PacketTypeFromString( m_pBuffer + nPosition, nTypeLen );
+			oChild.nOffset		= nPosition + nTypeLen;
+			oChild.nLength		= nLength;
+			oChild.bCompound	= ( nInput & G2_FLAG_COMPOUND ) == G2_FLAG_COMPOUND;
+
+			nPosition += nTypeLen + nLength;
+		}
+
+		m_nPayload = nPosition;
+	}
+
+	m_nIndexed = m_nLength;
+}
+
+const G2PacketChild* G2Packet::GetChildren(quint32& nCount)
+{
+	if ( !IsIndexed() )
+		BuildIndex();
+
+	nCount = m_nIndex;
+	return m_pIndex;
+}
+
+// Finds the first child of type nType, or the next one after pAfter
+const G2PacketChild* G2Packet::FindChild(G2_PACKET nType, const G2PacketChild* pAfter)
+{
+	quint32 nCount = 0;
+	const G2PacketChild* pChild = GetChildren(nCount);
+	const G2PacketChild* pEnd = pChild + nCount;
+
+	if ( pAfter )
+		pChild = pAfter + 1;
+
+	for ( ; pChild < pEnd ; pChild++ )
+	{
+		if ( pChild->nType == nType )
+			return pChild;
+	}
+
+	return 0;
+}
+
+// Where the packet's own payload starts, m_nLength if there is none
+quint32 G2Packet::GetPayloadOffset()
+{
+	if ( !IsIndexed() )
+		BuildIndex();
+
+	return m_nPayload;
+}
+
+//////////////////////////////////////////////////////////////////////
+// G2PacketView in-place parsing
+
+G2PacketView::G2PacketView()
+{
+	m_pBuffer	= 0;
+	m_nLength	= 0;
+	m_nPosition	= 0;
+
+	memset(&m_sType[0], 0, sizeof(m_sType));
+	m_nType = 0;
+	m_bCompound = false;
+}
+
+// Parses the packet header at pData and points the view at its payload.
+// Returns the number of bytes the packet occupies in the stream, 0 if it is not complete yet.
+// A stream padding byte (0x00) is consumed as 1 byte with an empty type.
+quint32 G2PacketView::ReadBuffer(const char* pData, quint32 nAvailable)
+{
+	if ( nAvailable < 1 )
+		return 0;
+
+	char nInput = pData[0];
+
+	if ( nInput == 0 )
+	{
+		m_sType[0] = 0;
+		m_nType = 0;
+		return 1;
+	}
+
+	if ( nAvailable < 2 )
+		return 0;
+
+	char nLenLen	= ( nInput & 0xC0 ) >> 6;
+	char nTypeLen	= ( nInput & 0x38 ) >> 3;
+	char nFlags		= ( nInput & 0x07 );
+
+	if ( nAvailable < (quint32)nLenLen + nTypeLen + 2u )
+		return 0;
+
+	if ( nFlags & G2_FLAG_BIG_ENDIAN )
+		throw packet_error();
+
+	quint32 nLength = 0;
+	const char* pLenIn	= pData + 1;
+	char* pLenOut		= (char*)&nLength;
+	for ( char nLenCnt = nLenLen ; nLenCnt-- ; ) *pLenOut++ = *pLenIn++;
+
+	quint32 nPacket = nLength + nLenLen + nTypeLen + 2;
+
+	if ( nAvailable < nPacket )
+		return 0;
+
+	memcpy(&m_sType[0], pData + 1 + nLenLen, nTypeLen + 1);
+	m_sType[nTypeLen + 1] = 0;
+	m_nType = G2PacketTypeFromString(&m_sType[0], nTypeLen + 1);
+
+	m_bCompound	= ( nFlags & G2_FLAG_COMPOUND ) ? true : false;
+	m_pBuffer	= pData + nLenLen + nTypeLen + 2;
+	m_nLength	= nLength;
+	m_nPosition	= 0;
+
+	return nPacket;
+}
+
+// Full length of the frame at pData, 0 if not even its header is available yet
+quint32 G2PacketView::GetFrameLength(const char* pData, quint32 nAvailable)
+{
+	if ( nAvailable < 1 )
+		return 0;
+
+	if ( pData[0] == 0 )
+		return 1;
+
+	quint32 nLenLen		= ( (uchar)pData[0] & 0xC0 ) >> 6;
+	quint32 nTypeLen	= ( (uchar)pData[0] & 0x38 ) >> 3;
+
+	if ( nAvailable < nLenLen + nTypeLen + 2 )
+		return 0;
+
+	quint32 nLength = 0;
+	memcpy( &nLength, pData + 1, nLenLen );
+
+	return nLength + nLenLen + nTypeLen + 2;
+}
+
+// Copies the viewed packet into a pooled G2Packet, for packets that have to be kept or forwarded
+G2Packet* G2PacketView::ToPacket() const
+{
+	G2Packet* pPacket = G2Packet::New(m_sType, m_bCompound);
+	pPacket->Write(m_pBuffer, m_nLength);
+	pPacket->m_nPosition = m_nPosition;
+	return pPacket;
+}
+
+bool G2PacketView::ReadPacket(char* pszType, quint32& nLength, bool* pbCompound)
+{
+	if ( GetRemaining() == 0 ) return false;
+
+	char nInput = ReadByte();
+	if ( nInput == 0 ) return false;
+
+	char nLenLen	= ( nInput & 0xC0 ) >> 6;
+	char nTypeLen	= ( nInput & 0x38 ) >> 3;
+	char nFlags		= ( nInput & 0x07 );
+
+	if ( GetRemaining() < nTypeLen + nLenLen + 1 ) throw packet_error();
+
+	nLength = 0;
+	Read( &nLength, nLenLen );
+
+	if ( GetRemaining() < (int)nLength + nTypeLen + 1 ) throw packet_error();
+
+	Read( pszType, nTypeLen + 1 );
+	pszType[ nTypeLen + 1 ] = 0;
+
+	if ( pbCompound )
+	{
+		*pbCompound = ( nFlags & G2_FLAG_COMPOUND ) == G2_FLAG_COMPOUND;
+	}
+	else
+	{
+		if ( nFlags & G2_FLAG_COMPOUND ) SkipCompound( nLength );
+	}
+
+	return true;
+}
+
+bool G2PacketView::ReadPacket(G2_PACKET& nType, quint32& nLength, bool* pbCompound)
+{
+	if ( GetRemaining() == 0 ) return false;
+
+	char nInput = ReadByte();
+	if ( nInput == 0 ) return false;
+
+	char nLenLen	= ( nInput & 0xC0 ) >> 6;
+	char nTypeLen	= ( nInput & 0x38 ) >> 3;
+	char nFlags		= ( nInput & 0x07 );
+
+	if ( GetRemaining() < nTypeLen + nLenLen + 1 ) throw packet_error();
+
+	nLength = 0;
+	Read( &nLength, nLenLen );
+
+	if ( GetRemaining() < (int)nLength + nTypeLen + 1 ) throw packet_error();
+
+	nType = G2PacketTypeFromString( m_pBuffer + m_nPosition, nTypeLen + 1 );
+	m_nPosition += nTypeLen + 1;
+
+	if ( pbCompound )
+	{
+		*pbCompound = ( nFlags & G2_FLAG_COMPOUND ) == G2_FLAG_COMPOUND;
+	}
+	else
+	{
+		if ( nFlags & G2_FLAG_COMPOUND ) SkipCompound( nLength );
+	}
+
+	return true;
+}
+
+bool G2PacketView::SkipCompound()
+{
+	if ( m_bCompound )
+	{
+		quint32 nLength = m_nLength;
+		if ( ! SkipCompound( nLength ) ) return false;
+	}
+
+	return true;
+}
+
+bool G2PacketView::SkipCompound(quint32& nLength, quint32 nRemaining)
+{
+	quint32 nStart	= m_nPosition;
+	quint32 nEnd	= m_nPosition + nLength;
+
+	while ( m_nPosition < nEnd )
+	{
+		char nInput = ReadByte();
+		if ( nInput == 0 ) break;
+
+		char nLenLen	= ( nInput & 0xC0 ) >> 6;
+		char nTypeLen	= ( nInput & 0x38 ) >> 3;
+
+		if ( m_nPosition + nTypeLen + nLenLen + 1 > nEnd ) throw packet_error();
+
+		quint32 nPacket = 0;
+
+		Read( &nPacket, nLenLen );
+
+		if ( m_nPosition + nTypeLen + 1 + nPacket > nEnd ) throw packet_error();
+
+		m_nPosition += nPacket + nTypeLen + 1;
+	}
+
+	nEnd = m_nPosition - nStart;
+	if ( nEnd > nLength ) throw packet_error();
+	nLength -= nEnd;
+
+	return nRemaining ? nLength >= nRemaining : true;
+}
+
+bool G2PacketView::GetTo(QUuid& pGUID)
 {
 	if ( m_bCompound == false ) return false;
 	if ( GetRemaining() < 4 + 16 ) return false;
 
-	char* pTest = m_oBuffer.data() + m_nPosition;
+	const char* pTest = m_pBuffer + m_nPosition;
 
 	if ( pTest[0] != 0x48 ) return false;
 	if ( pTest[1] != 0x10 ) return false;
@@ -427,43 +919,393 @@ bool G2Packet::GetTo(QUuid& pGUID)
 	return true;
 }
 
+QString G2PacketView::ReadString(quint32 nMaximum)
+{
+	nMaximum = qMin<quint32>(nMaximum, m_nLength - m_nPosition);
+	if( !nMaximum )
+		return QString();
+
+	const char* pInput = m_pBuffer + m_nPosition;
+	const char* pScan = pInput;
 
+	quint32 nLength = 0;
 
-void G2PacketPool::Clear()
+	for( ; nLength < nMaximum; nLength++ )
+	{
+		m_nPosition++;
+		if( ! *pScan )
+			break;
+		pScan++;
+	}
+
+	return QString::fromUtf8(pInput, nLength);
+}
+
+
+
+//////////////////////////////////////////////////////////////////////
+// G2PacketPool construction
+
+G2PacketCache::G2PacketCache(G2PacketPool* pPool)
+{
+	m_pPool		= pPool;
+	m_nCount	= 0;
+	m_nHits		= 0;
+	m_nMisses	= 0;
+
+	memset(&m_nSlabs[0], 0, sizeof(m_nSlabs));
+}
+
+G2PacketCache::~G2PacketCache()
 {
-	for ( int nIndex = m_pPools.size() - 1 ; nIndex >= 0 ; nIndex-- )
+	m_pPool->Detach(this);
+}
+
+G2PacketPool::G2PacketPool()
+	: m_pSection("packet_pool", mlPacketPool)
+{
+	m_bShutdown = false;
+	m_nRetiredHits = m_nRetiredMisses = 0;
+
+	m_nFull = 0xFFFF;
+	m_nEmpty = 0xFFFF;
+
+	for ( int nIndex = G2_POOL_MAGAZINES - 1 ; nIndex >= 0 ; nIndex-- )
 	{
-		G2Packet* pPool = (G2Packet*)m_pPools[ nIndex ];
-		delete [] pPool;
+		m_pMagazines[nIndex].m_nCount = 0;
+		PushMagazine(m_nEmpty, nIndex);
 	}
+}
+
+G2PacketPool::~G2PacketPool()
+{
+	// main thread cache goes back to the global pool before anything is counted
+	m_oCache.setLocalData(0);
+
+	m_bShutdown = true;
+
+	Dump();
+
+	PROFILED_LOCKER(l, &m_pSection);
+
+	quint32 nCached = 0;
+	foreach( G2PacketCache* pCache, m_lCaches )
+		nCached += pCache->m_nCount;
+
+	Clear();
 
-	m_pPools.clear();;
-	m_pFree = 0;
-	m_nFree = 0;
+	quint32 nLeaked = quint32(int(m_nAllocated)) - nCached;
+	if ( nLeaked )
+	{
+		qWarning() << "G2PacketPool: " << nLeaked << " packets not released at shutdown";
+	}
 }
 
 //////////////////////////////////////////////////////////////////////
-// G2PacketPool new pool setup
+// G2PacketPool global magazine stacks
 
-void G2PacketPool::NewPool()
+int G2PacketPool::PopMagazine(QAtomicInt& nStack)
 {
-	G2Packet* pPool = 0;
-	int nPitch = 0, nSize = 256;
+	forever
+	{
+		int nOld = nStack;
+		int nIndex = nOld & 0xFFFF;
 
-	nPitch	= sizeof(G2Packet);
-	pPool	= new G2Packet[ nSize ];
+		if ( nIndex == 0xFFFF )
+			return -1;
 
-	m_pPools.append( pPool );
+		int nNew = int( ( ( quint32(nOld) & 0xFFFF0000u ) + 0x10000u ) | quint32(m_pMagazines[nIndex].m_nNext & 0xFFFF) );
 
-	char* pchars = (char*)pPool;
+		if ( nStack.testAndSetOrdered(nOld, nNew) )
+			return nIndex;
+	}
+}
 
-	while ( nSize-- > 0 )
+void G2PacketPool::PushMagazine(QAtomicInt& nStack, int nIndex)
+{
+	forever
 	{
-		pPool = (G2Packet*)pchars;
-		pchars += nPitch;
+		int nOld = nStack;
+		m_pMagazines[nIndex].m_nNext = nOld & 0xFFFF;
 
-		pPool->m_pNext = m_pFree;
-		m_pFree = pPool;
-		m_nFree++;
+		int nNew = int( ( ( quint32(nOld) & 0xFFFF0000u ) + 0x10000u ) | quint32(nIndex) );
+
+		if ( nStack.testAndSetOrdered(nOld, nNew) )
+			return;
 	}
 }
+
+//////////////////////////////////////////////////////////////////////
+// G2PacketPool thread caches
+
+G2PacketCache* G2PacketPool::Attach()
+{
+	if ( m_bShutdown )
+		return 0;
+
+	G2PacketCache* pCache = m_oCache.localData();
+
+	if ( pCache == 0 )
+	{
+		pCache = new G2PacketCache(this);
+		m_oCache.setLocalData(pCache);
+
+		PROFILED_LOCKER(l, &m_pSection);
+		m_lCaches.append(pCache);
+	}
+
+	return pCache;
+}
+
+void G2PacketPool::Detach(G2PacketCache* pCache)
+{
+	while ( pCache->m_nCount )
+		SpillMagazine(pCache, qMin<quint32>(pCache->m_nCount, G2_POOL_MAGAZINE));
+
+	for ( int nClass = 0 ; nClass < G2_SLAB_CLASSES ; nClass++ )
+	{
+		while ( pCache->m_nSlabs[nClass] )
+			free( pCache->m_pSlabs[nClass][ --pCache->m_nSlabs[nClass] ] );
+	}
+
+	PROFILED_LOCKER(l, &m_pSection);
+
+	m_nRetiredHits += pCache->m_nHits;
+	m_nRetiredMisses += pCache->m_nMisses;
+	m_lCaches.removeOne(pCache);
+}
+
+G2Packet* G2PacketPool::Refill()
+{
+	G2PacketCache* pCache = Attach();
+
+	if ( pCache == 0 )
+		return Allocate();
+
+	Q_ASSERT( pCache->m_nCount == 0 );
+
+	int nIndex = PopMagazine(m_nFull);
+
+	if ( nIndex >= 0 )
+	{
+		Magazine& oMagazine = m_pMagazines[nIndex];
+		m_nFullCount.fetchAndAddRelaxed(-1);
+		m_nGlobalFree.fetchAndAddRelaxed(-int(oMagazine.m_nCount));
+
+		memcpy(&pCache->m_pPackets[0], &oMagazine.m_pPackets[0], oMagazine.m_nCount * sizeof(G2Packet*));
+		pCache->m_nCount = oMagazine.m_nCount;
+		oMagazine.m_nCount = 0;
+
+		PushMagazine(m_nEmpty, nIndex);
+
+		pCache->m_nHits++;
+	}
+	else
+	{
+		for ( int i = 0 ; i < G2_POOL_GROW ; i++ )
+			pCache->m_pPackets[ pCache->m_nCount++ ] = Allocate();
+
+		pCache->m_nMisses++;
+	}
+
+	return pCache->m_pPackets[ --pCache->m_nCount ];
+}
+
+void G2PacketPool::Spill(G2Packet* pPacket)
+{
+	G2PacketCache* pCache = Attach();
+
+	if ( pCache == 0 )
+	{
+		Free(pPacket);
+		return;
+	}
+
+	if ( pCache->m_nCount == G2_POOL_MAGAZINE * 2 )
+		SpillMagazine(pCache, G2_POOL_MAGAZINE);
+
+	pCache->m_pPackets[ pCache->m_nCount++ ] = pPacket;
+}
+
+// Moves the nCount most recently freed packets to the global pool, or to the heap if it is full
+void G2PacketPool::SpillMagazine(G2PacketCache* pCache, quint32 nCount)
+{
+	Q_ASSERT( nCount <= pCache->m_nCount && nCount <= G2_POOL_MAGAZINE );
+
+	pCache->m_nCount -= nCount;
+	G2Packet** pPackets = &pCache->m_pPackets[ pCache->m_nCount ];
+
+	int nIndex = PopMagazine(m_nEmpty);
+
+	if ( nIndex >= 0 )
+	{
+		Magazine& oMagazine = m_pMagazines[nIndex];
+		memcpy(&oMagazine.m_pPackets[0], pPackets, nCount * sizeof(G2Packet*));
+		oMagazine.m_nCount = nCount;
+
+		m_nGlobalFree.fetchAndAddRelaxed(nCount);
+		m_nFullCount.fetchAndAddRelaxed(1);
+		PushMagazine(m_nFull, nIndex);
+	}
+	else
+	{
+		for ( quint32 i = 0 ; i < nCount ; i++ )
+			Free(pPackets[i]);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// G2PacketPool payload slabs
+
+static inline int SlabClass(quint32 nLength)
+{
+	for ( int nClass = 0 ; nClass < G2_SLAB_CLASSES ; nClass++ )
+	{
+		if ( nLength <= ( quint32(G2_SLAB_MIN) << ( nClass * 2 ) ) )
+			return nClass;
+	}
+	return -1;
+}
+
+char* G2PacketPool::AllocBuffer(quint32 nLength, quint32& nBuffer)
+{
+	int nClass = SlabClass(nLength);
+
+	if ( nClass < 0 )
+	{
+		nBuffer = ( nLength + 4095 ) & ~4095u;
+	}
+	else
+	{
+		nBuffer = quint32(G2_SLAB_MIN) << ( nClass * 2 );
+
+		G2PacketCache* pCache = Attach();
+		if ( pCache && pCache->m_nSlabs[nClass] )
+			return pCache->m_pSlabs[nClass][ --pCache->m_nSlabs[nClass] ];
+	}
+
+	m_nBufferAllocs.fetchAndAddRelaxed(1);
+
+	char* pBuffer = (char*)malloc(nBuffer);
+	if ( pBuffer == 0 )
+		qFatal("G2PacketPool: out of memory");
+
+	return pBuffer;
+}
+
+void G2PacketPool::FreeBuffer(char* pBuffer, quint32 nBuffer)
+{
+	int nClass = SlabClass(nBuffer);
+
+	if ( nClass >= 0 )
+	{
+		G2PacketCache* pCache = Attach();
+		if ( pCache && pCache->m_nSlabs[nClass] < G2_SLAB_CACHE )
+		{
+			pCache->m_pSlabs[nClass][ pCache->m_nSlabs[nClass]++ ] = pBuffer;
+			return;
+		}
+	}
+
+	free(pBuffer);
+}
+
+G2Packet* G2PacketPool::Allocate()
+{
+	G2Packet* pPacket = new G2Packet();
+
+	int nAllocated = m_nAllocated.fetchAndAddRelaxed(1) + 1;
+
+	forever
+	{
+		int nPeak = m_nPeak;
+		if ( nAllocated <= nPeak || m_nPeak.testAndSetRelaxed(nPeak, nAllocated) )
+			break;
+	}
+
+	return pPacket;
+}
+
+void G2PacketPool::Free(G2Packet* pPacket)
+{
+	m_nAllocated.fetchAndAddRelaxed(-1);
+	delete pPacket;
+}
+
+// Returns memory kept in the global pool after a burst, called periodically from the network thread
+void G2PacketPool::Trim()
+{
+	while ( int(m_nFullCount) > G2_POOL_KEEP )
+	{
+		int nIndex = PopMagazine(m_nFull);
+
+		if ( nIndex < 0 )
+			break;
+
+		Magazine& oMagazine = m_pMagazines[nIndex];
+		m_nFullCount.fetchAndAddRelaxed(-1);
+		m_nGlobalFree.fetchAndAddRelaxed(-int(oMagazine.m_nCount));
+
+		for ( quint32 i = 0 ; i < oMagazine.m_nCount ; i++ )
+			Free(oMagazine.m_pPackets[i]);
+
+		oMagazine.m_nCount = 0;
+		PushMagazine(m_nEmpty, nIndex);
+	}
+}
+
+void G2PacketPool::GetStats(G2PacketPoolStats& oStats)
+{
+	PROFILED_LOCKER(l, &m_pSection);
+
+	// other threads' counters are read without synchronisation, good enough for statistics
+	oStats.nHits	= m_nRetiredHits;
+	oStats.nMisses	= m_nRetiredMisses;
+	oStats.nFree	= int(m_nGlobalFree);
+	oStats.nThreads	= m_lCaches.size();
+
+	foreach( G2PacketCache* pCache, m_lCaches )
+	{
+		oStats.nHits	+= pCache->m_nHits;
+		oStats.nMisses	+= pCache->m_nMisses;
+		oStats.nFree	+= pCache->m_nCount;
+	}
+
+	oStats.nAllocated	= int(m_nAllocated);
+	oStats.nPeak		= int(m_nPeak);
+	oStats.nBufferAllocs	= quint32(int(m_nBufferAllocs));
+	oStats.nOutstanding	= oStats.nAllocated > oStats.nFree ? oStats.nAllocated - oStats.nFree : 0;
+}
+
+void G2PacketPool::Dump()
+{
+	G2PacketPoolStats oStats;
+	GetStats(oStats);
+
+	quint64 nTotal = oStats.nHits + oStats.nMisses;
+
+	qDebug() << "G2PacketPool: allocated" << oStats.nAllocated << "peak" << oStats.nPeak
+			 << "outstanding" << oStats.nOutstanding << "free" << oStats.nFree
+			 << "threads" << oStats.nThreads << "payload allocs" << oStats.nBufferAllocs
+			 << "hit rate" << ( nTotal ? double(oStats.nHits) * 100.0 / nTotal : 100.0 ) << "%";
+}
+
+void G2PacketPool::Clear()
+{
+	Q_ASSERT( m_bShutdown );
+
+	int nIndex;
+	while ( ( nIndex = PopMagazine(m_nFull) ) >= 0 )
+	{
+		Magazine& oMagazine = m_pMagazines[nIndex];
+
+		for ( quint32 i = 0 ; i < oMagazine.m_nCount ; i++ )
+			Free(oMagazine.m_pPackets[i]);
+
+		oMagazine.m_nCount = 0;
+		PushMagazine(m_nEmpty, nIndex);
+	}
+
+	m_nFullCount = 0;
+	m_nGlobalFree = 0;
+}
@@ -2,15 +2,38 @@
 #define G2PACKET_H
 
 #include "types.h"
+#include "g2packettypes.h"
 #include <QByteArray>
 #include <QtGlobal>
 #include <QMutex>
 #include <QList>
+#include <QAtomicInt>
+#include <QThreadStorage>
+#include "LockProfiler.h"
+
+class CBufferChain;
 
 struct packet_error{};
 struct packet_read_past_end{};
 
-
+// Payloads up to this size live inside the packet itself (headroom included)
+#define G2_PACKET_INLINE	144
+// Bytes kept free in front of the payload, so a child can be prepended without moving it
+#define G2_PACKET_HEADROOM	16
+// Slab payloads up to this size stay with the packet when it is recycled
+#define G2_PACKET_KEEP		2048
+// Child index entries allocated at first, index arrays up to G2_INDEX_KEEP entries stay with recycled packets
+#define G2_INDEX_MIN		16
+#define G2_INDEX_KEEP		128
+
+// A top level child, as found by G2Packet::GetChildren()
+struct G2PacketChild
+{
+	G2_PACKET	nType;
+	quint32		nOffset;	// child payload, from the start of the parent payload
+	quint32		nLength;
+	bool		bCompound;
+};
 
 class G2Packet
 {
@@ -29,33 +52,70 @@ public:
 	G2Packet*	m_pNext;
 	quint32		m_nReference;
 public:
-	QByteArray	m_oBuffer;
+	char*		m_pBuffer;		// payload, inside m_pInline or a pool slab
+	quint32		m_nLength;		// payload length
+	quint32		m_nBuffer;		// payload capacity from m_pBuffer
+	quint32		m_nHeadroom;	// free bytes in front of m_pBuffer
 	quint32		m_nPosition;
 	char		m_sType[9];
+	G2_PACKET	m_nType;
 	bool		m_bCompound;
+protected:
+	char		m_pInline[G2_PACKET_INLINE];
+
+	G2PacketChild*	m_pIndex;		// top level children, built on first use
+	quint32		m_nIndex;
+	quint32		m_nIndexSize;
+	quint32		m_nIndexed;		// m_nLength the index was built for, 0xFFFFFFFF if none
+	quint32		m_nPayload;		// offset of the packet's own payload, past children and terminator
 
 	enum { seekStart, seekEnd };
 
 // Operations
 public:
 	void	Reset();
+	void	Ensure(quint32 nLength);
 	void	Seek(quint32 nPosition, int nRelative = seekStart);
 	char*	WriteGetPointer(quint32 nLength, quint32 nOffset = 0xFFFFFFFF);
+	char*	Prepend(quint32 nLength);
+protected:
+	inline char* GetStorage() const
+	{
+		return m_pBuffer - m_nHeadroom;
+	}
+	void	SetStorage(char* pStorage, quint32 nStorage);
 public:
 	char*	GetType() const;
 
 public:
 	G2Packet*	WritePacket(G2Packet* pPacket);
 	G2Packet*	WritePacket(const char* pszType, quint32 nLength, bool bCompound = false);
+	char*	PrependPacket(const char* pszType, quint32 nLength, bool bCompound = false);
+	static quint32 GetHeaderLength(quint32 nTypeLen, quint32 nLength);
+	static void	WriteHeader(char* pOut, const char* pszType, quint32 nTypeLen, quint32 nLength, bool bCompound);
 	bool	ReadPacket(char* pszType, quint32& nLength, bool* pbCompound = 0);
+	bool	ReadPacket(G2_PACKET& nType, quint32& nLength, bool* pbCompound = 0);
 	bool	SkipCompound();
 	bool	SkipCompound(quint32& nLength, quint32 nRemaining = 0);
 	bool	GetTo(QUuid& pGUID);
 
+	const G2PacketChild* GetChildren(quint32& nCount);
+	const G2PacketChild* FindChild(G2_PACKET nType, const G2PacketChild* pAfter = 0);
+	quint32	GetPayloadOffset();
+protected:
+	void	BuildIndex();
+public:
+	inline bool IsIndexed() const
+	{
+		return m_nIndexed == m_nLength;
+	}
+
 
 public:
 	static	G2Packet* ReadBuffer(QByteArray* pBuffer);
 	void	ToBuffer(QByteArray* pBuffer) const;
+	void	ToBuffer(CBufferChain* pBuffer) const;
+	QByteArray	ToFrame() const;
 
 // Inline Packet Operations
 public:
@@ -65,45 +125,48 @@ public:
 		return strcmp(sType, m_sType) == 0;
 	}
 
+	inline bool IsType(G2_PACKET nType) const
+	{
+		return m_nType == nType;
+	}
+
 	inline int GetRemaining()
 	{
-		return m_oBuffer.size() - m_nPosition;
+		return m_nLength - m_nPosition;
 	}
 
 	inline void Read(void* pData, int nLength)
 	{
-		if ( m_nPosition + nLength > (quint32)m_oBuffer.size() ) throw packet_read_past_end();
-		memcpy(pData, m_oBuffer.constData() + m_nPosition, nLength);
+		if ( m_nPosition + nLength > m_nLength ) throw packet_read_past_end();
+		memcpy(pData, m_pBuffer + m_nPosition, nLength);
 		m_nPosition += nLength;
 	}
 
-	inline void Write(void* pData, int nLength)
+	inline void Write(const void* pData, quint32 nLength)
 	{
-		if( m_oBuffer.size() + nLength < m_oBuffer.capacity() )
-		{
-			m_oBuffer.reserve(qMax(m_oBuffer.capacity() + nLength, m_oBuffer.capacity() + 128));
-		}
+		if ( m_nLength + nLength > m_nBuffer ) Ensure(nLength);
 
-		m_oBuffer.append((char*)pData, nLength);
+		memcpy(m_pBuffer + m_nLength, pData, nLength);
+		m_nLength += nLength;
 	}
 
 	template <typename T>
 	inline T ReadIntBE()
 	{
-		if( m_oBuffer.size() - m_nPosition < sizeof(T) )
+		if( m_nLength - m_nPosition < sizeof(T) )
 			throw packet_read_past_end();
 
-		T nRet = qFromBigEndian(*(T*)(m_oBuffer.constData() + m_nPosition));
+		T nRet = qFromBigEndian(*(T*)(m_pBuffer + m_nPosition));
 		m_nPosition += sizeof(T);
 		return nRet;
 	}
 	template <typename T>
 	inline T ReadIntLE()
 	{
-		if( m_oBuffer.size() - m_nPosition < sizeof(T) )
+		if( m_nLength - m_nPosition < sizeof(T) )
 			throw packet_read_past_end();
 
-		T nRet = qFromLittleEndian(*(T*)(m_oBuffer.constData() + m_nPosition));
+		T nRet = qFromLittleEndian(*(T*)(m_pBuffer + m_nPosition));
 		m_nPosition += sizeof(T);
 		return nRet;
 	}
@@ -222,6 +285,169 @@ protected:
 #define G2_FLAG_BIG_ENDIAN	0x02
 
 
+// Read-only packet parsed in place over somebody else's buffer (eg. connection input).
+// Nothing is copied - the view is valid only as long as the underlying buffer is untouched,
+// so anything that has to outlive the handler must be materialized with ToPacket().
+class G2PacketView
+{
+// Construction
+public:
+	G2PacketView();
+
+// Attributes
+public:
+	const char*	m_pBuffer;		// payload
+	quint32		m_nLength;		// payload length
+	quint32		m_nPosition;	// child cursor
+	char		m_sType[9];
+	G2_PACKET	m_nType;
+	bool		m_bCompound;
+
+// Operations
+public:
+	quint32		ReadBuffer(const char* pData, quint32 nAvailable);
+	static quint32 GetFrameLength(const char* pData, quint32 nAvailable);
+	G2Packet*	ToPacket() const;
+
+	bool	ReadPacket(char* pszType, quint32& nLength, bool* pbCompound = 0);
+	bool	ReadPacket(G2_PACKET& nType, quint32& nLength, bool* pbCompound = 0);
+	bool	SkipCompound();
+	bool	SkipCompound(quint32& nLength, quint32 nRemaining = 0);
+	bool	GetTo(QUuid& pGUID);
+
+	QString ReadString(quint32 nMaximum = 0xFFFFFFFF);
+
+// Inline Packet Operations
+public:
+	inline char* GetType() const
+	{
+		return (char*)&m_sType;
+	}
+
+	inline bool IsType(const char* sType)
+	{
+		return strcmp(sType, m_sType) == 0;
+	}
+
+	inline bool IsType(G2_PACKET nType) const
+	{
+		return m_nType == nType;
+	}
+
+	inline int GetRemaining()
+	{
+		return m_nLength - m_nPosition;
+	}
+
+	inline void Read(void* pData, int nLength)
+	{
+		if ( m_nPosition + nLength > m_nLength ) throw packet_read_past_end();
+		memcpy(pData, m_pBuffer + m_nPosition, nLength);
+		m_nPosition += nLength;
+	}
+
+	template <typename T>
+	inline T ReadIntBE()
+	{
+		if( m_nLength - m_nPosition < sizeof(T) )
+			throw packet_read_past_end();
+
+		T nRet = qFromBigEndian(*(T*)(m_pBuffer + m_nPosition));
+		m_nPosition += sizeof(T);
+		return nRet;
+	}
+	template <typename T>
+	inline T ReadIntLE()
+	{
+		if( m_nLength - m_nPosition < sizeof(T) )
+			throw packet_read_past_end();
+
+		T nRet = qFromLittleEndian(*(T*)(m_pBuffer + m_nPosition));
+		m_nPosition += sizeof(T);
+		return nRet;
+	}
+	template <typename T>
+	inline void ReadIntBE(T* pDest)
+	{
+		*pDest = ReadIntBE<T>();
+	}
+	template <typename T>
+	inline void ReadIntLE(T* pDest)
+	{
+		*pDest = ReadIntLE<T>();
+	}
+	inline char ReadByte()
+	{
+		char nRet;
+		Read(&nRet, 1);
+		return nRet;
+	}
+
+	void ReadHostAddress(IPv4_ENDPOINT* pDest)
+	{
+		ReadIntBE(&pDest->ip);
+		ReadIntLE(&pDest->port);
+	}
+
+	QUuid ReadGUID()
+	{
+		QUuid ret;
+		ReadIntBE(&ret.data1);
+		ReadIntBE(&ret.data2);
+		ReadIntBE(&ret.data3);
+		Read(&ret.data4[0], 8);
+
+		return ret;
+	}
+};
+
+
+// Packets move between the thread caches and the global pool in magazines of this size
+#define G2_POOL_MAGAZINE	64
+// Magazines the global pool can hold, packets freed beyond that go back to the heap
+#define G2_POOL_MAGAZINES	128
+// Magazines kept by Trim()
+#define G2_POOL_KEEP		16
+// Packets allocated at once when the pool runs dry
+#define G2_POOL_GROW		16
+// Payload slab size classes (512, 2K, 8K, 32K), bigger payloads come straight from the heap
+#define G2_SLAB_CLASSES		4
+#define G2_SLAB_MIN			512
+// Free slabs kept per size class by each thread
+#define G2_SLAB_CACHE		16
+
+class G2PacketPool;
+
+struct G2PacketPoolStats
+{
+	quint32	nAllocated;		// packets currently allocated from the heap
+	quint32	nPeak;			// peak of nAllocated
+	quint32	nOutstanding;	// packets in use
+	quint32	nFree;			// free packets in the global pool and thread caches
+	quint64	nHits;			// New() served without a heap allocation
+	quint64	nMisses;		// New() that needed a heap allocation
+	quint32	nThreads;		// threads with a packet cache
+	quint64	nBufferAllocs;	// payload buffers taken from the heap
+};
+
+// Per-thread free packet cache, only ever touched by its own thread
+class G2PacketCache
+{
+public:
+	G2PacketCache(G2PacketPool* pPool);
+	~G2PacketCache();
+
+public:
+	G2PacketPool*	m_pPool;
+	G2Packet*		m_pPackets[G2_POOL_MAGAZINE * 2];
+	quint32			m_nCount;
+	quint64			m_nHits;
+	quint64			m_nMisses;
+
+	char*			m_pSlabs[G2_SLAB_CLASSES][G2_SLAB_CACHE];
+	quint32			m_nSlabs[G2_SLAB_CLASSES];
+};
+
 class G2PacketPool
 {
 // Construction
@@ -231,31 +457,67 @@ public:
 
 // Attributes
 protected:
-	G2Packet*	m_pFree;
-	quint32		m_nFree;
+	struct Magazine
+	{
+		G2Packet*		m_pPackets[G2_POOL_MAGAZINE];
+		quint32			m_nCount;
+		volatile int	m_nNext;
+	};
+
+	// Lock-free stacks of magazine indexes; head = (tag << 16) | index, the tag guards against ABA
+	Magazine		m_pMagazines[G2_POOL_MAGAZINES];
+	QAtomicInt		m_nFull;
+	QAtomicInt		m_nEmpty;
+	QAtomicInt		m_nFullCount;
+	QAtomicInt		m_nGlobalFree;
+
+	QAtomicInt		m_nAllocated;
+	QAtomicInt		m_nPeak;
+	QAtomicInt		m_nBufferAllocs;
+
+	QThreadStorage<G2PacketCache*>	m_oCache;
+	bool			m_bShutdown;
 protected:
-	QMutex				m_pSection;
-	QList<G2Packet*>	m_pPools;
+	CProfiledMutex			m_pSection;		// thread cache registration and stats only
+	QList<G2PacketCache*>	m_lCaches;
+	quint64					m_nRetiredHits;
+	quint64					m_nRetiredMisses;
 
 // Operations
 protected:
-	void	Clear();
-	void	NewPool();
+	int			PopMagazine(QAtomicInt& nStack);
+	void		PushMagazine(QAtomicInt& nStack, int nIndex);
+	G2PacketCache*	Attach();
+	void		Detach(G2PacketCache* pCache);
+	G2Packet*	Refill();
+	void		Spill(G2Packet* pPacket);
+	void		SpillMagazine(G2PacketCache* pCache, quint32 nCount);
+	G2Packet*	Allocate();
+	void		Free(G2Packet* pPacket);
+	void		Clear();
+public:
+	char*		AllocBuffer(quint32 nLength, quint32& nBuffer);
+	void		FreeBuffer(char* pBuffer, quint32 nBuffer);
+	void		Trim();
+	void		GetStats(G2PacketPoolStats& oStats);
+	void		Dump();
 
 // Inlines
 public:
 	inline G2Packet* New()
 	{
-		m_pSection.lock();
-
-		if ( m_nFree == 0 ) NewPool();
-		Q_ASSERT( m_nFree > 0 );
+		G2PacketCache* pCache = m_bShutdown ? 0 : m_oCache.localData();
+		G2Packet* pPacket;
 
-		G2Packet* pPacket = m_pFree;
-		m_pFree = m_pFree->m_pNext;
-		m_nFree --;
-
-		m_pSection.unlock();
+		if ( pCache && pCache->m_nCount )
+		{
+			pPacket = pCache->m_pPackets[ --pCache->m_nCount ];
+			pCache->m_nHits++;
+		}
+		else
+		{
+			pPacket = Refill();
+		}
 
 		pPacket->Reset();
 		pPacket->AddRef();
@@ -268,15 +530,19 @@ public:
 		Q_ASSERT( pPacket != NULL );
 		Q_ASSERT( pPacket->m_nReference == 0 );
 
-		m_pSection.lock();
-
-		pPacket->m_pNext = m_pFree;
-		m_pFree = pPacket;
-		m_nFree ++;
+		G2PacketCache* pCache = m_bShutdown ? 0 : m_oCache.localData();
 
-		m_pSection.unlock();
+		if ( pCache && pCache->m_nCount < G2_POOL_MAGAZINE * 2 )
+		{
+			pCache->m_pPackets[ pCache->m_nCount++ ] = pPacket;
+		}
+		else
+		{
+			Spill(pPacket);
+		}
 	}
 
+	friend class G2PacketCache;
 };
 
 extern G2PacketPool G2Packets;
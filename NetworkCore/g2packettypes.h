@@ -0,0 +1,92 @@
+#ifndef G2PACKETTYPES_H
+#define G2PACKETTYPES_H
+
+#include <QtGlobal>
+
+// G2 packet names packed into an integer, first character in the lowest byte.
+// Names are at most 8 characters, so comparing packet types is a single integer compare
+// and known names can be used as case labels.
+
+typedef quint64 G2_PACKET;
+
+#define MAKE_G2_PACKET(a,b,c,d,e,f,g,h) \
+	( (G2_PACKET)(quint8)(a)         | ( (G2_PACKET)(quint8)(b) << 8 )  | \
+	( (G2_PACKET)(quint8)(c) << 16 ) | ( (G2_PACKET)(quint8)(d) << 24 ) | \
+	( (G2_PACKET)(quint8)(e) << 32 ) | ( (G2_PACKET)(quint8)(f) << 40 ) | \
+	( (G2_PACKET)(quint8)(g) << 48 ) | ( (G2_PACKET)(quint8)(h) << 56 ) )
+
+inline G2_PACKET G2PacketTypeFromString(const char* pszType, int nLength)
+{
+	G2_PACKET nType = 0;
+	for ( int i = 0 ; i < nLength && i < 8 ; i++ )
+		nType |= (G2_PACKET)(quint8)pszType[i] << ( i * 8 );
+	return nType;
+}
+
+// Type of an encoded frame, 0 if the header is incomplete
+inline G2_PACKET G2PacketTypeFromFrame(const char* pFrame, quint32 nLength)
+{
+	if ( nLength < 2 || pFrame[0] == 0 )
+		return 0;
+
+	quint32 nLenLen		= ( (quint8)pFrame[0] & 0xC0 ) >> 6;
+	quint32 nTypeLen	= ( ( (quint8)pFrame[0] & 0x38 ) >> 3 ) + 1;
+
+	if ( 1 + nLenLen + nTypeLen > nLength )
+		return 0;
+
+	return G2PacketTypeFromString(pFrame + 1 + nLenLen, nTypeLen);
+}
+
+// Top level packets
+const G2_PACKET G2_PACKET_PING			= MAKE_G2_PACKET('P','I', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_PONG			= MAKE_G2_PACKET('P','O', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_LNI			= MAKE_G2_PACKET('L','N','I', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_KHL			= MAKE_G2_PACKET('K','H','L', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QHT			= MAKE_G2_PACKET('Q','H','T', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY			= MAKE_G2_PACKET('Q','2', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY_KEY_REQ	= MAKE_G2_PACKET('Q','K','R', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY_KEY_ANS	= MAKE_G2_PACKET('Q','K','A', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY_ACK		= MAKE_G2_PACKET('Q','A', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_HIT			= MAKE_G2_PACKET('Q','H','2', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_CRAWL_REQ		= MAKE_G2_PACKET('C','R','A','W','L','R', 0 , 0 );
+const G2_PACKET G2_PACKET_CRAWL_ANS		= MAKE_G2_PACKET('C','R','A','W','L','A', 0 , 0 );
+const G2_PACKET G2_PACKET_PUSH			= MAKE_G2_PACKET('P','U','S','H', 0 , 0 , 0 , 0 );
+
+// Children
+const G2_PACKET G2_PACKET_TO			= MAKE_G2_PACKET('T','O', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_UDP			= MAKE_G2_PACKET('U','D','P', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_RELAY			= MAKE_G2_PACKET('R','E','L','A','Y', 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_TFW			= MAKE_G2_PACKET('T','F','W', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_NODE_ADDRESS	= MAKE_G2_PACKET('N','A', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_NODE_GUID		= MAKE_G2_PACKET('G','U', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_HUB_STATUS	= MAKE_G2_PACKET('H','S', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY_KEY		= MAKE_G2_PACKET('Q','K', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_G2CORE		= MAKE_G2_PACKET('g','2','c','o','r','e', 0 , 0 );
+const G2_PACKET G2_PACKET_VENDOR		= MAKE_G2_PACKET('V', 0 , 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_NEIGHBOUR_HUB	= MAKE_G2_PACKET('N','H', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_NEIGHBOUR_LEAF	= MAKE_G2_PACKET('N','L', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_CACHED_HUB	= MAKE_G2_PACKET('C','H', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_TIMESTAMP		= MAKE_G2_PACKET('T','S', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY_ADDRESS	= MAKE_G2_PACKET('Q','N','A', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_REFRESH		= MAKE_G2_PACKET('R','E','F', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_SEND_ADDRESS	= MAKE_G2_PACKET('S','N','A', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY_CACHED	= MAKE_G2_PACKET('C','A','C','H','E','D', 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY_DONE	= MAKE_G2_PACKET('D', 0 , 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_QUERY_SEARCH	= MAKE_G2_PACKET('S', 0 , 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_RETRY_AFTER	= MAKE_G2_PACKET('R','A', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_FROM_ADDRESS	= MAKE_G2_PACKET('F','R', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_HIT_DESCRIPTOR	= MAKE_G2_PACKET('H', 0 , 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_URN			= MAKE_G2_PACKET('U','R','N', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_URL			= MAKE_G2_PACKET('U','R','L', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_DESCRIPTIVE_NAME	= MAKE_G2_PACKET('D','N', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_METADATA		= MAKE_G2_PACKET('M','D', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_SIZE			= MAKE_G2_PACKET('S','Z', 0 , 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_CACHED_SOURCES	= MAKE_G2_PACKET('C','S','C', 0 , 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_PARTIAL		= MAKE_G2_PACKET('P','A','R','T', 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_CRAWL_RLEAF	= MAKE_G2_PACKET('R','L','E','A','F', 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_CRAWL_RNAME	= MAKE_G2_PACKET('R','N','A','M','E', 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_CRAWL_RGPS		= MAKE_G2_PACKET('R','G','P','S', 0 , 0 , 0 , 0 );
+const G2_PACKET G2_PACKET_CRAWL_REXT		= MAKE_G2_PACKET('R','E','X','T', 0 , 0 , 0 , 0 );
+
+#endif // G2PACKETTYPES_H
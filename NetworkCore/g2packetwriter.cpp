@@ -0,0 +1,89 @@
+#include "g2packetwriter.h"
+
+G2PacketWriter::G2PacketWriter(G2Packet* pPacket)
+{
+	Q_ASSERT( pPacket != 0 );
+
+	m_pPacket	= pPacket;
+	m_nDepth	= 0;
+}
+
+G2PacketWriter::~G2PacketWriter()
+{
+	CloseAll();
+}
+
+// Starts a child of the innermost open child (or of the packet itself)
+void G2PacketWriter::Open(const char* pszType)
+{
+	Q_ASSERT( m_nDepth < G2_WRITER_DEPTH );
+	Q_ASSERT( strlen( pszType ) > 0 );
+
+	if ( m_nDepth )
+	{
+		Q_ASSERT( !m_pScopes[m_nDepth - 1].bPayload );
+		m_pScopes[m_nDepth - 1].bCompound = true;
+	}
+	else
+	{
+		m_pPacket->m_bCompound = true;
+	}
+
+	Scope& oScope	= m_pScopes[m_nDepth++];
+	oScope.nTypeLen	= qMin<quint32>( strlen( pszType ), 8 );
+	oScope.nHeader	= m_pPacket->m_nLength;
+	oScope.bCompound	= false;
+	oScope.bPayload	= false;
+
+	char* pOut = m_pPacket->WriteGetPointer( 4 + oScope.nTypeLen );
+	memset( pOut, 0, 4 );
+	memcpy( pOut + 4, pszType, oScope.nTypeLen );
+}
+
+// Ends the children of the open child, what follows is its payload
+void G2PacketWriter::Payload()
+{
+	Q_ASSERT( m_nDepth > 0 );
+
+	Scope& oScope = m_pScopes[m_nDepth - 1];
+
+	if ( oScope.bCompound && !oScope.bPayload )
+		m_pPacket->WriteByte( 0 );
+
+	oScope.bPayload = true;
+}
+
+void G2PacketWriter::Close()
+{
+	Q_ASSERT( m_nDepth > 0 );
+
+	Scope& oScope = m_pScopes[--m_nDepth];
+
+	quint32 nBody	= oScope.nHeader + 4 + oScope.nTypeLen;
+	quint32 nLength	= m_pPacket->m_nLength - nBody;
+
+	Q_ASSERT( nLength <= 0xFFFFFF );
+
+	quint32 nHeader	= G2Packet::GetHeaderLength( oScope.nTypeLen, nLength );
+	char* pHeader	= m_pPacket->m_pBuffer + oScope.nHeader;
+
+	// the placeholder is 4 + nTypeLen bytes, slide name and body down over the unused length bytes
+	quint32 nUnused = 4 + oScope.nTypeLen - nHeader;
+
+	if ( nUnused )
+	{
+		memmove( pHeader + nHeader - oScope.nTypeLen, pHeader + 4, oScope.nTypeLen + nLength );
+		m_pPacket->m_nLength -= nUnused;
+	}
+
+	char szType[9];
+	memcpy( szType, pHeader + nHeader - oScope.nTypeLen, oScope.nTypeLen );
+
+	G2Packet::WriteHeader( pHeader, szType, oScope.nTypeLen, nLength, oScope.bCompound );
+}
+
+void G2PacketWriter::CloseAll()
+{
+	while ( m_nDepth )
+		Close();
+}
@@ -0,0 +1,77 @@
+#ifndef G2PACKETWRITER_H
+#define G2PACKETWRITER_H
+
+#include "g2packet.h"
+
+// Builds nested children straight into one packet.
+//
+// Open() writes a child header with a 3 byte length placeholder, everything written to the
+// packet until the matching Close() is the child's body. Close() back-patches the length with
+// the shortest encoding and slides the body down over the unused length bytes, so no temporary
+// packets are needed for compound children and lengths never have to be known up front.
+// A child that has children is flagged compound automatically; Payload() writes the terminator
+// before a compound child's own payload.
+
+#define G2_WRITER_DEPTH	8
+
+class G2PacketWriter
+{
+public:
+	G2PacketWriter(G2Packet* pPacket);
+	~G2PacketWriter();
+
+// Operations
+public:
+	void	Open(const char* pszType);
+	void	Payload();
+	void	Close();
+	void	CloseAll();
+
+public:
+	inline G2Packet* operator->() const
+	{
+		return m_pPacket;
+	}
+	inline G2Packet* GetPacket() const
+	{
+		return m_pPacket;
+	}
+	inline quint32 GetDepth() const
+	{
+		return m_nDepth;
+	}
+
+// Attributes
+protected:
+	struct Scope
+	{
+		quint32	nHeader;	// offset of the control byte
+		quint32	nTypeLen;
+		bool	bCompound;
+		bool	bPayload;
+	};
+
+	G2Packet*	m_pPacket;
+	Scope		m_pScopes[G2_WRITER_DEPTH];
+	quint32		m_nDepth;
+};
+
+// Closes the child it opened when it goes out of scope
+class G2WriterScope
+{
+public:
+	inline G2WriterScope(G2PacketWriter& oWriter, const char* pszType)
+		: m_oWriter(oWriter)
+	{
+		m_oWriter.Open(pszType);
+	}
+	inline ~G2WriterScope()
+	{
+		m_oWriter.Close();
+	}
+
+protected:
+	G2PacketWriter&	m_oWriter;
+};
+
+#endif // G2PACKETWRITER_H
@@ -0,0 +1,145 @@
+#ifndef G2SCHEMA_H
+#define G2SCHEMA_H
+
+#include "g2packet.h"
+
+// Table driven child packet parsing.
+//
+// A handler declares the children it understands - type, minimum payload length and a reader -
+// in a static Rule table terminated by a zero type. The schema hashes the type ids into a small
+// collision free table once, so every child costs one multiply and one compare instead of a chain
+// of strcmp calls. Readers decode into a handler defined context struct and are called with the
+// packet positioned at the child payload (children already skipped unless bChildren is set);
+// the cursor is moved past the child afterwards whatever the reader consumed.
+//
+// TPacket is G2Packet or G2PacketView.
+
+template <class TPacket, class TContext>
+class G2ChildSchema
+{
+public:
+	typedef void (*Reader)(TContext& oContext, TPacket* pPacket, quint32 nLength);
+
+	struct Rule
+	{
+		G2_PACKET	nType;
+		quint32		nMinLength;
+		bool		bChildren;		// reader walks the child's own children, skipped unless compound
+		Reader		pReader;
+	};
+
+	enum { MaxBits = 8 };
+
+// Construction
+public:
+	G2ChildSchema(const Rule* pRules)
+	{
+		quint32 nRules = 0;
+		while ( pRules[nRules].nType )
+			nRules++;
+
+		m_pRules = pRules;
+		m_nBits = 0;
+
+		static const G2_PACKET pMultipliers[] = { Q_UINT64_C(0x9E3779B97F4A7C15), Q_UINT64_C(0xC2B2AE3D27D4EB4F), Q_UINT64_C(0x165667B19E3779F9) };
+
+		for ( quint32 nBits = 1 ; nBits <= MaxBits && !m_nBits ; nBits++ )
+		{
+			if ( ( 1u << nBits ) < nRules )
+				continue;
+
+			for ( quint32 nSeed = 0 ; nSeed < sizeof(pMultipliers) / sizeof(pMultipliers[0]) ; nSeed++ )
+			{
+				m_nMultiplier = pMultipliers[nSeed];
+				m_nBits = nBits;
+
+				if ( Build(nRules) )
+					break;
+
+				m_nBits = 0;
+			}
+		}
+
+		// no perfect hash found (more rules than MaxBits allows, or every multiplier
+		// collides) - m_nBits stays 0 and Find() scans the rules instead, still correct
+	}
+
+// Operations
+public:
+	inline const Rule* Find(G2_PACKET nType) const
+	{
+		if ( m_nBits )
+		{
+			const Rule* pRule = m_pTable[ Hash(nType) ];
+			return ( pRule && pRule->nType == nType ) ? pRule : 0;
+		}
+
+		for ( const Rule* pRule = m_pRules ; pRule->nType ; pRule++ )
+		{
+			if ( pRule->nType == nType )
+				return pRule;
+		}
+		return 0;
+	}
+
+	// Walks the children of pPacket from its current position.
+	// Returns false if the packet is not compound.
+	bool Read(TPacket* pPacket, TContext& oContext) const
+	{
+		if ( !pPacket->m_bCompound )
+			return false;
+
+		G2_PACKET nType = 0;
+		quint32 nLength = 0, nNext = 0;
+		bool bCompound = false;
+
+		while ( pPacket->ReadPacket(nType, nLength, &bCompound) )
+		{
+			nNext = pPacket->m_nPosition + nLength;
+
+			const Rule* pRule = Find(nType);
+
+			if ( pRule && ( bCompound || !pRule->bChildren ) )
+			{
+				if ( bCompound && !pRule->bChildren )
+					pPacket->SkipCompound(nLength);
+
+				if ( nLength >= pRule->nMinLength )
+					pRule->pReader(oContext, pPacket, nLength);
+			}
+
+			pPacket->m_nPosition = nNext;
+		}
+
+		return true;
+	}
+
+protected:
+	inline quint32 Hash(G2_PACKET nType) const
+	{
+		return quint32( ( nType * m_nMultiplier ) >> ( 64 - m_nBits ) );
+	}
+
+	bool Build(quint32 nRules)
+	{
+		memset(&m_pTable[0], 0, sizeof(m_pTable));
+
+		for ( quint32 i = 0 ; i < nRules ; i++ )
+		{
+			quint32 nSlot = Hash(m_pRules[i].nType);
+			if ( m_pTable[nSlot] )
+				return false;
+			m_pTable[nSlot] = &m_pRules[i];
+		}
+		return true;
+	}
+
+// Attributes
+protected:
+	const Rule*	m_pRules;
+	const Rule*	m_pTable[1 << MaxBits];
+	G2_PACKET	m_nMultiplier;
+	quint32		m_nBits;
+};
+
+#endif // G2SCHEMA_H
@@ -4,12 +4,16 @@
 #include "webcache.h"
 #include "hostcache.h"
 #include "g2packet.h"
+#include "g2packetwriter.h"
 #include "datagrams.h"
 #include <QTimer>
 #include <QList>
 #include "g2node.h"
 #include "NetworkConnection.h"
+#include "NetworkShard.h"
 #include "Handshakes.h"
+#include "TimerWheel.h"
+#include "Metrics.h"
 
 #include "quazaasettings.h"
 
@@ -24,17 +28,21 @@ CNetwork Network;
 CThread NetworkThread;
 
 CNetwork::CNetwork(QObject *parent)
-    :QObject(parent)
+    :QObject(parent), m_pSection("network", mlNetwork)
 {
     m_pSecondTimer = 0;
+    m_nShards = 0;
+    m_nStatsSerial = 0;
     //m_oAddress.port = 6346;
 	m_oAddress.port = quazaaSettings.Connection.Port;
 
     m_nHubsConnected = 0;
     m_nLeavesConnected = 0;
     m_bNeedUpdateLNI = true;
-    m_nLNIWait = 60;
-    m_nKHLWait = 60;
+    m_pTimerWheel = 0;
+    m_pMetricsServer = 0;
+    m_oLNITimer.Init(this, ntLNI);
+    m_oKHLTimer.Init(this, ntKHL);
     m_tCleanRoutesNext = 60;
 
 	m_nNextCheck = 0;
@@ -60,7 +68,7 @@ CNetwork::~CNetwork()
 
 void CNetwork::Connect()
 {
-    QMutexLocker l(&m_pSection);
+    PROFILED_LOCKER(l, &m_pSection);
 
     qDebug() << "connect " << QThread::currentThreadId();
 
@@ -86,18 +94,45 @@ void CNetwork::Connect()
     Handshakes.moveToThread(&NetworkThread);
     SearchManager.moveToThread(&NetworkThread);
     m_oRoutingTable.Clear();
+
+	m_nShards = quazaaSettings.Connection.NetworkThreads;
+	if( m_nShards <= 0 )
+		m_nShards = QThread::idealThreadCount();
+	m_nShards = qBound(1, m_nShards, NETWORK_SHARDS_MAX);
+
+	for( int i = 0; i < m_nShards; i++ )
+	{
+		CNetworkShard* pShard = new CNetworkShard(i);
+		pShard->Start();
+		m_lShards.append(pShard);
+	}
+
     NetworkThread.start(&m_pSection, this);
 
 }
 void CNetwork::Disconnect()
 {
-    QMutexLocker l(&m_pSection);
+    PROFILED_LOCKER(l, &m_pSection);
 
     qDebug() << "CNetwork::Disconnect() ThreadID:" << QThread::currentThreadId();
 
     if( m_bActive )
     {
         m_bActive = false;
+
+		// shards delete their nodes on the way out, which takes the lock
+		QList<CNetworkShard*> lShards = m_lShards;
+		m_lShards.clear();
+		l.unlock();
+
+		foreach( CNetworkShard* pShard, lShards )
+		{
+			pShard->Stop();
+			delete pShard;
+		}
+
+		l.relock();
+		PublishStats();
         NetworkThread.exit(0);
     }
 
@@ -107,21 +142,25 @@ void CNetwork::SetupThread()
     qWarning("In Network Thread");
     qDebug() << QThread::currentThreadId();
 
-    Q_ASSERT(m_pSecondTimer == 0 && m_pRateController == 0);
+    Q_ASSERT(m_pSecondTimer == 0 && m_pRateController == 0 && m_pTimerWheel == 0);
 
     m_pSecondTimer = new QTimer();
 	connect(m_pSecondTimer, SIGNAL(timeout()), this, SLOT(OnSecondTimer()));
     m_pSecondTimer->start(1000);
 
-    // Powiedzmy ze mamy lacze 2Mbit/s / 128kbit/s
-	quint32 nUploadCapacity = quazaaSettings.Connection.OutSpeed;
-	quint32 nDownloadCapacity = quazaaSettings.Connection.InSpeed;
-
-    // Dla polaczen TCP w sieci 1/4 dostepnego pasma
     m_pRateController = new CRateController();
     m_pRateController->setObjectName("CNetwork rate controller");
-	m_pRateController->SetDownloadLimit(nDownloadCapacity); // /4
-	m_pRateController->SetUploadLimit(nUploadCapacity);	// /4
+	UpdateRateLimits();
+
+	m_pTimerWheel = new CTimerWheel();
+	m_oLNITimer.Start(m_pTimerWheel, 60000);
+	m_oKHLTimer.Start(m_pTimerWheel, 60000);
+
+	if( quazaaSettings.Logging.MetricsPort > 0 )
+	{
+		m_pMetricsServer = new CMetricsServer();
+		m_pMetricsServer->Listen(quazaaSettings.Logging.MetricsPort);
+	}
 
 	Datagrams.Listen();
 	Handshakes.Listen();
@@ -139,7 +178,13 @@ void CNetwork::CleanupThread()
     Datagrams.Disconnect();
     Handshakes.Disconnect();
 
-	DisconnectAllNodes();
+	m_oLNITimer.Stop();
+	m_oKHLTimer.Stop();
+	delete m_pTimerWheel;
+	m_pTimerWheel = 0;
+
+	delete m_pMetricsServer;
+	m_pMetricsServer = 0;
 
 	delete m_pRateController;
 	m_pRateController = 0;
@@ -147,14 +192,111 @@ void CNetwork::CleanupThread()
     moveToThread(qApp->thread());
 }
 
+void CNetwork::UpdateRateLimits()
+{
+	ApplyRateLimits(m_pRateController, false);
+}
+
+// Zero stays zero (no limit), anything else never rounds down to it
+static inline qint64 SplitLimit(qint64 nLimit, qint64 nShares)
+{
+	return nLimit ? qMax(nLimit / nShares, qint64(1)) : 0;
+}
+
+// Root budget is the line capacity, hub/leaf/peer links and UDP each get their own under it.
+// Zero for a class means it may use whatever the root has. Each shard meters its own
+// neighbours, so it gets an even part of every TCP budget; the core's controller meters UDP.
+void CNetwork::ApplyRateLimits(CRateController* pController, bool bShard)
+{
+	qint64 nShares = bShard ? qMax(m_nShards, 1) : 1;
+
+	pController->SetDownloadLimit(SplitLimit(quazaaSettings.Connection.InSpeed, nShares));
+	pController->SetUploadLimit(SplitLimit(quazaaSettings.Connection.OutSpeed, nShares));
+
+	pController->SetClassLimits(rcHub, SplitLimit(quazaaSettings.Transfers.BandwidthHubIn, nShares), SplitLimit(quazaaSettings.Transfers.BandwidthHubOut, nShares));
+	pController->SetClassLimits(rcLeaf, SplitLimit(quazaaSettings.Transfers.BandwidthLeafIn, nShares), SplitLimit(quazaaSettings.Transfers.BandwidthLeafOut, nShares));
+	pController->SetClassLimits(rcPeer, SplitLimit(quazaaSettings.Transfers.BandwidthPeerIn, nShares), SplitLimit(quazaaSettings.Transfers.BandwidthPeerOut, nShares));
+	pController->SetClassLimits(rcUDP, 0, bShard ? 0 : quazaaSettings.Transfers.BandwidthUdpOut);
+}
+
+quint32 CNetwork::UploadSpeed()
+{
+	quint32 nSpeed = m_pRateController ? m_pRateController->UploadSpeed() : 0;
+
+	foreach( CNetworkShard* pShard, m_lShards )
+	{
+		if( pShard->m_pRateController )
+			nSpeed += pShard->m_pRateController->UploadSpeed();
+	}
+
+	return nSpeed;
+}
+quint32 CNetwork::DownloadSpeed()
+{
+	quint32 nSpeed = m_pRateController ? m_pRateController->DownloadSpeed() : 0;
+
+	foreach( CNetworkShard* pShard, m_lShards )
+	{
+		if( pShard->m_pRateController )
+			nSpeed += pShard->m_pRateController->DownloadSpeed();
+	}
+
+	return nSpeed;
+}
+
+// Merges what the shards copied out of their nodes on their last tick. The GUI picks it up
+// from m_oStats without ever taking m_pSection or touching a node.
+void CNetwork::PublishStats()
+{
+	CNeighbourSnapshot* pSnapshot = new CNeighbourSnapshot();
+	pSnapshot->m_nSerial = ++m_nStatsSerial;
+
+	foreach( CNetworkShard* pShard, m_lShards )
+		pSnapshot->m_lNodes += pShard->m_lStats;
+
+	m_oStats.Publish(pSnapshot);
+}
+
+// Gauges sampled once a tick, the shards keep the send queue total themselves
+void CNetwork::UpdateMetrics()
+{
+	Metrics.SetGauge(mgNodes, m_lNodes.size());
+	Metrics.SetGauge(mgUdpSendQueue, Datagrams.m_SendCache.GetCount());
+
+	Metrics.SetGauge(mgUdpReassembly, Datagrams.m_RecvCache.size());
+
+	Metrics.SetFile(quazaaSettings.Logging.MetricsFile, quazaaSettings.Logging.MetricsPeriod, quazaaSettings.Logging.MetricsFileSize);
+}
+
+// The least loaded shard, 0 while the network is down
+CNetworkShard* CNetwork::PickShard()
+{
+	if( !m_bActive )
+		return 0;
+
+	CNetworkShard* pBest = 0;
+
+	foreach( CNetworkShard* pShard, m_lShards )
+	{
+		if( !pBest || pShard->GetLoad() < pBest->GetLoad() )
+			pBest = pShard;
+	}
+
+	return pBest;
+}
+
+// Called from the node's destructor, in its shard's thread
 void CNetwork::RemoveNode(CG2Node* pNode)
 {
+	PROFILED_LOCKER(l, &m_pSection);
+
     if( pNode->m_nType == G2_HUB )
         m_nHubsConnected--;
     else if( pNode->m_nType == G2_LEAF )
         m_nLeavesConnected--;
 
-    m_pRateController->RemoveSocket(pNode);
+	if( pNode->m_pShard )
+		pNode->m_pShard->RemoveNode(pNode);
 
     emit NodeRemoved(pNode);
     m_lNodes.removeOne(pNode);
@@ -166,12 +308,8 @@ void CNetwork::RemoveNode(CG2Node* pNode)
 
 void CNetwork::OnSecondTimer()
 {
-
-	if( !m_pSection.tryLock(150) )
-    {
-        qWarning() << "WARNING: Network core overloaded!";
-        return;
-	}
+	static CLockSite oSite = LOCK_SITE(0);
+	m_pSection.lock(&oSite);
 
     if( !m_bActive )
     {
@@ -184,18 +322,22 @@ void CNetwork::OnSecondTimer()
         WebCache.RequestRandom();
     }
 
+	UpdateRateLimits();
+	PublishStats();
+	UpdateMetrics();
+
     if( m_tCleanRoutesNext > 0 )
         m_tCleanRoutesNext--;
     else
     {
 		//m_oRoutingTable.Dump();
         m_oRoutingTable.ExpireOldRoutes();
+		G2Packets.Trim();
         m_tCleanRoutesNext = 60;
     }
 
 	//Datagrams.FlushSendCache();
 	emit Datagrams.SendQueueUpdated();
-    Handshakes.OnTimer();
 
 	if( isHub() && quazaaSettings.Gnutella2.AdaptiveHub && --m_nNextCheck == 0 )
 	{
@@ -207,47 +349,52 @@ void CNetwork::OnSecondTimer()
 
     SearchManager.OnTimer();
 
-    if( m_nLNIWait == 0 )
-    {
-        if( m_bNeedUpdateLNI )
-        {
-			m_nLNIWait = quazaaSettings.Gnutella2.LNIMinimumUpdate;
-            m_bNeedUpdateLNI = false;
+	if( m_bNeedUpdateLNI && !m_oLNITimer.IsActive() )
+		BroadcastLNI();
 
-            foreach( CG2Node* pNode, m_lNodes )
-            {
-                if( pNode->m_nState == nsConnected )
-                    pNode->SendLNI();
-            }
-        }
-    }
-    else
-        m_nLNIWait--;
+	m_pSection.unlock();
 
-    if( m_nKHLWait == 0 )
-    {
-        HostCache.Save();
-        DispatchKHL();
-		m_nKHLWait = quazaaSettings.Gnutella2.KHLPeriod;
-    }
-    else
-        m_nKHLWait--;
+	Metrics.Collect();
+}
 
-	m_pSection.unlock();
+// Network thread, from m_pTimerWheel
+void CNetwork::OnTimerExpired(int nTimer)
+{
+	PROFILED_LOCKER(l, &m_pSection);
+
+	if( !m_bActive )
+		return;
+
+	switch( nTimer )
+	{
+	case ntLNI:
+		if( m_bNeedUpdateLNI )
+			BroadcastLNI();
+		break;
+
+	case ntKHL:
+		HostCache.Save();
+		DispatchKHL();
+		m_oKHLTimer.Start(m_pTimerWheel, quazaaSettings.Gnutella2.KHLPeriod * 1000);
+		break;
+	}
 }
 
-void CNetwork::DisconnectAllNodes()
+// At most one every LNIMinimumUpdate seconds, m_oLNITimer holds back the next
+void CNetwork::BroadcastLNI()
 {
-    QListIterator<CG2Node*> it(m_lNodes);
-    CG2Node* pNode = 0;
-    while( it.hasNext() )
-    {
-        pNode = it.next();
-		RemoveNode(pNode);
-        pNode->abort();
-		delete pNode;
-    }
+	m_bNeedUpdateLNI = false;
+	m_oLNITimer.Start(m_pTimerWheel, quazaaSettings.Gnutella2.LNIMinimumUpdate * 1000);
+
+	QByteArray baLNI = CG2Node::LNIFrame();
+
+	foreach( CG2Node* pNode, m_lNodes )
+	{
+		if( pNode->m_nState == nsConnected )
+			pNode->SendFrame(baLNI);
+	}
 }
+
 bool CNetwork::NeedMore(G2NodeType nType)
 {
     if( nType == G2_HUB ) // potrzeba hubow?
@@ -272,19 +419,12 @@ void CNetwork::Maintain()
     //qDebug() << "CNetwork::Maintain";
     CG2Node* pNode = 0;
 
-    quint32 tNow = time(0);
-
-    QListIterator<CG2Node*> it(m_lNodes);
-    while(it.hasNext())
-    {
-        pNode = it.next();
-        pNode->OnTimer(tNow);
-    }
+    // node timers run in their shards
 
     quint32 nHubs = 0, nLeaves = 0, nUnknown = 0;
     quint32 nCoreHubs = 0, nCoreLeaves = 0;
 
-    it.toFront();
+    QListIterator<CG2Node*> it(m_lNodes);
     while(it.hasNext())
     {
         pNode = it.next();
@@ -417,14 +557,20 @@ void CNetwork::DispatchKHL()
         return;
 
     G2Packet* pKHL = G2Packet::New("KHL");
+	G2PacketWriter oKHL(pKHL);
+
     quint32 ts = time(0);
-	pKHL->WritePacket("TS", 4)->WriteIntLE(ts);
+	oKHL.Open("TS");
+		pKHL->WriteIntLE(ts);
+	oKHL.Close();
 
     foreach(CG2Node* pNode, m_lNodes)
     {
         if( pNode->m_nType == G2_HUB && pNode->m_nState == nsConnected )
         {
-			pKHL->WritePacket("NH", 6)->WriteHostAddress(&pNode->m_oAddress);
+			oKHL.Open("NH");
+				pKHL->WriteHostAddress(&pNode->m_oAddress);
+			oKHL.Close();
         }
     }
 
@@ -432,19 +578,23 @@ void CNetwork::DispatchKHL()
 
 	for( ; nCount < (quint32)quazaaSettings.Gnutella2.KHLHubCount && HostCache.size() > nCount; nCount++ )
 	{
-		pKHL->WritePacket("CH", 10)->WriteHostAddress(&HostCache.m_lHosts.at(nCount)->m_oAddress);
-		pKHL->WriteIntLE(&HostCache.m_lHosts.at(nCount)->m_tTimestamp);
+		oKHL.Open("CH");
+			pKHL->WriteHostAddress(&HostCache.m_lHosts.at(nCount)->m_oAddress);
+			pKHL->WriteIntLE(&HostCache.m_lHosts.at(nCount)->m_tTimestamp);
+		oKHL.Close();
 	}
 
 
+	QByteArray baKHL = pKHL->ToFrame();
+	pKHL->Release();
+
     foreach(CG2Node* pNode, m_lNodes)
     {
         if( pNode->m_nState == nsConnected )
         {
-			pNode->SendPacket(pKHL, false, false);
+			pNode->SendFrame(baKHL);
         }
     }
-	pKHL->Release();
 }
 
 void CNetwork::OnNodeStateChange()
@@ -456,22 +606,22 @@ void CNetwork::OnNodeStateChange()
 
 void CNetwork::OnAccept(QTcpSocket* pConn)
 {
-	if( !m_pSection.tryLock(50) )
+	PROFILED_LOCKER(l, &m_pSection);
+
+	CNetworkShard* pShard = PickShard();
+	if( !pShard )
 	{
-		qDebug() << "Not accepting incoming connection. Network overloaded";
 		pConn->abort();
 		delete pConn;
 		return;
 	}
 
     CG2Node* pNew = new CG2Node();
-    pNew->moveToThread(&NetworkThread);
     pNew->AttachTo(pConn);
 	connect(pNew, SIGNAL(NodeStateChanged()), this, SLOT(OnNodeStateChange()));
     emit NodeAdded(pNew);
-    m_pRateController->AddSocket(pNew);
     m_lNodes.append(pNew);
-	m_pSection.unlock();
+	pShard->Assign(pNew);
 }
 
 bool CNetwork::IsListening()
@@ -511,7 +661,7 @@ void CNetwork::DropYoungest(G2NodeType nType, bool bCore)
     }
 
     if( pNode )
-        pNode->disconnectFromHost();
+		QMetaObject::invokeMethod(pNode, "OnDisconnectRequest", Qt::QueuedConnection, Q_ARG(bool, false));
 }
 
 void CNetwork::AcquireLocalAddress(QString &sHeader)
@@ -656,19 +806,23 @@ void CNetwork::AdaptiveHubRun()
 
 void CNetwork::ConnectTo(IPv4_ENDPOINT &addr)
 {
+	CNetworkShard* pShard = PickShard();
+	if( !pShard )
+		return;
+
+	// the shard dials it, see CNetworkShard::OnAssigned
 	CG2Node* pNew = new CG2Node();
+	pNew->m_oAddress = addr;
 	connect(pNew, SIGNAL(NodeStateChanged()), this, SLOT(OnNodeStateChange()));
 	emit NodeAdded(pNew);
-	m_pRateController->AddSocket(pNew);
 	m_lNodes.append(pNew);
-	pNew->connectToHost(addr);
-	pNew->moveToThread(&NetworkThread);
+	pShard->Assign(pNew);
 }
 
 // WARNING: pNode must be a valid pointer
 void CNetwork::DisconnectFrom(CG2Node *pNode)
 {
-	pNode->close();
+	QMetaObject::invokeMethod(pNode, "OnDisconnectRequest", Qt::QueuedConnection, Q_ARG(bool, true));
 }
 void CNetwork::DisconnectFrom(int index)
 {
@@ -7,22 +7,27 @@
 #include "types.h"
 #include "RateController.h"
 #include "RouteTable.h"
+#include "NeighbourStats.h"
+#include "TimerWheel.h"
+#include "LockProfiler.h"
 
 class QTimer;
 class CG2Node;
 class QTcpSocket;
 class CThread;
+class CNetworkShard;
+class CMetricsServer;
 class G2Packet;
 
 class QueryHashTable;   // przeniesc to w chuj!
 class CManagedSearch;
 
-class CNetwork : public QObject
+class CNetwork : public QObject, public CTimerTarget
 {
     Q_OBJECT
 
 public:    
-    QMutex  m_pSection;
+    CProfiledMutex  m_pSection;
 
     QueryHashTable* m_pHashTable;   // przeniesc!
 public:
@@ -30,12 +35,16 @@ public:
     QTimer*          m_pSecondTimer;
     G2NodeType       m_nNodeState;
     QList<CG2Node*>  m_lNodes;
-    CRateController* m_pRateController;
+    QList<CNetworkShard*> m_lShards;	// I/O workers, each owns a part of m_lNodes
+    int              m_nShards;
+    CRateController* m_pRateController;	// meters UDP, neighbours use their shard's
     quint16          m_nHubsConnected;
     quint16          m_nLeavesConnected;
     bool             m_bNeedUpdateLNI;
-    quint32          m_nLNIWait;
-    quint32          m_nKHLWait;
+    CTimerWheel*     m_pTimerWheel;		// network thread: handshakes, LNI and KHL
+    CMetricsServer*  m_pMetricsServer;	// 0 unless Logging.MetricsPort is set
+    CWheelTimer      m_oLNITimer;		// running while LNIs are held back
+    CWheelTimer      m_oKHLTimer;
     IPv4_ENDPOINT    m_oAddress;
 
     CRouteTable      m_oRoutingTable;
@@ -45,13 +54,15 @@ public:
 	quint32			 m_nBusyPeriods;	// num of busy periods
 	quint32			 m_nTotalPeriods;	// how many check periods?
 
+    CNeighbourStatsMailbox m_oStats;	// per-tick node stats for the GUI, see PublishStats()
+    quint32          m_nStatsSerial;
+
 public:
     CNetwork(QObject* parent = 0);
     ~CNetwork();
 
     void Connect();
     void Disconnect();
-    void DisconnectAllNodes();
 
     void RemoveNode(CG2Node* pNode);
     bool NeedMore(G2NodeType nType);
@@ -75,27 +86,18 @@ public:
         return m_oAddress;
     }
 
-    inline quint32 UploadSpeed()
-    {
-        if( m_pRateController )
-        {
-            return m_pRateController->UploadSpeed();
-        }
-        return 0;
-    }
-    inline quint32 DownloadSpeed()
-    {
-        if( m_pRateController )
-        {
-            return m_pRateController->DownloadSpeed();
-        }
-        return 0;
-    }
+    quint32 UploadSpeed();
+    quint32 DownloadSpeed();
 
     QList<CG2Node*>* List(){ return &m_lNodes; }
 
     bool IsConnectedTo(IPv4_ENDPOINT addr);
 
+    void ApplyRateLimits(CRateController* pController, bool bShard);
+
+    enum NetworkTimer { ntLNI, ntKHL };
+    void OnTimerExpired(int nTimer);
+
 public slots:
     void OnSecondTimer();
 
@@ -116,7 +118,12 @@ signals:
 
 protected:
     void Maintain();
+    void UpdateRateLimits();
+    CNetworkShard* PickShard();
+    void PublishStats();
+    void UpdateMetrics();
     void DispatchKHL();
+    void BroadcastLNI();
     void DropYoungest(G2NodeType nType, bool bCore = false);
 	void AdaptiveHubRun();
 
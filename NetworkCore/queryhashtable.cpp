@@ -25,27 +25,6 @@ void QueryHashTable::Add(const char* pSz, const quint32 nLength)
     m_pTable[ nByte ] &= ~( 1 << nBit );
 }
 
-quint32 QueryHashTable::HashWord(const char* pSz, quint32 nLength, qint32 nBits)
-{
-    quint32 nNumber = 0;
-    int nByte = 0;
-    for ( ; nLength > 0 ; nLength--, pSz++ )
-    {
-        int nValue = tolower( *pSz ) & 0xFF;
-        nValue = nValue << ( nByte * 8 );
-        nByte = ( nByte + 1 ) & 3;
-        nNumber = nNumber ^ nValue;
-    }
-    return HashNumber( nNumber, nBits );
-}
-
-quint32 QueryHashTable::HashNumber(quint32 nNumber, qint32 nBits)
-{
-    quint64 nProduct = (quint64)nNumber * (quint64)0x4F1BBCDC;
-    quint64 nHash = ( nProduct << 32 ) >> ( 32 + ( 32 - nBits ) );
-    return (quint32)nHash;
-}
-
 void QueryHashTable::Reset()
 {
     memset(m_pTable, 0xFF, m_nTableSize);
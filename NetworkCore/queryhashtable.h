@@ -2,6 +2,7 @@
 #define QUERYHASHTABLE_H
 
 #include "types.h"
+#include <ctype.h>
 class QString;
 class QByteArray;
 class CG2Node;
@@ -15,8 +16,6 @@ protected:
 
 protected:
     void    Add(const char* pSz, const quint32 nLength);
-    quint32 HashWord(const char* pSz, const quint32 nLength, qint32 nBits);
-    quint32 HashNumber(quint32 nNumber, qint32 nBits);
 
 public:
     QueryHashTable();
@@ -45,6 +44,27 @@ public:
     {
         return m_pTable;
     }
+
+public:
+    static inline quint32 HashWord(const char* pSz, quint32 nLength, qint32 nBits)
+    {
+        quint32 nNumber = 0;
+        int nByte = 0;
+        for ( ; nLength > 0 ; nLength--, pSz++ )
+        {
+            int nValue = tolower( *pSz ) & 0xFF;
+            nValue = nValue << ( nByte * 8 );
+            nByte = ( nByte + 1 ) & 3;
+            nNumber = nNumber ^ nValue;
+        }
+        return HashNumber( nNumber, nBits );
+    }
+    static inline quint32 HashNumber(quint32 nNumber, qint32 nBits)
+    {
+        quint64 nProduct = (quint64)nNumber * (quint64)0x4F1BBCDC;
+        quint64 nHash = ( nProduct << 32 ) >> ( 32 + ( 32 - nBits ) );
+        return (quint32)nHash;
+    }
 };
 
 #pragma pack(push,1)
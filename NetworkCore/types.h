@@ -61,7 +61,7 @@ struct IPv4_ENDPOINT
         }
     }
 
-    QString toString()
+    QString toString() const
     {
         QString r;
 
@@ -69,7 +69,7 @@ struct IPv4_ENDPOINT
 
         return r;
     }
-    QString toStringNoPort()
+    QString toStringNoPort() const
     {
         QString r;
 
@@ -71,12 +71,21 @@ SOURCES += main.cpp \
     NetworkCore/Query.cpp \
     NetworkCore/parser.cpp \
     NetworkCore/NetworkConnection.cpp \
+    NetworkCore/BufferChain.cpp \
+    NetworkCore/EpollReactor.cpp \
     NetworkCore/network.cpp \
+    NetworkCore/NetworkShard.cpp \
+    NetworkCore/Metrics.cpp \
+    NetworkCore/LockProfiler.cpp \
+    NetworkCore/UdpBatch.cpp \
+    NetworkCore/TimerWheel.cpp \
     NetworkCore/ManagedSearch.cpp \
     NetworkCore/hostcache.cpp \
     NetworkCore/Handshakes.cpp \
     NetworkCore/Handshake.cpp \
     NetworkCore/g2packet.cpp \
+    NetworkCore/g2packetwriter.cpp \
+    NetworkCore/PacketCapture.cpp \
     NetworkCore/g2node.cpp \
     NetworkCore/datagrams.cpp \
     NetworkCore/datagramfrags.cpp \
@@ -116,6 +125,7 @@ SOURCES += main.cpp \
     3rdparty/CyoEncode/CyoDecode.c \
     Models/NeighboursTableModel.cpp \
     Models/searchtreemodel.cpp \
+    Models/PacketDumpModel.cpp \
     geoiplist.cpp \
     UI/dialogconnectto.cpp \
     ShareManager/ShareManager.cpp \
@@ -170,12 +180,24 @@ HEADERS += UI/dialoglanguage.h \
     NetworkCore/QueryHit.h \
     NetworkCore/Query.h \
     NetworkCore/NetworkConnection.h \
+    NetworkCore/BufferChain.h \
+    NetworkCore/EpollReactor.h \
     NetworkCore/network.h \
+    NetworkCore/NetworkShard.h \
+    NetworkCore/NeighbourStats.h \
+    NetworkCore/TimerWheel.h \
+    NetworkCore/Metrics.h \
+    NetworkCore/LockProfiler.h \
+    NetworkCore/UdpBatch.h \
     NetworkCore/ManagedSearch.h \
     NetworkCore/hostcache.h \
     NetworkCore/Handshakes.h \
     NetworkCore/Handshake.h \
     NetworkCore/g2packet.h \
+    NetworkCore/g2packettypes.h \
+    NetworkCore/g2packetwriter.h \
+    NetworkCore/PacketCapture.h \
+    NetworkCore/g2schema.h \
     NetworkCore/g2node.h \
     NetworkCore/datagrams.h \
     NetworkCore/datagramfrags.h \
@@ -221,6 +243,7 @@ HEADERS += UI/dialoglanguage.h \
     3rdparty/CyoEncode/CyoDecode.h \
     Models/NeighboursTableModel.h \
     Models/searchtreemodel.h \
+    Models/PacketDumpModel.h \
     geoiplist.h \
     UI/dialogconnectto.h \
     ShareManager/ShareManager.h \
@@ -10,7 +10,7 @@ CThread ShareManagerThread;
 CShareManager ShareManager;
 
 CShareManager::CShareManager(QObject *parent) :
-    QObject(parent), m_pWatcher()
+    QObject(parent), m_pSection("shares", mlShares), m_pWatcher()
 {
     m_pSharedFiles = 0;
     m_nCurrentHasher = 0;
@@ -35,7 +35,8 @@ CShareManager::~CShareManager()
 
 void CShareManager::Initialize()
 {
-    m_pSection.lock();
+    static CLockSite oSite = LOCK_SITE(0);
+    m_pSection.lock(&oSite);
     LoadDatabase();
     m_pSection.unlock();
     ShareManagerThread.start(&m_pSection, this);
@@ -48,7 +49,8 @@ void CShareManager::SetupThread()
 
 void CShareManager::OnInitialize()
 {
-    m_pSection.lock();
+    static CLockSite oSite = LOCK_SITE(0);
+    m_pSection.lock(&oSite);
 
     connect(&m_pWatcher, SIGNAL(directoryChanged(QString)), this, SLOT(ScanFolder(QString)));
 
@@ -150,7 +152,8 @@ void CShareManager::ScanFolder(QString sPath)
 
 void CShareManager::OnFileHashed(CSharedFilePtr pFile)
 {
-    m_pSection.lock();
+    static CLockSite oSite = LOCK_SITE(0);
+    m_pSection.lock(&oSite);
 
     static quint32 nCounter = 0;
     nCounter++;
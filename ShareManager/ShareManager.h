@@ -4,6 +4,7 @@
 #include <QObject>
 #include <QFileSystemWatcher>
 #include "Thread.h"
+#include "LockProfiler.h"
 #include "ShareManager/SharedFile.h"
 #include "ShareManager/SharedFiles.h"
 
@@ -15,7 +16,7 @@ class CShareManager : public QObject
     Q_OBJECT
 
 public:
-    QMutex m_pSection;
+    CProfiledMutex m_pSection;
 
 protected:
     CSharedFiles* m_pSharedFiles;
@@ -40,7 +40,8 @@ void DialogConnectTo::on_pushButtonConnect_clicked()
 
 	IPv4_ENDPOINT ip(ui->lineEditIPAddress->text() + ":" + ui->spinBoxPort->text());
 
-	Network.m_pSection.lock();
+	static CLockSite oSite = LOCK_SITE(0);
+	Network.m_pSection.lock(&oSite);
 	Network.ConnectTo(ip);
 	Network.m_pSection.unlock();
 
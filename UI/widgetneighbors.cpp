@@ -88,19 +88,25 @@ void WidgetNeighbors::updateG2()
 	quint16 nUDPInSpeed = 0;
 	quint16 nUDPOutSpeed = 0;
 
-	if( Network.m_pSection.tryLock(50) && bEmit  )
+	if( bEmit )
 	{
-		nHubsConnected = Network.m_nHubsConnected;
-		nLeavesConnected = Network.m_nLeavesConnected;
-		nTCPInSpeed = Network.DownloadSpeed();
-		nTCPOutSpeed = Network.UploadSpeed();
-		Network.m_pSection.unlock();
-	}
-	if( Datagrams.m_pSection.tryLock(50) && bEmit )
-	{
-		nUDPInSpeed = Datagrams.DownloadSpeed();
-		nUDPOutSpeed = Datagrams.UploadSpeed();
-		Datagrams.m_pSection.unlock();
+		static CLockSite oNetworkSite = LOCK_SITE("G2 panel hub/leaf counts and TCP speed");
+		if( Network.m_pSection.tryLock(&oNetworkSite, 50) )
+		{
+			nHubsConnected = Network.m_nHubsConnected;
+			nLeavesConnected = Network.m_nLeavesConnected;
+			nTCPInSpeed = Network.DownloadSpeed();
+			nTCPOutSpeed = Network.UploadSpeed();
+			Network.m_pSection.unlock();
+		}
+
+		static CLockSite oDatagramsSite = LOCK_SITE("G2 panel UDP speed");
+		if( Datagrams.m_pSection.tryLock(&oDatagramsSite, 50) )
+		{
+			nUDPInSpeed = Datagrams.DownloadSpeed();
+			nUDPOutSpeed = Datagrams.UploadSpeed();
+			Datagrams.m_pSection.unlock();
+		}
 	}
 	labelG2Stats->setText(tr(" %1 Hubs, %2 Leaves, %3/s In:%4/s Out").arg(nHubsConnected).arg(nLeavesConnected).arg(Functions.FormatBytes(nTCPInSpeed + nUDPInSpeed)).arg(Functions.FormatBytes(nTCPOutSpeed + nUDPOutSpeed)));
 }
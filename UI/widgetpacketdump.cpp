@@ -3,6 +3,11 @@
 
 #include "quazaasettings.h"
 #include "QSkinDialog/qskinsettings.h"
+#include "PacketDumpModel.h"
+#include "PacketCapture.h"
+
+#include <QApplication>
+#include <QScrollBar>
 
 WidgetPacketDump::WidgetPacketDump(QWidget *parent) :
     QMainWindow(parent),
@@ -12,6 +17,16 @@ WidgetPacketDump::WidgetPacketDump(QWidget *parent) :
 	restoreState(quazaaSettings.WinMain.PacketDumpToolbar);
 	connect(&skinSettings, SIGNAL(skinChanged()), this, SLOT(skinChangeEvent()));
 	skinChangeEvent();
+
+	m_nLastSequence = 0;
+	m_pModel = new CPacketDumpModel(this);
+	ui->treeViewPacketDump->setModel(m_pModel);
+
+	// The capture ring is filled by the network threads, the view only polls it
+	connect(&m_tPoll, SIGNAL(timeout()), this, SLOT(onPoll()));
+	m_tPoll.setInterval(500);
+
+	ui->actionPacketDumpCapture->setChecked(quazaaSettings.Logging.PacketCapture);
 }
 
 WidgetPacketDump::~WidgetPacketDump()
@@ -41,3 +56,67 @@ void WidgetPacketDump::saveWidget()
 	quazaaSettings.WinMain.PacketDumpToolbar = saveState();
 }
 
+void WidgetPacketDump::startCapture()
+{
+	QString sPath = qApp->applicationDirPath() + "/PacketCapture.g2cap";
+
+	if( PacketCapture.Open(sPath, quint32(qMax(1, quazaaSettings.Logging.PacketCaptureSize)) * 1024 * 1024) )
+	{
+		m_nLastSequence = 0;
+		if( !ui->actionPacketDumpPauseDisplay->isChecked() )
+			m_tPoll.start();
+	}
+	else
+	{
+		ui->actionPacketDumpCapture->setChecked(false);
+	}
+}
+
+// Copies the records captured since the last poll, a bounded batch per tick
+void WidgetPacketDump::onPoll()
+{
+	QList<QByteArray> lRecords;
+	m_nLastSequence = PacketCapture.Read(lRecords, m_nLastSequence, 2000);
+
+	if( lRecords.isEmpty() )
+		return;
+
+	QScrollBar* pScroll = ui->treeViewPacketDump->verticalScrollBar();
+	bool bFollow = ( pScroll->value() == pScroll->maximum() );
+
+	m_pModel->AddRecords(lRecords);
+
+	if( bFollow )
+		ui->treeViewPacketDump->scrollToBottom();
+}
+
+void WidgetPacketDump::on_actionPacketDumpCapture_toggled(bool bChecked)
+{
+	quazaaSettings.Logging.PacketCapture = bChecked;
+
+	if( bChecked )
+	{
+		if( !PacketCapture.IsEnabled() )
+			startCapture();
+	}
+	else
+	{
+		m_tPoll.stop();
+		onPoll();
+		PacketCapture.Close();
+	}
+}
+
+void WidgetPacketDump::on_actionPacketDumpPauseDisplay_toggled(bool bChecked)
+{
+	if( bChecked )
+		m_tPoll.stop();
+	else if( PacketCapture.IsEnabled() )
+		m_tPoll.start();
+}
+
+void WidgetPacketDump::on_actionPacketDumpClearBuffer_triggered()
+{
+	m_pModel->Clear();
+}
+
@@ -2,6 +2,9 @@
 #define WIDGETPACKETDUMP_H
 
 #include <QMainWindow>
+#include <QTimer>
+
+class CPacketDumpModel;
 
 namespace Ui {
     class WidgetPacketDump;
@@ -19,9 +22,18 @@ protected:
 
 private:
     Ui::WidgetPacketDump *ui;
+	CPacketDumpModel* m_pModel;
+	QTimer m_tPoll;
+	quint64 m_nLastSequence;
+
+	void startCapture();
 
 private slots:
 	void skinChangeEvent();
+	void onPoll();
+	void on_actionPacketDumpCapture_toggled(bool bChecked);
+	void on_actionPacketDumpPauseDisplay_toggled(bool bChecked);
+	void on_actionPacketDumpClearBuffer_triggered();
 };
 
 #endif // WIDGETPACKETDUMP_H
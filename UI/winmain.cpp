@@ -26,6 +26,7 @@
 #include "commonfunctions.h"
 #include "network.h"
 #include "datagrams.h"
+#include "LockProfiler.h"
 #include "geoiplist.h"
 
 #include "NetworkCore/network.h" // not sure that it is right place, but...
@@ -49,6 +50,9 @@ WinMain::WinMain(QWidget *parent) :
 	quazaaSettings.loadSettings();
 	interfaceLoaded = false;
 
+	LockProfiler.SetEnabled(quazaaSettings.Logging.LockProfiler);
+	LockProfiler.InstallSignalHandler();
+
 	//Initialize multilanguage support
 	quazaaSettings.loadLanguageSettings();
 
@@ -291,6 +295,7 @@ WinMain::WinMain(QWidget *parent) :
 		connect(neighboursRefresher, SIGNAL(timeout()), neighboursList, SLOT(UpdateAll()));
 		connect(neighboursRefresher, SIGNAL(timeout()), this, SLOT(updateBandwidth()));
 		connect(neighboursRefresher, SIGNAL(timeout()), pageActivity->panelNeighbors, SLOT(updateG2()));
+		connect(neighboursRefresher, SIGNAL(timeout()), this, SLOT(checkLockProfiler()));
 		neighboursRefresher->start(1000);
 
 	// Tray icon construction
@@ -654,6 +659,11 @@ void WinMain::on_actionPacketDump_triggered()
 	quazaaSettings.WinMain.ActiveTab = 12;
 }
 
+void WinMain::on_actionDumpLockProfile_triggered()
+{
+	LockProfiler.Dump();
+}
+
 void WinMain::on_actionSearchMonitor_triggered()
 {
 	ui->actionSearchMonitor->setChecked(true);
@@ -974,13 +984,17 @@ void WinMain::updateBandwidth()
 	quint16 nUDPInSpeed = 0;
 	quint16 nUDPOutSpeed = 0;
 
-	if( Network.m_pSection.tryLock() && bEmit  )
+	if( bEmit )
 	{
-		nTCPInSpeed = Network.DownloadSpeed();
-		nTCPOutSpeed = Network.UploadSpeed();
-		nUDPInSpeed = Datagrams.DownloadSpeed();
-		nUDPOutSpeed = Datagrams.UploadSpeed();
-		Network.m_pSection.unlock();
+		static CLockSite oSite = LOCK_SITE("status bar bandwidth totals");
+		if( Network.m_pSection.tryLock(&oSite) )
+		{
+			nTCPInSpeed = Network.DownloadSpeed();
+			nTCPOutSpeed = Network.UploadSpeed();
+			nUDPInSpeed = Datagrams.DownloadSpeed();
+			nUDPOutSpeed = Datagrams.UploadSpeed();
+			Network.m_pSection.unlock();
+		}
 	}
 	/*if( Datagrams.m_pSection.tryLock(50) && bEmit )
 	{
@@ -989,6 +1003,13 @@ void WinMain::updateBandwidth()
 	labelBandwidthTotals->setText(tr("%1/s In:%2/s Out [D:%3/U:%4]").arg(Functions.FormatBytes(nTCPInSpeed + nUDPInSpeed)).arg(Functions.FormatBytes(nTCPOutSpeed + nUDPOutSpeed)).arg("0").arg("0"));
 }
 
+// SIGUSR1 only sets a flag, the dump is written from here
+void WinMain::checkLockProfiler()
+{
+	if( LockProfiler.TakeDumpRequest() )
+		LockProfiler.Dump();
+}
+
 void WinMain::on_actionConnectTo_triggered()
 {
 	QSkinDialog *dlgSkinConnectTo = new QSkinDialog(false, true, false, this);
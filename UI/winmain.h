@@ -100,6 +100,7 @@ private slots:
  void on_actionExit_triggered();
  void on_actionShowOrHide_triggered();
 	void on_actionHitMonitor_triggered();
+	void on_actionDumpLockProfile_triggered();
 	void on_actionSearchMonitor_triggered();
 	void on_actionPacketDump_triggered();
 	void on_actionGraph_triggered();
@@ -119,6 +120,7 @@ private slots:
 	void skinChangeEvent();
 	void startNewSearch(QString *searchString);
 	void updateBandwidth();
+	void checkLockProfiler();
 };
 
 #endif // WINMAIN_H
@@ -0,0 +1,50 @@
+# -------------------------------------------------
+# G2 protocol micro-benchmarks, runs headless:
+#   qmake && make && ./g2bench [packets] [corpus.g2 ...]
+# -------------------------------------------------
+QT += network
+CONFIG += console
+CONFIG -= app_bundle
+TARGET = g2bench
+CONFIG(debug, debug|release):TARGET = $$join(TARGET,,,_debug)
+INCLUDEPATH += ../NetworkCore \
+    ../3rdparty \
+    ..
+TEMPLATE = app
+SOURCES += main.cpp \
+    ../NetworkCore/g2packet.cpp \
+    ../NetworkCore/g2packetwriter.cpp \
+    ../NetworkCore/QueryHit.cpp \
+    ../NetworkCore/Query.cpp \
+    ../NetworkCore/NetworkConnection.cpp \
+    ../NetworkCore/CompressedConnection.cpp \
+    ../NetworkCore/BufferChain.cpp \
+    ../NetworkCore/EpollReactor.cpp \
+    ../NetworkCore/ZLibUtils.cpp \
+    ../NetworkCore/RouteTable.cpp \
+    ../NetworkCore/types.cpp \
+    ../NetworkCore/LockProfiler.cpp \
+    ../NetworkCore/Metrics.cpp \
+    ../NetworkCore/Hashes/sha1.cpp \
+    ../NetworkCore/Hashes/AbstractHash.cpp \
+    ../3rdparty/CyoEncode/CyoEncode.c \
+    ../3rdparty/CyoEncode/CyoDecode.c \
+    ../systemlog.cpp
+HEADERS += ../NetworkCore/g2packet.h \
+    ../NetworkCore/g2packettypes.h \
+    ../NetworkCore/g2packetwriter.h \
+    ../NetworkCore/QueryHit.h \
+    ../NetworkCore/Query.h \
+    ../NetworkCore/NetworkConnection.h \
+    ../NetworkCore/CompressedConnection.h \
+    ../NetworkCore/BufferChain.h \
+    ../NetworkCore/EpollReactor.h \
+    ../NetworkCore/ZLibUtils.h \
+    ../NetworkCore/RouteTable.h \
+    ../NetworkCore/queryhashtable.h \
+    ../NetworkCore/types.h \
+    ../NetworkCore/LockProfiler.h \
+    ../NetworkCore/Metrics.h \
+    ../NetworkCore/Hashes/sha1.h \
+    ../NetworkCore/Hashes/AbstractHash.h \
+    ../systemlog.h
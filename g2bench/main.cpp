@@ -0,0 +1,770 @@
+// g2bench - G2 protocol micro-benchmarks
+//
+// Runs headless, without network access, over synthetic packet streams and,
+// optionally, recorded ones (raw G2 streams, as found in the TCP input buffer):
+//
+//   g2bench [packets] [corpus.g2 ...]
+//
+// Every benchmark reports ops/s, MB/s and heap allocations per op.
+// The routed packet cases replay the same work with the old QByteArray payload
+// to keep an eye on the packet pool.
+
+#include <QCoreApplication>
+#include <QTime>
+#include <QByteArray>
+#include <QUuid>
+#include <QFile>
+#include <QStringList>
+#include <QList>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "g2packet.h"
+#include "g2packetwriter.h"
+#include "QueryHit.h"
+#include "Query.h"
+#include "CompressedConnection.h"
+#include "ZLibUtils.h"
+#include "queryhashtable.h"
+#include "RouteTable.h"
+#include "systemlog.h"
+
+//////////////////////////////////////////////////////////////////////
+// Allocation counting
+
+static quint64 g_nAllocs = 0;
+
+#if defined(Q_OS_LINUX) && defined(__GLIBC__)
+extern "C"
+{
+	void* __libc_malloc(size_t nSize);
+	void* __libc_realloc(void* pPtr, size_t nSize);
+	void* __libc_calloc(size_t nCount, size_t nSize);
+
+	void* malloc(size_t nSize)
+	{
+		g_nAllocs++;
+		return __libc_malloc(nSize);
+	}
+	void* realloc(void* pPtr, size_t nSize)
+	{
+		g_nAllocs++;
+		return __libc_realloc(pPtr, nSize);
+	}
+	void* calloc(size_t nCount, size_t nSize)
+	{
+		g_nAllocs++;
+		return __libc_calloc(nCount, nSize);
+	}
+}
+#define ALLOC_COUNTING 1
+#else
+#define ALLOC_COUNTING 0
+#endif
+
+//////////////////////////////////////////////////////////////////////
+// Measurement
+
+class BenchRun
+{
+public:
+	BenchRun(const char* szName)
+	{
+		m_szName = szName;
+		m_nAllocs = g_nAllocs;
+		m_tTimer.start();
+	}
+
+	void Report(quint64 nOps, quint64 nBytes)
+	{
+		int nMs = m_tTimer.elapsed();
+		quint64 nAllocs = g_nAllocs - m_nAllocs;
+
+		double dSeconds = qMax(nMs, 1) / 1000.0;
+		printf("%-36s %12.0f ops/s %10.2f MB/s", m_szName, nOps / dSeconds, nBytes / dSeconds / (1024.0 * 1024.0));
+		if( ALLOC_COUNTING )
+			printf(" %8.3f allocs/op", nOps ? double(nAllocs) / nOps : 0.0);
+		printf("\n");
+	}
+
+protected:
+	const char*	m_szName;
+	quint64		m_nAllocs;
+	QTime		m_tTimer;
+};
+
+// Only warnings and worse are printed, the parsers are chatty at debug level
+static void BenchMessageHandler(QtMsgType nType, const char* szMessage)
+{
+	if( nType != QtDebugMsg )
+		fprintf(stderr, "%s\n", szMessage);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Legacy packet - payload kept in a QByteArray, cleared on recycle
+
+struct LegacyPacket
+{
+	QByteArray	m_oBuffer;
+	char		m_sType[9];
+	bool		m_bCompound;
+
+	void Reset()
+	{
+		m_oBuffer.clear();
+	}
+	void Write(const char* pData, int nLength)
+	{
+		m_oBuffer.append(pData, nLength);
+	}
+	void ToBuffer(QByteArray* pBuffer) const
+	{
+		char nLenLen = m_oBuffer.size() > 0xFF ? 2 : 1;
+		char nTypeLen = (char)( strlen(m_sType) - 1 ) & 0x07;
+		char nFlags = ( nLenLen << 6 ) + ( nTypeLen << 3 ) + ( m_bCompound ? G2_FLAG_COMPOUND : 0 );
+		quint32 nLength = m_oBuffer.size();
+		pBuffer->append(&nFlags, 1);
+		pBuffer->append((char*)&nLength, nLenLen);
+		pBuffer->append(m_sType, nTypeLen + 1);
+		pBuffer->append(m_oBuffer);
+	}
+};
+
+//////////////////////////////////////////////////////////////////////
+// Test data
+
+struct Corpus
+{
+	QString		m_sName;
+	QByteArray	m_baStream;
+	quint32		m_nPackets;
+};
+
+static G2Packet* MakeQuery()
+{
+	QUuid oTarget = QUuid::createUuid();
+	QUuid oGUID = QUuid::createUuid();
+	IPv4_ENDPOINT oAddr(0x7F000001, 6346);
+
+	G2Packet* pQuery = G2Packet::New("Q2", true);
+	pQuery->WritePacket("TO", 16)->WriteGUID(oTarget);
+	pQuery->WritePacket("UDP", 6)->WriteHostAddress(&oAddr);
+	pQuery->WritePacket("DN", 12)->WriteString("quazaa bench");
+	pQuery->WriteByte(0);
+	pQuery->WriteGUID(oGUID);
+
+	return pQuery;
+}
+
+// A query hit with nHits /H children, laid out like Shareaza's
+static G2Packet* MakeHit(int nHits)
+{
+	QUuid oSearch = QUuid::createUuid();
+	QUuid oNode = QUuid::createUuid();
+	IPv4_ENDPOINT oAddr(0x7F000001, 6346);
+
+	G2Packet* pHit = G2Packet::New("QH2", true);
+	G2PacketWriter oHit(pHit);
+
+	oHit.Open("GU");
+		pHit->WriteGUID(oNode);
+	oHit.Close();
+	oHit.Open("NA");
+		pHit->WriteHostAddress(&oAddr);
+	oHit.Close();
+	oHit.Open("V");
+		pHit->WriteString("RAZA");
+	oHit.Close();
+
+	for( int i = 0; i < nHits; i++ )
+	{
+		oHit.Open("H");
+			oHit.Open("URN");
+				pHit->WriteString("sha1", true);
+				for( int j = 0; j < 20; j++ )
+					pHit->WriteByte(quint8(i * 20 + j));
+			oHit.Close();
+			oHit.Open("SZ");
+				quint64 nSize = 1024 * 1024 + i;
+				pHit->WriteIntLE(nSize);
+			oHit.Close();
+			oHit.Open("DN");
+				pHit->WriteString(QString("quazaa benchmark file %1.avi").arg(i));
+			oHit.Close();
+		oHit.Close();
+	}
+
+	oHit.CloseAll();
+
+	pHit->WriteByte(0);
+	pHit->WriteByte(0);	// hops
+	pHit->WriteGUID(oSearch);
+
+	return pHit;
+}
+
+static Corpus MakeCorpus(const char* szName, G2Packet* pPacket, quint32 nPackets)
+{
+	Corpus oCorpus;
+	oCorpus.m_sName = szName;
+	oCorpus.m_nPackets = nPackets;
+
+	QByteArray baFrame = pPacket->ToFrame();
+	oCorpus.m_baStream.reserve(baFrame.size() * nPackets);
+	for( quint32 i = 0; i < nPackets; i++ )
+		oCorpus.m_baStream.append(baFrame);
+
+	pPacket->Release();
+	return oCorpus;
+}
+
+// A recorded corpus is a raw G2 stream, as it is read from a (decompressed) TCP link
+static bool LoadCorpus(const QString& sPath, Corpus& oCorpus)
+{
+	QFile oFile(sPath);
+	if( !oFile.open(QIODevice::ReadOnly) )
+	{
+		fprintf(stderr, "can't open corpus %s\n", sPath.toLocal8Bit().constData());
+		return false;
+	}
+
+	oCorpus.m_sName = sPath;
+	oCorpus.m_baStream = oFile.readAll();
+	oCorpus.m_nPackets = 0;
+
+	const char* pData = oCorpus.m_baStream.constData();
+	quint32 nSize = oCorpus.m_baStream.size(), nOffset = 0;
+	G2PacketView oView;
+
+	try
+	{
+		for( quint32 nPacket; nOffset < nSize && ( nPacket = oView.ReadBuffer(pData + nOffset, nSize - nOffset) ); nOffset += nPacket )
+		{
+			if( oView.m_sType[0] )
+				oCorpus.m_nPackets++;
+		}
+	}
+	catch(...)
+	{
+		fprintf(stderr, "corpus %s is malformed at offset %u\n", sPath.toLocal8Bit().constData(), nOffset);
+		return false;
+	}
+
+	// drop a truncated packet at the end
+	oCorpus.m_baStream.truncate(nOffset);
+	return oCorpus.m_nPackets > 0;
+}
+
+static QList<G2Packet*> ParseCorpus(const Corpus& oCorpus)
+{
+	QList<G2Packet*> lPackets;
+
+	const char* pData = oCorpus.m_baStream.constData();
+	quint32 nSize = oCorpus.m_baStream.size(), nOffset = 0;
+	G2PacketView oView;
+
+	for( quint32 nPacket; nOffset < nSize && ( nPacket = oView.ReadBuffer(pData + nOffset, nSize - nOffset) ); nOffset += nPacket )
+	{
+		if( oView.m_sType[0] )
+			lPackets.append(oView.ToPacket());
+	}
+
+	return lPackets;
+}
+
+static void ReleasePackets(QList<G2Packet*>& lPackets)
+{
+	foreach( G2Packet* pPacket, lPackets )
+		pPacket->Release();
+	lPackets.clear();
+}
+
+static void Title(const QString& sTitle)
+{
+	printf("\n-- %s\n", sTitle.toLocal8Bit().constData());
+}
+
+//////////////////////////////////////////////////////////////////////
+// Routed packet: parse, materialize, serialize, release
+
+static void BenchRouted(const Corpus& oCorpus)
+{
+	QByteArray baOut;
+	baOut.reserve(oCorpus.m_baStream.size() + 1024);
+
+	BenchRun oRun("routed packet (G2Packet)");
+
+	const char* pData = oCorpus.m_baStream.constData();
+	quint32 nSize = oCorpus.m_baStream.size(), nOffset = 0;
+	G2PacketView oView;
+
+	for( quint32 nPacket; nOffset < nSize && ( nPacket = oView.ReadBuffer(pData + nOffset, nSize - nOffset) ); nOffset += nPacket )
+	{
+		if( !oView.m_sType[0] )
+			continue;
+
+		G2Packet* pPacket = oView.ToPacket();
+		pPacket->ToBuffer(&baOut);
+		pPacket->Release();
+	}
+
+	oRun.Report(oCorpus.m_nPackets, nSize);
+}
+
+static void BenchRoutedLegacy(const Corpus& oCorpus)
+{
+	QByteArray baOut;
+	baOut.reserve(oCorpus.m_baStream.size() + 1024);
+
+	LegacyPacket oPacket;
+
+	BenchRun oRun("routed packet (QByteArray)");
+
+	const char* pData = oCorpus.m_baStream.constData();
+	quint32 nSize = oCorpus.m_baStream.size(), nOffset = 0;
+	G2PacketView oView;
+
+	for( quint32 nPacket; nOffset < nSize && ( nPacket = oView.ReadBuffer(pData + nOffset, nSize - nOffset) ); nOffset += nPacket )
+	{
+		if( !oView.m_sType[0] )
+			continue;
+
+		oPacket.Reset();
+		memcpy(oPacket.m_sType, oView.m_sType, sizeof(oPacket.m_sType));
+		oPacket.m_bCompound = oView.m_bCompound;
+		oPacket.Write(oView.m_pBuffer, oView.m_nLength);
+		oPacket.ToBuffer(&baOut);
+	}
+
+	oRun.Report(oCorpus.m_nPackets, nSize);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Parsing and serialization
+
+// G2Packet::ReadBuffer fed the way the TCP input buffer is: 8 KB reads, drained after each
+static void BenchReadBuffer(const Corpus& oCorpus)
+{
+	const quint32 nChunk = 8 * 1024;
+
+	QByteArray baInput;
+	baInput.reserve(nChunk * 2);
+
+	quint32 nSize = oCorpus.m_baStream.size();
+	quint64 nPackets = 0;
+
+	BenchRun oRun("G2Packet::ReadBuffer");
+
+	for( quint32 nOffset = 0; nOffset < nSize; nOffset += nChunk )
+	{
+		baInput.append(oCorpus.m_baStream.constData() + nOffset, qMin(nChunk, nSize - nOffset));
+
+		while( baInput.size() )
+		{
+			int nBefore = baInput.size();
+			G2Packet* pPacket = G2Packet::ReadBuffer(&baInput);
+
+			if( pPacket )
+			{
+				nPackets++;
+				pPacket->Release();
+			}
+			else if( baInput.size() == nBefore )
+			{
+				break;	// incomplete, wait for the next read
+			}
+		}
+	}
+
+	oRun.Report(nPackets, nSize);
+}
+
+static void BenchWalk(const Corpus& oCorpus)
+{
+	QList<G2Packet*> lPackets = ParseCorpus(oCorpus);
+	quint32 nSize = oCorpus.m_baStream.size();
+
+	{
+		BenchRun oRun("ReadPacket walk");
+		quint64 nChildren = 0;
+
+		foreach( G2Packet* pPacket, lPackets )
+		{
+			if( !pPacket->m_bCompound )
+				continue;
+
+			pPacket->m_nPosition = 0;
+
+			G2_PACKET nType = 0;
+			quint32 nLength = 0, nNext = 0;
+			bool bCompound = false;
+
+			while( pPacket->ReadPacket(nType, nLength, &bCompound) )
+			{
+				nNext = pPacket->m_nPosition + nLength;
+				nChildren++;
+				pPacket->m_nPosition = nNext;
+			}
+		}
+
+		oRun.Report(lPackets.size(), nSize);
+		Q_UNUSED(nChildren);
+	}
+
+	{
+		BenchRun oRun("SkipCompound");
+
+		foreach( G2Packet* pPacket, lPackets )
+		{
+			pPacket->m_nPosition = 0;
+			pPacket->SkipCompound();
+		}
+
+		oRun.Report(lPackets.size(), nSize);
+	}
+
+	{
+		BenchRun oRun("ToBuffer");
+
+		QByteArray baOut;
+		baOut.reserve(64 * 1024 + 4096);
+
+		foreach( G2Packet* pPacket, lPackets )
+		{
+			pPacket->ToBuffer(&baOut);
+			if( baOut.size() > 64 * 1024 )
+				baOut.resize(0);
+		}
+
+		oRun.Report(lPackets.size(), nSize);
+	}
+
+	{
+		BenchRun oRun("ToFrame");
+
+		foreach( G2Packet* pPacket, lPackets )
+		{
+			QByteArray baFrame = pPacket->ToFrame();
+			Q_UNUSED(baFrame);
+		}
+
+		oRun.Report(lPackets.size(), nSize);
+	}
+
+	ReleasePackets(lPackets);
+}
+
+static void BenchQueryHit(const Corpus& oCorpus)
+{
+	quint64 nHits = 0, nPackets = 0;
+	quint32 nSize = oCorpus.m_baStream.size();
+
+	BenchRun oRun("CQueryHit::ReadPacket");
+
+	const char* pData = oCorpus.m_baStream.constData();
+	G2PacketView oView;
+
+	for( quint32 nPacket, nOffset = 0; nOffset < nSize && ( nPacket = oView.ReadBuffer(pData + nOffset, nSize - nOffset) ); nOffset += nPacket )
+	{
+		if( !oView.IsType(G2_PACKET_HIT) )
+			continue;
+
+		nPackets++;
+
+		G2Packet* pPacket = oView.ToPacket();
+		QSharedPointer<QueryHitInfo> pHitInfo(new QueryHitInfo());
+
+		if( CQueryHit* pHit = CQueryHit::ReadPacket(pPacket, pHitInfo) )
+		{
+			for( CQueryHit* pNext = pHit; pNext; pNext = pNext->m_pNext )
+				nHits++;
+			pHit->Delete();
+		}
+
+		pPacket->Release();
+	}
+
+	oRun.Report(nPackets, nSize);
+	printf("%-36s %12llu hits\n", "", (unsigned long long)nHits);
+}
+
+static void BenchQuery(quint32 nOps)
+{
+	CQuery oQuery;
+	QUuid oGUID = QUuid::createUuid();
+	IPv4_ENDPOINT oAddr(0x7F000001, 6346);
+
+	oQuery.SetGUID(oGUID);
+	oQuery.SetDescriptiveName("quazaa benchmark query");
+	oQuery.AddURN("urn:sha1:ABCDEFGHIJKLMNOPQRSTUVWXYZ234567", 41);
+
+	quint64 nBytes = 0;
+
+	BenchRun oRun("CQuery::ToG2Packet");
+
+	for( quint32 i = 0; i < nOps; i++ )
+	{
+		G2Packet* pPacket = oQuery.ToG2Packet(&oAddr, i);
+		nBytes += pPacket->m_nLength;
+		pPacket->Release();
+	}
+
+	oRun.Report(nOps, nBytes);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Compression
+
+// Both ends of a deflated link, without a socket
+class BenchLink : public CCompressedConnection
+{
+public:
+	BenchLink()
+	{
+		m_pInput = new CBufferChain();
+		m_pOutput = new CBufferChain();
+		EnableInputCompression();
+		EnableOutputCompression();
+	}
+
+	void Flush()
+	{
+		m_bOutputPending = true;
+		Deflate();
+	}
+	void Receive()
+	{
+		Inflate();
+	}
+	CBufferChain* GetInflated()
+	{
+		return m_pZInput;
+	}
+};
+
+static void BenchDeflateLink(const Corpus& oCorpus)
+{
+	const quint32 nChunk = 4096;	// what FlushSendQueue hands to the link at a time
+
+	BenchLink oSender, oReceiver;
+	QList<QByteArray> lCompressed;
+
+	quint32 nSize = oCorpus.m_baStream.size();
+	quint64 nChunks = ( nSize + nChunk - 1 ) / nChunk;
+	quint64 nCompressed = 0;
+
+	{
+		BenchRun oRun("CCompressedConnection deflate");
+
+		for( quint32 nOffset = 0; nOffset < nSize; nOffset += nChunk )
+		{
+			oSender.GetOutputBuffer()->Append(oCorpus.m_baStream.constData() + nOffset, qMin(nChunk, nSize - nOffset));
+			oSender.Flush();
+
+			nCompressed += oSender.m_pOutput->size();
+			lCompressed.append(oSender.m_pOutput->Read(oSender.m_pOutput->size()));
+		}
+
+		oRun.Report(nChunks, nSize);
+	}
+
+	{
+		BenchRun oRun("CCompressedConnection inflate");
+
+		foreach( const QByteArray& baChunk, lCompressed )
+		{
+			oReceiver.m_pInput->Append(baChunk);
+			oReceiver.Receive();
+			oReceiver.GetInflated()->Clear();
+		}
+
+		oRun.Report(nChunks, nSize);
+	}
+
+	printf("%-36s %12.1f %% of input\n", "", nSize ? 100.0 * nCompressed / nSize : 0.0);
+}
+
+// UDP payloads go through ZLibUtils one packet at a time
+static void BenchZLibUtils(const Corpus& oCorpus)
+{
+	QList<G2Packet*> lPackets = ParseCorpus(oCorpus);
+	QList<QByteArray> lFrames;
+
+	foreach( G2Packet* pPacket, lPackets )
+		lFrames.append(pPacket->ToFrame());
+	ReleasePackets(lPackets);
+
+	QList<QByteArray> lCompressed;
+	quint64 nBytes = 0;
+
+	{
+		BenchRun oRun("ZLibUtils::Compress");
+
+		foreach( const QByteArray& baFrame, lFrames )
+		{
+			QByteArray baData = baFrame;
+			if( ZLibUtils::Compress(baData, true) )
+				lCompressed.append(baData);
+			nBytes += baFrame.size();
+		}
+
+		oRun.Report(lFrames.size(), nBytes);
+	}
+
+	nBytes = 0;
+
+	{
+		BenchRun oRun("ZLibUtils::Uncompress");
+
+		foreach( const QByteArray& baCompressed, lCompressed )
+		{
+			QByteArray baData = baCompressed;
+			ZLibUtils::Uncompress(baData);
+			nBytes += baData.size();
+		}
+
+		oRun.Report(lCompressed.size(), nBytes);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Query hash table and routing
+
+static void BenchHashWord(quint32 nOps)
+{
+	QList<QByteArray> lWords;
+	QStringList lSource = QString("quazaa shareaza gnutella hub leaf query hit hash table keyword "
+								  "music video linux ubuntu release album live concert mp3 avi mkv "
+								  "document manual reference guide 2010 remastered extended edition").split(' ');
+
+	foreach( const QString& sWord, lSource )
+		lWords.append(sWord.toUtf8());
+
+	quint32 nCheck = 0;
+	quint64 nBytes = 0;
+
+	BenchRun oRun("QueryHashTable::HashWord");
+
+	for( quint32 i = 0; i < nOps; i++ )
+	{
+		const QByteArray& baWord = lWords.at(i % lWords.size());
+		nCheck ^= QueryHashTable::HashWord(baWord.constData(), baWord.size(), 20);
+		nBytes += baWord.size();
+	}
+
+	oRun.Report(nOps, nBytes);
+	Q_UNUSED(nCheck);
+}
+
+static void BenchRouteTable()
+{
+	CRouteTable oTable;
+	QList<QUuid> lGUIDs;
+	IPv4_ENDPOINT oAddr(0x7F000001, 6346);
+
+	quint32 nRoutes = MaxRoutes * 2;	// past the limit, so Add() has to expire
+	for( quint32 i = 0; i < nRoutes; i++ )
+		lGUIDs.append(QUuid::createUuid());
+
+	{
+		BenchRun oRun("CRouteTable::Add");
+
+		for( quint32 i = 0; i < nRoutes; i++ )
+			oTable.Add(lGUIDs[i], oAddr);
+
+		oRun.Report(nRoutes, 0);
+	}
+
+	{
+		BenchRun oRun("CRouteTable::Find");
+		IPv4_ENDPOINT oFound;
+
+		for( quint32 i = 0; i < nRoutes; i++ )
+			oTable.Find(lGUIDs[i], 0, &oFound);
+
+		oRun.Report(nRoutes, 0);
+	}
+
+	{
+		BenchRun oRun("CRouteTable::ExpireOldRoutes");
+		const quint32 nRounds = 100;
+
+		for( quint32 i = 0; i < nRounds; i++ )
+		{
+			oTable.ExpireOldRoutes(true);
+			for( quint32 j = 0; j < MaxRoutes / 4; j++ )
+				oTable.Add(lGUIDs[ ( i * MaxRoutes / 4 + j ) % nRoutes ], oAddr);
+		}
+
+		oRun.Report(nRounds, 0);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Suite
+
+static void RunCorpus(const Corpus& oCorpus)
+{
+	Title(QString("%1 - %2 packets, %3 bytes").arg(oCorpus.m_sName).arg(oCorpus.m_nPackets).arg(oCorpus.m_baStream.size()));
+
+	BenchRoutedLegacy(oCorpus);
+	BenchRouted(oCorpus);
+	BenchReadBuffer(oCorpus);
+	BenchWalk(oCorpus);
+	BenchDeflateLink(oCorpus);
+	BenchZLibUtils(oCorpus);
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+	qInstallMsgHandler(BenchMessageHandler);
+
+	quint32 nPackets = 200000;
+	QStringList lCorpora;
+
+	for( int i = 1; i < argc; i++ )
+	{
+		bool bNumber = false;
+		int nValue = QString(argv[i]).toInt(&bNumber);
+
+		if( bNumber )
+			nPackets = qMax(1, nValue);
+		else
+			lCorpora.append(QString::fromLocal8Bit(argv[i]));
+	}
+
+	if( !ALLOC_COUNTING )
+		printf("allocation counting is not available on this platform\n");
+
+	// warm up the pool and slab caches
+	for( int i = 0; i < 64; i++ )
+		G2Packet::New("Q2", true)->Release();
+
+	Corpus oQueries = MakeCorpus("synthetic Q2", MakeQuery(), nPackets);
+	Corpus oHits = MakeCorpus("synthetic QH2 (8 hits)", MakeHit(8), qMax(1u, nPackets / 10));
+
+	RunCorpus(oQueries);
+	RunCorpus(oHits);
+	BenchQueryHit(oHits);
+
+	foreach( const QString& sPath, lCorpora )
+	{
+		Corpus oCorpus;
+		if( LoadCorpus(sPath, oCorpus) )
+		{
+			RunCorpus(oCorpus);
+			BenchQueryHit(oCorpus);
+		}
+	}
+
+	Title("other");
+	BenchQuery(nPackets);
+	BenchHashWord(nPackets * 10);
+	BenchRouteTable();
+
+	printf("\n");
+	G2Packets.Dump();
+
+	return 0;
+}
@@ -0,0 +1,18 @@
+# -------------------------------------------------
+# Offline decoder for packet capture ring files:
+#   qmake && make && ./g2capture [-x] [-t TYPE ...] [-w stream.g2] PacketCapture.g2cap
+# -------------------------------------------------
+QT += network
+CONFIG += console
+CONFIG -= app_bundle
+TARGET = g2capture
+CONFIG(debug, debug|release):TARGET = $$join(TARGET,,,_debug)
+INCLUDEPATH += ../NetworkCore \
+    ..
+TEMPLATE = app
+SOURCES += main.cpp \
+    ../NetworkCore/PacketCapture.cpp \
+    ../NetworkCore/types.cpp
+HEADERS += ../NetworkCore/PacketCapture.h \
+    ../NetworkCore/g2packettypes.h \
+    ../NetworkCore/types.h
@@ -0,0 +1,112 @@
+// g2capture - offline decoder for packet capture ring files
+//
+// Reads the ring the packet dump tap (NetworkCore/PacketCapture) leaves behind,
+// also after a crash, and prints one line per captured frame, oldest first:
+//
+//   g2capture [-x] [-t TYPE ...] [-w stream.g2] PacketCapture.g2cap
+//
+//   -x    dump every captured byte instead of the first 32
+//   -t    only frames of this packet type, may be repeated
+//   -w    also write the complete frames as a raw G2 stream, usable as a g2bench corpus
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QHostAddress>
+#include <QFile>
+#include <QStringList>
+#include <QList>
+#include <stdio.h>
+
+#include "PacketCapture.h"
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	bool bFull = false;
+	QList<G2_PACKET> lTypes;
+	QString sRing, sStream;
+
+	for( int i = 1; i < argc; i++ )
+	{
+		QString sArg = QString::fromLocal8Bit(argv[i]);
+
+		if( sArg == "-x" )
+			bFull = true;
+		else if( sArg == "-t" && i + 1 < argc )
+		{
+			const char* pszType = argv[++i];
+			lTypes.append(G2PacketTypeFromString(pszType, qMin<int>(strlen(pszType), 8)));
+		}
+		else if( sArg == "-w" && i + 1 < argc )
+			sStream = QString::fromLocal8Bit(argv[++i]);
+		else
+			sRing = sArg;
+	}
+
+	if( sRing.isEmpty() )
+	{
+		fprintf(stderr, "usage: g2capture [-x] [-t TYPE ...] [-w stream.g2] PacketCapture.g2cap\n");
+		return 2;
+	}
+
+	QFile oRing(sRing);
+	if( !oRing.open(QIODevice::ReadOnly) )
+	{
+		fprintf(stderr, "cannot open %s\n", qPrintable(sRing));
+		return 1;
+	}
+
+	const char* pMap = reinterpret_cast<const char*>(oRing.map(0, oRing.size()));
+	if( !pMap )
+	{
+		fprintf(stderr, "cannot map %s\n", qPrintable(sRing));
+		return 1;
+	}
+
+	QList<QByteArray> lRecords;
+	CPacketCapture::ReadRing(pMap, quint32(oRing.size()), lRecords, 0);
+
+	if( lRecords.isEmpty() )
+	{
+		fprintf(stderr, "%s: no records, or not a packet capture ring\n", qPrintable(sRing));
+		return 1;
+	}
+
+	const G2CaptureHeader* pHeader = reinterpret_cast<const G2CaptureHeader*>(pMap);
+	printf("%s: %d records, %llu captured, %llu overwritten\n", qPrintable(sRing), lRecords.size(),
+		   (unsigned long long)pHeader->nSequence, (unsigned long long)pHeader->nEvicted);
+
+	QFile oStream(sStream);
+	if( !sStream.isEmpty() && !oStream.open(QIODevice::WriteOnly | QIODevice::Truncate) )
+	{
+		fprintf(stderr, "cannot create %s\n", qPrintable(sStream));
+		return 1;
+	}
+
+	foreach( const QByteArray& baRecord, lRecords )
+	{
+		const G2CaptureRecord* pRecord = CPacketCapture::Record(baRecord);
+
+		if( !lTypes.isEmpty() && !lTypes.contains(pRecord->nType) )
+			continue;
+
+		QString sTime = QDateTime::fromTime_t(pRecord->tTime / 1000).toString("yyyy-MM-dd hh:mm:ss");
+		QString sAddress = QString("%1:%2").arg(QHostAddress(pRecord->nAddress).toString()).arg(pRecord->nPort);
+
+		printf("%8llu %s.%03u %s %-3s %-21s %-8s %6u  %s\n",
+			   (unsigned long long)pRecord->nSequence,
+			   qPrintable(sTime), quint32(pRecord->tTime % 1000),
+			   ( pRecord->nFlags & capUDP ) ? "UDP" : "TCP",
+			   ( pRecord->nFlags & capOut ) ? "out" : "in",
+			   qPrintable(sAddress),
+			   qPrintable(CPacketCapture::TypeName(pRecord->nType)),
+			   pRecord->nLength,
+			   qPrintable(CPacketCapture::FormatHex(baRecord, bFull ? 0x7FFFFFFF : 32)));
+
+		if( oStream.isOpen() && pRecord->nCaptured == pRecord->nLength )
+			oStream.write(CPacketCapture::Frame(baRecord), pRecord->nCaptured);
+	}
+
+	return 0;
+}
@@ -77,9 +77,16 @@ void QuazaaSettings::saveSettings()
 
 	m_qSettings.beginGroup("Logging");
 	m_qSettings.setValue("DebugLog", quazaaSettings.Logging.DebugLog);
+	m_qSettings.setValue("LockProfiler", quazaaSettings.Logging.LockProfiler);
 	m_qSettings.setValue("LogLevel", quazaaSettings.Logging.LogLevel);
 	m_qSettings.setValue("LogShowTimestamp", quazaaSettings.Logging.LogShowTimestamp);
 	m_qSettings.setValue("MaxDebugLogSize", quazaaSettings.Logging.MaxDebugLogSize);
+	m_qSettings.setValue("MetricsFile", quazaaSettings.Logging.MetricsFile);
+	m_qSettings.setValue("MetricsFileSize", quazaaSettings.Logging.MetricsFileSize);
+	m_qSettings.setValue("MetricsPeriod", quazaaSettings.Logging.MetricsPeriod);
+	m_qSettings.setValue("MetricsPort", quazaaSettings.Logging.MetricsPort);
+	m_qSettings.setValue("PacketCapture", quazaaSettings.Logging.PacketCapture);
+	m_qSettings.setValue("PacketCaptureSize", quazaaSettings.Logging.PacketCaptureSize);
 	m_qSettings.setValue("SearchLog", quazaaSettings.Logging.SearchLog);
 	m_qSettings.endGroup();
 
@@ -185,12 +192,15 @@ void QuazaaSettings::saveSettings()
 	m_qSettings.setValue("FailureLimit", quazaaSettings.Connection.FailureLimit);
 	m_qSettings.setValue("FailurePenalty", quazaaSettings.Connection.FailurePenalty);
 	m_qSettings.setValue("InSpeed", quazaaSettings.Connection.InSpeed);
+	m_qSettings.setValue("NetworkThreads", quazaaSettings.Connection.NetworkThreads);
 	m_qSettings.setValue("OutSpeed", quazaaSettings.Connection.OutSpeed);
 	m_qSettings.setValue("Port", quazaaSettings.Connection.Port);
 	m_qSettings.setValue("RandomPort", quazaaSettings.Connection.RandomPort);
 	m_qSettings.setValue("SendBuffer", quazaaSettings.Connection.SendBuffer);
 	m_qSettings.setValue("TimeoutConnect", quazaaSettings.Connection.TimeoutConnect);
 	m_qSettings.setValue("TimeoutTraffic", quazaaSettings.Connection.TimeoutTraffic);
+	m_qSettings.setValue("UseEpoll", quazaaSettings.Connection.UseEpoll);
+	m_qSettings.setValue("UdpBatch", quazaaSettings.Connection.UdpBatch);
 	m_qSettings.setValue("PreferredCountries", quazaaSettings.Connection.PreferredCountries);
 	m_qSettings.endGroup();
 
@@ -344,6 +354,11 @@ void QuazaaSettings::saveSettings()
 
 	m_qSettings.beginGroup("Gnutella2");
 	m_qSettings.setValue("ClientMode", quazaaSettings.Gnutella2.ClientMode);
+	m_qSettings.setValue("DeflateHubMemLevel", quazaaSettings.Gnutella2.DeflateHubMemLevel);
+	m_qSettings.setValue("DeflateHubWindowBits", quazaaSettings.Gnutella2.DeflateHubWindowBits);
+	m_qSettings.setValue("DeflateIdleRelease", quazaaSettings.Gnutella2.DeflateIdleRelease);
+	m_qSettings.setValue("DeflateLeafMemLevel", quazaaSettings.Gnutella2.DeflateLeafMemLevel);
+	m_qSettings.setValue("DeflateLeafWindowBits", quazaaSettings.Gnutella2.DeflateLeafWindowBits);
 	m_qSettings.setValue("Enable", quazaaSettings.Gnutella2.Enable);
 	m_qSettings.setValue("HAWPeriod", quazaaSettings.Gnutella2.HAWPeriod);
 	m_qSettings.setValue("HostCount", quazaaSettings.Gnutella2.HostCount);
@@ -366,6 +381,7 @@ void QuazaaSettings::saveSettings()
 	m_qSettings.setValue("QueryLimit", quazaaSettings.Gnutella2.QueryLimit);
 	m_qSettings.setValue("RequeryDelay", quazaaSettings.Gnutella2.RequeryDelay);
 	m_qSettings.setValue("UdpBuffers", quazaaSettings.Gnutella2.UdpBuffers);
+	m_qSettings.setValue("UdpCompressMin", quazaaSettings.Gnutella2.UdpCompressMin);
 	m_qSettings.setValue("UdpInExpire", quazaaSettings.Gnutella2.UdpInExpire);
 	m_qSettings.setValue("UdpInFrames", quazaaSettings.Gnutella2.UdpInFrames);
 	m_qSettings.setValue("UdpMTU", quazaaSettings.Gnutella2.UdpMTU);
@@ -523,9 +539,16 @@ void QuazaaSettings::loadSettings()
 
 	m_qSettings.beginGroup("Logging");
 	quazaaSettings.Logging.DebugLog = m_qSettings.value("DebugLog", false).toBool();
+	quazaaSettings.Logging.LockProfiler = m_qSettings.value("LockProfiler", false).toBool();
 	quazaaSettings.Logging.LogLevel = m_qSettings.value("LogLevel", 3).toInt();
 	quazaaSettings.Logging.LogShowTimestamp = m_qSettings.value("LogShowTimestamp", true).toBool();
 	quazaaSettings.Logging.MaxDebugLogSize = m_qSettings.value("MaxDebugLogSize", 10).toInt();
+	quazaaSettings.Logging.MetricsFile = m_qSettings.value("MetricsFile", false).toBool();
+	quazaaSettings.Logging.MetricsFileSize = m_qSettings.value("MetricsFileSize", 4).toInt();
+	quazaaSettings.Logging.MetricsPeriod = m_qSettings.value("MetricsPeriod", 60).toInt();
+	quazaaSettings.Logging.MetricsPort = m_qSettings.value("MetricsPort", 0).toInt();
+	quazaaSettings.Logging.PacketCapture = m_qSettings.value("PacketCapture", false).toBool();
+	quazaaSettings.Logging.PacketCaptureSize = m_qSettings.value("PacketCaptureSize", 16).toInt();
 	quazaaSettings.Logging.SearchLog = m_qSettings.value("SearchLog", true).toBool();
 	m_qSettings.endGroup();
 
@@ -647,12 +670,15 @@ void QuazaaSettings::loadSettings()
 	quazaaSettings.Connection.FailureLimit = m_qSettings.value("FailureLimit", 3).toInt();
 	quazaaSettings.Connection.FailurePenalty = m_qSettings.value("FailurePenalty", 300).toInt();
 	quazaaSettings.Connection.InSpeed = m_qSettings.value("InSpeed", 1024 * 1024).toULongLong(); // 1Mbit
+	quazaaSettings.Connection.NetworkThreads = m_qSettings.value("NetworkThreads", 0).toInt();
 	quazaaSettings.Connection.OutSpeed = m_qSettings.value("OutSpeed", 16384).toULongLong();	 // 16KB/s
 	quazaaSettings.Connection.Port = m_qSettings.value("Port", 6350).toUInt();
 	quazaaSettings.Connection.RandomPort = m_qSettings.value("RandomPort", false).toBool();
 	quazaaSettings.Connection.SendBuffer = m_qSettings.value("SendBuffer", 2048).toUInt();
 	quazaaSettings.Connection.TimeoutConnect = m_qSettings.value("TimeoutConnect", 16).toUInt();
 	quazaaSettings.Connection.TimeoutTraffic = m_qSettings.value("TimeoutTraffic", 60).toUInt();
+	quazaaSettings.Connection.UseEpoll = m_qSettings.value("UseEpoll", false).toBool();
+	quazaaSettings.Connection.UdpBatch = m_qSettings.value("UdpBatch", true).toBool();
 	quazaaSettings.Connection.PreferredCountries = m_qSettings.value("PreferredCountries", QStringList()).toStringList();
 	m_qSettings.endGroup();
 
@@ -683,15 +709,15 @@ void QuazaaSettings::loadSettings()
 	m_qSettings.endGroup();
 
 	m_qSettings.beginGroup("Transfers");
-	quazaaSettings.Transfers.BandwidthHubIn = m_qSettings.value("HubIn", 0).toInt();
-	quazaaSettings.Transfers.BandwidthHubOut = m_qSettings.value("HubOut", 0).toInt();
-	quazaaSettings.Transfers.BandwidthHubUploads = m_qSettings.value("HubUploads", 40).toInt();
-	quazaaSettings.Transfers.BandwidthLeafIn = m_qSettings.value("LeafIn", 0).toInt();
-	quazaaSettings.Transfers.BandwidthLeafOut = m_qSettings.value("LeafOut", 0).toInt();
-	quazaaSettings.Transfers.BandwidthPeerIn = m_qSettings.value("PeerIn", 0).toInt();
-	quazaaSettings.Transfers.BandwidthPeerOut = m_qSettings.value("PeerOut", 0).toInt();
-	quazaaSettings.Transfers.BandwidthRequest = m_qSettings.value("Request", 32).toInt();
-	quazaaSettings.Transfers.BandwidthUdpOut = m_qSettings.value("UdpOut", 0).toInt();
+	quazaaSettings.Transfers.BandwidthHubIn = m_qSettings.value("BandwidthHubIn", 0).toInt();
+	quazaaSettings.Transfers.BandwidthHubOut = m_qSettings.value("BandwidthHubOut", 0).toInt();
+	quazaaSettings.Transfers.BandwidthHubUploads = m_qSettings.value("BandwidthHubUploads", 40).toInt();
+	quazaaSettings.Transfers.BandwidthLeafIn = m_qSettings.value("BandwidthLeafIn", 0).toInt();
+	quazaaSettings.Transfers.BandwidthLeafOut = m_qSettings.value("BandwidthLeafOut", 0).toInt();
+	quazaaSettings.Transfers.BandwidthPeerIn = m_qSettings.value("BandwidthPeerIn", 0).toInt();
+	quazaaSettings.Transfers.BandwidthPeerOut = m_qSettings.value("BandwidthPeerOut", 0).toInt();
+	quazaaSettings.Transfers.BandwidthRequest = m_qSettings.value("BandwidthRequest", 32).toInt();
+	quazaaSettings.Transfers.BandwidthUdpOut = m_qSettings.value("BandwidthUdpOut", 0).toInt();
 	quazaaSettings.Transfers.MinTransfersRest = m_qSettings.value("MinTransfersRest", 15).toInt();
 	quazaaSettings.Transfers.RatesUnit = m_qSettings.value("RatesUnit", 1).toInt();
 	quazaaSettings.Transfers.RequireConnectedNetwork = m_qSettings.value("RequireConnectedNetwork", true).toBool();
@@ -804,6 +830,11 @@ void QuazaaSettings::loadSettings()
 
 	m_qSettings.beginGroup("Gnutella2");
 	quazaaSettings.Gnutella2.ClientMode = m_qSettings.value("ClientMode", 0).toInt();
+	quazaaSettings.Gnutella2.DeflateHubMemLevel = m_qSettings.value("DeflateHubMemLevel", 8).toInt();
+	quazaaSettings.Gnutella2.DeflateHubWindowBits = m_qSettings.value("DeflateHubWindowBits", 15).toInt();
+	quazaaSettings.Gnutella2.DeflateIdleRelease = m_qSettings.value("DeflateIdleRelease", 30).toUInt();
+	quazaaSettings.Gnutella2.DeflateLeafMemLevel = m_qSettings.value("DeflateLeafMemLevel", 4).toInt();
+	quazaaSettings.Gnutella2.DeflateLeafWindowBits = m_qSettings.value("DeflateLeafWindowBits", 11).toInt();
 	quazaaSettings.Gnutella2.Enable = m_qSettings.value("Enable", true).toBool();
 	quazaaSettings.Gnutella2.HAWPeriod = m_qSettings.value("HAWPeriod", 300).toInt();
 	quazaaSettings.Gnutella2.HostCount = m_qSettings.value("HostCount", 15).toInt();
@@ -826,6 +857,7 @@ void QuazaaSettings::loadSettings()
 	quazaaSettings.Gnutella2.QueryLimit = m_qSettings.value("QueryLimit", 2400).toInt();
 	quazaaSettings.Gnutella2.RequeryDelay = m_qSettings.value("RequeryDelay", 14400).toInt();
 	quazaaSettings.Gnutella2.UdpBuffers = m_qSettings.value("UdpBuffers", 512).toInt();
+	quazaaSettings.Gnutella2.UdpCompressMin = m_qSettings.value("UdpCompressMin", 64).toInt();
 	quazaaSettings.Gnutella2.UdpInExpire = m_qSettings.value("UdpInExpire", 30).toInt();
 	quazaaSettings.Gnutella2.UdpInFrames = m_qSettings.value("UdpInFrames", 256).toInt();
 	quazaaSettings.Gnutella2.UdpMTU = m_qSettings.value("UdpMTU", 500).toInt();
@@ -155,9 +155,16 @@ namespace Settings
 	struct sLogging
 	{
 		bool		DebugLog;								// Create a log file
+		bool		LockProfiler;							// Profile core lock contention per call site (dump from View > Advanced or SIGUSR1)
 		int			LogLevel;								// Log severity (0 - MSG_ERROR .. 4 - MSG_DEBUG)
 		bool		LogShowTimestamp;						// Show timestamps in the system log?
 		int			MaxDebugLogSize;						// Max size of the log file
+		bool		MetricsFile;							// Append network metrics snapshots to Metrics.prom
+		int			MetricsFileSize;						// Size in MB at which Metrics.prom is rolled over
+		int			MetricsPeriod;							// Seconds between snapshots in Metrics.prom
+		int			MetricsPort;							// Serve network metrics on http://127.0.0.1:port/ (0 = off)
+		bool		PacketCapture;							// Capture G2 packets to the packet dump ring file
+		int			PacketCaptureSize;						// Size of the packet capture ring file in MB
 		bool		SearchLog;								// Display search facility log information
 	};
 
@@ -319,12 +326,15 @@ namespace Settings
 		int			FailureLimit;							// Max allowed connection failures (default = 3) (Neighbour connections)
 		int			FailurePenalty;							// Delay after connection failure (seconds, default = 300) (Neighbour connections)
 		quint64		InSpeed;								// Inbound internet connection speed in B/s
+		int			NetworkThreads;							// Neighbour I/O threads, each with its own share of the connections (0 = one per core)
 		quint64		OutSpeed;								// Outbound internet connection speed in B/s
 		quint16		Port;									// Incoming port
 		bool		RandomPort;								// Select a random incoming port
 		quint32		SendBuffer;								// Size of data send blocks
 		quint32		TimeoutConnect;							// Time to wait for a connection before dropping the connection
 		quint32		TimeoutTraffic;							// Time to wait for general network communications before dropping a connection
+		bool		UseEpoll;								// Drive neighbour sockets from an epoll loop instead of QTcpSocket (Linux only)
+		bool		UdpBatch;								// Receive and send UDP in batches with recvmmsg/sendmmsg (Linux only)
 		QStringList	PreferredCountries;						// Country preference
 	};
 
@@ -486,6 +496,11 @@ namespace Settings
 	struct sGnutella2
 	{
 		int			ClientMode;								// Desired mode of operation: MODE_AUTO, MODE_LEAF, MODE_HUB
+		int			DeflateHubMemLevel;						// zlib memLevel for compressed links to hubs (1 - 9)
+		int			DeflateHubWindowBits;					// zlib windowBits for compressed links to hubs (9 - 15)
+		quint32		DeflateIdleRelease;						// Seconds without output before a link's compressor is released
+		int			DeflateLeafMemLevel;					// zlib memLevel for compressed links to leaves (1 - 9)
+		int			DeflateLeafWindowBits;					// zlib windowBits for compressed links to leaves (9 - 15)
 		bool		Enable;									// Connect to G2
 		int			HAWPeriod;
 		int			HostCount;								// Number of hosts in X-Try-Hubs
@@ -508,6 +523,7 @@ namespace Settings
 		quint32		QueryKeyTime;							// Time in seconds before re-requesting query key
 		int			RequeryDelay;							// Time before sending another query
 		int			UdpBuffers;								// UDP protocol buffer size
+		int			UdpCompressMin;							// Smallest UDP packet worth compressing
 		quint32		UdpInExpire;							// Time before incoming an incloming UDP connection
 		int			UdpInFrames;							// UDP protocol in frame size
 		quint32		UdpMTU;									// UDP protocol maximum transmission units